@@ -0,0 +1,251 @@
+//
+//  Schema.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#ifndef Schema_hh
+#define Schema_hh
+
+#include "Val.hh"
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*  Compile-time schemas map the fields of a C++ struct to the keys of a Fleece dictionary, so
+    that the struct can be read with a single pass over the dict (using the multi-key Dict::get)
+    and written without the Encoder having to sort the keys. Declare the fields once, inside the
+    struct, as (member, "key") pairs IN SORTED ORDER OF THEIR KEYS:
+
+        struct Person {
+            int64_t age;
+            std::string name;
+            bool active;
+            std::vector<std::string> tags;
+
+            FLEECE_SCHEMA(Person, (age, "age"), (active, "isActive"), (name, "name"),
+                                  (tags, "tags"));
+        };
+
+        Person p;
+        Person::schema::read(dict, p);
+        Person::schema::write(encoder, p);
+
+    The key order is checked at compile time. Members can be bool, numbers, std::string, slice
+    (pointing into the Fleece data), std::vector of any of those, or structs with their own
+    schemas. Keys mapped by SharedKeys aren't supported. */
+
+namespace fleece {
+
+    namespace schema {
+
+        // Compile-time string comparison and length, matching slice::compare's ordering.
+        constexpr int compareKeys(const char *a, const char *b) {
+            return (*a == *b && *a) ? compareKeys(a + 1, b + 1)
+                                    : (int)(uint8_t)*a - (int)(uint8_t)*b;
+        }
+
+        constexpr size_t keyLength(const char *key) {
+            return *key ? 1 + keyLength(key + 1) : 0;
+        }
+
+        template <class... FIELDS> struct inOrder {
+            static constexpr bool value = true;
+        };
+        template <class F1, class F2, class... REST> struct inOrder<F1, F2, REST...> {
+            static constexpr bool value = compareKeys(F1::key(), F2::key()) < 0
+                                       && inOrder<F2, REST...>::value;
+        };
+
+        /** Describes one struct member. (FLEECE_SCHEMA subclasses it to add the key.) */
+        template <class T, class M, M T::*MEMBER>
+        struct field {
+            typedef M type;
+            static M& of(T &obj)                {return obj.*MEMBER;}
+            static const M& of(const T &obj)    {return obj.*MEMBER;}
+        };
+
+        template <class T> struct hasSchema {
+            template <class U> static std::true_type test(typename U::schema*);
+            template <class U> static std::false_type test(...);
+            static constexpr bool value = decltype(test<T>(nullptr))::value;
+        };
+
+        //////// Reading values:
+
+        inline void read(const Value *v, bool &out)         {out = (bool)Val(v);}
+        inline void read(const Value *v, std::string &out)  {out = (std::string)Val(v);}
+        inline void read(const Value *v, slice &out)        {out = v->asString();}
+
+        template <class M>
+        typename std::enable_if<std::is_integral<M>::value && std::is_signed<M>::value>::type
+        read(const Value *v, M &out)                        {out = (M)(int64_t)Val(v);}
+
+        template <class M>
+        typename std::enable_if<std::is_integral<M>::value && std::is_unsigned<M>::value>::type
+        read(const Value *v, M &out)                        {out = (M)(uint64_t)Val(v);}
+
+        template <class M>
+        typename std::enable_if<std::is_floating_point<M>::value>::type
+        read(const Value *v, M &out)                        {out = (M)(double)Val(v);}
+
+        template <class M>
+        typename std::enable_if<hasSchema<M>::value>::type
+        read(const Value *v, M &out)                        {M::schema::read(v->asDict(), out);}
+
+        template <class M>
+        void read(const Value *v, std::vector<M> &out) {
+            out.clear();
+            auto array = v->asArray();
+            if (!array)
+                return;
+            out.resize(array->count());
+            auto item = out.begin();
+            for (Array::iterator i(array); i; ++i)
+                read(i.value(), *item++);
+        }
+
+        //////// Writing values:
+
+        inline void write(Encoder &enc, bool b)                 {enc.writeBool(b);}
+        inline void write(Encoder &enc, const std::string &s)   {enc.writeString(s);}
+        inline void write(Encoder &enc, slice s)                {enc.writeString(s);}
+
+        template <class M>
+        typename std::enable_if<std::is_integral<M>::value && std::is_signed<M>::value>::type
+        write(Encoder &enc, M i)                                {enc.writeInt(i);}
+
+        template <class M>
+        typename std::enable_if<std::is_integral<M>::value && std::is_unsigned<M>::value>::type
+        write(Encoder &enc, M i)                                {enc.writeUInt(i);}
+
+        inline void write(Encoder &enc, float f)                {enc.writeFloat(f);}
+        inline void write(Encoder &enc, double d)               {enc.writeDouble(d);}
+
+        template <class M>
+        typename std::enable_if<hasSchema<M>::value>::type
+        write(Encoder &enc, const M &obj)                       {M::schema::write(enc, obj);}
+
+        template <class M>
+        void write(Encoder &enc, const std::vector<M> &items) {
+            enc.beginArray(items.size());
+            for (auto &item : items)
+                write(enc, item);
+            enc.endArray();
+        }
+
+    }
+
+
+    /** A compile-time mapping between the members of struct T and the keys of a Dict.
+        Usually declared with the FLEECE_SCHEMA macro, not directly. */
+    template <class T, class... FIELDS>
+    class Schema {
+    public:
+        static constexpr size_t kCount = sizeof...(FIELDS);
+        static_assert(kCount > 0, "A schema needs at least one field");
+        static_assert(schema::inOrder<FIELDS...>::value,
+                      "Schema fields must be listed in order of their keys");
+
+        /** The keys, in sorted order. */
+        static constexpr const char* kKeys[kCount] = {FIELDS::key()...};
+
+        /** Reads the values of the dict's keys into the corresponding members of `obj`. Members
+            whose keys are missing are left alone. Returns the number of keys found. */
+        static size_t read(const Dict *dict, T &obj) {
+            if (!dict)
+                return 0;
+            // The keys persist (per thread, since they cache hints) so that later reads get to
+            // use the hints the earlier ones left:
+            static thread_local DictKeys<kCount> keys = {{
+                DictKey(FIELDS::key(), schema::keyLength(FIELDS::key()))...
+            }};
+            const Value* values[kCount];
+            size_t found = dict->get(keys, values);
+            const Value* const *value = values;
+            int expand[] = {(readField<FIELDS>(*value++, obj), 0)...};
+            (void)expand;
+            return found;
+        }
+
+        /** Writes `obj` as a dict. The keys are written in order, so the Encoder doesn't have to
+            sort them (unless it's using SharedKeys, which changes the sort order.) */
+        static void write(Encoder &enc, const T &obj) {
+            enc.beginDictionary(kCount, (enc.sharedStrings() == nullptr));
+            int expand[] = {(writeField<FIELDS>(enc, obj), 0)...};
+            (void)expand;
+            enc.endDictionary();
+        }
+
+    private:
+        template <class F>
+        static void readField(const Value *v, T &obj) {
+            if (v)
+                schema::read(v, F::of(obj));
+        }
+
+        template <class F>
+        static void writeField(Encoder &enc, const T &obj) {
+            enc.writeKey(slice(F::key(), schema::keyLength(F::key())));
+            schema::write(enc, F::of(obj));
+        }
+    };
+
+    template <class T, class... FIELDS>
+    constexpr const char* Schema<T, FIELDS...>::kKeys[];
+
+}
+
+
+// Implementation of FLEECE_SCHEMA. It applies a macro to each (member, key) pair, supporting up
+// to 16 fields. (The _FL_EXPAND calls are there for the sake of MSVC's preprocessor.)
+#define _FL_EXPAND(X) X
+#define _FL_CAT(A, B) _FL_CAT_(A, B)
+#define _FL_CAT_(A, B) A##B
+#define _FL_COUNT(...) _FL_EXPAND(_FL_COUNT_(__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, \
+                                             8, 7, 6, 5, 4, 3, 2, 1))
+#define _FL_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, \
+                   N, ...) N
+#define _FL_FOR_EACH(M, S, ...) _FL_EXPAND(_FL_CAT(_FL_FE_, _FL_COUNT(__VA_ARGS__))(M, S, __VA_ARGS__))
+#define _FL_FE_1(M, S, X)      M(S, X)
+#define _FL_FE_2(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_1(M, S, __VA_ARGS__))
+#define _FL_FE_3(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_2(M, S, __VA_ARGS__))
+#define _FL_FE_4(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_3(M, S, __VA_ARGS__))
+#define _FL_FE_5(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_4(M, S, __VA_ARGS__))
+#define _FL_FE_6(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_5(M, S, __VA_ARGS__))
+#define _FL_FE_7(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_6(M, S, __VA_ARGS__))
+#define _FL_FE_8(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_7(M, S, __VA_ARGS__))
+#define _FL_FE_9(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_8(M, S, __VA_ARGS__))
+#define _FL_FE_10(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_9(M, S, __VA_ARGS__))
+#define _FL_FE_11(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_10(M, S, __VA_ARGS__))
+#define _FL_FE_12(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_11(M, S, __VA_ARGS__))
+#define _FL_FE_13(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_12(M, S, __VA_ARGS__))
+#define _FL_FE_14(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_13(M, S, __VA_ARGS__))
+#define _FL_FE_15(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_14(M, S, __VA_ARGS__))
+#define _FL_FE_16(M, S, X, ...) M(S, X) _FL_EXPAND(_FL_FE_15(M, S, __VA_ARGS__))
+
+#define _FL_UNPAREN(...) __VA_ARGS__
+#define _FL_SCHEMA_FIELD(S, PAIR) _FL_EXPAND(_FL_SCHEMA_FIELD_(S, _FL_UNPAREN PAIR))
+#define _FL_SCHEMA_FIELD_(S, ...) _FL_EXPAND(_FL_SCHEMA_FIELD__(S, __VA_ARGS__))
+#define _FL_SCHEMA_FIELD__(S, MEMBER, KEY) \
+    struct _fl_field_##MEMBER : ::fleece::schema::field<S, decltype(S::MEMBER), &S::MEMBER> { \
+        static constexpr const char* key() {return KEY;} \
+    };
+#define _FL_SCHEMA_TYPE(S, PAIR) _FL_EXPAND(_FL_SCHEMA_TYPE_(S, _FL_UNPAREN PAIR))
+#define _FL_SCHEMA_TYPE_(S, ...) _FL_EXPAND(_FL_SCHEMA_TYPE__(S, __VA_ARGS__))
+#define _FL_SCHEMA_TYPE__(S, MEMBER, KEY) , _fl_field_##MEMBER
+
+/** Declares the schema of struct S, as a nested type `S::schema`. Must be used inside the
+    struct, after the members. The arguments after S are (member, "key") pairs, in order of
+    their keys. */
+#define FLEECE_SCHEMA(S, ...) \
+    _FL_FOR_EACH(_FL_SCHEMA_FIELD, S, __VA_ARGS__) \
+    typedef ::fleece::Schema<S _FL_FOR_EACH(_FL_SCHEMA_TYPE, S, __VA_ARGS__)> schema
+
+#endif /* Schema_hh */
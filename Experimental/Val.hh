@@ -58,21 +58,21 @@ namespace fleece {
 
         class iterator {
         public:
-            iterator(Arr a)             :iterator(a._a._first, a._a._wide) { }
-            operator Val() const        {return Val(Value::deref(_v, _wide), true);}
+            iterator(Arr a)             :iterator(a._a._first, a._a._width) { }
+            operator Val() const        {return Val(Value::derefItem(_v, _width), true);}
             Val operator-> () const     {return operator Val();}
-            iterator& operator++()      {_v = _v->next(_wide); return *this;}
+            iterator& operator++()      {_v = offsetby(_v, _width); return *this;}
             bool operator== (const iterator& i) const {return _v == i._v;}
         private:
             friend class Arr;
 
-            iterator(const Value *v, bool wide)   :_v(v), _wide(wide) { }
+            iterator(const Value *v, int width)   :_v(v), _width(width) { }
             const Value *_v;
-            bool _wide;
+            int _width;
         };
 
-        iterator begin()                {return iterator(_a._first, _a._wide);}
-        iterator end()                  {return iterator(offsetby(_a._first, internal::width(_a._wide)*_a._count), _a._wide);}
+        iterator begin()                {return iterator(_a._first, _a._width);}
+        iterator end()                  {return iterator(offsetby(_a._first, _a._width*_a._count), _a._width);}
 
     private:
         friend class iterator;
@@ -16,10 +16,13 @@
 #include "Array.hh"
 #include "SharedKeys.hh"
 #include "Internal.hh"
+#include "Endian.hh"
 #include "FleeceException.hh"
 #include "varint.hh"
 #include "PlatformCompat.hh"
+#include <algorithm>
 #include <assert.h>
+#include <limits.h>
 #include <iostream>
 
 
@@ -56,20 +59,32 @@ namespace fleece {
     template const Value* Value::deref<false>(const Value *v);
     template const Value* Value::deref<true>(const Value *v);
 
+    const Value* Value::derefExtraWide(const Value *v) noexcept {
+        v = offsetby(v, -(ptrdiff_t)v->extraWidePointerValue());
+        while (_usuallyFalse(v->isPointer()))
+            v = derefPointer<true>(v);
+        return v;
+    }
+
 
 #pragma mark - ARRAY:
 
 
-    Array::impl::impl(const Value* v) noexcept {
+    Array::impl::impl(const Value* v, bool lazilyValidate) noexcept {
+        _hasHashIndex = _hasPrefixIndex = false;
+        if (_usuallyFalse(lazilyValidate && LazyValidator::sCount.load(std::memory_order_relaxed) > 0)
+                && !LazyValidator::check(v)) {
+            v = nullptr;            // invalid data; treat it as empty
+        }
         if (v == nullptr) {
             _first = nullptr;
-            _wide = false;
+            _width = kNarrow;
             _count = 0;
             return;
         }
         
         _first = (const Value*)(&v->_byte[2]);
-        _wide = v->isWideArray();
+        _width = v->isWideArray() ? kWide : kNarrow;
         _count = v->shortValue() & 0x07FF;
         if (_count == kLongArrayCount) {
             // Long count is stored as a varint:
@@ -79,27 +94,47 @@ namespace fleece {
             _count += extraCount;
             _first = offsetby(_first, countSize + (countSize & 1));
         }
+        if (_usuallyFalse(_width == kWide && _count > 0 && _first->_byte[0] == kExtraWideMarker)) {
+            // The items are 8 bytes wide, following a marker slot (see kExtraWideMarker):
+            _width = kExtraWide;
+            _first = offsetby(_first, kExtraWide);
+        }
+        if (_count > 0 && v->tag() == kDictTag && _first->_byte[0] == 0x08
+                                               && _first->_byte[1] == 0x00) {
+            // The first entry is a hash index (see kDictHashIndexKey); hide it:
+            _hasHashIndex = true;
+            _first = offsetby(_first, 2*_width);
+            --_count;
+        }
+        if (_count > 0 && v->tag() == kDictTag && _first->_byte[0] == 0x08
+                                               && _first->_byte[1] == 0x01) {
+            // Then a prefix index (see kDictPrefixIndexKey); hide that too:
+            _hasPrefixIndex = true;
+            _first = offsetby(_first, 2*_width);
+            --_count;
+        }
     }
 
     bool Array::impl::next() {
         throwIf(_count == 0, OutOfRange, "iterating past end of array");
         if (--_count == 0)
             return false;
-        _first = _first->next(_wide);
+        _first = offsetby(_first, _width);
         return true;
     }
 
     const Value* Array::impl::operator[] (unsigned index) const noexcept {
         if (index >= _count)
             return nullptr;
-        if (_wide)
-            return Value::deref<true> (offsetby(_first, kWide   * index));
-        else
-            return Value::deref<false>(offsetby(_first, kNarrow * index));
+        switch (_width) {
+            case kNarrow:   return Value::derefItem<kNarrow>(offsetby(_first, kNarrow * index));
+            case kWide:     return Value::derefItem<kWide>  (offsetby(_first, kWide   * index));
+            default:        return Value::derefItem<kExtraWide>(offsetby(_first, kExtraWide * index));
+        }
     }
 
     size_t Array::impl::indexOf(const Value *v) const noexcept {
-        return ((size_t)v - (size_t)_first) / width(_wide);
+        return ((size_t)v - (size_t)_first) / _width;
     }
 
 
@@ -119,16 +154,45 @@ namespace fleece {
      _value(_a.firstValue())
     { }
 
+    Array::iterator::iterator(const Array *a, unsigned prefetchDistance) noexcept
+    :_a(a),
+     _value(_a.firstValue())
+    {
+        prefetchDistance = std::min(prefetchDistance, 255u);
+        _a._prefetchDistance = (uint8_t)prefetchDistance;
+        for (unsigned i = 1; i <= prefetchDistance && i < _a._count; ++i)
+            _prefetch(_a[i]);
+    }
+
+    // Steps to the next item, with the item width known at compile time so the deref has
+    // no width test in it.
+    template <int WIDTH>
+    inline void Array::iterator::step() {
+        throwIf(_a._count == 0, OutOfRange, "iterating past end of array");
+        if (--_a._count == 0) {
+            _value = nullptr;
+            return;
+        }
+        _a._first = offsetby(_a._first, WIDTH);
+        _value = Value::derefItem<WIDTH>(_a._first);
+        unsigned ahead = _a._prefetchDistance;
+        if (_usuallyFalse(ahead > 0) && _a._count > ahead)
+            _prefetch(Value::derefItem<WIDTH>(offsetby(_a._first, ahead * WIDTH)));
+    }
+
     Array::iterator& Array::iterator::operator++() {
-        _a.next();
-        _value = _a.firstValue();
+        switch (_a._width) {
+            case kNarrow:   step<kNarrow>(); break;
+            case kWide:     step<kWide>(); break;
+            default:        step<kExtraWide>(); break;
+        }
         return *this;
     }
 
     Array::iterator& Array::iterator::operator += (uint32_t n) {
         throwIf(n > _a._count, OutOfRange, "iterating past end of array");
         _a._count -= n;
-        _a._first = offsetby(_a._first, width(_a._wide)*n);
+        _a._first = offsetby(_a._first, _a._width*n);
         _value = _a.firstValue();
         return *this;
     }
@@ -137,18 +201,95 @@ namespace fleece {
 #pragma mark - DICT:
 
 
-    template <bool WIDE>
+    // The first 8 bytes of a string (zero-padded) as a big-endian integer, so that comparing two
+    // of them as integers orders the strings by those bytes.
+    // (Shorter strings are read with overlapping loads instead of a loop.)
+    static inline uint64_t keyPrefix(slice s) noexcept {
+        auto bytes = (const uint8_t*)s.buf;
+        size_t len = s.size;
+        if (_usuallyTrue(len >= 8)) {
+            uint64_t word;
+            memcpy(&word, bytes, 8);
+            return _dec64(word);
+        } else if (len >= 4) {
+            uint32_t hi, lo;
+            memcpy(&hi, bytes, 4);
+            memcpy(&lo, bytes + len - 4, 4);
+            return ((uint64_t)_dec32(hi) << 32) | ((uint64_t)_dec32(lo) << (8 * (8 - len)));
+        } else if (len > 0) {
+            return ((uint64_t)bytes[0] << 56) | ((uint64_t)bytes[len >> 1] << (56 - 8*(len >> 1)))
+                 | ((uint64_t)bytes[len - 1] << (64 - 8*len));
+        } else {
+            return 0;
+        }
+    }
+
+    // The last 8 bytes of a string of at least 8 bytes.
+    static inline uint64_t keySuffix(slice s) noexcept {
+        uint64_t word;
+        memcpy(&word, offsetby(s.buf, s.size - 8), 8);
+        return word;
+    }
+
+    // A key being looked up, with its first (and last) 8 bytes loaded as integers, so most keys
+    // it's compared with can be told apart by comparing integers instead of calling memcmp.
+    struct keyToMatch {
+        slice str;
+        uint64_t prefix, suffix;
+
+        explicit keyToMatch(slice s) noexcept
+        :str(s)
+        ,prefix(keyPrefix(s))
+        ,suffix(s.size >= 8 ? keySuffix(s) : 0)
+        { }
+
+        bool equals(slice key) const noexcept {
+            if (key.size != str.size || keyPrefix(key) != prefix)
+                return false;
+            if (str.size <= 8)
+                return true;
+            // The suffix is checked before the middle since keys often differ at the end
+            // ("item_001", "item_002"...):
+            if (keySuffix(key) != suffix)
+                return false;
+            return str.size <= 16 || memcmp(offsetby(str.buf, 8), offsetby(key.buf, 8),
+                                            str.size - 16) == 0;
+        }
+
+        int compare(slice key) const noexcept {
+            uint64_t keyPre = keyPrefix(key);
+            if (keyPre != prefix)
+                return (prefix < keyPre) ? -1 : 1;
+            if (str.size <= 8 || key.size <= 8) {
+                // The shorter string's bytes are all equal to the other's, which is only
+                // longer by zero bytes (or else by bytes past the first 8), so it comes first:
+                return (str.size == key.size) ? 0 : (str.size < key.size ? -1 : 1);
+            }
+            return slice(offsetby(str.buf, 8), str.size - 8)
+                        .compare(slice(offsetby(key.buf, 8), key.size - 8));
+        }
+    };
+
+
+
+    // Dict lookups, with the item width known at compile time. (It's constructed from the
+    // dict's Array::impl, whose _width must be WIDTH.)
+    template <int WIDTH>
     struct dictImpl : public Array::impl {
 
-        dictImpl(const Dict *d) noexcept
-        :impl(d)
+        explicit dictImpl(const Array::impl &a) noexcept
+        :impl(a)
         { }
 
         const Value* get_unsorted(slice keyToFind) const noexcept {
-            const Value *key = _first;
+            const Value *key;
+            if (_hasHashIndex && findKeyByHashIndex(keyToFind, &key))
+                return key ? deref(next(key)) : nullptr;
+            keyToMatch target(keyToFind);
+            key = _first;
             for (uint32_t i = 0; i < _count; i++) {
                 const Value *val = next(key);
-                if (keyToFind.compare(keyBytes(key)) == 0)
+                if (!key->isInteger() && target.equals(keyBytes(key)))
                     return deref(val);
                 key = next(val);
             }
@@ -156,15 +297,57 @@ namespace fleece {
         }
 
         inline const Value* get(slice keyToFind) const noexcept {
-            auto key = (const Value*) ::bsearch(&keyToFind, _first, _count, 2*kWidth, &keyCmp);
+            const Value *key;
+            if (!(_hasHashIndex && findKeyByHashIndex(keyToFind, &key))) {
+                const Value *start = _first;
+                uint32_t count = _count;
+                if (_hasPrefixIndex)
+                    narrowByPrefixIndex(keyToFind, start, count);
+                key = searchKey(keyToMatch(keyToFind), start, count);
+            }
             if (!key)
                 return nullptr;
             return deref(next(key));
         }
 
         inline const Value* get(int keyToFind) const noexcept {
+            const Value *first = _first;
+            uint32_t count = _count;
+            if (_usuallyTrue(count > 0)) {
+                // Integer keys sort before strings. If all the keys are short ints (as SharedKeys
+                // keys are), they're distinct ints in increasing order, so key k's index can only
+                // be between k-firstKey-gaps and k-firstKey, where `gaps` is the number of ints
+                // missing from the range. For a dict with the whole range, that's one entry, found
+                // by direct indexing; for a dense one it's a few, instead of the whole dict.
+                int firstKey = shortIntKey(first);
+                int lastKey = shortIntKey(offsetby(first, (count - 1) * 2 * kWidth));
+                if (firstKey != kNotShortInt && lastKey != kNotShortInt) {
+                    if (keyToFind < firstKey || keyToFind > lastKey)
+                        return nullptr;
+                    uint32_t maxIndex = std::min((uint32_t)(keyToFind - firstKey), count - 1);
+                    uint32_t gaps = (uint32_t)(lastKey - firstKey) - (count - 1);
+                    uint32_t minIndex = (maxIndex > gaps) ? maxIndex - gaps : 0;
+                    first = offsetby(first, minIndex * 2 * kWidth);
+                    count = maxIndex - minIndex + 1;
+                    // Binary search of the entries in that range:
+                    while (count > 0) {
+                        uint32_t half = count / 2;
+                        const Value *mid = offsetby(first, half * 2 * kWidth);
+                        int midKey = shortIntKey(mid);
+                        if (midKey == keyToFind)
+                            return deref(next(mid));
+                        if (midKey < keyToFind) {
+                            first = offsetby(mid, 2 * kWidth);
+                            count -= half + 1;
+                        } else {
+                            count = half;
+                        }
+                    }
+                    return nullptr;
+                }
+            }
             auto key = (const Value*) ::bsearch((void*)(ssize_t)(keyToFind + 1),
-                                                _first, _count, 2*kWidth,
+                                                first, count, 2*kWidth,
                                                 &numericKeyCmp);
             if (!key)
                 return nullptr;
@@ -187,7 +370,8 @@ namespace fleece {
                     }
                     return false;
                 }
-            } while (--v >= _first);
+                v = offsetby(v, -2*(ptrdiff_t)kWidth);
+            } while (v >= _first);
             return false;
         }
 
@@ -217,12 +401,42 @@ namespace fleece {
             const Value *key = findKeyByHint(keyToFind);
             if (!key) {
                 const Value *end = offsetby(_first, _count*2*kWidth);
-                if (!findKeyByPointer(keyToFind, _first, end, &key))
-                    key = findKeyBySearch(keyToFind, _first, end);
+                if (!findKeyByPointer(keyToFind, _first, end, &key)) {
+                    if (_hasHashIndex && findKeyByHashIndex(keyToFind._rawString,
+                                                            hashOf(keyToFind), &key)) {
+                        if (key)
+                            keyToFind._hint = (uint32_t)indexOf(key) / 2;
+                    } else {
+                        key = findKeyBySearch(keyToFind, _first, end);
+                    }
+                }
             }
             return key ? deref(next(key)) : nullptr;
         }
 
+        // Like get(Dict::key&), but first checks whether the key at the hinted index points to
+        // `lastKeyString`, the key string found in the previous dict. That's usually the case
+        // when looking up a key in a series of dicts encoded together, since the Encoder
+        // writes a string only once; it's cheaper than comparing strings. Then updates
+        // `lastKeyString`. (Only pointer equality is trusted, so it's safe with any dicts.)
+        const Value* getForColumn(Dict::key &keyToFind, const Value* &lastKeyString) const noexcept {
+            if (keyToFind._sharedKeys)
+                return get(keyToFind);
+            if (lastKeyString && keyToFind._hint < _count) {
+                const Value *key = offsetby(_first, keyToFind._hint * 2 * kWidth);
+                if (key->isPointer() && deref(key) == lastKeyString)
+                    return deref(next(key));
+            }
+            const Value *value = get(keyToFind);
+            lastKeyString = nullptr;
+            if (value && keyToFind._hint < _count) {
+                const Value *key = offsetby(_first, keyToFind._hint * 2 * kWidth);
+                if (key->isPointer())
+                    lastKeyString = deref(key);
+            }
+            return value;
+        }
+
 #ifdef _MSC_VER
     #define log(FMT, PARAM, ...)
 #else
@@ -331,11 +545,13 @@ namespace fleece {
                               const Value **outKey) const
         {
             // Check whether there's a cached key pointer, and the key would be a pointer:
-            if (!keyToFind._keyValue || (keyToFind._rawString.size < kWidth))
+            // (Extra-wide dicts aren't scanned; they're too big for it to be worth it.)
+            if (!keyToFind._keyValue || (keyToFind._rawString.size < kWidth)
+                                     || WIDTH == kExtraWide)
                 return false;
             // Check whether the key is in pointer range of this dict:
             const Value *key = start;
-            size_t maxOffset = (WIDE ?0xFFFFFFFF : 0xFFFF);
+            size_t maxOffset = (WIDTH == kWide ?0xFFFFFFFF : 0xFFFF);
             auto offset = (size_t)((uint8_t*)key - (uint8_t*)keyToFind._keyValue);
             auto offsetAtEnd = (size_t)((uint8_t*)end - kWidth - (uint8_t*)keyToFind._keyValue);
             if (offset > maxOffset || offsetAtEnd > maxOffset)
@@ -344,7 +560,7 @@ namespace fleece {
             // Raw integer key we're looking for (in native byte order):
             auto rawKeyToFind = (uint32_t)((offset >> 1) | kPtrMask);
             while (key < end) {
-                if (WIDE ? (_dec32(*(uint32_t*)key) == rawKeyToFind)
+                if (WIDTH == kWide ? (_dec32(*(uint32_t*)key) == rawKeyToFind)
                     : (_dec16(*(uint16_t*)key) == (uint16_t)rawKeyToFind)) {
                     // Found it! Cache the dict index as a hint for next time:
                     keyToFind._hint = (uint32_t)indexOf(key) / 2;
@@ -359,13 +575,132 @@ namespace fleece {
             return true;
         }
 
+        // A key's hash-index hash; it's computed the first time, unless it was at compile time.
+        static uint32_t hashOf(Dict::key &key) noexcept {
+            if (_usuallyFalse(key._hash == 0))
+                key._hash = dictHashIndexHash(key._rawString.buf, key._rawString.size);
+            return key._hash;
+        }
+
+        // Finds a key using the dict's hash index. Returns false if the index is unusable.
+        bool findKeyByHashIndex(slice keyToFind, const Value **outKey) const noexcept {
+            return findKeyByHashIndex(keyToFind, dictHashIndexHash(keyToFind.buf, keyToFind.size),
+                                      outKey);
+        }
+
+        bool findKeyByHashIndex(slice keyToFind, uint32_t hash,
+                                const Value **outKey) const noexcept {
+            // (The hash index entry comes before the prefix index entry, if there is one.)
+            auto indexValue = offsetby(_first, -(ptrdiff_t)kWidth * (_hasPrefixIndex ? 3 : 1));
+            slice table = deref(indexValue)->asData();
+            size_t nSlots = table.size / sizeof(uint32_t);
+            if (_usuallyFalse(nSlots == 0 || (nSlots & (nSlots - 1)) != 0))
+                return false;
+            const size_t mask = nSlots - 1;
+            uint32_t hashBits = hash & ~kDictHashIndexMask;
+            for (size_t slot = hash & mask, n = 0; n < nSlots; slot = (slot + 1) & mask, ++n) {
+                uint32_t entry;
+                memcpy(&entry, offsetby(table.buf, slot * sizeof(uint32_t)), sizeof(entry));
+                entry = _decLittle32(entry);
+                if (entry == 0)
+                    break;
+                uint32_t index = (entry & kDictHashIndexMask) - 1;
+                if ((entry & ~kDictHashIndexMask) == hashBits && index < _count) {
+                    const Value *key = offsetby(_first, 2*kWidth*index);
+#ifndef NDEBUG
+                    ++gTotalComparisons;
+#endif
+                    if (!key->isInteger() && keyBytes(key) == keyToFind) {
+                        *outKey = key;
+                        return true;
+                    }
+                }
+            }
+            *outKey = nullptr;
+            return true;
+        }
+
+        // Narrows the range of entries [start, start+count) that a binary search for a string key
+        // has to look at, to the string keys whose bytes in the dict's prefix index are the same
+        // as the key's (usually just one), by binary-searching the index. That way few keys need
+        // to be dereferenced and compared. Leaves the range alone if the index is unusable.
+        void narrowByPrefixIndex(slice keyToFind, const Value* &start,
+                                 uint32_t &count) const noexcept {
+            slice table = deref(offsetby(_first, -(ptrdiff_t)kWidth))->asData();
+            if (_usuallyFalse(table.size < kDictPrefixIndexHeaderSize || (table.size & 3)))
+                return;
+            auto bytes = (const uint8_t*)table.buf;
+            uint32_t prefixLen, firstString;
+            memcpy(&prefixLen, bytes, 4);
+            memcpy(&firstString, bytes + 4, 4);
+            prefixLen = _decLittle32(prefixLen);
+            firstString = _decLittle32(firstString);
+            size_t nStrings = (table.size - kDictPrefixIndexHeaderSize) / 4;
+            if (_usuallyFalse(firstString > _count || nStrings != _count - firstString))
+                return;
+            const uint8_t *entries = bytes + kDictPrefixIndexHeaderSize;
+
+            // Every string key starts with the same prefix, so check that against the first one:
+            if (nStrings == 0 || keyToFind.size < prefixLen) {
+                count = 0;                          // it can't be any of them
+                return;
+            }
+            if (prefixLen > 0) {
+                slice firstKey = keyBytes(offsetby(_first, 2*kWidth*firstString));
+                if (_usuallyFalse(firstKey.size < prefixLen))
+                    return;
+                if (memcmp(keyToFind.buf, firstKey.buf, prefixLen) != 0) {
+                    count = 0;
+                    return;
+                }
+            }
+
+            // The key's bytes after the prefix, as they'd appear in the index:
+            uint8_t targetBytes[4] = {};
+            memcpy(targetBytes, offsetby(keyToFind.buf, prefixLen),
+                   std::min(keyToFind.size - prefixLen, sizeof(targetBytes)));
+            uint32_t target;
+            memcpy(&target, targetBytes, sizeof(target));
+            target = _dec32(target);
+            auto entry = [=](size_t i) {
+                uint32_t e;
+                memcpy(&e, entries + 4*i, 4);
+                return _dec32(e);
+            };
+
+            // Find the range of entries equal to the target:
+            size_t lo = 0;
+            for (size_t n = nStrings; n > 0; ) {
+                size_t half = n / 2;
+                if (entry(lo + half) < target) {
+                    lo += half + 1;
+                    n -= half + 1;
+                } else {
+                    n = half;
+                }
+            }
+            size_t hi = lo;
+            for (size_t n = nStrings - lo; n > 0; ) {
+                size_t half = n / 2;
+                if (entry(hi + half) <= target) {
+                    hi += half + 1;
+                    n -= half + 1;
+                } else {
+                    n = half;
+                }
+            }
+            start = offsetby(_first, 2*kWidth*(firstString + lo));
+            count = (uint32_t)(hi - lo);
+        }
+
         // Finds a key in a dictionary via binary search of the UTF-8 key strings.
         const Value* findKeyBySearch(Dict::key &keyToFind,
                                      const Value *start, const Value *end) const
         {
-            auto key = (const Value*) ::bsearch(&keyToFind._rawString, start,
-                                                ((ptrdiff_t)end - (ptrdiff_t)start) / (2*kWidth),
-                                                2*kWidth, &keyCmp);
+            auto count = (uint32_t)(((ptrdiff_t)end - (ptrdiff_t)start) / (2*kWidth));
+            if (_hasPrefixIndex && start == _first && count == _count)
+                narrowByPrefixIndex(keyToFind._rawString, start, count);
+            auto key = searchKey(keyToMatch(keyToFind._rawString), start, count);
             if (!key)
                 return nullptr;
 
@@ -376,16 +711,50 @@ namespace fleece {
             return key;
         }
 
+        static constexpr int kNotShortInt = INT_MIN;
+
+        // Returns the value of a key that's a short int, else kNotShortInt.
+        static inline int shortIntKey(const Value *key) noexcept {
+            uint16_t raw = _dec16(*(const uint16_t*)key);
+            if (raw & 0xF000)
+                return kNotShortInt;                    // tag isn't kShortIntTag
+            return (int16_t)(raw << 4) >> 4;            // sign-extends the 12-bit value
+        }
+
         static inline slice keyBytes(const Value *key) {
             return deref(key)->getStringBytes();
         }
 
         static inline const Value* next(const Value *v) {
-            return v->next<WIDE>();
+            return offsetby(v, WIDTH);
         }
 
         static inline const Value* deref(const Value *v) {
-            return Value::deref<WIDE>(v);
+            return Value::derefItem<WIDTH>(v);
+        }
+
+        // Binary search of `count` dict entries starting at `key` for a string key.
+        // (Like ::bsearch with keyCmp, but with the comparison inlined and mostly done on
+        // integers.)
+        static const Value* searchKey(const keyToMatch &target,
+                                      const Value *key, uint32_t count) noexcept {
+            while (count > 0) {
+#ifndef NDEBUG
+                ++gTotalComparisons;
+#endif
+                uint32_t half = count / 2;
+                const Value *mid = offsetby(key, 2*kWidth*half);
+                int cmp = mid->isInteger() ? 1 : target.compare(keyBytes(mid));
+                if (cmp == 0)
+                    return mid;
+                if (cmp > 0) {
+                    key = offsetby(mid, 2*kWidth);
+                    count -= half + 1;
+                } else {
+                    count = half;
+                }
+            }
+            return nullptr;
         }
 
         static int keyCmp(const void* keyToFindP, const void* keyP) {
@@ -410,56 +779,48 @@ namespace fleece {
                 return -1;
         }
 
-        static constexpr size_t kWidth = (WIDE ? 4 : 2);
-        static constexpr uint32_t kPtrMask = (WIDE ? 0x80000000 : 0x8000);
+        static constexpr size_t kWidth = WIDTH;
+        static constexpr uint32_t kPtrMask = (WIDTH == kWide ? 0x80000000 : 0x8000);
     };
 
 
+    // Calls a method of the dictImpl specialized for the dict's item width:
+    #define DICT_IMPL(CALL) \
+        Array::impl a(this); \
+        switch (a._width) { \
+            case kNarrow:   return dictImpl<kNarrow>(a).CALL; \
+            case kWide:     return dictImpl<kWide>(a).CALL; \
+            default:        return dictImpl<kExtraWide>(a).CALL; \
+        }
+
+
 
     uint32_t Dict::count() const noexcept {
         return Array::impl(this)._count;
     }
     
     const Value* Dict::get_unsorted(slice keyToFind) const noexcept {
-        if (isWideArray())
-            return dictImpl<true>(this).get_unsorted(keyToFind);
-        else
-            return dictImpl<false>(this).get_unsorted(keyToFind);
+        DICT_IMPL(get_unsorted(keyToFind));
     }
 
     const Value* Dict::get(slice keyToFind) const noexcept {
-        if (isWideArray())
-            return dictImpl<true>(this).get(keyToFind);
-            else
-                return dictImpl<false>(this).get(keyToFind);
-                }
+        DICT_IMPL(get(keyToFind));
+    }
     
     const Value* Dict::get(slice keyToFind, SharedKeys *sk) const noexcept {
-        if (isWideArray())
-            return dictImpl<true>(this).get(keyToFind, sk);
-        else
-            return dictImpl<false>(this).get(keyToFind, sk);
+        DICT_IMPL(get(keyToFind, sk));
     }
 
     const Value* Dict::get(int keyToFind) const noexcept {
-        if (isWideArray())
-            return dictImpl<true>(this).get(keyToFind);
-        else
-            return dictImpl<false>(this).get(keyToFind);
+        DICT_IMPL(get(keyToFind));
     }
 
     const Value* Dict::get(key &keyToFind) const noexcept {
-        if (isWideArray())
-            return dictImpl<true>(this).get(keyToFind);
-        else
-            return dictImpl<false>(this).get(keyToFind);
+        DICT_IMPL(get(keyToFind));
     }
 
     size_t Dict::get(key keys[], const Value* values[], size_t count) const noexcept {
-        if (isWideArray())
-            return dictImpl<true>(this).get(keys, values, count);
-        else
-            return dictImpl<false>(this).get(keys, values, count);
+        DICT_IMPL(get(keys, values, count));
     }
 
     static int sortKeysCmp(const void *a, const void *b) {
@@ -468,6 +829,10 @@ namespace fleece {
 
     }
 
+    const Value* Dict::getForColumn(key &keyToFind, const Value* &lastKeyString) const noexcept {
+        DICT_IMPL(getForColumn(keyToFind, lastKeyString));
+    }
+
     void Dict::sortKeys(key keys[], size_t count) noexcept {
         qsort(keys, count, sizeof(key), sortKeysCmp);
     }
@@ -493,10 +858,20 @@ namespace fleece {
         return keyStr;
     }
 
+    Dict::iterator::iterator(const Dict* d, const SharedKeys *sk, unsigned prefetchDistance) noexcept
+    :_a(d), _sharedKeys(sk)
+    {
+        prefetchDistance = std::min(prefetchDistance, 255u);
+        _a._prefetchDistance = (uint8_t)prefetchDistance;
+        readKV();
+        for (unsigned i = 1; i <= prefetchDistance && i < _a._count; ++i)
+            _prefetch(derefItem(offsetby(_a._first, (2*i + 1) * _a._width), _a._width));
+    }
+
     Dict::iterator& Dict::iterator::operator++() {
         throwIf(_a._count == 0, OutOfRange, "iterating past end of dict");
         --_a._count;
-        _a._first = offsetby(_a._first, 2*width(_a._wide));
+        _a._first = offsetby(_a._first, 2*_a._width);
         readKV();
         return *this;
     }
@@ -504,27 +879,129 @@ namespace fleece {
     Dict::iterator& Dict::iterator::operator += (uint32_t n) {
         throwIf(n > _a._count, OutOfRange, "iterating past end of dict");
         _a._count -= n;
-        _a._first = offsetby(_a._first, 2*width(_a._wide)*n);
+        _a._first = offsetby(_a._first, 2*_a._width*n);
         readKV();
         return *this;
     }
 
     void Dict::iterator::readKV() noexcept {
+        switch (_a._width) {
+            case kNarrow:   readKV<kNarrow>(); break;
+            case kWide:     readKV<kWide>(); break;
+            default:        readKV<kExtraWide>(); break;
+        }
+    }
+
+    template <int WIDTH>
+    inline void Dict::iterator::readKV() noexcept {
         if (_a._count) {
-            _key   = deref(_a._first,                _a._wide);
-            _value = deref(_a._first->next(_a._wide), _a._wide);
+            _key   = Value::derefItem<WIDTH>(_a._first);
+            _value = Value::derefItem<WIDTH>(offsetby(_a._first, WIDTH));
+            unsigned ahead = _a._prefetchDistance;
+            if (_usuallyFalse(ahead > 0) && _a._count > ahead)
+                _prefetch(Value::derefItem<WIDTH>(offsetby(_a._first, (2*ahead + 1) * WIDTH)));
         } else {
             _key = _value = nullptr;
         }
     }
 
 
-    Dict::key::key(slice rawString)
-    :_rawString(rawString), _cachePointer(false)
+#pragma mark - COLUMNS:
+
+
+    // How many items ahead extractColumn prefetches:
+    static const unsigned kPrefetchDistance = 4;
+
+    template <class T, class CONVERT>
+    inline size_t Array::extractColumn(DictKey &key, T out[], T missing,
+                                       CONVERT convert) const noexcept
+    {
+        size_t found = 0;
+        const Value *lastKeyString = nullptr;
+        for (iterator i(this, kPrefetchDistance); i; ++i, ++out) {
+            const Dict *dict = i.value()->asDict();
+            const Value *value = dict ? dict->getForColumn(key, lastKeyString) : nullptr;
+            if (value && convert(value, *out))
+                ++found;
+            else
+                *out = missing;
+        }
+        return found;
+    }
+
+    size_t Array::extractColumn(DictKey &key, int64_t out[], int64_t missing) const noexcept {
+        return extractColumn(key, out, missing, [](const Value *v, int64_t &n) {
+            if (v->type() != kNumber)
+                return false;
+            n = v->asInt();
+            return true;
+        });
+    }
+
+    size_t Array::extractColumn(DictKey &key, double out[], double missing) const noexcept {
+        return extractColumn(key, out, missing, [](const Value *v, double &n) {
+            if (v->type() != kNumber)
+                return false;
+            n = v->asDouble();
+            return true;
+        });
+    }
+
+    size_t Array::extractColumn(DictKey &key, slice out[]) const noexcept {
+        return extractColumn(key, out, nullslice, [](const Value *v, slice &s) {
+            s = v->asString();
+            return s.buf != nullptr;
+        });
+    }
+
+
+#pragma mark - PACKED ARRAYS:
+
+
+    Array::PackedType Array::packedType() const noexcept {
+        impl a(this);
+        if (a._width != kWide || a._count == 0 || !a._first->isPackedNumber())
+            return kNotPacked;
+        // Every item should point to the next number; checking the last one ensures that the
+        // whole range lies within the (validated) data:
+        auto size = a._first->packedNumberSize();
+        auto last = offsetby(a._first, (a._count - 1) * kWide);
+        if (last->_byte[0] != a._first->_byte[0]
+                || last->packedNumberData() != offsetby(a._first->packedNumberData(),
+                                                        (a._count - 1) * size))
+            return kNotPacked;
+        switch (a._first->_byte[0] & (0x08 | kPackedIntFlag)) {
+            case 0:                     return kPackedFloat;
+            case 0x08:                  return kPackedDouble;
+            case kPackedIntFlag:        return kPackedInt32;
+            default:                    return kPackedInt64;
+        }
+    }
+
+    const void* Array::packedData(PackedType type) const noexcept {
+#ifdef _LITTLE_ENDIAN
+        if (packedType() != type)
+            return nullptr;
+        auto first = impl(this)._first;
+        auto data = first->packedNumberData();
+        if ((size_t)data & (first->packedNumberSize() - 1))
+            return nullptr;             // misaligned
+        return data;
+#else
+        return nullptr;
+#endif
+    }
+
+
+#pragma mark - DICT KEY:
+
+
+    DictKey::DictKey(slice rawString)
+    :_rawString(rawString)
     { }
 
 
-    Dict::key::key(slice rawString, SharedKeys *sk, bool cachePointer)
+    DictKey::DictKey(slice rawString, SharedKeys *sk, bool cachePointer)
     :_rawString(rawString), _sharedKeys(sk), _cachePointer(cachePointer)
     {
         int n;
@@ -13,6 +13,7 @@
 namespace fleece {
 
     class Dict;
+    class DictKey;
     class SharedKeys;
 
     /** A Value that's an array. */
@@ -20,12 +21,15 @@ namespace fleece {
         struct impl {
             const Value* _first;
             uint32_t _count;
-            bool _wide;
+            uint8_t _width;         // Item width: kNarrow, kWide or kExtraWide
+            bool _hasHashIndex;     // Dict only: does a hash index entry precede _first?
+            bool _hasPrefixIndex;   // Dict only: does a prefix index entry precede _first?
+            uint8_t _prefetchDistance {0};  // Iterators only: how far ahead to prefetch
 
-            impl(const Value*) noexcept;
-            const Value* second() const noexcept      {return _first->next(_wide);}
+            impl(const Value*, bool lazilyValidate =true) noexcept;
+            const Value* second() const noexcept      {return offsetby(_first, _width);}
             bool next();
-            const Value* firstValue() const noexcept  {return _count ? Value::deref(_first, _wide) : nullptr;}
+            const Value* firstValue() const noexcept  {return _count ? Value::derefItem(_first, _width) : nullptr;}
             const Value* operator[] (unsigned index) const noexcept;
             size_t indexOf(const Value *v) const noexcept;
         };
@@ -45,6 +49,13 @@ namespace fleece {
         public:
             iterator(const Array* a) noexcept;
 
+            /** Creates an iterator that, as it steps to each item, prefetches the item
+                `prefetchDistance` places ahead of it into the CPU cache. This helps when the
+                items are collections that are looked into as they're reached, like an array of
+                dicts that isn't already in the cache, since otherwise each one is a stall.
+                (The distance is capped at 255.) */
+            iterator(const Array* a, unsigned prefetchDistance) noexcept;
+
             /** Returns the number of _remaining_ items. */
             uint32_t count() const noexcept              {return _a._count;}
 
@@ -70,21 +81,172 @@ namespace fleece {
 
         private:
             const Value* rawValue() noexcept             {return _a._first;}
+            template <int WIDTH> void step();
 
             impl _a;
             const Value *_value;
             
             friend class Value;
+            friend class SizeProfiler;
         };
 
         iterator begin() const noexcept                  {return iterator(this);}
 
+        /** Gets the value of a key in every item of the array, which should be dicts, and
+            writes them to consecutive elements of `out`, which must have room for count()
+            values. An item gets `missing` instead if it isn't a dict, or doesn't contain the
+            key, or its value isn't a number. This is a lot faster than iterating and calling
+            Dict::get yourself: the key's hint is reused from one dict to the next, and upcoming
+            dicts are prefetched.
+            @return  The number of items that had a (numeric) value for the key. */
+        size_t extractColumn(DictKey&, int64_t out[], int64_t missing =0) const noexcept;
+        size_t extractColumn(DictKey&, double out[], double missing =0.0) const noexcept;
+
+        /** Like the above, but writes string values; other items get nullslice. */
+        size_t extractColumn(DictKey&, slice out[]) const noexcept;
+
+        /** The ways the numbers in a packed array can be stored (see packedType.) */
+        enum PackedType : uint8_t {
+            kNotPacked,
+            kPackedFloat,
+            kPackedDouble,
+            kPackedInt32,
+            kPackedInt64
+        };
+
+        /** If this array's numbers are packed, i.e. stored as a contiguous C array (see
+            Encoder::packNumericArrays), returns their type; otherwise returns kNotPacked. */
+        PackedType packedType() const noexcept;
+
+        /** If the array is packed as doubles, returns a pointer to the count() numbers.
+            Otherwise, or on a big-endian CPU (the numbers are little-endian), or if the data
+            isn't suitably aligned in memory, returns nullptr; then iterate the items instead. */
+        const double* packedDoubles() const noexcept {return (const double*)packedData(kPackedDouble);}
+
+        /** Like packedDoubles, but for an array packed as floats. */
+        const float* packedFloats() const noexcept   {return (const float*)packedData(kPackedFloat);}
+
+        /** Like packedDoubles, but for an array packed as 32-bit integers. */
+        const int32_t* packedInt32s() const noexcept {return (const int32_t*)packedData(kPackedInt32);}
+
+        /** Like packedDoubles, but for an array packed as 64-bit integers. */
+        const int64_t* packedInt64s() const noexcept {return (const int64_t*)packedData(kPackedInt64);}
+
+    private:
+        const void* packedData(PackedType) const noexcept;
+
+        template <class T, class CONVERT>
+        size_t extractColumn(DictKey&, T out[], T missing, CONVERT) const noexcept;
+
+    public:
         friend class Value;
         friend class Dict;
-        template <bool WIDE> friend struct dictImpl;
+        friend class Encoder;
+        friend class Arr;
+        template <int WIDTH> friend struct dictImpl;
     };
 
 
+    /** An abstracted key for dictionaries, also known as Dict::key. It will cache the key as an
+        encoded Value, and it will cache the index at which the key was last found, which speeds
+        up succssive lookups.
+        Warning: An instance of this should be used only on a single thread.
+        Warning: If you set the `cache` flag to true, the key will cache the Value
+        representation of the string, so it should only be used with dictionaries that are
+        stored in the same encoded data. */
+    class DictKey {
+    public:
+        DictKey(slice rawString);
+
+        /** Creates a key from a string whose contents are known at compile time, such as a
+            literal; its hash is computed then too, so a key can be made without any work at
+            runtime. (See FLEECE_KEYS.) */
+        constexpr DictKey(const char *str, size_t length)
+        :_rawString(str, length), _hash(internal::constDictHashIndexHash(str, length))
+        { }
+
+        /** If the data was encoded using a SharedKeys mapping, you need to use this
+            constructor so the proper numeric encoding can be found & used. */
+        DictKey(slice rawString, SharedKeys*, bool cachePointer =false);
+
+        /** Sets the SharedKeys mapping of the dicts it'll be used with, if it was created
+            without one (as FLEECE_KEYS are.) The numeric key is looked up on the next use. */
+        void setSharedKeys(SharedKeys *sk) noexcept {
+            if (sk != _sharedKeys) {
+                _sharedKeys = sk;
+                _hasNumericKey = false;
+            }
+        }
+
+        SharedKeys* sharedKeys() const noexcept      {return _sharedKeys;}
+        slice string() const noexcept                {return _rawString;}
+        const Value* asValue() const noexcept        {return _keyValue;}
+        int compare(const DictKey &k) const noexcept {return _rawString.compare(k._rawString);}
+    private:
+        slice const _rawString;
+        const Value* _keyValue  {nullptr};
+        SharedKeys* _sharedKeys {nullptr};
+        uint32_t _hint          {0xFFFFFFFF};
+        int32_t _numericKey     {0};
+        uint32_t _hash          {0};            // Hash-index hash of the string, or 0 if not known
+        bool _cachePointer      {false};
+        bool _hasNumericKey     {false};
+
+        template <int WIDTH> friend struct dictImpl;
+    };
+
+
+    /** A fixed list of keys, in sorted order, to look up together with
+        Dict::get(DictKeys&, values). Declare one with FLEECE_KEYS. */
+    template <size_t N>
+    struct DictKeys {
+        DictKey keys[N];
+
+        static constexpr size_t size()                  {return N;}
+        DictKey& operator[] (size_t i) noexcept         {return keys[i];}
+
+        /** Sets the SharedKeys of all the keys; see DictKey::setSharedKeys. */
+        void setSharedKeys(SharedKeys *sk) noexcept {
+            for (auto &key : keys)
+                key.setSharedKeys(sk);
+        }
+    };
+
+    namespace internal {
+        // True if string `a` sorts before `b` (as slice::compare orders them.)
+        constexpr bool constKeyLess(const char *a, const char *b) noexcept {
+            return (*a == *b) ? (*a != 0 && constKeyLess(a + 1, b + 1))
+                              : (*b != 0 && (*a == 0 || (uint8_t)*a < (uint8_t)*b));
+        }
+
+        constexpr bool constKeysSorted(const char*) noexcept {return true;}
+
+        template <class... Rest>
+        constexpr bool constKeysSorted(const char *a, const char *b, Rest... rest) noexcept {
+            return constKeyLess(a, b) && constKeysSorted(b, rest...);
+        }
+    }
+
+    /** Makes a DictKeys from string literals. (Use FLEECE_KEYS, which also checks the order.) */
+    template <size_t... LEN>
+    constexpr DictKeys<sizeof...(LEN)> makeDictKeys(const char (&...strs)[LEN]) {
+        return {{DictKey(strs, LEN - 1)...}};
+    }
+
+    /** Declares `NAME` as a DictKeys of the given string literals, which must be in sorted
+        order; that's checked at compile time, so they don't have to be sorted at runtime.
+        Their lengths and hashes are computed at compile time too. Declared `static` (or
+        `thread_local`, since keys cache hints and can't be shared between threads), the keys
+        are initialized before the program starts, and lookups with them need no setup.
+        For example: `static FLEECE_KEYS(kPersonKeys, "age", "name");`
+        The keys don't know about SharedKeys, so with dicts encoded using them, pass the
+        SharedKeys to Dict::get (or call setSharedKeys); otherwise no encoded key is found. */
+    #define FLEECE_KEYS(NAME, ...) \
+        auto NAME = ::fleece::makeDictKeys(__VA_ARGS__); \
+        static_assert(::fleece::internal::constKeysSorted(__VA_ARGS__), \
+                      "FLEECE_KEYS must be in sorted order")
+
+
     /** A Value that's a dictionary/map */
     class Dict : public Value {
     public:
@@ -120,6 +282,10 @@ namespace fleece {
             iterator(const Dict*) noexcept;
             iterator(const Dict*, const SharedKeys*) noexcept;
 
+            /** Creates an iterator that prefetches the value `prefetchDistance` entries ahead
+                of the current one as it steps; see Array::iterator. */
+            iterator(const Dict*, const SharedKeys*, unsigned prefetchDistance) noexcept;
+
             /** Returns the number of _remaining_ items. */
             uint32_t count() const noexcept                  {return _a._count;}
 
@@ -138,6 +304,7 @@ namespace fleece {
 
         private:
             void readKV() noexcept;
+            template <int WIDTH> void readKV() noexcept;
             const Value* rawKey() noexcept             {return _a._first;}
             const Value* rawValue() noexcept           {return _a.second();}
 
@@ -146,40 +313,14 @@ namespace fleece {
             const SharedKeys *_sharedKeys {nullptr};
 
             friend class Value;
+            friend class SizeProfiler;
         };
         
         iterator begin() const noexcept                      {return iterator(this);}
         iterator begin(const SharedKeys *sk) const noexcept  {return iterator(this, sk);}
 
-        /** An abstracted key for dictionaries. It will cache the key as an encoded Value, and it
-            will cache the index at which the key was last found, which speeds up succssive
-            lookups.
-            Warning: An instance of this should be used only on a single thread.
-            Warning: If you set the `cache` flag to true, the key will cache the Value
-            representation of the string, so it should only be used with dictionaries that are
-            stored in the same encoded data. */
-        class key {
-        public:
-            key(slice rawString);
-
-            /** If the data was encoded using a SharedKeys mapping, you need to use this
-                constructor so the proper numeric encoding can be found & used. */
-            key(slice rawString, SharedKeys*, bool cachePointer =false);
-
-            slice string() const noexcept                {return _rawString;}
-            const Value* asValue() const noexcept        {return _keyValue;}
-            int compare(const key &k) const noexcept     {return _rawString.compare(k._rawString);}
-        private:
-            slice const _rawString;
-            const Value* _keyValue  {nullptr};
-            SharedKeys* _sharedKeys {nullptr};
-            uint32_t _hint          {0xFFFFFFFF};
-            int32_t _numericKey;
-            bool _cachePointer;
-            bool _hasNumericKey     {false};
-
-            template <bool WIDE> friend struct dictImpl;
-        };
+        /** A key for the get(key&) methods; see DictKey. */
+        typedef DictKey key;
 
         /** Looks up the Value for a key, in a form that can cache the key's Fleece object.
             Using the Fleece object is significantly faster than a normal get. */
@@ -195,8 +336,35 @@ namespace fleece {
         /** Sorts an array of keys, a prerequisite of the multi-key get() method. */
         static void sortKeys(key keys[], size_t count) noexcept;
 
+        /** Looks up a fixed list of keys (see FLEECE_KEYS.) Up to kMaxKeysLookedUpSeparately
+            keys are looked up one at a time, in a loop the compiler can unroll; with each key's
+            hint, that's faster for so few. More keys go to the multi-key get() above.
+            @return  The number of keys that were found. */
+        template <size_t N>
+        size_t get(DictKeys<N> &keys, const Value* (&values)[N]) const noexcept {
+            if (N > kMaxKeysLookedUpSeparately && !keys.keys[0].sharedKeys())
+                return get(keys.keys, values, N);       // (which doesn't support SharedKeys)
+            size_t nFound = 0;
+            for (size_t i = 0; i < N; ++i)
+                nFound += ((values[i] = get(keys.keys[i])) != nullptr);
+            return nFound;
+        }
+
+        /** Looks up a fixed list of keys in a dict encoded with SharedKeys. The keys remember
+            it (see DictKeys::setSharedKeys), and resolve their numeric forms on first use. */
+        template <size_t N>
+        size_t get(DictKeys<N> &keys, const Value* (&values)[N], SharedKeys *sk) const noexcept {
+            keys.setSharedKeys(sk);
+            return get(keys, values);
+        }
+
+        static const size_t kMaxKeysLookedUpSeparately = 8;
+
     private:
+        const Value* getForColumn(key&, const Value* &lastKeyString) const noexcept;
+
         friend class Value;
+        friend class Array;
     };
 
 }
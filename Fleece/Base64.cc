@@ -0,0 +1,306 @@
+//
+//  Base64.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "Base64.hh"
+#include "decode.h"
+#include <algorithm>
+#include <string.h>
+
+// The SIMD code uses the techniques of Wojciech Muła and Alfred Klomp (see "Faster Base64
+// Encoding and Decoding Using AVX2 Instructions", Muła & Lemire, 2018): bytes are shuffled so
+// that each 32-bit lane holds three input bytes, shifted into four 6-bit fields with multiplies,
+// and translated to ASCII by adding offsets looked up by range. Decoding runs the same steps
+// backwards, looking up each character's nibbles to validate it and find its offset.
+// The SIMD functions are compiled for their instruction sets whatever the build's target, and
+// are only called if the CPU supports them.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define FL_BASE64_SIMD
+    #define SSSE3_FN __attribute__((target("ssse3")))
+    #define AVX2_FN  __attribute__((target("avx2")))
+    #include <immintrin.h>
+#endif
+
+
+namespace fleece {
+
+    static const char kBase64Digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // Maps ASCII to base64 digit values, or -1 for characters that aren't digits.
+    static const int8_t kBase64Values[256] = {
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+            52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+            -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+            15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+            -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+            41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    };
+
+
+#pragma mark - SIMD:
+
+
+#ifdef FL_BASE64_SIMD
+    // Spreads 12 bytes into 16 six-bit values, one per byte.
+    SSSE3_FN static inline __m128i encodeReshuffle(__m128i in) {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+        __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+        __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        return _mm_or_si128(t1, t3);
+    }
+
+    // Translates six-bit values to base64 digits.
+    SSSE3_FN static inline __m128i encodeTranslate(__m128i in) {
+        const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                          -4, -4, -4, -4, -19, -16, 0, 0);
+        __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+        __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+        indices = _mm_sub_epi8(indices, mask);
+        return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+    }
+
+    // Encodes 12-byte groups while at least 16 bytes are readable. Returns the bytes consumed.
+    SSSE3_FN static size_t encodeSSSE3(const uint8_t *src, size_t size, char *&dst) {
+        const uint8_t *start = src;
+        for (; size >= 16; src += 12, size -= 12, dst += 16) {
+            __m128i in = _mm_loadu_si128((const __m128i*)src);
+            _mm_storeu_si128((__m128i*)dst, encodeTranslate(encodeReshuffle(in)));
+        }
+        return src - start;
+    }
+
+    // Converts 16 base64 digits to their six-bit values, or returns false if any aren't digits.
+    SSSE3_FN static inline bool decodeTranslate(__m128i &str) {
+        const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i nibbleMask = _mm_set1_epi8(0x0F);
+        __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(str, 4), nibbleMask);
+        __m128i loNibbles = _mm_and_si128(str, nibbleMask);
+        __m128i hi = _mm_shuffle_epi8(lutHi, hiNibbles);
+        __m128i lo = _mm_shuffle_epi8(lutLo, loNibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+            return false;
+        __m128i eq2F = _mm_cmpeq_epi8(str, _mm_set1_epi8('/'));
+        __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles));
+        str = _mm_add_epi8(str, roll);
+        return true;
+    }
+
+    // Packs 16 six-bit values into 12 bytes (at the start of the result.)
+    SSSE3_FN static inline __m128i decodeReshuffle(__m128i in) {
+        __m128i mergedAB_BC = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+        __m128i out = _mm_madd_epi16(mergedAB_BC, _mm_set1_epi32(0x00011000));
+        return _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                   -1, -1, -1, -1));
+    }
+
+    // Decodes groups of 16 digits, stopping at the first group containing a non-digit.
+    // Each group writes 16 bytes, of which the last 4 are garbage, so this stops while there
+    // are at least 24 digits left; then the output buffer has room to spare.
+    SSSE3_FN static size_t decodeSSSE3(const uint8_t *src, size_t size, uint8_t *&dst) {
+        const uint8_t *start = src;
+        for (; size >= 24; src += 16, size -= 16, dst += 12) {
+            __m128i str = _mm_loadu_si128((const __m128i*)src);
+            if (!decodeTranslate(str))
+                break;
+            _mm_storeu_si128((__m128i*)dst, decodeReshuffle(str));
+        }
+        return src - start;
+    }
+#endif
+
+
+#ifdef FL_BASE64_SIMD
+    // The AVX2 versions do the same as the SSSE3 ones, on two 128-bit lanes at once.
+
+    AVX2_FN static inline __m256i broadcast(__m128i x) {
+        return _mm256_broadcastsi128_si256(x);
+    }
+
+    AVX2_FN static size_t encodeAVX2(const uint8_t *src, size_t size, char *&dst) {
+        const __m256i shuffle  = broadcast(_mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                                        4, 5, 3, 4, 1, 2, 0, 1));
+        const __m256i lut      = broadcast(_mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                                         -4, -4, -4, -4, -19, -16, 0, 0));
+        const uint8_t *start = src;
+        for (; size >= 28; src += 24, size -= 24, dst += 32) {
+            __m256i in = _mm256_inserti128_si256(
+                                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)),
+                                _mm_loadu_si128((const __m128i*)(src + 12)), 1);
+            in = _mm256_shuffle_epi8(in, shuffle);
+            __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00));
+            __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+            __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0));
+            __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+            __m256i values = _mm256_or_si256(t1, t3);
+            __m256i indices = _mm256_subs_epu8(values, _mm256_set1_epi8(51));
+            __m256i mask = _mm256_cmpgt_epi8(values, _mm256_set1_epi8(25));
+            indices = _mm256_sub_epi8(indices, mask);
+            __m256i out = _mm256_add_epi8(values, _mm256_shuffle_epi8(lut, indices));
+            _mm256_storeu_si256((__m256i*)dst, out);
+        }
+        return src - start;
+    }
+
+    AVX2_FN static size_t decodeAVX2(const uint8_t *src, size_t size, uint8_t *&dst) {
+        const __m256i lutLo = broadcast(_mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                      0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+                                                      0x1B, 0x1B, 0x1B, 0x1A));
+        const __m256i lutHi = broadcast(_mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                                      0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+                                                      0x10, 0x10, 0x10, 0x10));
+        const __m256i lutRoll = broadcast(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                                        0, 0, 0, 0, 0, 0, 0, 0));
+        const __m256i pack = broadcast(_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                                     -1, -1, -1, -1));
+        const __m256i nibbleMask = _mm256_set1_epi8(0x0F);
+        const uint8_t *start = src;
+        // Each group writes 28 bytes, of which 24 are output:
+        for (; size >= 48; src += 32, size -= 32, dst += 24) {
+            __m256i str = _mm256_loadu_si256((const __m256i*)src);
+            __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), nibbleMask);
+            __m256i loNibbles = _mm256_and_si256(str, nibbleMask);
+            __m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+            __m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+            if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(lo, hi),
+                                                       _mm256_setzero_si256())))
+                break;
+            __m256i eq2F = _mm256_cmpeq_epi8(str, _mm256_set1_epi8('/'));
+            __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+            str = _mm256_add_epi8(str, roll);
+            __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+            __m256i out = _mm256_shuffle_epi8(_mm256_madd_epi16(merged,
+                                                                _mm256_set1_epi32(0x00011000)),
+                                              pack);
+            _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(out));
+            _mm_storeu_si128((__m128i*)(dst + 12), _mm256_extracti128_si256(out, 1));
+        }
+        return src - start;
+    }
+
+    static Base64SIMD detectSIMD() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return kBase64AVX2;
+        else if (__builtin_cpu_supports("ssse3"))
+            return kBase64SSSE3;
+        else
+            return kBase64Scalar;
+    }
+#endif
+
+
+    Base64SIMD Base64SupportedSIMD() noexcept {
+#ifdef FL_BASE64_SIMD
+        static const Base64SIMD sSupported = detectSIMD();
+        return sSupported;
+#else
+        return kBase64Scalar;
+#endif
+    }
+
+
+#pragma mark - ENCODING:
+
+
+    size_t EncodeBase64(slice data, char *dst, Base64SIMD simd) noexcept {
+        auto src = (const uint8_t*)data.buf;
+        size_t size = data.size;
+        char *out = dst;
+#ifdef FL_BASE64_SIMD
+        simd = std::min(simd, Base64SupportedSIMD());
+        if (simd >= kBase64AVX2) {
+            size_t n = encodeAVX2(src, size, out);
+            src += n;
+            size -= n;
+        }
+        if (simd >= kBase64SSSE3) {
+            size_t n = encodeSSSE3(src, size, out);
+            src += n;
+            size -= n;
+        }
+#endif
+        for (; size >= 3; src += 3, size -= 3, out += 4) {
+            uint32_t group = (src[0] << 16) | (src[1] << 8) | src[2];
+            out[0] = kBase64Digits[group >> 18];
+            out[1] = kBase64Digits[(group >> 12) & 0x3F];
+            out[2] = kBase64Digits[(group >> 6) & 0x3F];
+            out[3] = kBase64Digits[group & 0x3F];
+        }
+        if (size > 0) {
+            uint32_t group = (src[0] << 16) | (size > 1 ? (src[1] << 8) : 0);
+            out[0] = kBase64Digits[group >> 18];
+            out[1] = kBase64Digits[(group >> 12) & 0x3F];
+            out[2] = (size > 1) ? kBase64Digits[(group >> 6) & 0x3F] : '=';
+            out[3] = '=';
+            out += 4;
+        }
+        return out - dst;
+    }
+
+
+#pragma mark - DECODING:
+
+
+    size_t DecodeBase64(slice base64, void *dst, Base64SIMD simd) noexcept {
+        auto src = (const uint8_t*)base64.buf;
+        size_t size = base64.size;
+        auto out = (uint8_t*)dst;
+#ifdef FL_BASE64_SIMD
+        simd = std::min(simd, Base64SupportedSIMD());
+        if (simd >= kBase64AVX2) {
+            size_t n = decodeAVX2(src, size, out);
+            src += n;
+            size -= n;
+        }
+        if (simd >= kBase64SSSE3) {
+            size_t n = decodeSSSE3(src, size, out);
+            src += n;
+            size -= n;
+        }
+#endif
+        // Decode whole groups of four valid digits:
+        for (; size >= 4; src += 4, size -= 4, out += 3) {
+            int8_t a = kBase64Values[src[0]], b = kBase64Values[src[1]],
+                   c = kBase64Values[src[2]], d = kBase64Values[src[3]];
+            if ((a | b | c | d) < 0)
+                break;
+            uint32_t group = (a << 18) | (b << 12) | (c << 6) | d;
+            out[0] = (uint8_t)(group >> 16);
+            out[1] = (uint8_t)(group >> 8);
+            out[2] = (uint8_t)group;
+        }
+        // Leave the rest, which has padding, whitespace or invalid characters, to libb64:
+        if (size > 0) {
+            base64::decoder dec;
+            out += dec.decode(src, size, out);
+        }
+        return out - (uint8_t*)dst;
+    }
+
+}
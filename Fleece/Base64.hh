@@ -0,0 +1,57 @@
+//
+//  Base64.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "slice.hh"
+
+namespace fleece {
+
+    /** The length of the base64 encoding of `size` bytes (including padding.) */
+    static inline size_t Base64EncodedSize(size_t size) {
+        return (size + 2) / 3 * 4;
+    }
+
+    /** The maximum number of bytes that `size` bytes of base64 can decode to. */
+    static inline size_t Base64DecodedMaxSize(size_t size) {
+        return (size + 3) / 4 * 3;
+    }
+
+    /** SIMD instruction sets the base64 functions can use, from least to most capable. */
+    enum Base64SIMD {
+        kBase64Scalar,              // No SIMD
+        kBase64SSSE3,
+        kBase64AVX2,
+    };
+
+    /** The best SIMD instruction set that this CPU supports and this build can use. */
+    Base64SIMD Base64SupportedSIMD() noexcept;
+
+    /** Writes the base64 encoding of `data` to `dst`, with '=' padding and no line breaks.
+        `dst` must have room for Base64EncodedSize(data.size) bytes. Uses SIMD instructions
+        up to `simd`, if the CPU supports them. Returns the number of bytes written. */
+    size_t EncodeBase64(slice data, char *dst, Base64SIMD simd) noexcept;
+
+    static inline size_t EncodeBase64(slice data, char *dst) noexcept {
+        return EncodeBase64(data, dst, kBase64AVX2);
+    }
+
+    /** Decodes base64 into `dst`, which must have room for Base64DecodedMaxSize(base64.size)
+        bytes. Any characters that aren't base64 digits, like whitespace or '=' padding, are
+        ignored, as they are by libb64. Uses SIMD instructions up to `simd`, if the CPU supports
+        them. Returns the number of bytes written. */
+    size_t DecodeBase64(slice base64, void *dst, Base64SIMD simd) noexcept;
+
+    static inline size_t DecodeBase64(slice base64, void *dst) noexcept {
+        return DecodeBase64(base64, dst, kBase64AVX2);
+    }
+
+}
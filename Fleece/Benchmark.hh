@@ -8,16 +8,19 @@
 
 #pragma once
 #include <math.h>
-#include <time.h>
+#include <stdio.h>
 #include <algorithm>
+#include <chrono>
 #include <vector>
 
 
+/** Measures elapsed wall-clock time, using a monotonic high-resolution clock. (Unlike the
+    process CPU time from ::clock(), this also gives meaningful results for multithreaded code.) */
 class Stopwatch {
 public:
-    Stopwatch()         :_start(::clock()) { }
-    void reset()        {_start = clock();}
-    double elapsed()    {return (clock() - _start) / (double)CLOCKS_PER_SEC;}
+    Stopwatch()         :_start(clock::now()) { }
+    void reset()        {_start = clock::now();}
+    double elapsed()    {return std::chrono::duration<double>(clock::now() - _start).count();}
     double elapsedMS()  {return elapsed() * 1000.0;}
 
     void printReport(const char *what, unsigned count, const char *item) {
@@ -31,7 +34,8 @@ public:
 #endif
     }
 private:
-    clock_t _start;
+    typedef std::chrono::steady_clock clock;
+    clock::time_point _start;
 };
 
 
@@ -0,0 +1,398 @@
+//
+//  Compression.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "Compression.hh"
+#include "SharedKeys.hh"
+#include "Internal.hh"
+#include "Endian.hh"
+#include "FleeceException.hh"
+#include "varint.hh"
+#include "PlatformCompat.hh"
+#include <algorithm>
+#include <string.h>
+
+namespace fleece {
+    using namespace internal;
+
+    typedef uint8_t byte;
+
+    static std::vector<uint32_t> indexBlock(const byte *buf, size_t size);
+
+
+#pragma mark - DICTIONARY:
+
+
+    const size_t CompressionDictionary::kMaxSize;
+
+    CompressionDictionary::CompressionDictionary(alloc_slice data) {
+        if (data.size > kMaxSize)
+            data = alloc_slice(slice(offsetby(data.buf, data.size - kMaxSize), kMaxSize));
+        _data = data;
+        if (_data.size > 0) {
+            _id = std::max(dictHashIndexHash(_data.buf, _data.size), 1u);
+            _table = std::make_shared<std::vector<uint32_t>>(indexBlock((const byte*)_data.buf,
+                                                                        _data.size));
+        }
+    }
+
+
+    CompressionDictionary CompressionDictionary::fromStrings(const SharedKeys *sharedKeys,
+                                                             const std::vector<slice> &commonStrings)
+    {
+        std::vector<slice> strings;
+        if (sharedKeys) {
+            for (auto &key : sharedKeys->byKey())
+                strings.push_back(key);
+        }
+        strings.insert(strings.end(), commonStrings.begin(), commonStrings.end());
+
+        // Write each string the way Encoder does, header and all:
+        std::vector<byte> data;
+        for (auto &str : strings) {
+            byte header[1 + kMaxVarintLen64];
+            size_t headerSize = 1;
+            header[0] = (byte)((kStringTag << 4) | std::min(str.size, (size_t)0x0F));
+            if (str.size >= 0x0F)
+                headerSize += PutUVarInt(&header[1], str.size);
+            data.insert(data.end(), header, header + headerSize);
+            data.insert(data.end(), (const byte*)str.buf, (const byte*)str.end());
+        }
+        return CompressionDictionary(alloc_slice(data.data(), data.size()));
+    }
+
+
+    CompressionDictionary CompressionDictionary::fromSamples(const std::vector<slice> &samples,
+                                                             size_t maxSize)
+    {
+        maxSize = std::min(maxSize, kMaxSize);
+        // Take the samples from the end, since the later ones are closer to the data:
+        size_t size = 0;
+        auto first = samples.end();
+        while (first != samples.begin() && size < maxSize)
+            size += (--first)->size;
+        alloc_slice data(size);
+        byte *dst = (byte*)data.buf;
+        for (auto s = first; s != samples.end(); ++s) {
+            memcpy(dst, s->buf, s->size);
+            dst += s->size;
+        }
+        return CompressionDictionary(data);     // (which trims it to kMaxSize)
+    }
+
+
+#pragma mark - LZ4 BLOCKS:
+
+
+    // This is the LZ4 block format (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md)
+    // -- a series of sequences, each made of a token byte, some literal bytes to copy, and a
+    // 16-bit offset back to earlier output to copy a match from -- so that the output could be
+    // read by any LZ4 decoder that supports dictionaries. The compressor is the same greedy
+    // hash-table search as LZ4's default (fast) mode.
+
+    static const size_t   kMinMatch     = 4;
+    static const size_t   kMatchLimit   = 12;   // No match may start in the last 12 bytes
+    static const size_t   kLastLiterals = 5;    // The last 5 bytes are always literals
+    static const size_t   kMaxOffset    = 0xFFFF;
+    static const unsigned kHashBits     = 14;
+
+    static inline uint32_t read32(const byte *p) {uint32_t n; memcpy(&n, p, 4); return n;}
+    static inline uint64_t read64(const byte *p) {uint64_t n; memcpy(&n, p, 8); return n;}
+
+    static inline uint32_t hashOf(uint32_t sequence) {
+        return (sequence * 2654435761u) >> (32 - kHashBits);
+    }
+
+    static inline size_t compressBound(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    static inline byte* writeLength(byte *dst, size_t length) {
+        for (; length >= 255; length -= 255)
+            *dst++ = 255;
+        *dst++ = (byte)length;
+        return dst;
+    }
+
+    static byte* writeSequence(byte *dst, const byte *literals, size_t literalLength,
+                               size_t offset, size_t matchLength)
+    {
+        byte *token = dst++;
+        *token = (byte)(std::min(literalLength, (size_t)15) << 4);
+        if (literalLength >= 15)
+            dst = writeLength(dst, literalLength - 15);
+        memcpy(dst, literals, literalLength);
+        dst += literalLength;
+        if (matchLength > 0) {
+            *dst++ = (byte)(offset & 0xFF);
+            *dst++ = (byte)(offset >> 8);
+            matchLength -= kMinMatch;
+            *token |= (byte)std::min(matchLength, (size_t)15);
+            if (matchLength >= 15)
+                dst = writeLength(dst, matchLength - 15);
+        }
+        return dst;
+    }
+
+    // Returns the compressor's hash table for data that will be used as a dictionary.
+    static std::vector<uint32_t> indexBlock(const byte *buf, size_t size) {
+        std::vector<uint32_t> table(1 << kHashBits, 0);
+        for (size_t pos = 0; pos + kMinMatch <= size; ++pos)
+            table[hashOf(read32(&buf[pos]))] = (uint32_t)pos;
+        return table;
+    }
+
+    // The compressor's hash table of positions in the data being compressed. Each thread reuses
+    // one, instead of clearing 64KB for every call: positions are stored plus `base`, which
+    // goes up by the size of the data each call, so entries left over from earlier calls (which
+    // are less than the current base) are recognizably stale.
+    struct scratchTable {
+        std::vector<uint32_t> entries;
+        uint32_t base {0};
+    };
+
+    // Compresses `data` to dst, which must have room for compressBound(data.size) bytes.
+    // Matches may refer back into `dict`, as though it came right before the data; `dictTable`
+    // is its indexBlock, or null if it's empty. Returns the compressed size.
+    static size_t compressBlock(slice dict, slice data, const uint32_t *dictTable, byte *dst) {
+        static thread_local scratchTable scratch;
+        const size_t end = data.size;
+        if (scratch.entries.empty() || end >= UINT32_MAX - scratch.base) {
+            scratch.entries.assign(1 << kHashBits, 0);
+            scratch.base = 1;
+        }
+        uint32_t *table = scratch.entries.data();
+        const uint32_t base = scratch.base;
+        scratch.base += (uint32_t)end;
+
+        // Positions are relative to the start of the data; negative ones are in the dictionary.
+        const byte *buf = (const byte*)data.buf;
+        const byte *dictEnd = (const byte*)dict.end();
+        const ptrdiff_t dictSize = dict.size;
+        byte *out = dst;
+
+        size_t anchor = 0, pos = 0;
+        if (end >= kMatchLimit + 1) {
+            const size_t matchStartLimit = end - kMatchLimit;
+            const size_t matchEndLimit = end - kLastLiterals;
+            while (pos < matchStartLimit) {
+                uint32_t sequence = read32(&buf[pos]);
+                uint32_t hash = hashOf(sequence);
+                uint32_t entry = table[hash];
+                table[hash] = base + (uint32_t)pos;
+                // Look for a match in the data, then in the dictionary:
+                ptrdiff_t ref;
+                if (entry >= base && pos - (entry - base) <= kMaxOffset
+                                  && read32(&buf[entry - base]) == sequence) {
+                    ref = entry - base;
+                } else if (dictTable && dictSize - (ptrdiff_t)dictTable[hash] + pos <= kMaxOffset
+                                     && dictTable[hash] + kMinMatch <= (size_t)dictSize
+                                     && read32(&dictEnd[dictTable[hash] - dictSize]) == sequence) {
+                    ref = (ptrdiff_t)dictTable[hash] - dictSize;
+                } else {
+                    // No match; skip ahead faster the longer it's been since the last one:
+                    pos += 1 + ((pos - anchor) >> 6);
+                    continue;
+                }
+
+                // Extend the match backwards, then forwards (first through the dictionary, if
+                // it starts there):
+                auto byteAt = [&](ptrdiff_t p) {return p < 0 ? dictEnd[p] : buf[p];};
+                while (pos > anchor && ref > -dictSize && buf[pos - 1] == byteAt(ref - 1)) {
+                    --pos;
+                    --ref;
+                }
+                size_t length = kMinMatch;
+                bool matching = true;
+                while (ref + (ptrdiff_t)length < 0 && pos + length < matchEndLimit) {
+                    const byte *r = &dictEnd[ref + (ptrdiff_t)length];
+                    if (ref + (ptrdiff_t)length + 8 <= 0 && pos + length + 8 <= matchEndLimit
+                            && read64(&buf[pos + length]) == read64(r)) {
+                        length += 8;
+                    } else if (buf[pos + length] == *r) {
+                        ++length;
+                    } else {
+                        matching = false;
+                        break;
+                    }
+                }
+                if (matching && ref + (ptrdiff_t)length >= 0) {
+                    const byte *r = &buf[ref];
+                    while (pos + length + 8 <= matchEndLimit
+                                && read64(&buf[pos + length]) == read64(&r[length]))
+                        length += 8;
+                    while (pos + length < matchEndLimit && buf[pos + length] == r[length])
+                        ++length;
+                }
+
+                out = writeSequence(out, &buf[anchor], pos - anchor, pos - ref, length);
+                pos += length;
+                anchor = pos;
+                if (pos < matchStartLimit)
+                    table[hashOf(read32(&buf[pos - 2]))] = base + (uint32_t)(pos - 2);
+            }
+        }
+        out = writeSequence(out, &buf[anchor], end - anchor, 0, 0);
+        return out - dst;
+    }
+
+    [[noreturn]] static void failCorrupt() {
+        FleeceException::_throw(InvalidData, "corrupt compressed data");
+    }
+
+    static inline size_t readLength(const byte* &src, const byte *srcEnd, size_t length) {
+        if (length == 15) {
+            byte b;
+            do {
+                if (src >= srcEnd)
+                    failCorrupt();
+                b = *src++;
+                length += b;
+            } while (b == 255);
+        }
+        return length;
+    }
+
+    // Decompresses an LZ4 block into `dst`, which must be exactly the size of the original
+    // data. Offsets that reach back past the start of `dst` refer to the end of `dict`.
+    static void decompressBlock(slice src, slice dict, slice dst) {
+        auto in = (const byte*)src.buf, inEnd = (const byte*)src.end();
+        auto outStart = (byte*)dst.buf, out = outStart, outEnd = (byte*)dst.end();
+        while (true) {
+            if (in >= inEnd)
+                failCorrupt();
+            byte token = *in++;
+
+            size_t literalLength = readLength(in, inEnd, token >> 4);
+            if (literalLength > (size_t)(inEnd - in) || literalLength > (size_t)(outEnd - out))
+                failCorrupt();
+            memcpy(out, in, literalLength);
+            in += literalLength;
+            out += literalLength;
+            if (in == inEnd)
+                break;                              // The last sequence has no match
+
+            if (inEnd - in < 2)
+                failCorrupt();
+            size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+            size_t length = readLength(in, inEnd, token & 0x0F) + kMinMatch;
+            if (offset == 0 || length > (size_t)(outEnd - out))
+                failCorrupt();
+
+            size_t produced = out - outStart;
+            if (offset > produced) {
+                // The match starts in the dictionary:
+                size_t back = offset - produced;
+                if (back > dict.size)
+                    failCorrupt();
+                size_t n = std::min(back, length);
+                memcpy(out, offsetby(dict.end(), -(ptrdiff_t)back), n);
+                out += n;
+                length -= n;
+                // (...and may continue at the start of the output)
+            }
+            const byte *match = out - offset;
+            if (offset >= length) {
+                memcpy(out, match, length);
+                out += length;
+            } else {
+                while (length-- > 0)                // overlapping copy, i.e. a repeat
+                    *out++ = *match++;
+            }
+        }
+        if (out != outEnd)
+            failCorrupt();
+    }
+
+
+#pragma mark - CONTAINER:
+
+
+    // The container is a 16-byte header followed by the (possibly compressed) data:
+    //   0: 'F', 'l', 'z'
+    //   3: method: 0 = stored as-is, 1 = an LZ4 block
+    //   4: id of the dictionary it was compressed with (32-bit little-endian), or 0 if none
+    //   8: uncompressed size (64-bit little-endian)
+    static const size_t kHeaderSize = 16;
+    static const byte kMagic[3] = {'F', 'l', 'z'};
+    enum : byte {kMethodStored = 0, kMethodLZ4};
+
+
+    alloc_slice CompressFleece(slice data, const CompressionDictionary *dict) {
+        throwIf(data.size >= UINT32_MAX / 2, MemoryError, "data too large to compress");
+        slice dictData = dict ? dict->data() : nullslice;
+        alloc_slice output(kHeaderSize + compressBound(data.size));
+        auto out = (byte*)output.buf;
+        size_t size = compressBlock(dictData, data,
+                                    (dictData.size > 0 ? dict->_table->data() : nullptr),
+                                    out + kHeaderSize);
+        byte method = kMethodLZ4;
+        if (size >= data.size) {
+            method = kMethodStored;
+            size = data.size;
+            if (size)
+                memcpy(out + kHeaderSize, data.buf, size);
+        }
+
+        memcpy(out, kMagic, sizeof(kMagic));
+        out[3] = method;
+        uint32_t id = _encLittle32(dict ? dict->id() : 0);
+        memcpy(&out[4], &id, sizeof(id));
+        uint64_t uncompressedSize = _encLittle64((uint64_t)data.size);
+        memcpy(&out[8], &uncompressedSize, sizeof(uncompressedSize));
+        output.resize(kHeaderSize + size);
+        return output;
+    }
+
+
+    bool IsCompressedFleece(slice data) noexcept {
+        return data.size >= kHeaderSize && memcmp(data.buf, kMagic, sizeof(kMagic)) == 0
+            && data[3] <= kMethodLZ4;
+    }
+
+
+    uint32_t CompressedFleeceDictionaryID(slice data) noexcept {
+        if (!IsCompressedFleece(data))
+            return 0;
+        uint32_t id;
+        memcpy(&id, offsetby(data.buf, 4), sizeof(id));
+        return _decLittle32(id);
+    }
+
+
+    alloc_slice DecompressFleece(slice data, const CompressionDictionary *dict) {
+        throwIf(!IsCompressedFleece(data), InvalidData, "not compressed Fleece data");
+        // (Stored data doesn't need its dictionary, so any will do, including none; older
+        // versions recorded a dictionary id of 0 for it.)
+        uint32_t dictID = CompressedFleeceDictionaryID(data);
+        throwIf(data[3] != kMethodStored && dictID != (dict ? dict->id() : 0), InvalidData,
+                "compressed data needs a different dictionary");
+        uint64_t size;
+        memcpy(&size, offsetby(data.buf, 8), sizeof(size));
+        size = _decLittle64(size);
+        slice body(offsetby(data.buf, kHeaderSize), data.size - kHeaderSize);
+        // An LZ4 block can't expand data more than 255x, which bounds a corrupt size:
+        throwIf(size > body.size * 255 + 16 || size > SIZE_MAX / 2, InvalidData,
+                "corrupt compressed data");
+
+        alloc_slice output((size_t)size);
+        if (data[3] == kMethodStored) {
+            throwIf(body.size != size, InvalidData, "corrupt compressed data");
+            if (size)
+                memcpy((void*)output.buf, body.buf, body.size);
+        } else {
+            decompressBlock(body, (dict ? dict->data() : nullslice), output);
+        }
+        return output;
+    }
+
+}
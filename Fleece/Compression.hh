@@ -0,0 +1,81 @@
+//
+//  Compression.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "slice.hh"
+#include <memory>
+#include <vector>
+
+namespace fleece {
+    class SharedKeys;
+
+
+    /** A preset dictionary for compressing Fleece data: bytes that the compressor can refer
+        back to as though they came before the data. Small documents are too short to contain
+        much repetition themselves, so most of their savings come from matching what they have
+        in common with other documents -- dictionary keys, dict/array headers, common strings
+        -- which a dictionary made from typical documents supplies.
+        The same dictionary (identified by its id) must be used to decompress. */
+    class CompressionDictionary {
+    public:
+        /** The maximum useful size of a dictionary. (Matches can't reach further back.) */
+        static const size_t kMaxSize = 0xFFFF;
+
+        CompressionDictionary() { }
+
+        /** Uses arbitrary data as a dictionary. Only the last kMaxSize bytes are used. */
+        explicit CompressionDictionary(alloc_slice data);
+
+        /** Creates a dictionary from the strings of a SharedKeys mapping (if any) and other
+            common strings, in their Fleece-encoded form. Put the most common strings last;
+            they're the cheapest to refer to. */
+        static CompressionDictionary fromStrings(const SharedKeys*,
+                                                 const std::vector<slice> &commonStrings);
+
+        /** Creates a dictionary from sample documents (or any other sample data.) Put the most
+            typical samples last. */
+        static CompressionDictionary fromSamples(const std::vector<slice> &samples,
+                                                 size_t maxSize =kMaxSize);
+
+        slice data() const                  {return _data;}
+
+        /** A hash of the data, recorded in compressed data so it isn't decompressed with the
+            wrong dictionary. An empty dictionary's id is 0. */
+        uint32_t id() const                 {return _id;}
+
+    private:
+        alloc_slice _data;
+        uint32_t _id {0};
+        std::shared_ptr<const std::vector<uint32_t>> _table;   // Compressor's index of _data
+
+        friend alloc_slice CompressFleece(slice, const CompressionDictionary*);
+    };
+
+
+    /** Compresses (Fleece) data into a small self-describing container, using the LZ4 block
+        format, optionally with a preset dictionary. Data that doesn't compress is stored
+        as-is, so the container is at most 16 bytes larger than the input. */
+    alloc_slice CompressFleece(slice data, const CompressionDictionary* =nullptr);
+
+    /** Returns true if the data looks like the output of CompressFleece. */
+    bool IsCompressedFleece(slice) noexcept;
+
+    /** Returns the id of the dictionary the data was compressed with, or 0 if none. */
+    uint32_t CompressedFleeceDictionaryID(slice) noexcept;
+
+    /** Decompresses the output of CompressFleece. The result is 8-byte aligned, so it can be
+        given directly to Value::fromTrustedData (if the compressed data is trusted). Throws a
+        FleeceException if the data is corrupt or the dictionary isn't the one it needs.
+        (Data that was stored as-is, not compressed, can be decompressed with any dictionary.) */
+    alloc_slice DecompressFleece(slice compressed, const CompressionDictionary* =nullptr);
+
+}
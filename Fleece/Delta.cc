@@ -0,0 +1,315 @@
+//
+//  Delta.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "Delta.hh"
+#include "Encoder.hh"
+#include "Array.hh"
+#include "FleeceException.hh"
+#include <vector>
+
+namespace fleece {
+
+
+    // Compares dict keys in the order the Encoder sorts them: integers first, then strings.
+    static int compareKeys(const Value *a, const Value *b) noexcept {
+        if (a->isInteger()) {
+            if (!b->isInteger())
+                return -1;
+            int64_t ia = a->asInt(), ib = b->asInt();
+            return (ia > ib) - (ia < ib);
+        } else if (b->isInteger()) {
+            return 1;
+        } else {
+            return a->asString().compare(b->asString());
+        }
+    }
+
+    static bool keysSorted(const Dict *d) noexcept {
+        const Value *prevKey = nullptr;
+        for (Dict::iterator i(d); i; ++i) {
+            if (prevKey && compareKeys(prevKey, i.key()) >= 0)
+                return false;
+            prevKey = i.key();
+        }
+        return true;
+    }
+
+    static const Value* findKey(const Dict *d, const Value *key, bool sorted) noexcept {
+        if (sorted) {
+            return key->isInteger() ? d->get((int)key->asInt()) : d->get(key->asString());
+        } else {
+            for (Dict::iterator i(d); i; ++i) {
+                if (compareKeys(i.key(), key) == 0)
+                    return i.value();
+            }
+            return nullptr;
+        }
+    }
+
+
+#pragma mark - CREATING:
+
+
+    // Writes a delta to an Encoder. The dicts enclosing a change are only begun when the
+    // first change inside them is found, so unchanged subtrees produce no output at all.
+    class DeltaWriter {
+    public:
+        DeltaWriter(Encoder &enc)   :_enc(enc) { }
+
+        void diff(const Value *old, const Value *nuu) {
+            if (old == nuu)
+                return;                 // Same Value, so the subtree is unchanged
+            auto type = old->type();
+            if (type == kDict && nuu->type() == kDict)
+                diffDicts((const Dict*)old, (const Dict*)nuu);
+            else if (type == kArray && nuu->type() == kArray)
+                diffArrays((const Array*)old, (const Array*)nuu);
+            else if (!old->isEqual(nuu))
+                replace(nuu);
+        }
+
+    private:
+        struct pathItem {
+            const Value *key;           // Dict key, or nullptr for an array index
+            uint32_t index;
+        };
+
+        void diffDicts(const Dict *old, const Dict *nuu) {
+            size_t depth = _path.size();
+            if (keysSorted(old) && keysSorted(nuu)) {
+                // Walk both dicts together in key order:
+                Dict::iterator i(old), j(nuu);
+                while (i || j) {
+                    int cmp = !i ? 1 : (!j ? -1 : compareKeys(i.key(), j.key()));
+                    if (cmp < 0) {
+                        push(i.key());
+                        remove();
+                        ++i;
+                    } else if (cmp > 0) {
+                        push(j.key());
+                        replace(j.value());
+                        ++j;
+                    } else {
+                        push(j.key());
+                        diff(i.value(), j.value());
+                        ++i, ++j;
+                    }
+                    pop();
+                }
+            } else {
+                for (Dict::iterator j(nuu); j; ++j) {
+                    push(j.key());
+                    auto oldValue = findKey(old, j.key(), false);
+                    if (oldValue)
+                        diff(oldValue, j.value());
+                    else
+                        replace(j.value());
+                    pop();
+                }
+                for (Dict::iterator i(old); i; ++i) {
+                    if (!findKey(nuu, i.key(), false)) {
+                        push(i.key());
+                        remove();
+                        pop();
+                    }
+                }
+            }
+            close(depth);
+        }
+
+        void diffArrays(const Array *old, const Array *nuu) {
+            size_t depth = _path.size();
+            Array::iterator i(old), j(nuu);
+            uint32_t index = 0;
+            for (; i && j; ++i, ++j, ++index) {
+                push(index);
+                diff(i.value(), j.value());
+                pop();
+            }
+            if (i) {
+                push(index);
+                remove();               // truncate
+                pop();
+            } else {
+                for (; j; ++j, ++index) {
+                    push(index);
+                    replace(j.value());
+                    pop();
+                }
+            }
+            close(depth);
+        }
+
+        void push(const Value *key)     {_path.push_back({key, 0});}
+        void push(uint32_t index)       {_path.push_back({nullptr, index});}
+        void pop()                      {_path.pop_back();}
+
+        // Writes a new value for the current path.
+        void replace(const Value *nuu) {
+            beginChange();
+            _enc.beginArray(1);
+            _enc.writeValue(nuu);
+            _enc.endArray();
+        }
+
+        // Writes a deletion (or truncation) at the current path.
+        void remove() {
+            beginChange();
+            _enc.beginArray();
+            _enc.endArray();
+        }
+
+        // Begins any enclosing dicts not yet written, then writes the current path's key.
+        void beginChange() {
+            size_t depth = _path.size();
+            for (; _opened < depth; ++_opened) {
+                if (_opened > 0)
+                    writeKey(_path[_opened - 1]);
+                _enc.beginDictionary();
+            }
+            if (depth > 0)
+                writeKey(_path[depth - 1]);
+        }
+
+        // Ends the dict of the container at this depth, if anything changed inside it.
+        void close(size_t depth) {
+            if (_opened > depth) {
+                _enc.endDictionary();
+                _opened = depth;
+            }
+        }
+
+        void writeKey(const pathItem &item) {
+            if (item.key)
+                _enc.writeKey(item.key);
+            else
+                _enc.writeKey((int)item.index);
+        }
+
+        Encoder &_enc;
+        std::vector<pathItem> _path;    // Keys/indexes from the root to the current value
+        size_t _opened {0};             // Number of path levels whose delta dict is begun
+    };
+
+
+    alloc_slice CreateDelta(const Value *old, const Value *nuu) {
+        throwIf(!old || !nuu, InvalidData, "Can't diff a null Value pointer");
+        Encoder enc;
+        DeltaWriter(enc).diff(old, nuu);
+        if (enc.isEmpty())
+            return alloc_slice();
+        return enc.extractOutput();
+    }
+
+
+#pragma mark - APPLYING:
+
+
+    static void applyDelta(const Value *old, const Value *delta, Encoder &enc);
+
+    // Applies a delta that isn't a dict, i.e. a (one-item) array containing the new value.
+    static void applyReplacement(const Array *delta, Encoder &enc) {
+        throwIf(delta->count() != 1, InvalidData, "Invalid delta");
+        enc.writeValue(delta->get(0));
+    }
+
+    static void applyDictDelta(const Dict *old, const Dict *delta, Encoder &enc) {
+        bool oldSorted = keysSorted(old);
+        enc.beginDictionary(old->count());
+        for (Dict::iterator i(old); i; ++i) {
+            auto change = findKey(delta, i.key(), true);
+            if (!change) {
+                enc.writeKey(i.key());
+                enc.writeValue(i.value());
+            } else if (change->type() != kArray || change->asArray()->count() > 0) {
+                enc.writeKey(i.key());
+                applyDelta(i.value(), change, enc);
+            }
+        }
+        for (Dict::iterator j(delta); j; ++j) {
+            if (!findKey(old, j.key(), oldSorted)) {
+                throwIf(j.value()->type() != kArray, InvalidData, "Delta doesn't match source");
+                enc.writeKey(j.key());
+                applyReplacement(j.value()->asArray(), enc);
+            }
+        }
+        enc.endDictionary();
+    }
+
+    static void applyArrayDelta(const Array *old, const Dict *delta, Encoder &enc) {
+        Dict::iterator j(delta);
+        auto nextIndex = [&]() -> int64_t {
+            if (!j)
+                return -1;
+            throwIf(!j.key()->isInteger(), InvalidData, "Delta doesn't match source");
+            return j.key()->asInt();
+        };
+        enc.beginArray(old->count());
+        int64_t index = 0;
+        for (Array::iterator i(old); i; ++i, ++index) {
+            if (nextIndex() == index) {
+                auto change = j.value();
+                if (change->type() == kArray && change->asArray()->count() == 0)
+                    break;              // truncated here
+                applyDelta(i.value(), change, enc);
+                ++j;
+            } else {
+                enc.writeValue(i.value());
+            }
+        }
+        for (; j; ++j, ++index) {
+            throwIf(nextIndex() != index || j.value()->type() != kArray,
+                    InvalidData, "Delta doesn't match source");
+            if (j.value()->asArray()->count() == 0)
+                break;                  // (a truncation at the old end)
+            applyReplacement(j.value()->asArray(), enc);
+        }
+        enc.endArray();
+    }
+
+    static void applyDelta(const Value *old, const Value *delta, Encoder &enc) {
+        switch (delta->type()) {
+            case kArray:
+                applyReplacement(delta->asArray(), enc);
+                break;
+            case kDict:
+                if (old->type() == kDict)
+                    applyDictDelta(old->asDict(), delta->asDict(), enc);
+                else if (old->type() == kArray)
+                    applyArrayDelta(old->asArray(), delta->asDict(), enc);
+                else
+                    FleeceException::_throw(InvalidData, "Delta doesn't match source");
+                break;
+            default:
+                FleeceException::_throw(InvalidData, "Invalid delta");
+        }
+    }
+
+
+    void ApplyDelta(const Value *old, slice delta, Encoder &enc) {
+        throwIf(!old, InvalidData, "Can't apply a delta to a null Value pointer");
+        if (!delta) {
+            enc.writeValue(old);        // empty delta means no change
+            return;
+        }
+        auto deltaRoot = Value::fromData(delta);
+        throwIf(!deltaRoot, InvalidData, "Invalid delta");
+        applyDelta(old, deltaRoot, enc);
+    }
+
+    alloc_slice ApplyDelta(const Value *old, slice delta) {
+        Encoder enc;
+        ApplyDelta(old, delta, enc);
+        return enc.extractOutput();
+    }
+
+}
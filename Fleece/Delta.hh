@@ -0,0 +1,44 @@
+//
+//  Delta.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "slice.hh"
+
+namespace fleece {
+    class Value;
+    class Encoder;
+
+
+    /** Creates a delta (patch) describing how to change the value `old` into `nuu`, as Fleece
+        data. If they're equal, returns a null slice.
+        The delta of two values is:
+        - A dict, if both are dicts or both are arrays. Its keys are the dict keys (or array
+          indexes, as integers) whose values changed, and its values are the deltas of those.
+          A key only in `nuu` has the delta [value]; a key only in `old` has the delta [].
+          An array that got shorter has a [] delta at the index of its new end, and one that
+          got longer has [item] deltas for the items appended.
+        - Otherwise, a one-item array containing `nuu`.
+        The trees are walked together in sorted-key order, and subtrees that are the same
+        Value (as when both versions are in the same Fleece document) aren't visited. */
+    alloc_slice CreateDelta(const Value *old, const Value *nuu);
+
+    /** Writes to the encoder the value produced by applying the delta to `old`, i.e. `nuu` if
+        the delta came from CreateDelta(old, nuu). Unchanged values are written with
+        Encoder::writeValue, so if the encoder's base is the document containing `old`, they
+        become pointers into it and the output contains only what changed.
+        Throws a FleeceException if the delta is invalid or doesn't fit `old`. */
+    void ApplyDelta(const Value *old, slice delta, Encoder&);
+
+    /** Applies the delta to `old` and returns the resulting new document. */
+    alloc_slice ApplyDelta(const Value *old, slice delta);
+
+}
@@ -0,0 +1,237 @@
+//
+//  DocumentFile.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "DocumentFile.hh"
+#include "SharedKeys.hh"
+#include "Value.hh"
+#include "Endian.hh"
+#include "FleeceException.hh"
+#include "PlatformCompat.hh"
+#include <algorithm>
+
+namespace fleece {
+
+    typedef uint8_t byte;
+
+    // A document file is laid out as:
+    //   a header of kHeaderSize bytes:
+    //      0: 'F', 'l', 'd', 'f'
+    //      4: format version (32-bit little-endian)
+    //      8: number of documents (64-bit little-endian, like the rest)
+    //     16: offset of the index
+    //     24: offset of the SharedKeys segment, and at 32 its size (0 if there isn't one)
+    //   the documents, one after another, starting at kHeaderSize;
+    //   the SharedKeys segment: a Fleece array of the key strings, in the format
+    //     PersistentSharedKeys saves them in;
+    //   the index, 8-byte aligned: the offset of each document, then the end of the last one.
+    static const size_t kHeaderSize = 40;
+    static const byte kMagic[4] = {'F', 'l', 'd', 'f'};
+    static const uint32_t kVersion = 1;
+
+
+    static void putLittle64(byte *dst, uint64_t n) {
+        n = _encLittle64(n);
+        memcpy(dst, &n, sizeof(n));
+    }
+
+    static uint64_t getLittle64(const byte *src) {
+        uint64_t n;
+        memcpy(&n, src, sizeof(n));
+        return _decLittle64(n);
+    }
+
+
+#pragma mark - WRITER:
+
+
+    DocumentFileWriter::DocumentFileWriter(const char *path, SharedKeys *sk)
+    :_file(fopen(path, "wb")),
+     _sharedKeys(sk)
+    {
+        throwIf(!_file, IOError, "can't create file");
+        _encoder.setSharedKeys(sk);
+        byte header[kHeaderSize] = {};          // (written for real by finish)
+        write(header, sizeof(header));
+    }
+
+    DocumentFileWriter::~DocumentFileWriter() {
+        if (_file)
+            fclose(_file);
+    }
+
+    void DocumentFileWriter::write(const void *data, size_t size) {
+        throwIf(!_file, EncodeError, "document file is already finished");
+        throwIf(fwrite(data, 1, size, _file) < size, IOError, "can't write to file");
+        _pos += size;
+    }
+
+    void DocumentFileWriter::pad(size_t alignment) {
+        static const byte kZeros[8] = {};
+        write(kZeros, (alignment - _pos % alignment) % alignment);
+    }
+
+    size_t DocumentFileWriter::writeDocument() {
+        alloc_slice data = _encoder.extractOutput();
+        _encoder.reset();
+        return addDocument(data);
+    }
+
+    size_t DocumentFileWriter::addDocument(slice data) {
+        // Fleece documents always have even sizes, so each one starts 2-byte aligned:
+        throwIf(data.size < 2 || (data.size & 1), InvalidData, "not a Fleece document");
+        _offsets.push_back(_pos);
+        write(data.buf, data.size);
+        return _offsets.size() - 1;
+    }
+
+    void DocumentFileWriter::finish() {
+        uint64_t docsEnd = _pos;
+        byte header[kHeaderSize] = {};
+        memcpy(header, kMagic, sizeof(kMagic));
+        uint32_t version = _encLittle32(kVersion);
+        memcpy(&header[4], &version, sizeof(version));
+        putLittle64(&header[8], _offsets.size());
+
+        if (_sharedKeys && _sharedKeys->count() > 0) {
+            Encoder enc;
+            enc.beginArray(_sharedKeys->count());
+            for (auto &key : _sharedKeys->byKey())
+                enc.writeString(key);
+            enc.endArray();
+            alloc_slice keys = enc.extractOutput();
+            putLittle64(&header[24], _pos);
+            putLittle64(&header[32], keys.size);
+            write(keys.buf, keys.size);
+        }
+
+        pad(8);
+        putLittle64(&header[16], _pos);
+        std::vector<byte> index((_offsets.size() + 1) * 8);
+        for (size_t i = 0; i < _offsets.size(); ++i)
+            putLittle64(&index[8 * i], _offsets[i]);
+        putLittle64(&index[8 * _offsets.size()], docsEnd);
+        write(index.data(), index.size());
+
+        throwIf(fseek(_file, 0, SEEK_SET) != 0, IOError, "can't write to file");
+        write(header, sizeof(header));
+        int err = fclose(_file);
+        _file = nullptr;
+        throwIf(err != 0, IOError, "can't write to file");
+    }
+
+
+#pragma mark - READER:
+
+
+    // The SharedKeys of a document file. (It's read-only, since it's not in a transaction.)
+    class DocumentFileKeys : public PersistentSharedKeys {
+    public:
+        explicit DocumentFileKeys(slice data) {
+            throwIf(!loadFrom(data), InvalidData, "invalid shared keys in document file");
+        }
+    protected:
+        virtual bool read() override                {return false;}
+        virtual void write(slice) override          {}
+    };
+
+
+    DocumentFile::DocumentFile(const char *path)
+    :_mapped(path),
+     _data(_mapped)
+    {
+        open();
+    }
+
+    DocumentFile::DocumentFile(slice data)
+    :_data(data)
+    {
+        open();
+    }
+
+    // Reads and checks the header and the index's location.
+    void DocumentFile::open() {
+        auto bytes = (const byte*)_data.buf;
+        throwIf(_data.size < kHeaderSize || memcmp(bytes, kMagic, sizeof(kMagic)) != 0,
+                InvalidData, "not a Fleece document file");
+        uint32_t version;
+        memcpy(&version, &bytes[4], sizeof(version));
+        throwIf(_decLittle32(version) != kVersion, InvalidData,
+                "unsupported document file version");
+        _count = getLittle64(&bytes[8]);
+        uint64_t indexPos = getLittle64(&bytes[16]);
+        throwIf(indexPos < kHeaderSize || indexPos > _data.size || (indexPos & 7)
+                    || _count >= (_data.size - indexPos) / 8,
+                InvalidData, "invalid document file index");
+        _index = &bytes[indexPos];
+        throwIf(offset(0) != kHeaderSize || offset((size_t)_count) > indexPos,
+                InvalidData, "invalid document file index");
+
+        uint64_t keysPos = getLittle64(&bytes[24]), keysSize = getLittle64(&bytes[32]);
+        if (keysSize > 0) {
+            throwIf(keysPos < offset((size_t)_count) || keysPos > indexPos
+                        || keysSize > indexPos - keysPos,
+                    InvalidData, "invalid shared keys in document file");
+            _sharedKeys = std::make_shared<DocumentFileKeys>(slice(&bytes[keysPos],
+                                                                   (size_t)keysSize));
+        }
+    }
+
+    uint64_t DocumentFile::offset(size_t i) const noexcept {
+        return getLittle64(&_index[8 * i]);
+    }
+
+    slice DocumentFile::document(size_t docNumber) const {
+        throwIf(docNumber >= _count, OutOfRange, "document number out of range");
+        uint64_t start = offset(docNumber), end = offset(docNumber + 1);
+        throwIf(start >= end || end > offset((size_t)_count) || (start & 1), InvalidData,
+                "invalid document file index");
+        return slice(offsetby(_data.buf, (size_t)start), (size_t)(end - start));
+    }
+
+    const Value* DocumentFile::get(size_t docNumber) const {
+        return Value::fromTrustedData(document(docNumber));
+    }
+
+
+#pragma mark - ITERATOR:
+
+
+    DocumentFile::iterator::iterator(const DocumentFile &file, size_t startDoc)
+    :_file(file),
+     _docNumber(startDoc)
+    {
+        readAhead();
+    }
+
+    DocumentFile::iterator& DocumentFile::iterator::operator++() {
+        ++_docNumber;
+        readAhead();
+        return *this;
+    }
+
+    // Keeps the readahead at least half a window ahead of the current document, asking for a
+    // whole window at a time so there are few system calls.
+    void DocumentFile::iterator::readAhead() {
+        if (!_file._mapped || _docNumber >= _file.count())
+            return;
+        uint64_t pos = _file.offset(_docNumber);
+        if (_usuallyTrue(pos + kReadAheadSize / 2 < _readAheadEnd))
+            return;
+        uint64_t docsEnd = _file.offset(_file.count());
+        uint64_t start = std::max(pos, _readAheadEnd);
+        _readAheadEnd = std::min(pos + kReadAheadSize, docsEnd);
+        if (start < _readAheadEnd)
+            _file._mapped.willNeed(slice(offsetby(_file._data.buf, (size_t)start),
+                                         (size_t)(_readAheadEnd - start)));
+    }
+
+}
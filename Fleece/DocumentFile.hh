@@ -0,0 +1,136 @@
+//
+//  DocumentFile.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "Encoder.hh"
+#include "MappedFile.hh"
+#include <stdio.h>
+#include <memory>
+#include <vector>
+
+namespace fleece {
+    class SharedKeys;
+    class Value;
+
+
+    /** Writes a file containing many Fleece documents, which a DocumentFile can read any of by
+        number in constant time. The file has a header, the documents one after another, the
+        strings of the SharedKeys the documents were encoded with (if any), and an index of
+        the documents' offsets. Documents are numbered from 0 in the order they're added. */
+    class DocumentFileWriter {
+    public:
+        /** Creates (or replaces) the file at `path`. If the documents have integer dict keys,
+            give the SharedKeys they were encoded with, so its strings get saved in the file.
+            Throws a FleeceException if the file can't be created. */
+        explicit DocumentFileWriter(const char *path, SharedKeys* =nullptr);
+
+        /** Closes the file. If finish() wasn't called, the file is incomplete and can't be
+            opened. */
+        ~DocumentFileWriter();
+
+        /** An Encoder, using the SharedKeys, to encode the next document with. */
+        Encoder& encoder()                              {return _encoder;}
+
+        /** Adds the document that's been written to encoder(), and resets the encoder for the
+            next one. Returns the document's number. */
+        size_t writeDocument();
+
+        /** Adds an already-encoded document. Returns its number. */
+        size_t addDocument(slice fleeceData);
+
+        /** The number of documents added so far. */
+        size_t count() const                            {return _offsets.size();}
+
+        /** Writes the SharedKeys and the index, and closes the file. */
+        void finish();
+
+    private:
+        void write(const void *data, size_t size);
+        void pad(size_t alignment);
+
+        DocumentFileWriter(const DocumentFileWriter&) = delete;
+        DocumentFileWriter& operator=(const DocumentFileWriter&) = delete;
+
+        FILE *_file;
+        SharedKeys *_sharedKeys;
+        Encoder _encoder;
+        uint64_t _pos {0};                  // Current position in the file
+        std::vector<uint64_t> _offsets;     // Start of each document
+    };
+
+
+    /** Reads a file written by DocumentFileWriter. The file is memory-mapped, so opening it
+        takes constant time however big it is, and so does getting a document by number.
+        Documents aren't validated (see Value::fromTrustedData), so only open trusted files;
+        the rest of the file is checked when it's opened, and a document's bounds when it's
+        accessed. */
+    class DocumentFile {
+    public:
+        /** Maps the file at `path`. Throws a FleeceException if it can't be opened or isn't a
+            valid document file. */
+        explicit DocumentFile(const char *path);
+
+        /** Reads document-file data that's already in memory; it must remain valid and
+            unchanged while this object is in use. */
+        explicit DocumentFile(slice data);
+
+        /** The number of documents. */
+        size_t count() const                            {return (size_t)_count;}
+
+        /** The encoded data of a document. Throws if the number is out of range. */
+        slice document(size_t docNumber) const;
+
+        /** The root value of a document. Throws if the number is out of range. */
+        const Value* get(size_t docNumber) const;
+
+        /** The SharedKeys to decode the documents' integer keys with, or nullptr if the file
+            doesn't have any. (Adding keys to it throws, since the file can't change.) */
+        SharedKeys* sharedKeys() const                  {return _sharedKeys.get();}
+
+        /** Iterates over the documents in order, telling the OS to read ahead of the current
+            one (if the file is mapped), so a sequential scan doesn't wait for each page. */
+        class iterator {
+        public:
+            explicit iterator(const DocumentFile&, size_t startDoc =0);
+
+            explicit operator bool() const              {return _docNumber < _file.count();}
+            size_t docNumber() const                    {return _docNumber;}
+            slice document() const                      {return _file.document(_docNumber);}
+            const Value* value() const                  {return _file.get(_docNumber);}
+
+            iterator& operator++();
+
+            /** How far ahead of the current document to read. */
+            static const size_t kReadAheadSize = 1 << 20;
+
+        private:
+            void readAhead();
+
+            const DocumentFile &_file;
+            size_t _docNumber;
+            uint64_t _readAheadEnd {0};             // End of the range asked to be read ahead
+        };
+
+        iterator begin() const                          {return iterator(*this);}
+
+    private:
+        void open();
+        uint64_t offset(size_t i) const noexcept;
+
+        mapped_slice _mapped;               // The mapped file, if it was opened by path
+        slice _data;                        // The contents of the file
+        uint64_t _count {0};                // Number of documents
+        const uint8_t *_index {nullptr};    // Document offsets (_count + 1 of them)
+        std::shared_ptr<SharedKeys> _sharedKeys;
+    };
+
+}
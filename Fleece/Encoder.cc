@@ -16,12 +16,14 @@
 #include "Encoder.hh"
 #include "Array.hh"
 #include "SharedKeys.hh"
+#include "Path.hh"
 #include "Endian.hh"
 #include "varint.hh"
 #include "FleeceException.hh"
 #include "PlatformCompat.hh"
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <cmath>
 #include <stdlib.h>
 
@@ -34,19 +36,48 @@ namespace fleece {
 
     Encoder::Encoder(size_t reserveSize)
     :_out(reserveSize),
+     _stack(kInitialStackDepth),
      _strings(10)
     {
         push(kSpecialTag, 1);                   // Top-level 'array' is just a single item
     }
 
+    Encoder::Encoder(Writer::OutputCallback output, size_t chunkSize)
+    :_out(output, chunkSize),
+     _stack(kInitialStackDepth),
+     _strings(10)
+    {
+        push(kSpecialTag, 1);
+    }
+
     void Encoder::end() {
         if (!_items)
             return;
+        writeRoot();
+        _items = nullptr;
+        _stackDepth = 0;
+        _out.flush();
+        if (_usuallyFalse(_collectStats)) {
+            _stats.bytesWritten += _out.length();
+            _stats.stringTableLoad = _strings.count() / (double)_strings.tableSize();
+        }
+    }
+
+    size_t Encoder::finishDocument() {
+        throwIf(!_items, EncodeError, "encoder has already ended");
+        throwIf(_items->empty(), EncodeError, "no root value");
+        writeRoot();
+        return _out.length();
+    }
+
+    // Writes the top-level value, which makes the output so far a complete document.
+    void Encoder::writeRoot() {
         throwIf(_stackDepth > 1, EncodeError, "unclosed array/dict");
         throwIf(_items->size() > 1, EncodeError, "top level must have only one value");
 
         if (_items->size() > 0) {
             checkPointerWidths(_items);
+            throwIf(_items->extraWide, EncodeError, "root collection is too large");
             fixPointers(_items);
             Value &root = (*_items)[0];
             if (_items->wide) {
@@ -60,24 +91,83 @@ namespace fleece {
             }
             _items->clear();
         }
-        _items = nullptr;
-        _stackDepth = 0;
     }
 
     alloc_slice Encoder::extractOutput() {
         end();
-        return _out.extractOutput();
+        alloc_slice output = _out.extractOutput();
+        if (_usuallyFalse(!_indexedPaths.empty())) {
+            throwIf(!output || _base.size > 0, EncodeError,
+                    "can't index paths of streaming or appended output");
+            _pathIndex = PathIndex::create(output, _indexedPaths, _sharedKeys);
+        }
+        return output;
     }
 
     // Returns position in the stream of the next write. Pads stream to even pos if necessary.
+    // (If there's a base document, positions are relative to its start.)
     size_t Encoder::nextWritePos() {
+        if (_usuallyFalse(_items->packing))
+            flushDeferredNumbers();     // (must be written before whatever's written next)
         size_t pos = _out.length();
         if (pos & 1) {
             byte zero = 0;
             _out.write(&zero, 1);
             pos++;
         }
-        return pos;
+        return _base.size + pos;
+    }
+
+    void Encoder::copyOptionsFrom(const Encoder &other) {
+        _uniqueStrings = other._uniqueStrings;
+        _reemitFarStrings = other._reemitFarStrings;
+        _sortKeys = other._sortKeys;
+        _hashIndexMinCount = other._hashIndexMinCount;
+        _prefixIndexMinCount = other._prefixIndexMinCount;
+        _packNumericArrays = other._packNumericArrays;
+    }
+
+    void Encoder::setBase(slice base, bool reuseStrings, bool externPointers) {
+        throwIf(!isEmpty(), EncodeError, "can't set base after encoding has begun");
+        throwIf(base.size & 1, InvalidData, "base document has odd size");
+        _base = base;
+        _externBase = externPointers && base.size > 0;
+        _baseStrings.clear();
+        if (reuseStrings && base.size > 0) {
+            auto root = Value::fromTrustedData(base);
+            throwIf(!root, InvalidData, "base is not a Fleece document");
+            addBaseStrings(root);
+        }
+    }
+
+    // Adds all the strings in a Value in the base document to _baseStrings.
+    void Encoder::addBaseStrings(const Value *v) {
+        switch (v->tag()) {
+            case kStringTag: {
+                slice str = v->asString();
+                if (str.size >= kNarrow && str.size <= kMaxSharedStringSize) {
+                    StringTable::info info = {false, (uint32_t)((uint8_t*)v - (uint8_t*)_base.buf)};
+                    _baseStrings.add(str, info);
+                }
+                break;
+            }
+            case kArrayTag:
+                for (Array::iterator i(v->asArray()); i; ++i)
+                    addBaseStrings(i.value());
+                break;
+            case kDictTag:
+                for (Dict::iterator i(v->asDict()); i; ++i) {
+                    addBaseStrings(i.key());
+                    addBaseStrings(i.value());
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool Encoder::isInBase(const Value *v) const {
+        return _base.buf && v >= _base.buf && v < _base.end();
     }
 
     void Encoder::reset() {
@@ -89,14 +179,29 @@ namespace fleece {
         _stackDepth = 0;
         push(kSpecialTag, 1);
         _strings.clear();
+        _sourceStrings.clear();
+        _farPositions.clear();
+        _retainedStrings.reset();
         _writingKey = _blockedOnKey = false;
     }
 
+    size_t Encoder::memoryUsage() const {
+        size_t size = _out.capacity() + _retainedStrings.capacity()
+                    + _strings.tableSize() * (sizeof(StringTable::slot) + 1)
+                    + _sourceStrings.size() * (sizeof(const Value*) + sizeof(sourceString)
+                                               + 2 * sizeof(void*));
+        for (auto &items : _stack)
+            size += items.capacity() * sizeof(Value);
+        return size;
+    }
+
 
 #pragma mark - WRITING:
 
     void Encoder::addItem(Value v) {
         throwIf(_blockedOnKey, EncodeError, "need a key before this value");
+        if (_usuallyFalse(_items->packing))
+            flushDeferredNumbers();
         if (_writingKey) {
             _writingKey = false;
         } else {
@@ -151,11 +256,23 @@ namespace fleece {
         }
     }
 
-    void Encoder::writeInt(int64_t i)   {writeInt(i, (i < 2048 && i >= -2048), false);}
-    void Encoder::writeUInt(uint64_t i) {writeInt(i, (i < 2048),               true);}
+    void Encoder::writeInt(int64_t i) {
+        if (_usuallyFalse(_items->packing) && deferNumber({i, 0.0, false, false}))
+            return;
+        writeInt(i, (i < 2048 && i >= -2048), false);
+    }
+
+    void Encoder::writeUInt(uint64_t i) {
+        if (_usuallyFalse(_items->packing) && deferNumber({(int64_t)i, 0.0, false, true}))
+            return;
+        writeInt(i, (i < 2048), true);
+    }
 
     void Encoder::writeDouble(double n) {
         throwIf(std::isnan(n), InvalidData, "Can't write NaN");
+        if (_usuallyFalse(_items->packing) && n != (int64_t)n
+                                           && deferNumber({0, n, true, false}))
+            return;
         if (n == (int64_t)n) {
             return writeInt((int64_t)n);
         } else if (n == (float)n) {
@@ -174,10 +291,23 @@ namespace fleece {
         throwIf(std::isnan(n), InvalidData, "Can't write NaN");
         if (n == (int32_t)n)
             writeInt((int32_t)n);
-        else
+        else if (!_usuallyFalse(_items->packing) || !deferNumber({0, n, true, false}))
             _writeFloat(n);
     }
 
+    void Encoder::writeNumber(const Value *n) {
+        if (n->isInteger()) {
+            if (n->isUnsigned())
+                writeUInt(n->asUnsigned());
+            else
+                writeInt(n->asInt());
+        } else if (n->isDouble()) {
+            writeDouble(n->asDouble());
+        } else {
+            writeFloat(n->asFloat());
+        }
+    }
+
     void Encoder::_writeFloat(float n) {
         littleEndianFloat swapped = n;
         uint8_t buf[2 + sizeof(swapped)];
@@ -188,6 +318,105 @@ namespace fleece {
     }
 
 
+#pragma mark - PACKED ARRAYS:
+
+    // Adds a number to the deferred numbers of the current array, or if the array can't be
+    // packed after all, writes the deferred numbers as ordinary items and returns false.
+    bool Encoder::deferNumber(const deferredNumber &n) {
+        auto &numbers = _items->numbers;
+        if ((n.isUnsigned && n.i < 0) || numbers.size() >= kMaxPackedArrayCount) {
+            flushDeferredNumbers();
+            return false;
+        }
+        numbers.push_back(n);
+        return true;
+    }
+
+    // Writes the deferred numbers of the current array as ordinary items, and stops deferring.
+    void Encoder::flushDeferredNumbers() {
+        auto items = _items;
+        items->packing = false;
+        for (auto &n : items->numbers) {
+            if (n.isReal)
+                writeDouble(n.d);
+            else if (n.isUnsigned)
+                writeUInt(n.i);
+            else
+                writeInt(n.i);
+        }
+        items->numbers.clear();
+    }
+
+    // Called when an array that's been deferring numbers ends. If the numbers are worth packing,
+    // writes them and adds packed number items pointing to them (whose offsets get filled in by
+    // fixPointers); otherwise writes them as ordinary items.
+    void Encoder::packDeferredNumbers() {
+        auto items = _items;
+        auto &numbers = items->numbers;
+        size_t count = numbers.size();
+        static const int64_t kMaxExactDouble = 1ll << 53, kMaxExactFloat = 1ll << 24;
+        bool anyReal = false, allFloat = true, allInt32 = true, allExact = true;
+        size_t nLong = 0;               // Numbers that don't fit in a short int
+        for (auto &n : numbers) {
+            if (n.isReal) {
+                anyReal = true;
+                if ((float)n.d != n.d)
+                    allFloat = false;
+                ++nLong;
+            } else {
+                if (n.i < -2048 || n.i >= 2048)
+                    ++nLong;
+                if (n.i != (int32_t)n.i)
+                    allInt32 = false;
+                if (n.i < -kMaxExactFloat || n.i > kMaxExactFloat)
+                    allFloat = false;
+                if (n.i < -kMaxExactDouble || n.i > kMaxExactDouble)
+                    allExact = false;
+            }
+        }
+        if (count < kMinPackedArrayCount || 2 * nLong < count || (anyReal && !allExact)) {
+            flushDeferredNumbers();
+            return;
+        }
+
+        uint8_t flags = kPackedNumberFlag;
+        if (!anyReal)
+            flags |= kPackedIntFlag;
+        bool is64 = anyReal ? !allFloat : !allInt32;
+        if (is64)
+            flags |= 0x08;
+        items->packedSize = is64 ? 8 : 4;
+        items->packing = false;
+
+        // The numbers need to be aligned to their size (relative to the start of the data):
+        static const uint8_t kZeros[8] = { };
+        size_t pos = nextWritePos();
+        size_t padding = (size_t)(-(ptrdiff_t)pos) & (items->packedSize - 1);
+        _out.write(kZeros, padding);
+        items->packedPos = pos + padding;
+
+        for (auto &n : numbers) {
+            if (anyReal && is64) {
+                littleEndianDouble d = n.isReal ? n.d : (double)n.i;
+                _out.write(&d, sizeof(d));
+            } else if (anyReal) {
+                littleEndianFloat f = n.isReal ? (float)n.d : (float)n.i;
+                _out.write(&f, sizeof(f));
+            } else if (is64) {
+                int64_t i = _encLittle64(n.i);
+                _out.write(&i, sizeof(i));
+            } else {
+                int32_t i = _encLittle32((int32_t)n.i);
+                _out.write(&i, sizeof(i));
+            }
+        }
+        numbers.clear();
+
+        items->resize(count, Value(kFloatTag, flags));
+        items->wide = true;
+    }
+
+
 #pragma mark - STRINGS / DATA:
 
     // used for strings and binary data. Returns the location where s got written to, which
@@ -214,25 +443,56 @@ namespace fleece {
         return slice(dst, s.size);
     }
 
+    // A streaming Writer reuses its buffers after flushing, so a string that has to be looked at
+    // again later (a dictionary key or a uniqued string) needs to be copied somewhere stable.
+    slice Encoder::retainString(slice s) {
+        if (!s.buf || !_out.isStreaming())
+            return s;
+        return slice(_retainedStrings.write(s.buf, s.size), s.size);
+    }
+
+    // In reemitFarStrings mode, a uniqued string this far back is written again. (Less than the
+    // 64KB reach of a narrow pointer, since the collection containing the pointer gets written
+    // after everything else in it.)
+    static const size_t kReemitStringDistance = 0x8000;
+
     // Returns the location where s got written to, if possible, just like writeData above.
     slice Encoder::_writeString(slice s, bool asKey) {
         // Check whether this string's already been written:
         if (_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= kMaxSharedStringSize)) {
             auto &entry = _strings.find(s);
-            if (entry.first.buf != nullptr) {
+            StringTable::slot *baseEntry;
+            if (entry.first.buf != nullptr && _usuallyFalse(_reemitFarStrings)
+                    && _base.size + _out.length() - entry.second.offset > kReemitStringDistance) {
+                // Write a new copy nearby, and make later uses point to it instead:
+                entry.second.offset = (uint32_t)nextWritePos();
+                writeData(kStringTag, s);
+                if (_usuallyFalse(_collectStats))
+                    _stats.stringsReemitted++;
+                if (asKey)
+                    entry.second.usedAsKey = true;
+                return entry.first;
+            } else if (entry.first.buf != nullptr) {
 //                fprintf(stderr, "Found `%.*s` --> %u\n", (int)s.size, s.buf, entry.second);
                 writePointer(entry.second.offset);
-#ifndef NDEBUG
-                _numSavedStrings++;
-#endif
+                if (_usuallyFalse(_collectStats))
+                    countDedupedString(s);
                 if (asKey)
                     entry.second.usedAsKey = true;
                 return entry.first;
+            } else if (_usuallyFalse(_baseStrings.count() > 0)
+                            && (baseEntry = &_baseStrings.find(s))->first.buf != nullptr) {
+                // It's in the base document:
+                writePointer(baseEntry->second.offset);
+                if (_usuallyFalse(_collectStats))
+                    countDedupedString(s);
+                return baseEntry->first;
             } else {
                 auto offset = nextWritePos();
-                throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
-                s = writeData(kStringTag, s);
-                if (s.buf) {
+                if (_usuallyFalse(_collectStats))
+                    _stats.stringsWritten++;
+                s = retainString(writeData(kStringTag, s));
+                if (s.buf && _usuallyTrue(offset <= UINT32_MAX)) {   // (else it's not uniqued)
 #if 0
                     if (_strings.count() == 0)
                         fprintf(stderr, "---- new encoder ----\n");
@@ -244,10 +504,53 @@ namespace fleece {
                 return s;
             }
         } else {
-            return writeData(kStringTag, s);
+            if (_usuallyFalse(_collectStats))
+                _stats.stringsWritten++;
+            s = writeData(kStringTag, s);
+            return asKey ? retainString(s) : s;
         }
     }
 
+    // Writes a string Value from existing Fleece data. The strings in Fleece data are uniqued, so
+    // the same Value turns up wherever its string does; remembering where each one was written
+    // saves hashing the string and looking it up in _strings again. (The string is still compared
+    // with the remembered one, in case the source data was freed and its address reused.)
+    slice Encoder::writeSourceString(const Value *value, bool asKey) {
+        slice str = value->asString();
+        if (!_uniqueStrings || str.size < kNarrow || str.size > kMaxSharedStringSize)
+            return _writeString(str, asKey);
+
+        auto i = _sourceStrings.find(value);
+        if (i != _sourceStrings.end()) {
+            const sourceString &src = i->second;
+            if (src.string.size == str.size && (!asKey || src.usedAsKey)
+                    && (!_reemitFarStrings
+                        || _base.size + _out.length() - src.offset <= kReemitStringDistance)
+                    && memcmp(src.string.buf, str.buf, str.size) == 0) {
+                writePointer(src.offset);
+                if (_usuallyFalse(_collectStats))
+                    countDedupedString(str);
+                return src.string;
+            }
+        }
+
+        slice written = _writeString(str, asKey);
+        if (written.buf && _usuallyTrue(nextWritePos() <= UINT32_MAX)) {
+            // _writeString always adds a pointer to a string of this size:
+            assert(_items->back().isPointer());
+            auto offset = (uint32_t)pointerPos(_items->back());
+            bool usedAsKey = asKey || (i != _sourceStrings.end() && i->second.usedAsKey
+                                                                 && i->second.offset == offset);
+            _sourceStrings[value] = {written, offset, usedAsKey};
+        }
+        return written;
+    }
+
+    void Encoder::countDedupedString(slice s) {
+        _stats.stringsDeduped++;
+        _stats.bytesSaved += (1 + s.size + 1) & ~1;    // (string header, bytes, padding)
+    }
+
     void Encoder::writeString(const std::string &s) {
         _writeString(slice(s), false);
     }
@@ -258,15 +561,27 @@ namespace fleece {
 
 
     void Encoder::writeValue(const Value *value) {
+        if (_usuallyFalse(isInBase(value)) && value->tag() >= kStringTag) {
+            // The value already exists in the base document, so just point to it. (Scalars are
+            // small enough that they're just copied below.)
+            writePointer((uint8_t*)value - (uint8_t*)_base.buf);
+            return;
+        }
         switch (value->tag()) {
+            case kFloatTag:
+                if (value->isPackedNumber()) {
+                    // Its data is elsewhere, so write it as an ordinary number:
+                    writeNumber(value);
+                    break;
+                }
+                // fall through
             case kShortIntTag:
             case kIntTag:
-            case kFloatTag:
             case kSpecialTag:
                 writeRawValue(slice(value, value->dataSize()));
                 break;
             case kStringTag:
-                writeString(value->asString());
+                writeSourceString(value, false);
                 break;
             case kBinaryTag:
                 writeData(value->asData());
@@ -284,10 +599,7 @@ namespace fleece {
                 auto iter = value->asDict()->begin();
                 beginDictionary(iter.count());
                 for (; iter; ++iter) {
-                    if (iter.key()->isInteger())
-                        writeKey((int)iter.key()->asInt());
-                    else
-                        writeKey(iter.key()->asString());
+                    writeKey(iter.key());
                     writeValue(iter.value());
                 }
                 endDictionary();
@@ -302,16 +614,37 @@ namespace fleece {
 #pragma mark - POINTERS:
 
     // Pointers are added here as absolute positions in the stream (and fixed up before writing)
-    void Encoder::writePointer(size_t p)   {addItem(Value(p, kWide));}
+    void Encoder::writePointer(size_t p)   {addItem(pointerTo(p));}
+
+    // A position too big for a wide pointer Value is kept in _farPositions, and the pointer
+    // holds its index there instead, flagged with kExternPointerFlag (which real pointers don't
+    // get until fixPointers.) Use pointerPos to read a pointer's position.
+    Value Encoder::pointerTo(size_t p) {
+        if (_usuallyFalse(p >= _wideOffsetLimit)) {
+            Value v(_farPositions.size() << 1, kWide);
+            v._byte[0] |= kExternPointerFlag;
+            _farPositions.push_back(p);
+            return v;
+        }
+        return Value(p, kWide);
+    }
 
-    // Check whether any pointers in _items can't fit in a narrow Value:
-    void Encoder::checkPointerWidths(valueArray *items) {
+    size_t Encoder::pointerPos(const Value &v) const {
+        if (_usuallyFalse(v._byte[0] & kExternPointerFlag))
+            return _farPositions[v.externPointerValue() >> 1];
+        return v.pointerValue<true>();
+    }
+
+    // Check whether any pointers in _items can't fit in a narrow Value, or even a wide one.
+    // `headerSize` is the size of the collection header that will be written before the items.
+    void Encoder::checkPointerWidths(valueArray *items, size_t headerSize) {
+        size_t start = nextWritePos() + headerSize;
         if (!items->wide) {
-            size_t base = nextWritePos();
+            size_t base = start;
             for (auto v = items->begin(); v != items->end(); ++v) {
                 if (v->isPointer()) {
-                    size_t pos = v->pointerValue<true>();
-                    if (base - pos >= 0x10000) {
+                    size_t pos = pointerPos(*v);
+                    if (base - pos >= 0x10000 || (_externBase && pos < _base.size)) {
                         items->wide = true;
                         break;
                     }
@@ -319,6 +652,18 @@ namespace fleece {
                 base += kNarrow;
             }
         }
+        // Only far enough into the output can a wide pointer be too long. The items might be
+        // 8 bytes each, after an 8-byte marker slot, but wide ones are 4:
+        if (items->wide && _usuallyFalse(start + 8 + kWide * items->size() >= _wideOffsetLimit)) {
+            size_t base = start + 8;
+            for (auto v = items->begin(); v != items->end(); ++v) {
+                if (v->isPointer() && base - pointerPos(*v) >= _wideOffsetLimit) {
+                    items->extraWide = true;
+                    break;
+                }
+                base += kWide;
+            }
+        }
     }
 
     // Convert absolute offsets to relative in _items:
@@ -327,17 +672,71 @@ namespace fleece {
         int width = items->wide ? kWide : kNarrow;
         for (auto v = items->begin(); v != items->end(); ++v) {
             if (v->isPointer()) {
-                size_t pos = v->pointerValue<true>();
+                size_t pos = pointerPos(*v);
                 assert(pos < base);
+                bool external = _externBase && pos < _base.size;
                 pos = base - pos;
                 *v = Value(pos, width);
+                if (_usuallyFalse(_collectStats))
+                    (width == kWide ? _stats.widePointers : _stats.narrowPointers)++;
+                if (_usuallyFalse(external))
+                    v->_byte[0] |= kExternPointerFlag;    // (only wide pointers can be external)
+            } else if (_usuallyFalse(items->packedSize > 0)) {
+                // Packed number: point it back to its data
+                size_t pos = base - (items->packedPos + (v - items->begin()) * items->packedSize);
+                throwIf(pos > kMaxPackedOffset, InternalError, "packed array too large");
+                pos >>= 1;
+                v->_byte[1] = (uint8_t)(pos >> 16);
+                v->_byte[2] = (uint8_t)(pos >> 8);
+                v->_byte[3] = (uint8_t)pos;
             }
             base += width;
         }
     }
 
+    // Writes the items of an extra-wide collection after its header: the marker slot, then
+    // each item in 8 bytes, with pointers made relative. (See kExtraWideMarker in Internal.hh.)
+    void Encoder::writeExtraWideItems(valueArray *items) {
+        uint8_t slot[kExtraWide] = {kExtraWideMarker};
+        _out.write(slot, sizeof(slot));
+        size_t base = nextWritePos();
+        for (auto v = items->begin(); v != items->end(); ++v) {
+            if (v->isPointer()) {
+                size_t pos = pointerPos(*v);
+                assert(pos < base);
+                throwIf(_externBase && pos < _base.size, EncodeError,
+                        "can't write external pointers in a collection this far from the base");
+                uint64_t n = _enc64((uint64_t)((base - pos) >> 1) | 0x8000000000000000ull);
+                memcpy(slot, &n, sizeof(n));
+                if (_usuallyFalse(_collectStats))
+                    _stats.widePointers++;
+            } else {
+                memcpy(slot, &*v, kWide);
+                memset(&slot[kWide], 0, kExtraWide - kWide);
+            }
+            _out.write(slot, sizeof(slot));
+            base += kExtraWide;
+        }
+    }
+
 #pragma mark - ARRAYS / DICTIONARIES:
 
+    // compares dictionary keys as slices. If a slice has a null `buf`, it represents an integer
+    // key, whose value is in the `size` field.
+    static inline int compareKeysByIndex(const slice *sa, const slice *sb) {
+        if (sa->buf) {
+            if (sb->buf)
+                return sa->compare(*sb) < 0;                // string key comparison
+            else
+                return false;
+        } else {
+            if (sb->buf)
+                return true;
+            else
+                return (int)sa->size < (int)sb->size;       // integer key comparison
+        }
+    }
+
     void Encoder::writeKey(const std::string &s)   {writeKey(slice(s));}
 
     void Encoder::writeKey(slice s) {
@@ -350,17 +749,69 @@ namespace fleece {
             throwUnexpectedKey();
         _blockedOnKey = false;
         s = _writeString(s, true);
-        if (_sortKeys)
-            _items->keys.push_back(s);
+        if (recordsKeys())
+            addedKey(s);
     }
 
     void Encoder::writeKey(int n) {
         if (_usuallyFalse(!_blockedOnKey))
             throwUnexpectedKey();
+        throwIf(n == kDictHashIndexKey || n == kDictPrefixIndexKey,
+                EncodeError, "reserved dictionary key");
         _blockedOnKey = false;
         writeInt(n);
-        if (_sortKeys)
-            _items->keys.push_back(nullslice);
+        if (recordsKeys())
+            addedKey(nullslice);
+    }
+
+    void Encoder::writeKey(const Value *key) {
+        if (key->isInteger()) {
+            writeKey((int)key->asInt());
+        } else if (isInBase(key) && !_sharedKeys) {
+            if (_usuallyFalse(!_blockedOnKey))
+                throwUnexpectedKey();
+            _blockedOnKey = false;
+            _writingKey = true;
+            writeValue(key);
+            if (recordsKeys())
+                addedKey(key->asString());      // (base data is stable)
+        } else if (!_sharedKeys) {
+            if (_usuallyFalse(!_blockedOnKey))
+                throwUnexpectedKey();
+            _blockedOnKey = false;
+            slice s = writeSourceString(key, true);
+            if (recordsKeys())
+                addedKey(s);
+        } else {
+            writeKey(key->asString());
+        }
+    }
+
+    // Records a key that's just been written to the current dict, and checks whether it's still
+    // in sorted order so that sortDict can be skipped if it is. (This is the usual case when
+    // re-encoding existing Fleece data.)
+    void Encoder::addedKey(slice key) {
+        auto &keys = _items->keys;
+        keys.push_back(key);
+        if (_sortKeys && _items->keysInOrder && !_items->trustKeyOrder && keys.size() > 1) {
+            slice prevKey = sortableKey(keys.size() - 2), newKey = sortableKey(keys.size() - 1);
+            if (!compareKeysByIndex(&prevKey, &newKey))
+                _items->keysInOrder = false;
+        }
+    }
+
+    // Returns a dict key in the form compareKeysByIndex uses. Since the pointer to an inline
+    // string key is only valid until more items are added, this doesn't store the result.
+    slice Encoder::sortableKey(size_t i) const {
+        slice key = _items->keys[i];
+        if (key.buf == nullptr) {
+            const Value *item = &(*_items)[2*i];
+            if (item->tag() == kStringTag)
+                key.buf = offsetby(item, 1);                        // inline string
+            else
+                key = slice(nullptr, (size_t)item->asUnsigned());   // integer
+        }
+        return key;
     }
 
     void Encoder::throwUnexpectedKey() {
@@ -371,26 +822,100 @@ namespace fleece {
     }
 
     void Encoder::push(tags tag, size_t reserve) {
-        throwIf(_stackDepth >= _stack.size(), EncodeError, "nesting is too deep");
+        if (_usuallyFalse(_stackDepth >= _stack.size())) {
+            // Grow the stack. (This may move the valueArrays; the only pointer to one is
+            // _items, which gets reset right below.)
+            _stack.emplace_back();
+        }
         _items = &_stack[_stackDepth++];
         _items->reset(tag);
+        if (_usuallyFalse(_collectStats))
+            _stats.maxDepth = std::max(_stats.maxDepth, _stackDepth - 1);
         if (reserve > 0)
             _items->reserve(reserve);
     }
 
     void Encoder::beginArray(size_t reserve) {
         push(kArrayTag, reserve);
+        _items->packing = _packNumericArrays;
     }
 
-    void Encoder::beginDictionary(size_t reserve) {
+    void Encoder::beginDictionary(size_t reserve, bool keysInOrder) {
         push(kDictTag, 2*reserve);
+        _items->trustKeyOrder = keysInOrder;
         _writingKey = _blockedOnKey = true;
     }
 
     void Encoder::endArray() {
+        if (_items->packing)
+            packDeferredNumbers();
         endCollection(internal::kArrayTag);
     }
 
+    void Encoder::writeEncodedArrayItems(slice encoded) {
+        throwIf(_items->tag != kArrayTag, EncodeError, "not writing an array");
+        auto array = Value::fromTrustedData(encoded)->asArray();
+        throwIf(!array, InvalidData, "encoded data is not an array");
+
+        if (_items->packing) {
+            // Numbers can go into the deferred numbers like any others, so that this array gets
+            // packed if it would have been when written item by item:
+            Array::iterator i(array);
+            for (; i && i.value()->type() == kNumber; ++i)
+                ;
+            if (!i) {
+                for (Array::iterator j(array); j; ++j)
+                    writeNumber(j.value());
+                return;
+            }
+        }
+
+        // Everything before the array itself is data that its items point to. Pointers are
+        // relative, so it can be copied as-is, to a position aligned like the original's so that
+        // packed numbers in it stay aligned:
+        auto arrayStart = (const uint8_t*)array;
+        static const uint8_t kZeros[8] = { };
+        auto base = nextWritePos();
+        size_t padding = (size_t)(-(ptrdiff_t)base) & 7;
+        _out.write(kZeros, padding);
+        base += padding;
+        _out.write(encoded.buf, arrayStart - (const uint8_t*)encoded.buf);
+
+        for (Array::iterator i(array); i; ++i) {
+            auto v = (const uint8_t*)i.value();
+            if (v < arrayStart)
+                writePointer(base + (v - (const uint8_t*)encoded.buf));
+            else if (i.value()->isPackedNumber())
+                writeValue(i.value());                                  // packed number
+            else
+                writeRawValue(slice(v, i.value()->dataSize()));     // inline item
+        }
+    }
+
+    void Encoder::writeEncoded(slice encoded) {
+        auto root = Value::fromData(encoded);
+        throwIf(!root, InvalidData, "invalid Fleece data");
+        throwIf(_blockedOnKey, EncodeError, "need a key before this value");
+        if (root->tag() != kArrayTag && root->tag() != kDictTag) {
+            // A scalar is just copied, since it doesn't point to anything:
+            writeRawValue(slice(root, root->dataSize()));
+            return;
+        }
+        Array::impl a(root, false);
+        if (a._count == 0) {
+            writeRawValue(slice(root, a._first));     // (an empty collection can be inline)
+            return;
+        }
+        // Copy everything up to the end of the root collection, i.e. all that it points to, and
+        // add a pointer to it:
+        auto start = (const uint8_t*)encoded.buf;
+        auto end = (const uint8_t*)offsetby(a._first,
+                                    a._count * a._width * (root->tag() == kDictTag ? 2 : 1));
+        auto base = nextWritePos();
+        _out.write(start, end - start);
+        writePointer(base + ((const uint8_t*)root - start));
+    }
+
     void Encoder::endDictionary() {
         throwIf(!_writingKey, EncodeError, "need a value");
         endCollection(internal::kDictTag);
@@ -410,10 +935,29 @@ namespace fleece {
         _items = &_stack[_stackDepth - 1];
         _writingKey = _blockedOnKey = false;
 
-        if (_sortKeys && tag == kDictTag)
-            sortDict(*items);
-
-        checkPointerWidths(items);
+        if (tag == kDictTag) {
+            size_t nKeys = items->size() / 2;
+            bool hashIndex = _hashIndexMinCount > 0 && nKeys >= _hashIndexMinCount
+                                                    && nKeys <= kMaxDictHashIndexCount;
+            bool prefixIndex = _prefixIndexMinCount > 0 && nKeys >= _prefixIndexMinCount
+                                                        && _sortKeys;
+            if (_sortKeys && !items->keysInOrder) {
+                if (_usuallyFalse(_collectStats)) {
+                    auto start = std::chrono::steady_clock::now();
+                    sortDict(*items, hashIndex || prefixIndex);
+                    auto elapsed = std::chrono::steady_clock::now() - start;
+                    _stats.dictsSorted++;
+                    _stats.sortNanoseconds += std::chrono::duration_cast<
+                                                std::chrono::nanoseconds>(elapsed).count();
+                } else {
+                    sortDict(*items, hashIndex || prefixIndex);
+                }
+            }
+            if (hashIndex)
+                writeHashIndex(*items);
+            if (prefixIndex)
+                writePrefixIndex(*items, (hashIndex ? 2 : 0));
+        }
 
         auto count = (uint32_t)items->size();    // includes keys if this is a dict!
         if (items->tag == kDictTag)
@@ -430,14 +974,19 @@ namespace fleece {
             if (bufLen & 1)
                 buf[bufLen++] = 0;
         }
+
+        // (The items' pointers are relative to where they'll be, after the header:)
+        checkPointerWidths(items, bufLen);
         if (items->wide)
             buf[0] |= 0x08;     // "wide" flag
         writeValue(items->tag, buf, bufLen, (count==0));          // can inline only if empty
 
-        fixPointers(items);
+        if (_usuallyFalse(items->extraWide)) {
+            writeExtraWideItems(items);
+        } else if (count > 0) {
+            fixPointers(items);
 
-        // Write the values:
-        if (count > 0) {
+            // Write the values:
             auto nValues = items->size();
             if (items->wide) {
                 _out.write(&(*items)[0], kWide*nValues);
@@ -451,36 +1000,20 @@ namespace fleece {
             }
         }
 
-#ifndef NDEBUG
-        if (items->wide) {
-            _numWide++;
-            _wideCount += count;
-        } else {
-            _numNarrow++;
-            _narrowCount += count;
+        if (_usuallyFalse(_collectStats)) {
+            if (items->wide) {
+                _stats.wideCollections++;
+                _stats.wideItems += count;
+            } else {
+                _stats.narrowCollections++;
+                _stats.narrowItems += count;
+            }
         }
-#endif
 
         items->clear();
     }
 
-    // compares dictionary keys as slices. If a slice has a null `buf`, it represents an integer
-    // key, whose value is in the `size` field.
-    static inline int compareKeysByIndex(const slice *sa, const slice *sb) {
-        if (sa->buf) {
-            if (sb->buf)
-                return sa->compare(*sb) < 0;                // string key comparison
-            else
-                return false;
-        } else {
-            if (sb->buf)
-                return true;
-            else
-                return (int)sa->size < (int)sb->size;       // integer key comparison
-        }
-    }
-
-    void Encoder::sortDict(valueArray &items) {
+    void Encoder::sortDict(valueArray &items, bool reorderKeys) {
         auto &keys = items.keys;
         size_t n = keys.size();
         if (n < 2)
@@ -498,17 +1031,17 @@ namespace fleece {
         }
 
         // Construct an array that describes the permutation of item indices:
-        StackArray(indices, const slice*, n);
+        auto &indices = _sortIndices;
+        indices.resize(n);
         const slice* base = &keys[0];
         for (unsigned i = 0; i < n; i++)
             indices[i] = base + i;
-        std::sort(&indices[0], &indices[n], &compareKeysByIndex);
+        std::sort(indices.begin(), indices.end(), &compareKeysByIndex);
         // indices[i] is now a pointer to the Value that should go at index i
 
         // Now rewrite items according to the permutation in indices:
-        StackArray(oldBuf, char, 2*n * sizeof(Value));
-        auto old = (Value*)oldBuf;
-        memcpy(old, &items[0], 2*n * sizeof(Value));
+        _sortScratch.assign(items.begin(), items.begin() + 2*n);
+        const Value *old = _sortScratch.data();
         for (size_t i = 0; i < n; i++) {
             auto j = indices[i] - base;
             if ((ssize_t)i != j) {
@@ -516,6 +1049,133 @@ namespace fleece {
                 items[2*i+1] = old[2*j+1];
             }
         }
+
+        if (reorderKeys) {
+            // Put the keys in the same order too, so keys[i] is the key of items[2*i].
+            // (Pointers to inline strings are now stale, but writeHashIndex and
+            // writePrefixIndex fix those.)
+            _sortedKeys.resize(n);
+            for (size_t i = 0; i < n; i++)
+                _sortedKeys[i] = *indices[i];
+            keys.swap(_sortedKeys);
+        }
+    }
+
+    // Writes a hash index of a dictionary's string keys, and prepends it to the dictionary as an
+    // entry with a reserved key. (See the description of kDictHashIndexKey in Internal.hh.)
+    // items.keys must be in the same order as the items.
+    void Encoder::writeHashIndex(valueArray &items) {
+        auto &keys = items.keys;
+        size_t n = keys.size();
+        if (n != items.size() / 2)
+            return;                         // (keys weren't recorded; can't build an index)
+        size_t tableSize = 4;
+        while (tableSize * 3 < n * 4)          // max load factor is 0.75
+            tableSize *= 2;
+        const size_t mask = tableSize - 1;
+        auto &table = _hashIndexTable;
+        table.assign(tableSize, 0);
+        for (uint32_t i = 0; i < n; i++) {
+            const Value &key = items[2*i];
+            slice str = keys[i];
+            if (!key.isPointer()) {
+                if (key.tag() != kStringTag)
+                    continue;                                   // integer key; not indexed
+                str.buf = offsetby(&key, 1);                    // inline string
+            }
+            uint32_t hash = dictHashIndexHash(str.buf, str.size);
+            size_t slot = hash & mask;
+            while (table[slot] != 0)
+                slot = (slot + 1) & mask;
+            table[slot] = _encLittle32((hash & ~kDictHashIndexMask) | (i + 1));
+        }
+
+        // Write the table as a binary Value:
+        slice data(table.data(), tableSize * sizeof(uint32_t));
+        uint8_t header[1 + kMaxVarintLen32];
+        header[0] = (uint8_t)(kBinaryTag << 4) | 0x0F;        // (it's always over 15 bytes)
+        size_t headerSize = 1 + PutUVarInt(&header[1], data.size);
+        auto pos = nextWritePos();
+        _out.write(header, headerSize);
+        _out.write(data.buf, data.size);
+
+        Value indexKey(kShortIntTag, (kDictHashIndexKey >> 8) & 0x0F, kDictHashIndexKey & 0xFF);
+        Value indexValue = pointerTo(pos);                      // absolute pos; fixed up later
+        items.insert(items.begin(), {indexKey, indexValue});
+    }
+
+    // Writes a prefix index of a dictionary's string keys, and inserts it as an entry with a
+    // reserved key at `offset` in the items, i.e. after the hash index entry if there is one.
+    // (See the description of kDictPrefixIndexKey in Internal.hh.)
+    // items.keys must be in the same order as the items.
+    void Encoder::writePrefixIndex(valueArray &items, size_t offset) {
+        auto &keys = items.keys;
+        size_t n = keys.size();
+        if (n != (items.size() - offset) / 2)
+            return;                         // (keys weren't recorded; can't build an index)
+
+        // Collect the string keys, which must all come after the integer keys:
+        auto &strings = _sortedKeys;
+        strings.clear();
+        uint32_t firstString = 0;
+        for (size_t i = 0; i < n; i++) {
+            const Value &key = items[offset + 2*i];
+            slice str = keys[i];
+            if (!key.isPointer()) {
+                if (key.tag() != kStringTag) {
+                    if (!strings.empty())
+                        return;                                 // integer after a string?!
+                    ++firstString;
+                    continue;
+                }
+                str.buf = offsetby(&key, 1);                    // inline string
+            }
+            strings.push_back(str);
+        }
+        if (strings.empty())
+            return;
+
+        // The keys are sorted, so the prefix they share is the one the first and last share:
+        slice first = strings.front(), last = strings.back();
+        size_t prefixLen = 0, maxLen = std::min(first.size, last.size);
+        while (prefixLen < maxLen && first[prefixLen] == last[prefixLen])
+            ++prefixLen;
+
+        // Start the table with the header, then add each key's 4 bytes after the prefix:
+        auto &table = _hashIndexTable;
+        table.resize(2 + strings.size());
+        table[0] = _encLittle32((uint32_t)prefixLen);
+        table[1] = _encLittle32(firstString);
+        uint32_t prev = 0;
+        for (size_t i = 0; i < strings.size(); i++) {
+            uint8_t bytes[4] = {};
+            memcpy(bytes, offsetby(strings[i].buf, prefixLen),
+                   std::min(strings[i].size - prefixLen, sizeof(bytes)));
+            memcpy(&table[2 + i], bytes, sizeof(bytes));
+            uint32_t entry = _dec32(table[2 + i]);
+            if (entry < prev)
+                return;                     // (keys aren't in order; can't build an index)
+            prev = entry;
+        }
+
+        // Write the table as a binary Value:
+        slice data(table.data(), table.size() * sizeof(uint32_t));
+        uint8_t header[1 + kMaxVarintLen32];
+        size_t headerSize;
+        if (data.size < 0x0F) {
+            header[0] = (uint8_t)((kBinaryTag << 4) | data.size);
+            headerSize = 1;
+        } else {
+            header[0] = (uint8_t)(kBinaryTag << 4) | 0x0F;
+            headerSize = 1 + PutUVarInt(&header[1], data.size);
+        }
+        auto pos = nextWritePos();
+        _out.write(header, headerSize);
+        _out.write(data.buf, data.size);
+
+        Value indexKey(kShortIntTag, (kDictPrefixIndexKey >> 8) & 0x0F, kDictPrefixIndexKey & 0xFF);
+        Value indexValue = pointerTo(pos);                      // absolute pos; fixed up later
+        items.insert(items.begin() + offset, {indexKey, indexValue});
     }
 
     // Writes an array of strings, containing all the strings that have appeared as dictionary keys
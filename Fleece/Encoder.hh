@@ -18,38 +18,153 @@
 #include "Value.hh"
 #include "Writer.hh"
 #include "StringTable.hh"
-#include <array>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 
 namespace fleece {
     class SharedKeys;
+    struct NSStringCache;
     
 
+    /** Statistics about what an Encoder has written, if it's collecting them
+        (see Encoder::collectStats.) */
+    struct EncoderStats {
+        uint64_t bytesWritten {0};      // Bytes of output, counted when encoding ends
+        uint64_t stringsWritten {0};    // Strings written out in full
+        uint64_t stringsDeduped {0};    // Strings written as pointers to an earlier copy
+        uint64_t bytesSaved {0};        // Bytes not written thanks to string deduping
+        uint64_t stringsReemitted {0};  // Uniqued strings written again, being too far back
+        uint64_t narrowCollections {0}, wideCollections {0};    // Arrays and dicts written
+        uint64_t narrowItems {0}, wideItems {0};                // Items in those
+        uint64_t narrowPointers {0}, widePointers {0};          // Pointers written
+        uint64_t dictsSorted {0};       // Dicts whose keys had to be sorted
+        uint64_t sortNanoseconds {0};   // Time spent sorting them
+        unsigned maxDepth {0};          // Deepest nesting of arrays/dicts
+        double stringTableLoad {0.0};   // Fullness of the string table when encoding last ended
+    };
+
+
     /** Generates Fleece-encoded data. */
     class Encoder {
     public:
         /** Constructs an encoder. */
         Encoder(size_t reserveOutputSize =256);
 
+        /** Constructs an encoder that streams its output to a callback as it's generated,
+            instead of accumulating it in memory. extractOutput() will return a null slice.
+            (The encoder still has to keep copies of dictionary keys and uniqued strings.) */
+        Encoder(Writer::OutputCallback,
+                size_t chunkSize =Writer::kDefaultStreamingChunkSize);
+
         /** Sets the uniqueStrings property. If true (the default), the encoder tries to write
             each unique string only once. This saves space but makes the encoder slightly slower. */
         void uniqueStrings(bool b)      {_uniqueStrings = b;}
 
+        /** Sets the reemitFarStrings property. If true (the default is false), a uniqued string
+            whose earlier copy is more than 32KB back is written again, and later uses point to
+            the new copy. A collection has to be written with wide (4-byte) items if any of its
+            pointers reach back 64KB or more, so in a large document this keeps later
+            collections narrow, at the cost of some duplicated strings; the output is usually
+            smaller, and the collections more compact to read. */
+        void reemitFarStrings(bool b)   {_reemitFarStrings = b;}
+
         /** Sets the sortKeys property. If true (the default), dictionary keys will be written in
             sorted order. This makes dict::get faster but makes the encoder slightly slower. */
         void sortKeys(bool b)           {_sortKeys = b;}
 
+        /** Sets the minimum number of keys a dictionary must have to be given a hash index, or
+            0 (the default) to never write one. A hash index lets Dict::get find a key in
+            constant time instead of by binary search, which helps with very large dictionaries
+            (thousands of keys), at a cost of 4-8 bytes per key. */
+        void hashIndexMinCount(unsigned n)  {_hashIndexMinCount = n;}
+
+        /** Sets the minimum number of keys a dictionary must have to be given a prefix index, or
+            0 (the default) to never write one. A prefix index stores 4 bytes of each string key,
+            following the prefix they all share, so Dict::get can narrow its binary search down
+            to a key or two without dereferencing and comparing keys along the way. It helps
+            with large dictionaries whose keys have a long common prefix, like "attr_user_1234",
+            at a cost of 4 bytes per key. It's only written if keys are sorted. */
+        void prefixIndexMinCount(unsigned n)  {_prefixIndexMinCount = n;}
+
+        /** Sets the packNumericArrays property. If true (the default is false), an array of
+            at least 16 numbers that are all integers, or all floating-point, is written
+            "packed": its numbers are stored as a contiguous C array of int32, int64, float or
+            double, which Array::packedDoubles() etc. can return directly. The items still read
+            as ordinary numbers. Arrays of mostly small integers aren't packed, since they're
+            already compact. Older versions of Fleece can't read packed arrays. */
+        void packNumericArrays(bool b)  {_packNumericArrays = b;}
+
+        /** Gives this encoder the same options as another: uniqueStrings, reemitFarStrings,
+            sortKeys, hashIndexMinCount, prefixIndexMinCount and packNumericArrays. This is for
+            an encoder that writes part of the other one's output, e.g. on another thread, to be
+            copied in with writeEncodedArrayItems. (SharedKeys and the base aren't copied.) */
+        void copyOptionsFrom(const Encoder&);
+
         bool isEmpty() const            {return _out.length() == 0 && _stackDepth == 1 && _items->empty();}
 
+        /** The approximate number of bytes of heap memory the encoder keeps allocated between
+            documents (its output buffer, string table and collection stacks), which reset()
+            retains so the next document doesn't have to allocate them again. */
+        size_t memoryUsage() const;
+
+        /** Turns collection of statistics on or off; it's off by default. It's cheap enough
+            to leave on in production. The stats accumulate over all the documents encoded
+            (reset() doesn't clear them) until resetStats() is called. */
+        void collectStats(bool b)       {_collectStats = b;}
+
+        /** The statistics collected so far. */
+        const EncoderStats& stats() const   {return _stats;}
+
+        void resetStats()               {_stats = EncoderStats();}
+
+        /** Makes the encoder append to an existing Fleece document, instead of starting a new
+            one. Values from `base` given to writeValue() are written as pointers to the
+            existing data instead of being copied, so an updated version of a large document
+            costs about as much as the changes to it. The output is only the new data. The
+            complete new document is `base` followed by the output, and `base` must stay
+            unchanged in memory until encoding ends.
+            If `reuseStrings` is true, the base is scanned up front for strings, and later
+            writes of an equal string become pointers into the base. That lets a shared prefix
+            (say, a document listing common keys and values) be encoded once and then used as
+            the base of many small records, each of which is stored as just its own output.
+            If `externPointers` is true, pointers into the base are marked as external, so the
+            output can be read on its own, without copying the base in front of it, by using
+            an ExtensionScope. That makes wrapping a large document in a small new
+            one (an "envelope") cost nothing per byte of the big one.
+            The base stays in effect after reset(); call setBase(nullslice) to remove it. */
+        void setBase(slice base, bool reuseStrings =false, bool externPointers =false);
+        slice base() const              {return _base;}
+
         /** Ends encoding, writing the last of the data to the Writer. */
         void end();
 
+        /** Ends the current document without ending encoding, so that another root value can
+            be written after it in the same output. The string table is kept, so strings in
+            later documents become pointers to copies in earlier ones. The output from its start
+            up to the returned offset is a complete Fleece document whose root is the value
+            just finished. (Prefixed by the base, if there is one.) */
+        size_t finishDocument();
+
         /** Returns the encoded data. This implicitly calls end(). */
         alloc_slice extractOutput();
 
-        /** Resets the encoder so it can be used again. This creates a new empty Writer,
-            which can be accessed via the writer() method. */
+        /** Makes extractOutput() also create a PathIndex (see Path.hh) of these path specifiers
+            on the document, which extractPathIndex() then returns. Reading indexed paths with
+            that index takes constant time however big the document is. (Not supported with a
+            streaming Writer or a base document.) Pass an empty list to stop indexing. */
+        void indexPaths(std::vector<std::string> specifiers) {_indexedPaths = std::move(specifiers);}
+
+        /** Returns the PathIndex created by the last extractOutput(), if any. */
+        alloc_slice extractPathIndex()  {return std::move(_pathIndex);}
+
+        /** Resets the encoder so it can be used again. This empties its Writer,
+            which can be accessed via the writer() method.
+            The encoder keeps the memory it's allocated for its internal state, and the Writer
+            keeps its output buffers, so after the first few documents, encoding similar ones
+            doesn't allocate any scratch memory. */
         void reset();
 
         /////// Writing data:
@@ -69,10 +184,23 @@ namespace fleece {
 
         void writeValue(const Value*);
 
+        /** Writes the root value of a complete Fleece document, such as an earlier Encoder's
+            output, by copying its encoded data instead of re-encoding it. Since Fleece pointers
+            are relative, the data can be copied as-is, all at once; only the pointer to the root
+            is new. The data is validated first, and an InvalidData exception is thrown if it's
+            not valid (or has external pointers.) Strings in it won't be uniqued with ones
+            written to this Encoder. */
+        void writeEncoded(slice fleeceData);
+
 #ifdef __OBJC__
         /** Writes an Objective-C object. Supported classes are the ones allowed by
             NSJSONSerialization, as well as NSData. */
         void write(id);
+
+        /** Writes an NSString. The encoder caches the UTF-8 of short immutable NSStrings, so
+            writing the same NSString object again, even in a later document, doesn't have to
+            convert it again. */
+        void writeString(NSString*);
 #endif
 
         //////// Writing arrays:
@@ -87,14 +215,27 @@ namespace fleece {
             the next outermost collection (or made the root if there is no collection active.) */
         void endArray();
 
+        /** Adds all the items of an already-encoded Fleece array to the array currently being
+            written, by copying the encoded data instead of re-encoding it. `encoded` must be the
+            complete output of an Encoder whose root is an array; it's trusted, not validated.
+            That Encoder should have this one's options (see copyOptionsFrom.) If the array
+            being written may be packed, and all the items are numbers, they're written as
+            ordinary numbers so the array can still be packed.
+            (Strings in it won't be uniqued with ones written to this Encoder.) */
+        void writeEncodedArrayItems(slice encoded);
+
         //////// Writing dictionaries:
 
         /** Begins creating a dictionary. Until endDict is called, values written to the encoder
             are added to this dictionary.
             While creating a dictionary, writeKey must be called before every value.
             @param reserve  If nonzero, space is preallocated for this many values. This has no
-                            effect on the output but can speed up encoding slightly. */
-        void beginDictionary(size_t reserve =0);
+                            effect on the output but can speed up encoding slightly.
+            @param keysInOrder  If true, the caller promises to write the keys in sorted order
+                            (as with sortKeys), so the encoder doesn't need to check them.
+                            (Either way, keys that arrive in order aren't re-sorted.) Don't
+                            use this with SharedKeys, since integer keys sort before strings. */
+        void beginDictionary(size_t reserve =0, bool keysInOrder =false);
 
         /** Ends creating a dictionary. The dict is written to the output and added as a value to
             the next outermost collection (or made the root if there is no collection active.) */
@@ -105,9 +246,20 @@ namespace fleece {
         /** Writes a key to the current dictionary. This must be called before adding a value. */
         void writeKey(slice);
 
-        /** Writes a numeric key to the current dictionary. This must be called before adding a value. */
+        /** Writes a numeric key to the current dictionary. This must be called before adding a value.
+            The keys -2048 and -2047 are reserved for dictionary indexes, so writing them throws. */
         void writeKey(int);
 
+        /** Writes a key (string or integer) given as a Value, e.g. one read from another
+            dictionary. If the Value is in the base document, it's referenced, not copied. */
+        void writeKey(const Value*);
+
+#ifdef __OBJC__
+        /** Writes a key given as an NSString. Like writeString(NSString*), this caches the
+            key's UTF-8, and also its SharedKeys mapping if it has one. */
+        void writeKey(NSString*);
+#endif
+
         /** Associates a SharedKeys object with this Encoder. The writeKey() methods that take
             strings will consult this object to possibly map the key to an integer. */
         void setSharedKeys(SharedKeys *s) {_sharedKeys = s;}
@@ -129,32 +281,75 @@ namespace fleece {
         Encoder& operator<< (const Value *v)    {writeValue(v); return *this;}
 
     private:
+        // A number written to an array that might be packed
+        struct deferredNumber {
+            int64_t i;
+            double d;
+            bool isReal, isUnsigned;
+        };
+
+        // Where a string Value given to writeValue was written to
+        struct sourceString {
+            slice string;           // The written string (stable until the encoding ends)
+            uint32_t offset;        // Its position in the output
+            bool usedAsKey;         // Is it known to _strings as a key?
+        };
+
         // Stores the pending values to be written to an in-progress array/dict
         class valueArray : public std::vector<Value> {
         public:
             valueArray()                    { }
-            void reset(internal::tags t)    {tag = t; wide = false; keys.clear();}
+            void reset(internal::tags t) {
+                tag = t; wide = extraWide = false; keysInOrder = true; trustKeyOrder = false;
+                keys.clear(); packing = false; numbers.clear(); packedPos = 0; packedSize = 0;
+            }
             internal::tags tag;
             bool wide;
+            bool extraWide;         // Do pointers reach too far back even for wide items?
+            bool keysInOrder;       // Dict: Have the keys so far been written in sorted order?
+            bool trustKeyOrder;     // Dict: Did the caller promise keysInOrder (so don't check)?
             std::vector<slice> keys;
+            bool packing;           // Array: Are numbers being deferred, to maybe pack them?
+            std::vector<deferredNumber> numbers;    // Array: The deferred numbers
+            size_t packedPos;       // Array: Position of the packed numbers
+            uint8_t packedSize;     // Array: Size of each packed number, or 0 if not packed
         };
 
         void addItem(Value v);
         void writeRawValue(slice rawValue, bool canInline =true);
         void writeValue(internal::tags, uint8_t buf[], size_t size, bool canInline =true);
         void writePointer(size_t pos);
+        Value pointerTo(size_t pos);
+        size_t pointerPos(const Value&) const;
         void writeSpecial(uint8_t special);
         void writeInt(uint64_t i, bool isShort, bool isUnsigned);
         void _writeFloat(float);
+        void writeNumber(const Value*);
+        bool deferNumber(const deferredNumber&);
+        void flushDeferredNumbers();
+        void packDeferredNumbers();
         slice writeData(internal::tags, slice s);
         slice _writeString(slice, bool asKey);
+        slice writeSourceString(const Value*, bool asKey);
+        slice retainString(slice);
         [[noreturn]] void throwUnexpectedKey();
+        void addedKey(slice);
+        slice sortableKey(size_t keyIndex) const;
         size_t nextWritePos();
-        void sortDict(valueArray &items);
-        void checkPointerWidths(valueArray *items);
+        bool isInBase(const Value *v) const;
+        void addBaseStrings(const Value*);
+        void writeRoot();
+        void sortDict(valueArray &items, bool reorderKeys);
+        void writeHashIndex(valueArray &items);
+        void writePrefixIndex(valueArray &items, size_t offset);
+        bool recordsKeys() const        {return _sortKeys || _hashIndexMinCount > 0
+                                                          || _prefixIndexMinCount > 0;}
+        void checkPointerWidths(valueArray *items, size_t headerSize =0);
         void fixPointers(valueArray *items);
+        void writeExtraWideItems(valueArray *items);
         void endCollection(internal::tags tag);
         void push(internal::tags tag, size_t reserve);
+        void countDedupedString(slice);
 
         // experimental, may become public in some form
         void writeKeyTable();
@@ -164,25 +359,46 @@ namespace fleece {
 
         //////// Data members:
 
-        static const size_t kMaxStackDepth = 10;
+        static const size_t kInitialStackDepth = 10;    // Stack grows past this as needed
+        static const size_t kWideOffsetLimit = 1u << 31;  // Wide pointers must be shorter
 
         Writer _out;            // Where output is written to
+        slice _base;            // Existing document being appended to (if any)
+        bool _externBase {false};   // Are pointers into _base external?
         valueArray *_items;     // Values of the currently-open array/dict; == &_stack[_stackDepth]
-        std::array<valueArray, kMaxStackDepth> _stack; // Stack of open arrays/dicts
+        std::vector<valueArray> _stack; // Stack of open arrays/dicts; never shrinks
         unsigned _stackDepth {0};    // Current depth of _stack
+        std::vector<size_t> _farPositions;  // Pointer positions too big for a Value (see pointerTo)
+        size_t _wideOffsetLimit {kWideOffsetLimit}; // (Tests lower this to make far pointers)
         StringTable _strings;        // Maps strings to the offsets where they appear as values
+        StringTable _baseStrings;    // Same, for strings in _base (if reusing them)
+        std::unordered_map<const Value*, sourceString> _sourceStrings; // writeValue's strings
+        Writer _retainedStrings;     // Copies of strings that _strings/keys point to, if streaming
         bool _uniqueStrings {true};  // Should strings be uniqued before writing?
+        bool _reemitFarStrings {false}; // Write a new copy of a uniqued string that's far back?
         SharedKeys *_sharedKeys {nullptr};  // Client-provided key-to-int mapping
         bool _sortKeys      {true};  // Should dictionary keys be sorted?
+        unsigned _hashIndexMinCount {0}; // Min dict size to write a hash index for (0 = never)
+        unsigned _prefixIndexMinCount {0}; // Min dict size to write a prefix index for (0 = never)
+        bool _packNumericArrays {false}; // Should arrays of numbers be packed?
+        std::shared_ptr<NSStringCache> _nsStringCache; // UTF-8 of NSStrings (see Encoder+ObjC.mm)
         bool _writingKey    {false}; // True if Value being written is a key
         bool _blockedOnKey  {false}; // True if writes should be refused
 
+        // Scratch space for sortDict and writeHashIndex/writePrefixIndex, kept to avoid
+        // reallocating it:
+        std::vector<const slice*> _sortIndices;
+        std::vector<Value> _sortScratch;
+        std::vector<slice> _sortedKeys;
+        std::vector<uint32_t> _hashIndexTable;
+
+        std::vector<std::string> _indexedPaths; // Paths to create a PathIndex of
+        alloc_slice _pathIndex;      // PathIndex created by extractOutput
+
+        bool _collectStats {false};  // Should _stats be updated?
+        EncoderStats _stats;
+
         friend class EncoderTests;
-#ifndef NDEBUG
-    public: // Statistics for use in tests
-        unsigned _numNarrow {0}, _numWide {0}, _narrowCount {0}, _wideCount {0},
-                 _numSavedStrings {0};
-#endif
     };
 
 }
@@ -9,6 +9,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -35,6 +36,8 @@ extern "C" {
     typedef struct _FLEncoder*     FLEncoder;       ///< A reference to an encoder
     typedef struct _FLSharedKeys*  FLSharedKeys;    ///< A reference to a shared-keys mapping
     typedef struct _FLKeyPath*     FLKeyPath;       ///< A reference to a key path
+    typedef struct _FLMappedFile*  FLMappedFile;    ///< A reference to a memory-mapped file
+    typedef struct _FLStringCache* FLStringCache;   ///< A reference to a cache of converted strings
 #endif
 
 
@@ -114,7 +117,9 @@ extern "C" {
         EncodeError,        // Structural error encoding (missing value, too many ends, etc.)
         JSONError,          // Error parsing JSON
         UnknownValue,       // Unparseable data in a Value (corrupt? Or from some distant future?)
+        PathSyntaxError,    // Invalid key-path specifier
         InternalError,      // Something that shouldn't happen
+        IOError,            // File couldn't be opened or read
     } FLError;
 
     /** @} */
@@ -142,6 +147,23 @@ extern "C" {
         crash or return bogus results (including data from arbitrary memory locations.) */
     FLValue FLValue_FromTrustedData(FLSlice data);
 
+    /** Memory-maps a Fleece file and returns a reference to its root value. The file isn't read
+        into memory; its pages are loaded from disk as they're accessed, so even a huge file
+        opens almost instantly (unless it's validated, which has to read all of it.)
+        The FLValue, and any values derived from it, remain valid until the file is released by
+        calling FLMappedFile_Free on the value stored in `outFile`.
+        @param path  The filesystem path of the file.
+        @param trusted  If true, the data is only minimally validated; see FLValue_FromTrustedData.
+        @param outFile  On success, the mapped file is stored here. The caller must free it.
+        @param outError  On failure, the error code is stored here (IOError if the file couldn't
+                    be opened, or InvalidData if it isn't valid Fleece.)
+        @return  The root value, or NULL on failure. */
+    FLValue FLValue_FromFile(const char *path, bool trusted,
+                             FLMappedFile *outFile, FLError *outError);
+
+    /** Unmaps a file opened by FLValue_FromFile. All FLValues obtained from it become invalid. */
+    void FLMappedFile_Free(FLMappedFile);
+
     /** Directly converts JSON data to Fleece-encoded data.
         You can then call FLValueFromTrustedData to get the root as a Value. */
     FLSliceResult FLData_ConvertJSON(FLSlice json, FLError *outError);
@@ -218,6 +240,14 @@ extern "C" {
     /** Converts valid JSON5 to JSON. */
     FLSliceResult FLJSON5_ToJSON(FLSlice json5, FLError *error);
 
+    /** Compares two values for deep equality, ignoring differences in how they're encoded.
+        (Two nullptrs are equal.) */
+    bool FLValue_IsEqual(FLValue v1, FLValue v2);
+
+    /** Returns a stable 64-bit hash of a value's contents; values that are equal according to
+        FLValue_IsEqual have the same hash. Returns 0 for nullptr. */
+    uint64_t FLValue_Hash(FLValue);
+
     //////// ARRAY
 
 
@@ -305,8 +335,8 @@ extern "C" {
         "hints" that speed up future searches. */
     typedef struct {
         void* _private1[4];
-        uint32_t _private2, private3;
-        bool _private4, private5;
+        uint32_t _private2, private3, private4;
+        bool _private5, private6;
     } FLDictKey;
 
     /** Initializes an FLDictKey struct with a key string.
@@ -335,6 +365,25 @@ extern "C" {
     size_t FLDict_GetWithKeys(FLDict dict, FLDictKey keys[], FLValue values[], size_t count);
 
 
+    /** Types of output buffer for FLArray_ExtractColumn. */
+    typedef enum {
+        kFLColumnInt64,     ///< int64_t[]; non-numeric or missing values become 0
+        kFLColumnDouble,    ///< double[]; non-numeric or missing values become 0.0
+        kFLColumnString,    ///< FLSlice[]; non-string or missing values become {NULL, 0}
+    } FLColumnType;
+
+    /** Looks up a key in every item of an array of dictionaries, writing the values to
+        consecutive elements of a buffer, which is much faster than looking them up one by one.
+        @param array  The array, whose items should be dictionaries.
+        @param key  The key to look up. Its hint is updated.
+        @param type  The type of the elements of `outValues`.
+        @param outValues  The values will be written here. It must have room for
+                    FLArray_Count(array) elements of the given type.
+        @return  The number of items that had a value of the right type for the key. */
+    size_t FLArray_ExtractColumn(FLArray array, FLDictKey *key,
+                                 FLColumnType type, void *outValues);
+
+
     //////// PATH
 
 
@@ -353,6 +402,38 @@ extern "C" {
     FLValue FLKeyPath_EvalOnce(FLSlice specifier, FLSharedKeys, FLValue root, FLError *error);
 
 
+    //////// STRING CACHE
+
+
+    /** Converts a string to a platform (host-language) string object, for an FLStringCache. */
+    typedef const void* (*FLStringConverter)(void *context, FLSlice str);
+
+    /** Frees a platform string created by an FLStringConverter. */
+    typedef void (*FLStringReleaser)(void *context, const void *platformString);
+
+    /** Creates a cache of the platform strings that string values have been converted to, so
+        a string that appears many times in a document (an enum value, say) is only converted
+        once. It depends on the encoder's uniquing, so only strings of 2 to 15 bytes are cached.
+        The cache must be cleared or freed before the Fleece data it's used with is freed.
+        @param converter  Called to convert a string that isn't cached yet.
+        @param releaser  Called to free a cached string; may be NULL.
+        @param context  Passed to the callbacks.
+        @param threadSafe  If true, the cache may be used on multiple threads at once. */
+    FLStringCache FLStringCache_New(FLStringConverter converter, FLStringReleaser releaser,
+                                    void *context, bool threadSafe);
+
+    /** Frees a cache, releasing its strings. (It's ok to pass NULL.) */
+    void FLStringCache_Free(FLStringCache);
+
+    /** Returns the platform string for a string value, converting it the first time. The
+        result belongs to the cache. Returns NULL if the value isn't a string, or is too short
+        or too long to be cached; convert those strings yourself. */
+    const void* FLStringCache_Get(FLStringCache, FLValue);
+
+    /** Releases all the strings in a cache. */
+    void FLStringCache_Clear(FLStringCache);
+
+
     //////// ENCODER
 
 
@@ -378,9 +459,26 @@ extern "C" {
             this off, you can only look up keys with FLDictGetUnsorted(). (Default is true) */
     FLEncoder FLEncoder_NewWithOptions(size_t reserveSize, bool uniqueStrings, bool sortKeys);
 
+    /** Creates a new encoder that writes its output to a file as it goes, instead of
+        accumulating it in memory. This is useful for very large documents.
+        FLEncoder_Finish will return a null slice; check its error parameter for success. */
+    FLEncoder FLEncoder_NewWritingToFile(FILE*, bool uniqueStrings);
+
     /** Frees the space used by an encoder. */
     void FLEncoder_Free(FLEncoder);
 
+    /** Returns an encoder with the default options, like FLEncoder_New, but takes it from a
+        per-thread pool of idle encoders if possible. Those have kept the buffers they grew
+        while encoding earlier documents, so getting one is nearly free and encoding into it
+        rarely needs to allocate memory. Call FLEncoder_Release (not FLEncoder_Free) when done. */
+    FLEncoder FLEncoder_Acquire(void);
+
+    /** Resets an encoder and returns it to the current thread's pool, for a later
+        FLEncoder_Acquire to reuse. Its options, shared keys and base are reset to the defaults.
+        The pool holds only a few encoders and a limited amount of memory (1MB per thread);
+        past that, the encoder is freed. Any other encoder is simply freed. */
+    void FLEncoder_Release(FLEncoder);
+
     /** Tells the encoder to use a shared-keys mapping when encoding dictionary keys. */
     void FLEncoder_SetSharedKeys(FLEncoder, FLSharedKeys);
 
@@ -465,12 +563,38 @@ extern "C" {
     /** Writes a Fleece Value to an Encoder. */
     bool FLEncoder_WriteValue(FLEncoder, FLValue);
 
+    /** Writes the root value of already-encoded Fleece data (such as an earlier encoder's
+        output) to an Encoder, by copying the data instead of re-encoding it. The data is
+        validated first; the error is InvalidData if it isn't valid. */
+    bool FLEncoder_WriteEncoded(FLEncoder, FLSlice fleeceData);
+
 
     /** Parses JSON data and writes the object(s) to the encoder. (This acts as a single write,
         like WriteInt; it's just that the value written is likely to be an entire dictionary of
         array.) */
     bool FLEncoder_ConvertJSON(FLEncoder e, FLSlice json);
 
+    /** The JSON parsers FLEncoder_ConvertJSON can use. */
+    typedef enum {
+        kFLJSONStateMachine = 0,    // The jsonsl state machine (the default)
+        kFLJSONIndexed,             // Two-pass parser that indexes structure with SIMD first
+    } FLJSONEngine;
+
+    /** Selects the JSON parser used by FLEncoder_ConvertJSON. Both produce the same output from
+        valid JSON, but kFLJSONIndexed is usually faster, especially on large inputs. It's also
+        stricter: the default parser accepts some invalid JSON, such as trailing commas, and the
+        two may report a different error code or position for the same invalid input. */
+    void FLEncoder_SetJSONEngine(FLEncoder e, FLJSONEngine engine);
+
+    /** Returns a delta (patch) describing how to change `old` into `nuu`, as Fleece data,
+        or a null slice if they're equal. Transmitting the delta instead of the new value
+        saves the space of everything that didn't change. */
+    FLSliceResult FLCreateDelta(FLValue old, FLValue nuu);
+
+    /** Writes to an encoder the value that results from applying a delta (from FLCreateDelta)
+        to `old`. */
+    bool FLEncodeApplyingDelta(FLValue old, FLSlice delta, FLEncoder);
+
 
     /** Ends encoding; if there has been no error, it returns the encoded data, else null.
         This does not free the FLEncoder; call FLEncoder_Free (or FLEncoder_Reset) next. */
@@ -482,6 +606,37 @@ extern "C" {
     /** Returns the error message of an encoder, or nullptr if there's no error. */
     const char* FLEncoder_GetErrorMessage(FLEncoder e);
 
+
+    /** Statistics about what an encoder has written (see FLEncoder_GetStats.) */
+    typedef struct {
+        uint64_t bytesWritten;          ///< Bytes of output, counted when encoding ends
+        uint64_t stringsWritten;        ///< Strings written out in full
+        uint64_t stringsDeduped;        ///< Strings written as pointers to an earlier copy
+        uint64_t bytesSaved;            ///< Bytes not written thanks to string deduping
+        uint64_t stringsReemitted;      ///< Uniqued strings written again, being too far back
+        uint64_t narrowCollections;     ///< Arrays/dicts written with 2-byte items
+        uint64_t wideCollections;       ///< Arrays/dicts written with 4-byte items
+        uint64_t narrowItems;           ///< Items in narrow collections
+        uint64_t wideItems;             ///< Items in wide collections
+        uint64_t narrowPointers;        ///< 2-byte pointers written
+        uint64_t widePointers;          ///< 4-byte pointers written
+        uint64_t dictsSorted;           ///< Dicts whose keys had to be sorted
+        uint64_t sortNanoseconds;       ///< Time spent sorting them
+        unsigned maxDepth;              ///< Deepest nesting of arrays/dicts
+        double stringTableLoad;         ///< Fullness (0-1) of the string table at the end
+    } FLEncoderStats;
+
+    /** Turns collection of statistics on or off; it's off by default. The stats accumulate
+        over all the documents the encoder writes (FLEncoder_Reset doesn't clear them) until
+        FLEncoder_ResetStats is called. */
+    void FLEncoder_CollectStats(FLEncoder e, bool collect);
+
+    /** Returns the statistics collected by an encoder. */
+    FLEncoderStats FLEncoder_GetStats(FLEncoder e);
+
+    /** Clears an encoder's statistics. */
+    void FLEncoder_ResetStats(FLEncoder e);
+
     
     /** @} */
     /** @} */
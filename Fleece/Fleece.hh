@@ -16,4 +16,8 @@
 #include "Array.hh"
 #include "Encoder.hh"
 #include "JSONConverter.hh"
+#include "JSONStreamer.hh"
 #include "SharedKeys.hh"
+#include "MappedFile.hh"
+#include "ParallelArrayEncoder.hh"
+#include "StringCache.hh"
@@ -23,6 +23,7 @@ namespace fleece {
         UnknownValue,       // Unparseable data in a Value (corrupt? Or from some distant future?)
         PathSyntaxError,    // Invalid Path specifier
         InternalError,      // This shouldn't happen
+        IOError,            // File couldn't be opened or read
     } ErrorCode;
 
 
@@ -16,6 +16,7 @@
 #include "Fleece_C_impl.hh"
 #include "Fleece.h"
 #include "JSON5.hh"
+#include "Delta.hh"
 
 
 namespace fleece {
@@ -50,6 +51,27 @@ FLValue FLValue_FromData(FLSlice data)          {return Value::fromData(data);}
 FLValue FLValue_FromTrustedData(FLSlice data)   {return Value::fromTrustedData(data);}
 
 
+FLValue FLValue_FromFile(const char *path, bool trusted, FLMappedFile *outFile, FLError *outError) {
+    *outFile = nullptr;
+    try {
+        std::unique_ptr<mapped_slice> file(new mapped_slice);
+        const Value *root = Value::fromMappedFile(path, *file, trusted);
+        if (!root) {
+            if (outError)
+                *outError = ::InvalidData;
+            return nullptr;
+        }
+        *outFile = file.release();
+        return root;
+    } catchError(outError)
+    return nullptr;
+}
+
+void FLMappedFile_Free(FLMappedFile file) {
+    delete file;
+}
+
+
 FLValueType FLValue_GetType(FLValue v)          {return v ? (FLValueType)v->type() : kFLUndefined;}
 bool FLValue_IsInteger(FLValue v)               {return v && v->isInteger();}
 bool FLValue_IsUnsigned(FLValue v)              {return v && v->isUnsigned();}
@@ -88,6 +110,9 @@ static FLSliceResult ToJSON(FLValue v) {
 FLSliceResult FLValue_ToJSON(FLValue v)         {return ToJSON<1>(v);}
 FLSliceResult FLValue_ToJSON5(FLValue v)        {return ToJSON<5>(v);}
 
+bool FLValue_IsEqual(FLValue v1, FLValue v2)    {return v1 ? v1->isEqual(v2) : !v2;}
+uint64_t FLValue_Hash(FLValue v)                {return v ? v->hash() : 0;}
+
 
 FLSliceResult FLData_ConvertJSON(FLSlice json, FLError *outError) {
     FLEncoderImpl e(json.size);
@@ -202,6 +227,23 @@ size_t FLDict_GetWithKeys(FLDict d, FLDictKey keys[], FLValue values[], size_t c
     return d->get((Dict::key*)keys, values, count);
 }
 
+size_t FLArray_ExtractColumn(FLArray a, FLDictKey *k, FLColumnType type, void *outValues) {
+    if (!a)
+        return 0;
+    auto key = (Dict::key*)k;
+    switch (type) {
+        case kFLColumnInt64:
+            return a->extractColumn(*key, (int64_t*)outValues);
+        case kFLColumnDouble:
+            return a->extractColumn(*key, (double*)outValues);
+        case kFLColumnString:
+            static_assert(sizeof(FLSlice) == sizeof(slice), "FLSlice and slice differ");
+            return a->extractColumn(*key, (slice*)outValues);
+        default:
+            return 0;
+    }
+}
+
 
 #pragma mark - KEY-PATHS:
 
@@ -231,6 +273,34 @@ FLValue FLKeyPath_EvalOnce(FLSlice specifier, FLSharedKeys sharedKeys, FLValue r
 }
 
 
+#pragma mark - STRING CACHE:
+
+
+FLStringCache FLStringCache_New(FLStringConverter converter, FLStringReleaser releaser,
+                                void *context, bool threadSafe)
+{
+    try {
+        return new FLStringCacheImpl(converter, releaser, context, threadSafe);
+    } catchError(nullptr)
+    return nullptr;
+}
+
+void FLStringCache_Free(FLStringCache cache) {
+    delete cache;
+}
+
+const void* FLStringCache_Get(FLStringCache cache, FLValue v) {
+    try {
+        return cache->get(v);
+    } catchError(nullptr)
+    return nullptr;
+}
+
+void FLStringCache_Clear(FLStringCache cache) {
+    cache->clear();
+}
+
+
 #pragma mark - ENCODER:
 
 
@@ -245,6 +315,12 @@ FLEncoder FLEncoder_NewWithOptions(size_t reserveSize, bool uniqueStrings, bool
     return e;
 }
 
+FLEncoder FLEncoder_NewWritingToFile(FILE *outputFile, bool uniqueStrings) {
+    auto e = new FLEncoderImpl(outputFile);
+    e->uniqueStrings(uniqueStrings);
+    return e;
+}
+
 void FLEncoder_Reset(FLEncoder e) {
     e->reset();
 }
@@ -253,6 +329,64 @@ void FLEncoder_Free(FLEncoder e)                         {
     delete e;
 }
 
+
+namespace fleece {
+    // A per-thread cache of idle encoders for FLEncoder_Acquire. They keep the buffers they've
+    // grown, up to a limit on the total memory the pool holds.
+    class EncoderPool {
+    public:
+        static const size_t kMaxEncoders = 4;
+        static const size_t kMaxMemory = 1024*1024;
+
+        ~EncoderPool() {
+            for (auto e : _encoders)
+                delete e;
+        }
+
+        FLEncoderImpl* acquire() {
+            if (_encoders.empty()) {
+                auto e = new FLEncoderImpl;
+                e->pooled = true;
+                return e;
+            }
+            auto e = _encoders.back();
+            _encoders.pop_back();
+            _memory -= e->memoryUsage();
+            return e;
+        }
+
+        void release(FLEncoderImpl *e) {
+            e->resetToDefaults();
+            size_t memory = e->memoryUsage();
+            if (_encoders.size() < kMaxEncoders && _memory + memory <= kMaxMemory) {
+                _encoders.push_back(e);
+                _memory += memory;
+            } else {
+                delete e;
+            }
+        }
+
+    private:
+        std::vector<FLEncoderImpl*> _encoders;
+        size_t _memory {0};         // Sum of memoryUsage() of _encoders
+    };
+
+    static thread_local EncoderPool sEncoderPool;
+}
+
+FLEncoder FLEncoder_Acquire(void) {
+    return sEncoderPool.acquire();
+}
+
+void FLEncoder_Release(FLEncoder e) {
+    if (!e)
+        return;
+    if (e->pooled)
+        sEncoderPool.release(e);
+    else
+        delete e;
+}
+
 void FLEncoder_SetSharedKeys(FLEncoder e, FLSharedKeys sk) {
     e->setSharedKeys(sk);
 }
@@ -284,6 +418,7 @@ bool FLEncoder_WriteKey(FLEncoder e, FLSlice s)          {ENCODER_TRY(writeKey(s
 bool FLEncoder_EndDict(FLEncoder e)                      {ENCODER_TRY(endDictionary());}
 
 bool FLEncoder_WriteValue(FLEncoder e, FLValue v)        {ENCODER_TRY(writeValue(v));}
+bool FLEncoder_WriteEncoded(FLEncoder e, FLSlice d)      {ENCODER_TRY(writeEncoded(d));}
 
 
 bool FLEncoder_ConvertJSON(FLEncoder e, FLSlice json) {
@@ -296,6 +431,7 @@ bool FLEncoder_ConvertJSON(FLEncoder e, FLSlice json) {
                 jc = new JSONConverter(*e);
                 e->jsonConverter.reset(jc);
             }
+            jc->setEngine(e->jsonEngine);
             if (jc->encodeJSON(json)) {                   // encodeJSON can throw
                 return true;
             } else {
@@ -309,6 +445,31 @@ bool FLEncoder_ConvertJSON(FLEncoder e, FLSlice json) {
     return false;
 }
 
+
+void FLEncoder_SetJSONEngine(FLEncoder e, FLJSONEngine engine) {
+    e->jsonEngine = (engine == kFLJSONIndexed) ? JSONConverter::kIndexEngine
+                                               : JSONConverter::kJsonslEngine;
+}
+
+FLSliceResult FLCreateDelta(FLValue old, FLValue nuu) {
+    try {
+        return toSliceResult(CreateDelta(old, nuu));
+    } catchError(nullptr)
+    return {nullptr, 0};
+}
+
+bool FLEncodeApplyingDelta(FLValue old, FLSlice delta, FLEncoder e) {
+    try{
+        if (!e->hasError()) {
+            ApplyDelta(old, delta, *e);
+            return true;
+        }
+    } catch (const std::exception &x) {
+        e->recordException(x);
+    }
+    return false;
+}
+
 FLError FLEncoder_GetError(FLEncoder e) {
     return (FLError)e->errorCode;
 }
@@ -317,6 +478,35 @@ const char* FLEncoder_GetErrorMessage(FLEncoder e) {
     return e->hasError() ? e->errorMessage.c_str() : nullptr;
 }
 
+void FLEncoder_CollectStats(FLEncoder e, bool collect) {
+    e->collectStats(collect);
+}
+
+FLEncoderStats FLEncoder_GetStats(FLEncoder e) {
+    auto &stats = e->stats();
+    FLEncoderStats result;
+    result.bytesWritten = stats.bytesWritten;
+    result.stringsWritten = stats.stringsWritten;
+    result.stringsDeduped = stats.stringsDeduped;
+    result.bytesSaved = stats.bytesSaved;
+    result.stringsReemitted = stats.stringsReemitted;
+    result.narrowCollections = stats.narrowCollections;
+    result.wideCollections = stats.wideCollections;
+    result.narrowItems = stats.narrowItems;
+    result.wideItems = stats.wideItems;
+    result.narrowPointers = stats.narrowPointers;
+    result.widePointers = stats.widePointers;
+    result.dictsSorted = stats.dictsSorted;
+    result.sortNanoseconds = stats.sortNanoseconds;
+    result.maxDepth = stats.maxDepth;
+    result.stringTableLoad = stats.stringTableLoad;
+    return result;
+}
+
+void FLEncoder_ResetStats(FLEncoder e) {
+    e->resetStats();
+}
+
 FLSliceResult FLEncoder_Finish(FLEncoder e, FLError *outError) {
     if (!e->hasError()) {
         try {
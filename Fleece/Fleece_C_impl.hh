@@ -10,10 +10,13 @@
 #include "Fleece.hh"
 #include "Path.hh"
 #include "FleeceException.hh"
+#include "MappedFile.hh"
+#include "StringCache.hh"
 using namespace fleece;
 
 namespace fleece {
     struct FLEncoderImpl;
+    struct FLStringCacheImpl;
 }
 
 #define FL_IMPL
@@ -23,6 +26,8 @@ typedef const Dict* FLDict;
 typedef FLEncoderImpl* FLEncoder;
 typedef SharedKeys* FLSharedKeys;
 typedef Path*       FLKeyPath;
+typedef mapped_slice* FLMappedFile;
+typedef FLStringCacheImpl* FLStringCache;
 
 
 #include "Fleece.h" /* the C header */
@@ -36,13 +41,48 @@ namespace fleece {
         catch (const std::exception &x) { recordError(x, OUTERROR); }
 
     
+    // Implementation of FLStringCache: a StringCache that calls the C callbacks, converting
+    // the slice to an FLSlice (the function types differ, so they can't be cast.)
+    struct FLStringCacheImpl : public StringCache {
+        FLStringCacheImpl(FLStringConverter converter, FLStringReleaser releaser,
+                          void *context, bool threadSafe)
+        :StringCache(&convert, (releaser ? &release : nullptr), this, threadSafe)
+        ,_converter(converter)
+        ,_releaser(releaser)
+        ,_context(context)
+        { }
+
+        ~FLStringCacheImpl() {
+            clear();                // while the callbacks are still here to be called
+        }
+
+    private:
+        static PlatformString convert(void *self, slice str) {
+            auto impl = (FLStringCacheImpl*)self;
+            return impl->_converter(impl->_context, {str.buf, str.size});
+        }
+
+        static void release(void *self, PlatformString str) {
+            auto impl = (FLStringCacheImpl*)self;
+            impl->_releaser(impl->_context, str);
+        }
+
+        FLStringConverter const _converter;
+        FLStringReleaser const _releaser;
+        void* const _context;
+    };
+
+
     // Implementation of FLEncoder: a subclass of Encoder that keeps track of its error state.
     struct FLEncoderImpl : public Encoder {
         FLError errorCode {::NoError};
         std::string errorMessage;
         std::unique_ptr<JSONConverter> jsonConverter {nullptr};
+        JSONConverter::Engine jsonEngine {JSONConverter::kJsonslEngine};
+        bool pooled {false};            // Created by FLEncoder_Acquire?
 
         FLEncoderImpl(size_t reserveOutputSize =256) :Encoder(reserveOutputSize) { }
+        FLEncoderImpl(FILE *outputFile) :Encoder(Writer::outputToFile(outputFile)) { }
 
         bool hasError() const {
             return errorCode != ::NoError;
@@ -61,6 +101,23 @@ namespace fleece {
                 jsonConverter->reset();
             errorCode = ::NoError;
         }
+
+        // Resets, and also restores the options to their defaults, for reuse from a pool.
+        void resetToDefaults() {
+            reset();
+            errorMessage.clear();
+            jsonEngine = JSONConverter::kJsonslEngine;
+            setSharedKeys(nullptr);
+            setBase(nullslice);
+            uniqueStrings(true);
+            reemitFarStrings(false);
+            sortKeys(true);
+            hashIndexMinCount(0);
+            prefixIndexMinCount(0);
+            packNumericArrays(false);
+            collectStats(false);
+            resetStats();
+        }
     };
 
 }
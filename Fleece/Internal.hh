@@ -16,6 +16,7 @@
 #pragma once
 #include <stdint.h>
 #include <stdlib.h>
+#include <atomic>
 
 /*
  Value binary layout:
@@ -23,6 +24,8 @@
  0000iiii iiiiiiii       small integer (12-bit, signed, range ±2048)
  0001uccc iiiiiiii...    long integer (u = unsigned?; ccc = byte count - 1) LE integer follows
  0010s--- --------...    floating point (s = 0:float, 1:double). LE float data follows.
+ 0010s1i- oooooooo...    packed number (s = 0:4-byte, 1:8-byte; i = 0:float, 1:int; o = 24-bit
+                                BE offset in units of 2 bytes back to its LE data; always wide)
  0011ss-- --------       special (s = 0:null, 1:false, 2:true)
  0100cccc ssssssss...    string (cccc is byte count, or if it’s 15 then count follows as varint)
  0101cccc dddddddd...    binary data (same as string)
@@ -31,16 +34,22 @@
  0111wccc cccccccc...    dictionary (same as array)
  1ooooooo oooooooo       pointer (o = BE unsigned offset in units of 2 bytes back; up to -64kbytes)
                                 NOTE: In a wide collection, offset field is 31 bits wide
+ 1eoooooo oooooooo...    wide pointer in an extension (e = external, with a 30-bit offset;
+                                 see kExternPointerFlag)
+ 10oooooo oooooooo...    extra-wide pointer (8 bytes, with a 62-bit offset; see kExtraWideMarker)
 
  Bits marked "-" are reserved and should be set to zero.
 */
 
 namespace fleece {
+    struct slice;
+
     namespace internal {
 
         enum {
             kNarrow = 2,
-            kWide   = 4
+            kWide   = 4,
+            kExtraWide = 8
         };
 
         static inline int width(bool wide) { return wide ? kWide : kNarrow; }
@@ -73,6 +82,91 @@ namespace fleece {
         // Minimum array count that has to be stored outside the header
         static const uint32_t kLongArrayCount = 0x07FF;
 
+        // A dictionary may have a hash index of its string keys, stored as an extra first entry
+        // whose key is this (reserved) integer and whose value is binary data: a power-of-two
+        // sized open-addressed table of little-endian 32-bit slots. A nonzero slot holds the
+        // entry's index plus one in its low bits, and the upper bits of the key's hash above
+        // that. A reader that doesn't know about this just sees an extra integer key.
+        static const int      kDictHashIndexKey = -2048;
+        static const uint32_t kDictHashIndexMask = 0x000FFFFF;     // Bits that hold the index
+        static const uint32_t kMaxDictHashIndexCount = kDictHashIndexMask - 1;
+
+        // A dictionary may also have a prefix index of its string keys, an entry with this key
+        // (after the hash index entry, if any) whose value is binary data: the length L of the
+        // prefix all the string keys share, and the index of the first string key (integer keys
+        // come first), as little-endian 32-bit ints; then for each string key, in order, its 4
+        // bytes following the shared prefix, zero-padded. Those are in non-decreasing order when
+        // read as big-endian ints, so a search can narrow down the keys to compare by looking at
+        // them, without dereferencing any keys.
+        static const int      kDictPrefixIndexKey = -2047;
+        static const size_t   kDictPrefixIndexHeaderSize = 8;
+
+        // A wide array of numbers that are all the same type can be "packed": the raw numbers are
+        // stored contiguously, little-endian and aligned to their size, just before the array,
+        // and each item is a 4-byte packed number Value that points back to its number. This
+        // lets a reader get at all the numbers at once as a C array (see Array::packedDoubles),
+        // while each item still acts as an ordinary number Value.
+        static const uint8_t kPackedNumberFlag = 0x04;  // 'packed' bit in 1st byte of float Value
+        static const uint8_t kPackedIntFlag    = 0x02;  // 'integer' bit of a packed number
+        static const uint32_t kMaxPackedOffset = 0xFFFFFF << 1;
+
+        // Min/max count of numbers the encoder will write as a packed array
+        // (not part of the format, just heuristics used by the encoder)
+        static const size_t kMinPackedArrayCount = 16;
+        static const size_t kMaxPackedArrayCount = 0x3FFFF0;
+
+        // A wide pointer with this bit set in its 1st byte, in an extension document (one
+        // written by an Encoder whose base was separate; see Encoder::setBase), is external: it
+        // points into that base, as though the extension's data came right after the base's.
+        // Readers find the base by looking up the extension's address in a registry (see
+        // ExtensionScope.) The bit only means this in a registered extension; anywhere else
+        // it's part of the offset, as it always was, since older Encoders could write wide
+        // pointers reaching back up to 4GB. An Encoder never writes a wide pointer
+        // reaching back 2GB or more now (it writes an extra-wide collection instead), so in an
+        // extension the bit is unambiguous.
+        static const uint8_t kExternPointerFlag = 0x40;
+
+        // A collection whose pointers reach back 2GB or more is written "extra-wide": it has the
+        // wide bit set, and its first 8-byte slot (not counted in its count) is this byte
+        // followed by zeros, a special value that's otherwise never written. Its items are 8
+        // bytes: an inline value (still at most 4 bytes) padded with zeros, or a big-endian
+        // pointer whose low 62 bits are the offset in units of 2 bytes. Its items' targets are
+        // always wide, and extra-wide pointers are never external. Documents under 2GB never
+        // have extra-wide collections, so readers that predate them are only affected by ones
+        // that are too big for them anyway.
+        static const uint8_t kExtraWideMarker = 0x3C;
+
+        // The number of extension buffers with registered bases, i.e. of ExtensionScopes.
+        // (Implemented in Value.cc)
+        extern std::atomic<unsigned> gExternBaseCount;
+
+        // The hash function used by dictionary hash indexes. (It's part of the data format, so
+        // it must never change.) This is 32-bit FNV-1a.
+        static inline uint32_t dictHashIndexHash(const void *buf, size_t size) noexcept {
+            uint32_t h = 2166136261u;
+            for (size_t i = 0; i < size; i++)
+                h = (h ^ ((const uint8_t*)buf)[i]) * 16777619u;
+            return h;
+        }
+
+        // A constexpr version of dictHashIndexHash, for strings known at compile time.
+        constexpr uint32_t constDictHashIndexHash(const char *str, size_t size,
+                                                  uint32_t h = 2166136261u) noexcept {
+            return size == 0 ? h : constDictHashIndexHash(str + 1, size - 1,
+                                                          (h ^ (uint8_t)*str) * 16777619u);
+        }
+
+        /** Returns the number of bytes at the start of the range that can be written to a JSON
+            string as-is, i.e. before the first quote, backslash or control character.
+            Uses SSE2 or NEON instructions where available. (Implemented in Value+JSON.cc) */
+        size_t countUnescapedJSONBytes(const uint8_t *begin, const uint8_t *end);
+
+        /** A plain byte-at-a-time version of countUnescapedJSONBytes, for comparison. */
+        size_t countUnescapedJSONBytesScalar(const uint8_t *begin, const uint8_t *end);
+
+        /** Returns true if a dictionary key can be written to JSON5 without quotes. */
+        bool canBeUnquotedJSON5Key(slice key);
+
 #ifndef NDEBUG
         extern unsigned gTotalComparisons;
 #endif
@@ -14,8 +14,14 @@
 //  and limitations under the License.
 
 #include "JSON5.hh"
+#include "JSONConverter.hh"
+#include "Encoder.hh"
+#include "FleeceException.hh"
+#include "NumConversion.hh"
+#include "PlatformCompat.hh"
 #include <sstream>
 #include <stdexcept>
+#include <stdlib.h>
 
 using namespace std;
 
@@ -257,4 +263,328 @@ namespace fleece {
         return out.str();
     }
 
+
+#pragma mark - JSON5 TO FLEECE:
+
+
+    // Parses JSON5 from a slice, writing the values directly to an Encoder. Strings without
+    // escapes are passed to the Encoder straight from the input.
+    class json5encoder {
+    public:
+        json5encoder(slice in, Encoder &enc)
+        :_start((const char*)in.buf)
+        ,_pos(_start)
+        ,_end(_start + in.size)
+        ,_enc(enc)
+        { }
+
+        // Parses a complete JSON5 string.
+        void parse() {
+            parseValue(0);
+            if (peekToken() != 0)
+                fail("Unexpected characters after end of value");
+        }
+
+    private:
+
+        void parseValue(int depth) {
+            switch(peekToken()) {
+                case 'n':
+                    parseConstant("null");
+                    _enc.writeNull();
+                    break;
+                case 't':
+                    parseConstant("true");
+                    _enc.writeBool(true);
+                    break;
+                case 'f':
+                    parseConstant("false");
+                    _enc.writeBool(false);
+                    break;
+                case '-':
+                case '+':
+                case '.':
+                case '0': case '1': case '2': case '3': case '4':
+                case '5': case '6': case '7': case '8': case '9':
+                    parseNumber();
+                    break;
+                case '"':
+                case '\'':
+                    _enc.writeString(parseString());
+                    break;
+                case '[':
+                    parseSequence(false, depth + 1);
+                    break;
+                case '{':
+                    parseSequence(true, depth + 1);
+                    break;
+                default:
+                    fail("invalid start of JSON5 value");
+            }
+        }
+
+        void parseConstant(const char *ident) {
+            auto cp = ident;
+            while (*cp && get() == *cp)
+                ++cp;
+            char c = peek();
+            if (*cp || isalnum(c) || c == '$' || c == '_')
+                fail("unknown identifier");
+        }
+
+        void parseNumber() {
+            const char *start = _pos;
+            while (_pos < _end && (isalnum(*_pos) || *_pos == '.' || *_pos == '-' || *_pos == '+'))
+                ++_pos;
+            char buf[64];
+            size_t len = _pos - start;
+            if (len >= sizeof(buf))
+                fail("Number is too long");
+            memcpy(buf, start, len);
+            buf[len] = 0;
+
+            const char *digits = buf;
+            bool negative = (*digits == '-');
+            if (negative || *digits == '+')
+                ++digits;
+            int base = 10;
+            if (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+                base = 16;
+                digits += 2;
+            }
+            // Integers (decimal or hex) are written as such, unless they overflow:
+            const char *cp = digits;
+            while (base == 16 ? isxdigit(*cp) : isdigit(*cp))
+                ++cp;
+            if (*cp == 0 && cp > digits) {
+                errno = 0;
+                uint64_t n = strtoull(digits, nullptr, base);
+                if (errno == 0) {
+                    if (!negative) {
+                        _enc.writeUInt(n);
+                        return;
+                    } else if (n <= (uint64_t)INT64_MAX + 1) {
+                        _enc.writeInt((int64_t)(0 - n));
+                        return;
+                    }
+                }
+                if (base == 16)
+                    fail("Hex number out of range");
+            } else if (base == 16) {
+                fail("Invalid hex number");
+            }
+            double d;
+            if (!ParseDouble(slice(buf, len), d))
+                fail("Invalid number");
+            _enc.writeDouble(d);
+        }
+
+        // Reads a quoted string and returns its contents, which point either into the input or,
+        // if the string has escapes, to the _string buffer.
+        slice parseString() {
+            const char quote = get();
+            const char *start = _pos;
+            while (true) {
+                if (_pos >= _end)
+                    fail("Unexpected end of JSON5");
+                char c = *_pos;
+                if (c == quote) {
+                    slice str(start, _pos++);
+                    return str;
+                } else if (c == '\\') {
+                    break;
+                }
+                ++_pos;
+            }
+            // The string has escapes, so it has to be copied:
+            _string.assign(start, _pos);
+            char c;
+            while (quote != (c = get())) {
+                if (c == '\\')
+                    parseEscape();
+                else
+                    _string.push_back(c);
+            }
+            return slice(_string);
+        }
+
+        void parseEscape() {
+            char c = get();
+            switch (c) {
+                case 'b':   _string.push_back('\b'); break;
+                case 'f':   _string.push_back('\f'); break;
+                case 'n':   _string.push_back('\n'); break;
+                case 'r':   _string.push_back('\r'); break;
+                case 't':   _string.push_back('\t'); break;
+                case 'v':   _string.push_back('\v'); break;
+                case '0':   _string.push_back('\0'); break;
+                case 'x':   writeUTF8(parseHex(2)); break;
+                case 'u': {
+                    uint32_t ch = parseHex(4);
+                    if (ch >= 0xD800 && ch < 0xDC00) {
+                        // High surrogate; it must be followed by an escaped low surrogate:
+                        if (get() != '\\' || get() != 'u')
+                            fail("Missing low surrogate");
+                        uint32_t low = parseHex(4);
+                        if (low < 0xDC00 || low >= 0xE000)
+                            fail("Invalid low surrogate");
+                        ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+                    } else if (ch >= 0xDC00 && ch < 0xE000) {
+                        fail("Unexpected low surrogate");
+                    }
+                    writeUTF8(ch);
+                    break;
+                }
+                case '\r':
+                    if (peek() == '\n')       // backslash + CRLF is a line continuation
+                        get();
+                    break;
+                case '\n':
+                    break;                  // backslash + newline is a line continuation
+                default:
+                    if (isdigit(c))
+                        fail("Invalid escape sequence");
+                    _string.push_back(c);   // includes \\, \", \', \/
+                    break;
+            }
+        }
+
+        uint32_t parseHex(int nDigits) {
+            uint32_t n = 0;
+            for (int i = 0; i < nDigits; ++i) {
+                char c = get();
+                if (!isxdigit(c))
+                    fail("Invalid hex escape");
+                n = (n << 4) | (isdigit(c) ? (c - '0') : ((c | 0x20) - 'a' + 10));
+            }
+            return n;
+        }
+
+        void writeUTF8(uint32_t ch) {
+            if (ch < 0x80) {
+                _string.push_back((char)ch);
+            } else if (ch < 0x800) {
+                _string.push_back((char)(0xC0 | (ch >> 6)));
+                _string.push_back((char)(0x80 | (ch & 0x3F)));
+            } else if (ch < 0x10000) {
+                _string.push_back((char)(0xE0 | (ch >> 12)));
+                _string.push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
+                _string.push_back((char)(0x80 | (ch & 0x3F)));
+            } else {
+                _string.push_back((char)(0xF0 | (ch >> 18)));
+                _string.push_back((char)(0x80 | ((ch >> 12) & 0x3F)));
+                _string.push_back((char)(0x80 | ((ch >> 6) & 0x3F)));
+                _string.push_back((char)(0x80 | (ch & 0x3F)));
+            }
+        }
+
+        void parseSequence(bool isObject, int depth) {
+            if (depth > JSONConverter::kMaxNestingDepth)
+                fail("Nesting is too deep");
+            get();  // open bracket/brace
+            if (isObject)
+                _enc.beginDictionary();
+            else
+                _enc.beginArray();
+            const char closeBracket = (isObject ? '}' : ']');
+            char c;
+            while (closeBracket != (c = peekToken())) {
+                if (isObject) {
+                    // Key:
+                    if (c == '"' || c == '\'') {
+                        _enc.writeKey(parseString());
+                    } else if (isalpha(c) || c == '_' || c == '$') {
+                        const char *start = _pos++;
+                        while (_pos < _end && (isalnum(*_pos) || *_pos == '_' || *_pos == '$'))
+                            ++_pos;
+                        _enc.writeKey(slice(start, _pos));
+                    } else {
+                        fail("Invalid key");
+                    }
+                    if (peekToken() != ':')
+                        fail("Expected ':' after key");
+                    get();
+                }
+
+                // Value, or array item:
+                parseValue(depth);
+
+                if (peekToken() == ',')
+                    get();
+                else if (peekToken() != closeBracket)
+                    fail("unexpected token after array/object item");
+            }
+            get(); // close bracket/brace
+            if (isObject)
+                _enc.endDictionary();
+            else
+                _enc.endArray();
+        }
+
+        // Returns the next non-whitespace, non-comment character from the input.
+        // Consumes whitespace and comments, but not the character it returns.
+        char peekToken() {
+            while (_pos < _end) {
+                char c = *_pos;
+                if (isspace(c))
+                    ++_pos;
+                else if (c == '/')
+                    skipComment();
+                else
+                    return c;
+            }
+            return 0;
+        }
+
+        void skipComment() {
+            get(); // consume initial '/'
+            switch (get()) {
+                case '/':
+                    while (_pos < _end && !isnewline(*_pos))
+                        ++_pos;
+                    break;
+                case '*': {
+                    bool star;
+                    char c = 0;
+                    do {
+                        star = (c == '*');
+                        c = get();
+                    } while (!(star && c=='/'));
+                    break;
+                }
+                default:
+                    fail("Syntax error after '/'");
+            }
+        }
+
+        // Returns the next character from the input without consuming it, or 0 at EOF.
+        char peek() {
+            return (_pos < _end) ? *_pos : 0;
+        }
+
+        // Reads the next character from the input. Fails if input is at EOF.
+        char get() {
+            if (_usuallyFalse(_pos >= _end))
+                fail("Unexpected end of JSON5");
+            return *_pos++;
+        }
+
+        [[noreturn]] void fail(const char *error) {
+            stringstream message;
+            message << error << " (at :" << (_pos - _start) << ")";
+            FleeceException::_throw(JSONError, message.str().c_str());
+        }
+
+        const char* const _start;
+        const char *_pos;
+        const char* const _end;
+        Encoder &_enc;
+        std::string _string;        // Buffer for strings containing escapes
+    };
+
+
+    void ConvertJSON5(slice json5, Encoder &enc) {
+        json5encoder(json5, enc).parse();
+    }
+
 }
@@ -7,9 +7,11 @@
 //
 
 #pragma once
+#include "slice.hh"
 #include <iostream>
 
 namespace fleece {
+    class Encoder;
 
     // Reads valid JSON5 from a stream and writes the equivalent JSON to another stream.
     // Given _invalid_ JSON5, it either throws a runtime_exception or produces invalid JSON.
@@ -18,6 +20,11 @@ namespace fleece {
     // Converts a valid JSON5 string to an equivalent JSON string.
     std::string ConvertJSON5(const std::string &in);
 
+    // Parses JSON5 and writes the value it represents directly to an Encoder, without going
+    // through JSON. Unlike the functions above, this validates the input (including numbers and
+    // escape sequences), and throws a FleeceException with code JSONError if it's invalid.
+    void ConvertJSON5(slice json5, Encoder&);
+
     // For more info visit http://json5.org
 
 }
@@ -14,8 +14,15 @@
 //  and limitations under the License.
 
 #include "JSONConverter.hh"
+#include "JSONIndexParser.hh"
+#include "FleeceException.hh"
+#include "NumConversion.hh"
+#include "Path.hh"
 #include "jsonsl.h"
+#include <algorithm>
+#include <ctype.h>
 #include <map>
+#include <thread>
 
 namespace fleece {
 
@@ -34,7 +41,7 @@ namespace fleece {
 
     JSONConverter::JSONConverter(Encoder &e) noexcept
     :_encoder(e),
-     _jsn(jsonsl_new(50)),      // never returns nullptr, according to source code
+     _jsn(jsonsl_new(kMaxNestingDepth)),    // never returns nullptr, according to source code
      _error(JSONSL_ERROR_SUCCESS),
      _errorPos(0)
     {
@@ -49,6 +56,11 @@ namespace fleece {
         jsonsl_reset(_jsn);
         _error = JSONSL_ERROR_SUCCESS;
         _errorPos = 0;
+        _input = nullslice;
+        _inputOffset = 0;
+        _pending.clear();
+        _feeding = false;
+        _exception = nullptr;
     }
 
     const char* JSONConverter::errorMessage() noexcept {
@@ -61,25 +73,412 @@ namespace fleece {
 
     bool JSONConverter::encodeJSON(slice json) {
         _input = json;
+        _inputOffset = 0;
         _error = JSONSL_ERROR_SUCCESS;
         _errorPos = 0;
 
+        if (_engine == kIndexEngine && json.size <= JSONIndexParser::kMaxInputSize
+                                    && !_projection) {
+            if (!_indexParser)
+                _indexParser.reset(new JSONIndexParser(_encoder, kMaxNestingDepth));
+            if (!_indexParser->parse(json)) {
+                _error = _indexParser->error();
+                _errorPos = _indexParser->errorPos();
+            }
+            return (_error == JSONSL_ERROR_SUCCESS);
+        }
+
+        startJsonsl();
+        jsonsl_feed(_jsn, (char*)json.buf, json.size);
+        if (_exception) {
+            jsonsl_reset(_jsn);
+            rethrowException();
+        }
+        if (_jsn->level > 0 && !_error) {
+            // Input is valid JSON so far, but truncated:
+            _error = kErrTruncatedJSON;
+            _errorPos = json.size;
+        }
+        jsonsl_reset(_jsn);
+        return (_error == JSONSL_ERROR_SUCCESS);
+    }
+
+    void JSONConverter::startJsonsl() {
         _jsn->data = this;
         _jsn->action_callback_PUSH = writePushCallback;
         _jsn->action_callback_POP  = writePopCallback;
         _jsn->error_callback = errorCallback;
         jsonsl_enable_all_callbacks(_jsn);
+    }
 
-        jsonsl_feed(_jsn, (char*)json.buf, json.size);
+
+#pragma mark - PROJECTION:
+
+
+    // A tree of the paths given to setProjection. Each node stands for the values one path
+    // (or several with the same prefix) reaches, and says which of their children to keep.
+    struct JSONConverter::ProjectionNode {
+        bool all {false};                               // Keep the whole value
+        std::map<slice, ProjectionNode> properties;     // Dict values to look inside
+        std::map<uint32_t, ProjectionNode> items;       // Array items to look inside
+        std::unique_ptr<ProjectionNode> wildcard;       // Look inside every value/item
+
+        ProjectionNode() { }
+
+        ProjectionNode(const ProjectionNode &n)
+        :all(n.all),
+         properties(n.properties),
+         items(n.items),
+         wildcard(n.wildcard ? new ProjectionNode(*n.wildcard) : nullptr)
+        { }
+
+        // Adds the path made of the elements [e, end) below this node.
+        void add(const Path::Element *e, const Path::Element *end) {
+            if (all)
+                return;
+            if (e == end) {
+                all = true;
+                properties.clear();
+                items.clear();
+                wildcard.reset();
+                return;
+            }
+            switch (e->kind()) {
+                case Path::Element::kProperty:
+                    child(properties, e->key().string()).add(e + 1, end);
+                    break;
+                case Path::Element::kIndex:
+                    throwIf(e->index() < 0, PathSyntaxError,
+                            "projection paths can't have negative array indexes");
+                    child(items, (uint32_t)e->index()).add(e + 1, end);
+                    break;
+                case Path::Element::kWildcard:
+                    // What's under a wildcard is also under every specific child:
+                    if (!wildcard)
+                        wildcard.reset(new ProjectionNode);
+                    wildcard->add(e + 1, end);
+                    for (auto &p : properties)
+                        p.second.add(e + 1, end);
+                    for (auto &i : items)
+                        i.second.add(e + 1, end);
+                    break;
+                default:
+                    FleeceException::_throw(PathSyntaxError, "projection paths can't have filters");
+            }
+        }
+
+        // A new specific child starts with whatever's under the wildcard.
+        template <class MAP, class KEY>
+        ProjectionNode& child(MAP &map, KEY key) {
+            auto i = map.find(key);
+            if (i == map.end())
+                i = map.emplace(key, wildcard ? ProjectionNode(*wildcard) : ProjectionNode()).first;
+            return i->second;
+        }
+
+        // Does any of the value (of type jsonsl_type_t) need to be kept?
+        bool matches(unsigned type) const noexcept {
+            if (all)
+                return true;
+            else if (type == JSONSL_T_OBJECT)
+                return wildcard || !properties.empty();
+            else if (type == JSONSL_T_LIST)
+                return wildcard || !items.empty();
+            else
+                return false;       // The paths lead inside it, but it's a scalar
+        }
+
+        const ProjectionNode* property(slice key) const noexcept {
+            if (all)
+                return this;
+            auto i = properties.find(key);
+            return (i != properties.end()) ? &i->second : wildcard.get();
+        }
+
+        const ProjectionNode* item(uint32_t index) const noexcept {
+            if (all)
+                return this;
+            auto i = items.find(index);
+            return (i != items.end()) ? &i->second : wildcard.get();
+        }
+    };
+
+
+    void JSONConverter::setProjection(const std::vector<std::string> &specifiers) {
+        if (specifiers.empty()) {
+            _projection.reset();
+            _projectionKeys.clear();
+            _projectionLevels.clear();
+            return;
+        }
+        std::unique_ptr<ProjectionNode> root(new ProjectionNode);
+        std::vector<alloc_slice> keys;
+        for (auto &specifier : specifiers) {
+            Path path(specifier);
+            // Copy the path's keys, since they point into the Path:
+            std::vector<Path::Element> elements;
+            for (auto &e : path.path()) {
+                if (e.kind() == Path::Element::kProperty) {
+                    keys.emplace_back(e.key().string());
+                    elements.emplace_back(keys.back(), nullptr);
+                } else {
+                    elements.push_back(e);
+                }
+            }
+            root->add(elements.data(), elements.data() + elements.size());
+        }
+        _projection = std::move(root);
+        _projectionKeys = std::move(keys);
+        _projectionLevels.resize(kMaxNestingDepth + 2);
+    }
+
+
+    // Called when a value starts, while projecting. Decides whether to keep it, and if it's a
+    // container, which paths to follow inside it. If the value isn't kept, it tells jsonsl to
+    // skip the callbacks for it and everything in it, and returns false.
+    bool JSONConverter::projectPush(struct jsonsl_state_st *state) {
+        if (state->type == JSONSL_T_HKEY)
+            return true;                        // Keys are checked when they end (projectKey)
+        auto level = state->level;
+        const ProjectionNode *node;
+        ProjectionLevel *parent = nullptr;
+        if (level <= 1) {
+            node = _projection.get();
+        } else {
+            parent = &_projectionLevels[level - 1];
+            if (parent->node->all) {
+                node = parent->node;
+            } else if (_jsn->stack[level - 1].type == JSONSL_T_LIST) {
+                node = parent->node->item(parent->nextIndex++);
+            } else {
+                node = parent->valueNode;
+                parent->valueNode = nullptr;
+            }
+        }
+
+        if (!node || !node->matches(state->type)) {
+            state->ignore_callback = 1;
+            if (level <= 1)
+                _encoder.writeNull();           // There has to be a root value
+            return false;
+        }
+        if (parent && !parent->node->all && _jsn->stack[level - 1].type == JSONSL_T_OBJECT)
+            _encoder.writeKey(slice(parent->key));
+        if (state->type == JSONSL_T_LIST || state->type == JSONSL_T_OBJECT)
+            _projectionLevels[level] = {node, nullptr, std::string(), 0};
+        return true;
+    }
+
+    // Called with a complete dict key, while projecting. Returns true if the key should be
+    // written now. Otherwise, if its value may be kept, the key is saved for projectPush to
+    // write once it knows whether the value is.
+    bool JSONConverter::projectKey(struct jsonsl_state_st *state, slice key) {
+        auto &dict = _projectionLevels[state->level - 1];
+        if (dict.node->all)
+            return true;
+        dict.valueNode = dict.node->property(key);
+        if (dict.valueNode)
+            dict.key.assign((const char*)key.buf, key.size);
+        return false;
+    }
+
+
+#pragma mark - INCREMENTAL CONVERSION:
+
+
+    bool JSONConverter::feed(slice piece) {
+        if (!_feeding) {
+            _error = JSONSL_ERROR_SUCCESS;
+            _errorPos = 0;
+            _inputOffset = 0;
+            _pending.clear();
+            startJsonsl();
+            _feeding = true;
+        }
+        if (_error)
+            return false;
+
+        // The callbacks read tokens from _input, so an unfinished token from the last piece
+        // has to be contiguous with this one. Otherwise the piece is parsed in place.
+        const char *start;
+        if (_pending.empty()) {
+            _input = piece;
+            _inputOffset = _jsn->pos;
+            start = (const char*)piece.buf;
+        } else {
+            _pending.append((const char*)piece.buf, piece.size);
+            _input = slice(_pending);
+            start = &_pending[_pending.size() - piece.size];
+        }
+        jsonsl_feed(_jsn, (char*)start, piece.size);
+        if (_exception)
+            rethrowException();
+        if (_error)
+            return false;
+
+        // Save the token being parsed, if any, since the caller's buffer won't stay valid.
+        // (Strings and numbers never contain other values, so it can only be the innermost.)
+        auto state = &_jsn->stack[_jsn->level];
+        if (_jsn->level > 0 && (state->type == JSONSL_T_STRING || state->type == JSONSL_T_HKEY
+                                || state->type == JSONSL_T_SPECIAL)) {
+            size_t keep = state->pos_begin - _inputOffset;
+            if (_input.buf == _pending.data())
+                _pending.erase(0, keep);
+            else
+                _pending.assign((const char*)_input.buf + keep, _input.size - keep);
+            _inputOffset = state->pos_begin;
+        } else {
+            _pending.clear();
+        }
+        _input = nullslice;
+        return true;
+    }
+
+    bool JSONConverter::finish() {
         if (_jsn->level > 0 && !_error) {
             // Input is valid JSON so far, but truncated:
             _error = kErrTruncatedJSON;
-            _errorPos = json.size;
+            _errorPos = _jsn->pos;
         }
         jsonsl_reset(_jsn);
+        _input = nullslice;
+        _inputOffset = 0;
+        _pending.clear();
+        _feeding = false;
         return (_error == JSONSL_ERROR_SUCCESS);
     }
 
+
+
+#pragma mark - PARALLEL CONVERSION:
+
+
+    // Quickly scans a JSON top-level array without parsing it, and splits its contents into
+    // about `nPieces` runs of whole elements, each of which is the contents of a JSON array.
+    // Returns false if the JSON isn't an array or isn't well-formed enough to split.
+    /*static*/ bool JSONConverter::splitArray(slice json, size_t nPieces,
+                                              std::vector<slice> &pieces)
+    {
+        auto begin = (const char*)json.buf, end = (const char*)json.end();
+        auto c = begin;
+        while (c < end && isspace(*c))
+            ++c;
+        if (c == end || *c != '[')
+            return false;
+        auto pieceStart = ++c;
+        size_t pieceSize = std::max(json.size / nPieces, (size_t)1);
+        auto nextSplit = pieceStart + pieceSize;
+        int depth = 1;
+        for (; c < end; ++c) {
+            switch (*c) {
+                case '"':
+                    // Skip the string, so brackets and commas in it aren't counted:
+                    for (++c; c < end && *c != '"'; ++c) {
+                        if (*c == '\\')
+                            ++c;
+                    }
+                    if (c >= end)
+                        return false;
+                    break;
+                case '[':
+                case '{':
+                    ++depth;
+                    break;
+                case ']':
+                case '}':
+                    if (--depth == 0) {
+                        pieces.push_back(slice(pieceStart, c));
+                        for (++c; c < end && isspace(*c); ++c)
+                            ;
+                        return c == end;
+                    }
+                    break;
+                case ',':
+                    if (depth == 1 && c >= nextSplit) {
+                        pieces.push_back(slice(pieceStart, c));
+                        pieceStart = c + 1;
+                        nextSplit = c + pieceSize;
+                    }
+                    break;
+            }
+        }
+        return false;
+    }
+
+
+    bool JSONConverter::encodeJSONInParallel(slice json, unsigned nThreads) {
+        if (nThreads == 0)
+            nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        size_t nPieces = std::min((size_t)nThreads, json.size / kMinParallelChunkSize);
+        std::vector<slice> pieces;
+        if (nPieces < 2 || _encoder.sharedStrings() != nullptr || _projection
+                        || !splitArray(json, nPieces, pieces) || pieces.size() < 2)
+            return encodeJSON(json);
+
+        // Each piece gets converted by its own JSONConverter and Encoder:
+        struct result {
+            alloc_slice output;
+            int error {JSONSL_ERROR_SUCCESS};
+            size_t errorPos {0};
+            std::exception_ptr exception;
+        };
+        std::vector<result> results(pieces.size());
+        auto convert = [&](size_t i) {
+            try {
+                std::string piece;
+                piece.reserve(pieces[i].size + 2);
+                piece += '[';
+                piece.append((const char*)pieces[i].buf, pieces[i].size);
+                piece += ']';
+                Encoder enc(piece.size());
+                enc.copyOptionsFrom(_encoder);
+                JSONConverter cvt(enc);
+                cvt.setEngine(_engine);
+                if (cvt.encodeJSON(slice(piece))) {
+                    results[i].output = enc.extractOutput();
+                } else {
+                    results[i].error = cvt.error();
+                    // Convert error position to the original input, skipping the added '[':
+                    size_t pos = std::min(std::max(cvt.errorPos(), (size_t)1) - 1,
+                                          pieces[i].size);
+                    results[i].errorPos = ((const char*)pieces[i].buf - (const char*)json.buf)
+                                           + pos;
+                }
+            } catch (...) {
+                results[i].exception = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(pieces.size() - 1);
+        for (size_t i = 1; i < pieces.size(); ++i)
+            threads.emplace_back(convert, i);
+        convert(0);                                 // The calling thread does its share too
+        for (auto &t : threads)
+            t.join();
+
+        _input = json;
+        _error = JSONSL_ERROR_SUCCESS;
+        _errorPos = 0;
+        for (auto &r : results) {
+            if (r.exception)
+                std::rethrow_exception(r.exception);
+            if (r.error) {
+                _error = r.error;
+                _errorPos = r.errorPos;
+                return false;
+            }
+        }
+
+        // Stitch the pieces together into one array:
+        _encoder.beginArray();
+        for (auto &r : results)
+            _encoder.writeEncodedArrayItems(r.output);
+        _encoder.endArray();
+        return true;
+    }
+
+
     /*static*/ alloc_slice JSONConverter::convertJSON(slice json, SharedKeys *sk) {
         Encoder enc;
         enc.setSharedKeys(sk);
@@ -89,6 +488,8 @@ namespace fleece {
     }
 
     inline void JSONConverter::push(struct jsonsl_state_st *state) {
+        if (_projection && !projectPush(state))
+            return;
         switch (state->type) {
             case JSONSL_T_LIST:
                 _encoder.beginArray();
@@ -103,15 +504,8 @@ namespace fleece {
         switch (state->type) {
             case JSONSL_T_SPECIAL: {
                 unsigned f = state->special_flags;
-                if (f & JSONSL_SPECIALf_FLOAT) {
-                    char *start = (char*)&_input[state->pos_begin];
-                    char *end;
-                    double n = ::strtod(start, &end);
-                    _encoder.writeDouble(n);
-                } else if (f & JSONSL_SPECIALf_UNSIGNED) {
-                    _encoder.writeUInt(state->nelem);
-                } else if (f & JSONSL_SPECIALf_SIGNED) {
-                    _encoder.writeInt(-(int64_t)state->nelem);
+                if (f & (JSONSL_SPECIALf_FLOAT | JSONSL_SPECIALf_UNSIGNED | JSONSL_SPECIALf_SIGNED)) {
+                    writeNumber(state->pos_begin);
                 } else if (f & JSONSL_SPECIALf_TRUE) {
                     _encoder.writeBool(true);
                 } else if (f & JSONSL_SPECIALf_FALSE) {
@@ -123,7 +517,7 @@ namespace fleece {
             }
             case JSONSL_T_STRING:
             case JSONSL_T_HKEY: {
-                slice str(&_input[state->pos_begin + 1],
+                slice str(&_input[state->pos_begin + 1 - _inputOffset],
                           state->pos_cur - state->pos_begin - 1);
                 char *buf = nullptr;
                 bool mallocedBuf = false;
@@ -145,7 +539,7 @@ namespace fleece {
                 }
                 if (state->type == JSONSL_T_STRING)
                     _encoder.writeString(str);
-                else
+                else if (!_projection || projectKey(state, str))
                     _encoder.writeKey(str);
                 if (mallocedBuf)
                     free(buf);
@@ -155,11 +549,49 @@ namespace fleece {
                 _encoder.endArray();
                 break;
             case JSONSL_T_OBJECT:
+                // (jsonsl counts keys and values, and doesn't notice a key with no value.)
+                if (_usuallyFalse(state->nelem & 1)) {
+                    gotError(JSONSL_ERROR_VALUE_EXPECTED, state->pos_cur);
+                    return;
+                }
                 _encoder.endDictionary();
                 break;
         }
     }
 
+    // Parses the number starting at `pos` in the input and writes it to the encoder. Integers
+    // are written as such unless they overflow 64 bits.
+    void JSONConverter::writeNumber(size_t pos) {
+        auto start = (const char*)&_input[pos - _inputOffset], end = (const char*)_input.end();
+        auto c = start;
+        bool isInteger = true;
+        for (; c < end; ++c) {
+            if (*c == '.' || *c == 'e' || *c == 'E')
+                isInteger = false;
+            else if (!isdigit(*c) && *c != '-' && *c != '+')
+                break;
+        }
+        slice number(start, c);
+        if (isInteger) {
+            if (*start == '-') {
+                int64_t i;
+                if (ParseInteger(number, i))
+                    return _encoder.writeInt(i);
+            } else {
+                uint64_t u;
+                if (ParseUInteger(number, u))
+                    return _encoder.writeUInt(u);
+            }
+        }
+        double d;
+        if (!ParseDouble(number, d)) {
+            gotError(JSONSL_ERROR_INVALID_NUMBER, pos);
+            return;
+        }
+        _encoder.writeDouble(d);
+    }
+
+
     int JSONConverter::gotError(int err, size_t pos) noexcept {
         _error = err;
         _errorPos = pos;
@@ -168,7 +600,20 @@ namespace fleece {
     }
 
     int JSONConverter::gotError(int err, const char *errat) noexcept {
-        return gotError(err, errat - (char*)_input.buf);
+        return gotError(err, errat - (char*)_input.buf + _inputOffset);
+    }
+
+    // jsonsl is C and can't unwind, so a callback that catches an exception stops the parser
+    // and saves the exception, for encodeJSON or feed to rethrow once jsonsl_feed returns.
+    void JSONConverter::gotException(size_t pos) noexcept {
+        _exception = std::current_exception();
+        gotError(JSONSL_ERROR_GENERIC, pos);
+    }
+
+    void JSONConverter::rethrowException() {
+        std::exception_ptr x = _exception;
+        _exception = nullptr;
+        std::rethrow_exception(x);
     }
 
 
@@ -186,7 +631,7 @@ namespace fleece {
         try {
             converter(jsn)->push(state);
         } catch (...) {
-            converter(jsn)->gotError(JSONSL_ERROR_GENERIC, state->pos_begin);
+            converter(jsn)->gotException(state->pos_begin);
         }
     }
 
@@ -198,7 +643,7 @@ namespace fleece {
         try {
             converter(jsn)->pop(state);
         } catch (...) {
-            converter(jsn)->gotError(JSONSL_ERROR_GENERIC, state->pos_begin);
+            converter(jsn)->gotException(state->pos_begin);
         }
     }
 
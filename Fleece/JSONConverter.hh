@@ -10,8 +10,11 @@
 
 #include "Encoder.hh"
 #include "slice.hh"
-#include <vector>
+#include <exception>
 #include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 extern "C" {
     struct jsonsl_state_st;
@@ -19,6 +22,7 @@ extern "C" {
 }
 
 namespace fleece {
+    class JSONIndexParser;
 
     /** Parses JSON data and writes the values in it to a Fleece encoder. */
     class JSONConverter {
@@ -26,10 +30,67 @@ namespace fleece {
         JSONConverter(Encoder&) noexcept;
         ~JSONConverter();
 
-        /** Parses JSON data and writes the values to the encoder.
+        /** The available JSON parsers. */
+        enum Engine {
+            kJsonslEngine,      ///< The jsonsl state machine (the default)
+            kIndexEngine,       ///< Two-pass parser that indexes structure with SIMD first
+        };
+
+        /** Selects the parser to use. Both produce the same output from valid JSON, but the
+            index engine is usually faster, especially on large inputs. They don't quite agree
+            on invalid JSON: jsonsl accepts stray, missing and trailing commas, missing colons,
+            leading zeros and numbers ending in "." (which the index engine rejects), and the
+            two occasionally report a different error code or position. Only the index engine
+            can parse a bare top-level number. */
+        void setEngine(Engine e) noexcept       {_engine = e;}
+        Engine engine() const noexcept          {return _engine;}
+
+        /** Makes the converter write only the parts of the JSON that these paths select,
+            instead of the whole document. The specifiers use Path syntax, limited to
+            properties, non-negative array indexes and wildcards (".*" or "[*]"); "" selects
+            the whole document. For example {"name", "address.city", "friends[*].id"} writes a
+            dict with at most those three properties, and "friends" as an array of dicts that
+            have only "id"s. Arrays keep just their selected items, so later items move down.
+            Containers the paths lead into are written even if nothing in them is selected.
+            Values that aren't selected are skipped by jsonsl without calling back to the
+            converter at all, so the time to convert (and the size of the output) is mostly
+            in proportion to what's kept. Projection always uses the jsonsl engine, and
+            encodeJSONInParallel doesn't split the input while it's on. It stays in effect
+            across documents and reset(); pass an empty list to turn it off.
+            Throws a FleeceException if a specifier is invalid or uses a filter or a negative
+            index. */
+        void setProjection(const std::vector<std::string> &specifiers);
+
+        /** Parses JSON data and writes the values to the encoder. An exception thrown by the
+            encoder is passed on to the caller, whichever engine is used.
             @return  True if parsing succeeded, false if the JSON is invalid. */
         bool encodeJSON(slice json);
 
+        /** Like encodeJSON, but if the JSON is a large top-level array, it's split up at element
+            boundaries and the pieces are converted on multiple threads, then combined.
+            Falls back to encodeJSON if the input isn't an array, is too small to be worth
+            splitting, or if the encoder uses SharedKeys (which aren't thread-safe.)
+            The pieces are encoded with the encoder's options (sorting, indexes, packing...)
+            Strings aren't uniqued across pieces, so the output may be slightly larger.
+            @param json  The JSON data.
+            @param nThreads  Maximum number of threads to use; 0 means one per CPU core.
+            @return  True if parsing succeeded, false if the JSON is invalid. */
+        bool encodeJSONInParallel(slice json, unsigned nThreads =0);
+
+        /** Parses the next piece of a JSON document that's arriving incrementally, such as from
+            a network connection, writing values to the encoder as soon as they're complete.
+            The document can be split anywhere, even in the middle of a string or number; only
+            the token left unfinished at the end of a piece is copied, to be completed by the
+            next one. This always uses the jsonsl engine. Call finish() after the last piece.
+            @return  True if the JSON is valid so far, false if not (see error().)
+                     After an error, further calls do nothing until finish(). */
+        bool feed(slice piece);
+
+        /** Ends a document given to feed(), checks that it was complete, and gets ready for
+            another one.
+            @return  True if the whole document was valid, else false (see error().) */
+        bool finish();
+
         /** See jsonsl_error_t for error codes, plus a few more defined below. */
         int error() noexcept                    {return _error;}
         const char* errorMessage() noexcept;
@@ -42,26 +103,60 @@ namespace fleece {
             kErrTruncatedJSON = 1000
         };
 
-        /** Resets the converter, as though you'd deleted it and constructed a new one. */
+        /** Resets the converter, as though you'd deleted it and constructed a new one, except
+            that the engine and projection are kept. */
         void reset();
 
         /** Convenience method to convert JSON to Fleece data. Throws FleeceException on error. */
         static alloc_slice convertJSON(slice json, SharedKeys *sk =nullptr);
 
+        /** The smallest piece of JSON that encodeJSONInParallel will give to a thread. */
+        static const size_t kMinParallelChunkSize = 16*1024;
+
+        /** The deepest nesting of arrays/dicts the parser accepts. */
+        static const int kMaxNestingDepth = 256;
+
     //private:
         void push(struct jsonsl_state_st *state);
         void pop(struct jsonsl_state_st *state);
         int gotError(int err, size_t pos) noexcept;
         int gotError(int err, const char *errat) noexcept;
+        void gotException(size_t pos) noexcept;
 
     private:
         typedef std::map<size_t, uint64_t> startToLengthMap;
+        struct ProjectionNode;
+
+        // State of an open container while projecting
+        struct ProjectionLevel {
+            const ProjectionNode *node;         // The paths inside the container
+            const ProjectionNode *valueNode;    // In a dict, the paths inside the next value
+            std::string key;                    // In a dict, the next value's key
+            uint32_t nextIndex;                 // In an array, index of the next item
+        };
+
+        void startJsonsl();
+        void rethrowException();
+        bool projectPush(struct jsonsl_state_st *state);
+        bool projectKey(struct jsonsl_state_st *state, slice key);
+
+        static bool splitArray(slice json, size_t nPieces, std::vector<slice> &pieces);
+        void writeNumber(size_t pos);
 
         Encoder &_encoder;                  // encoder to write to
         struct jsonsl_st * _jsn;            // JSON parser
         int _error;                         // Parse error from jsonsl
         size_t _errorPos;                   // Byte index where parse error occurred
+        std::exception_ptr _exception;      // Exception thrown during a jsonsl callback
         slice _input;                       // Current JSON being parsed
+        size_t _inputOffset {0};            // Position of _input in the document, if fed
+        std::string _pending;               // Unfinished token from the last fed piece
+        bool _feeding {false};              // True between the first feed() and finish()
+        Engine _engine {kJsonslEngine};     // Which parser to use
+        std::unique_ptr<JSONIndexParser> _indexParser;  // Parser for kIndexEngine, if used
+        std::unique_ptr<ProjectionNode> _projection;    // Tree of paths to keep, if projecting
+        std::vector<alloc_slice> _projectionKeys;       // Owns the keys in _projection
+        std::vector<ProjectionLevel> _projectionLevels; // Projection state of each open level
     };
 
 }
@@ -0,0 +1,497 @@
+//
+//  JSONIndexParser.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "JSONIndexParser.hh"
+#include "JSONConverter.hh"
+#include "Encoder.hh"
+#include "NumConversion.hh"
+#include "PlatformCompat.hh"
+#include "jsonsl.h"
+#include <algorithm>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FL_JSONINDEX_SSE2
+    #include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+
+namespace fleece {
+
+    namespace {
+        // Thrown by fail() to unwind out of walkIndex; the details are in _error and _errorPos.
+        struct parseFailure { };
+
+        // Bit masks describing the bytes of a 64-byte block; bit i describes byte i.
+        struct blockMasks {
+            uint64_t quote, backslash, op, space;
+        };
+
+        enum : uint8_t {
+            kQuote = 1, kBackslash = 2, kOp = 4, kSpace = 8
+        };
+
+        inline uint8_t charClass(uint8_t c) {
+            switch (c) {
+                case '"':                                       return kQuote;
+                case '\\':                                      return kBackslash;
+                case '[': case ']': case '{': case '}':
+                case ':': case ',':                             return kOp;
+                case ' ': case '\t': case '\n': case '\r':      return kSpace;
+                default:                                        return 0;
+            }
+        }
+
+        inline bool isSpace(char c) {
+            return charClass((uint8_t)c) == kSpace;
+        }
+
+        inline unsigned countTrailingZeros(uint64_t n) {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward64(&index, n);
+            return index;
+#else
+            return __builtin_ctzll(n);
+#endif
+        }
+
+#ifdef FL_JSONINDEX_SSE2
+        inline uint64_t eqMask(__m128i bytes, char c) {
+            return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+        }
+
+        inline void classify(const uint8_t *block, blockMasks &m) {
+            m = {0, 0, 0, 0};
+            const __m128i kLowercase = _mm_set1_epi8(0x20);
+            for (unsigned i = 0; i < 64; i += 16) {
+                __m128i bytes = _mm_loadu_si128((const __m128i*)&block[i]);
+                // '[' and ']' differ from '{' and '}' only in the 0x20 bit:
+                __m128i folded = _mm_or_si128(bytes, kLowercase);
+                m.quote     |= eqMask(bytes, '"') << i;
+                m.backslash |= eqMask(bytes, '\\') << i;
+                m.op        |= (eqMask(folded, '{') | eqMask(folded, '}')
+                                | eqMask(bytes, ':') | eqMask(bytes, ',')) << i;
+                m.space     |= (eqMask(bytes, ' ') | eqMask(bytes, '\t')
+                                | eqMask(bytes, '\n') | eqMask(bytes, '\r')) << i;
+            }
+        }
+#else
+        inline void classify(const uint8_t *block, blockMasks &m) {
+            m = {0, 0, 0, 0};
+            for (unsigned i = 0; i < 64; ++i) {
+                uint8_t c = charClass(block[i]);
+                if (c) {
+                    uint64_t bit = 1ull << i;
+                    if (c == kQuote)            m.quote |= bit;
+                    else if (c == kBackslash)   m.backslash |= bit;
+                    else if (c == kOp)          m.op |= bit;
+                    else                        m.space |= bit;
+                }
+            }
+        }
+#endif
+
+        // Returns a mask of the bytes that are escaped by a preceding backslash. A run of
+        // backslashes escapes the byte after it only if the run's length is odd. `prevEscaped`
+        // carries the state across blocks.
+        inline uint64_t findEscaped(uint64_t backslash, uint64_t &prevEscaped) {
+            static const uint64_t kEvenBits = 0x5555555555555555ull;
+            backslash &= ~prevEscaped;
+            uint64_t followsEscape = (backslash << 1) | prevEscaped;
+            uint64_t oddSequenceStarts = backslash & ~kEvenBits & ~followsEscape;
+            uint64_t sequencesStartingOnEvenBits = oddSequenceStarts + backslash;
+            prevEscaped = (sequencesStartingOnEvenBits < oddSequenceStarts);   // carry out
+            uint64_t invertMask = sequencesStartingOnEvenBits << 1;
+            return (kEvenBits ^ invertMask) & followsEscape;
+        }
+
+        // Each bit of the result is the XOR of that bit and all lower bits of the input. Given
+        // a mask of quotes, this is the mask of bytes inside strings (including opening quotes.)
+        inline uint64_t prefixXOR(uint64_t n) {
+            n ^= n << 1;
+            n ^= n << 2;
+            n ^= n << 4;
+            n ^= n << 8;
+            n ^= n << 16;
+            n ^= n << 32;
+            return n;
+        }
+    }
+
+
+    bool JSONIndexParser::parse(slice json) {
+        _input = json;
+        _error = JSONSL_ERROR_SUCCESS;
+        _errorPos = 0;
+        _stack.clear();
+        try {
+            buildIndex();
+            walkIndex();
+        } catch (const parseFailure&) {
+            // (Exceptions from the Encoder propagate, as they do with the jsonsl engine.)
+        }
+        return _error == JSONSL_ERROR_SUCCESS;
+    }
+
+
+    // Pass 1: Finds the structural characters and stores their offsets in _index.
+    void JSONIndexParser::buildIndex() {
+        auto start = (const uint8_t*)_input.buf;
+        size_t size = _input.size;
+        _indexCount = 0;
+        if (_index.size() < 64)
+            _index.resize(std::max(size / 4, (size_t)64));
+
+        uint64_t prevEscaped = 0, prevInString = 0, prevScalar = 0;
+        uint8_t lastBlock[64];
+        for (size_t offset = 0; offset < size; offset += 64) {
+            const uint8_t *block = start + offset;
+            if (size - offset < 64) {
+                // Pad the final partial block with spaces:
+                memset(lastBlock, ' ', sizeof(lastBlock));
+                memcpy(lastBlock, block, size - offset);
+                block = lastBlock;
+            }
+            blockMasks m;
+            classify(block, m);
+
+            uint64_t quote = m.quote & ~findEscaped(m.backslash, prevEscaped);
+            uint64_t inString = prefixXOR(quote) ^ prevInString;
+            prevInString = (uint64_t)((int64_t)inString >> 63);
+            // Bytes inside strings, excluding opening quotes but including closing ones:
+            uint64_t stringTail = inString ^ quote;
+
+            // A value starts at any byte that isn't an operator or whitespace, unless it
+            // follows another such byte (other than a quote):
+            uint64_t scalar = ~(m.op | m.space);
+            uint64_t nonQuoteScalar = scalar & ~quote;
+            uint64_t followsScalar = (nonQuoteScalar << 1) | prevScalar;
+            prevScalar = nonQuoteScalar >> 63;
+            uint64_t structural = (m.op | (scalar & ~followsScalar)) & ~stringTail;
+
+            if (_index.size() < _indexCount + 64)
+                _index.resize(2 * _index.size() + 64);
+            uint32_t *out = &_index[_indexCount];
+            while (structural) {
+                *out++ = (uint32_t)(offset + countTrailingZeros(structural));
+                structural &= structural - 1;
+            }
+            _indexCount = out - &_index[0];
+        }
+    }
+
+
+    // Pass 2: Walks the index, parsing values and writing them to the encoder.
+    void JSONIndexParser::walkIndex() {
+        auto json = (const char*)_input.buf;
+        size_t i = 0, n = _indexCount;
+        if (n == 0)
+            return;                             // Empty input (or only whitespace)
+
+    value:
+        {
+            if (i >= n)
+                failTruncated();
+            const char *token = json + _index[i];
+            switch (*token) {
+                case '[':
+                case '{': {
+                    bool isDict = (*token == '{');
+                    if (_stack.size() >= _maxDepth)
+                        fail(JSONSL_ERROR_LEVELS_EXCEEDED, token);
+                    _stack.push_back(isDict);
+                    if (isDict)
+                        _encoder.beginDictionary();
+                    else
+                        _encoder.beginArray();
+                    if (++i < n && json[_index[i]] == (isDict ? '}' : ']'))
+                        goto close;
+                    if (isDict)
+                        goto key;
+                    goto value;
+                }
+                case '"': {
+                    slice str;
+                    checkTokenEnd(token, parseString(token, str), i + 1);
+                    _encoder.writeString(str);
+                    break;
+                }
+                case '-':
+                case '0': case '1': case '2': case '3': case '4':
+                case '5': case '6': case '7': case '8': case '9':
+                    checkTokenEnd(token, parseNumber(token), i + 1);
+                    break;
+                case 't':
+                case 'f':
+                case 'n':
+                    checkTokenEnd(token, parseLiteral(token), i + 1);
+                    break;
+                case ']':
+                case '}':
+                    if (_stack.empty())
+                        fail(JSONSL_ERROR_BRACKET_MISMATCH, token);
+                    if (i > 0 && json[_index[i-1]] == ',')
+                        fail(JSONSL_ERROR_TRAILING_COMMA, json + _index[i-1]);
+                    // falls through
+                case ',':
+                case ':':
+                    fail(JSONSL_ERROR_VALUE_EXPECTED, token);
+                default:
+                    fail(JSONSL_ERROR_STRAY_TOKEN, token);
+            }
+            ++i;
+            goto afterValue;
+        }
+
+    key:
+        {
+            if (i >= n)
+                failTruncated();
+            const char *token = json + _index[i];
+            if (*token != '"') {
+                if (*token == '}' && json[_index[i-1]] == ',')
+                    fail(JSONSL_ERROR_TRAILING_COMMA, json + _index[i-1]);
+                fail(JSONSL_ERROR_HKEY_EXPECTED, token);
+            }
+            slice str;
+            checkTokenEnd(token, parseString(token, str), i + 1);
+            _encoder.writeKey(str);
+            if (++i >= n)
+                failTruncated();
+            if (json[_index[i]] != ':')
+                fail(JSONSL_ERROR_MISSING_TOKEN, json + _index[i]);
+            ++i;
+            goto value;
+        }
+
+    afterValue:
+        {
+            if (_stack.empty()) {
+                if (i < n) {
+                    const char *token = json + _index[i];
+                    fail((*token == ']' || *token == '}') ? JSONSL_ERROR_BRACKET_MISMATCH
+                                                          : JSONSL_ERROR_GARBAGE_TRAILING,
+                         token);
+                }
+                return;                         // Done!
+            }
+            if (i >= n)
+                failTruncated();
+            const char *token = json + _index[i];
+            switch (*token) {
+                case ',':
+                    ++i;
+                    if (_stack.back())
+                        goto key;
+                    goto value;
+                case ']':
+                case '}':
+                    goto close;
+                default:
+                    // A missing comma if the token could start a value, else junk (which jsonsl
+                    // takes for a missing key if it's in a dict):
+                    if (*token && strchr("\"-0123456789tfn[{:", *token))
+                        fail(JSONSL_ERROR_MISSING_TOKEN, token);
+                    fail(_stack.back() ? JSONSL_ERROR_HKEY_EXPECTED : JSONSL_ERROR_STRAY_TOKEN,
+                         token);
+            }
+        }
+
+    close:
+        {
+            const char *token = json + _index[i];
+            if ((*token == '}') != _stack.back())
+                fail(JSONSL_ERROR_BRACKET_MISMATCH, token);
+            if (_stack.back())
+                _encoder.endDictionary();
+            else
+                _encoder.endArray();
+            _stack.pop_back();
+            ++i;
+            goto afterValue;
+        }
+    }
+
+
+    // Parses a string starting at the quote. Sets `str` to its contents (unescaped if necessary)
+    // and returns a pointer to just past the closing quote.
+    const char* JSONIndexParser::parseString(const char *start, slice &str) {
+        const char *end = (const char*)_input.end();
+        const char *c = start + 1;
+        bool escaped = false;
+        while (true) {
+            while (c < end && *c != '"' && *c != '\\')
+                ++c;
+            if (_usuallyFalse(c >= end))
+                failTruncated();
+            if (*c == '"')
+                break;
+            escaped = true;
+            c += 2;
+        }
+        str = slice(start + 1, c);
+        if (escaped) {
+            if (_unescaped.size() < str.size)
+                _unescaped.resize(str.size);
+            jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+            const char *errat = nullptr;
+            size_t size = jsonsl_util_unescape_ex((const char*)str.buf, _unescaped.data(),
+                                                  str.size, nullptr, nullptr, &err, &errat);
+            if (err)
+                fail(err, errat ? errat : start);
+            str = slice(_unescaped.data(), size);
+        }
+        return c + 1;
+    }
+
+
+    // Parses a number and writes it to the encoder. Returns a pointer to just past its end.
+    const char* JSONIndexParser::parseNumber(const char *start) {
+        const char *end = (const char*)_input.end();
+        const char *c = start;
+        bool negative = (*c == '-');
+        if (negative)
+            ++c;
+        if (c >= end)
+            failTruncated();
+        if (!isdigit(*c))
+            failNumber(start, c);
+
+        // Integer part; accumulate it in case it's the whole number:
+        uint64_t n = 0;
+        bool overflow = false;
+        if (*c == '0') {
+            ++c;
+        } else {
+            for (; c < end && isdigit(*c); ++c) {
+                unsigned digit = *c - '0';
+                if (n > (UINT64_MAX - digit) / 10)
+                    overflow = true;
+                n = 10 * n + digit;
+            }
+        }
+        bool isInteger = true;
+        if (c < end && *c == '.') {
+            isInteger = false;
+            if (++c >= end)
+                failTruncated();
+            if (!isdigit(*c))
+                failNumber(start, c);
+            while (c < end && isdigit(*c))
+                ++c;
+        }
+        if (c < end && (*c == 'e' || *c == 'E')) {
+            isInteger = false;
+            if (++c < end && (*c == '+' || *c == '-'))
+                ++c;
+            if (c >= end)
+                failTruncated();
+            if (!isdigit(*c))
+                failNumber(start, c);
+            while (c < end && isdigit(*c))
+                ++c;
+        }
+
+        if (isInteger && !overflow) {
+            if (!negative) {
+                _encoder.writeUInt(n);
+                return c;
+            } else if (n <= (uint64_t)INT64_MAX + 1) {
+                _encoder.writeInt((int64_t)(0 - n));
+                return c;
+            }
+        }
+        double d;
+        ParseDouble(slice(start, c), d);       // (can't fail; the syntax was checked above)
+        _encoder.writeDouble(d);
+        return c;
+    }
+
+
+    // Parses `true`, `false` or `null` and writes it to the encoder. Returns a pointer to just
+    // past its end.
+    const char* JSONIndexParser::parseLiteral(const char *start) {
+        static const slice kLiterals[3] = {slice("true"), slice("false"), slice("null")};
+        const slice &literal = kLiterals[(*start == 't') ? 0 : (*start == 'f') ? 1 : 2];
+        size_t available = (const char*)_input.end() - start;
+        size_t len = std::min(available, literal.size);
+        if (memcmp(start, literal.buf, len) != 0)
+            fail(JSONSL_ERROR_SPECIAL_EXPECTED, endOfWord(start));
+        if (len < literal.size)
+            failTruncated();
+        switch (*start) {
+            case 't':   _encoder.writeBool(true); break;
+            case 'f':   _encoder.writeBool(false); break;
+            default:    _encoder.writeNull(); break;
+        }
+        return start + literal.size;
+    }
+
+
+    // Returns a pointer to the end of the run of letters starting at `start`. jsonsl reports a
+    // bad literal there, so this does too.
+    const char* JSONIndexParser::endOfWord(const char *start) {
+        const char *end = (const char*)_input.end(), *c = start;
+        while (c < end && isalpha(*c))
+            ++c;
+        return c;
+    }
+
+
+    // Verifies that only whitespace lies between the end of a token and the next structural
+    // character. (The index doesn't mark where values end, so "truex" or "1x" would otherwise
+    // go unnoticed.) The error matches what jsonsl reports for the same junk.
+    void JSONIndexParser::checkTokenEnd(const char *token, const char *tokenEnd,
+                                        size_t nextIndex)
+    {
+        auto json = (const char*)_input.buf;
+        const char *limit = (nextIndex < _indexCount) ? json + _index[nextIndex]
+                                                      : (const char*)_input.end();
+        for (const char *c = tokenEnd; c < limit; ++c) {
+            if (!isSpace(*c)) {
+                if (isalpha(*token))
+                    fail(JSONSL_ERROR_SPECIAL_EXPECTED, endOfWord(token));
+                if (*token != '"' && (*c == '.' || *c == 'e' || *c == 'E'))
+                    fail(JSONSL_ERROR_INVALID_NUMBER, token);   // e.g. "1.2.3", "1e5e"
+                if (*token != '"' || isdigit(*c) || *c == '-' || *c == '+')
+                    fail(JSONSL_ERROR_INVALID_NUMBER, c);
+                fail(JSONSL_ERROR_SPECIAL_EXPECTED, c);
+            }
+        }
+    }
+
+
+    void JSONIndexParser::fail(int error, const char *at) {
+        _error = error;
+        _errorPos = at - (const char*)_input.buf;
+        throw parseFailure();
+    }
+
+
+    // Fails on an incomplete number. Like jsonsl, blames the number itself if it simply ended
+    // too soon (as in "-" or "1e+"), otherwise the invalid character.
+    void JSONIndexParser::failNumber(const char *start, const char *at) {
+        fail(JSONSL_ERROR_INVALID_NUMBER, (isSpace(*at) || strchr(",:]}", *at)) ? start : at);
+    }
+
+
+    void JSONIndexParser::failTruncated() {
+        _error = JSONConverter::kErrTruncatedJSON;
+        _errorPos = _input.size;
+        throw parseFailure();
+    }
+
+}
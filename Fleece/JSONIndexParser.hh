@@ -0,0 +1,66 @@
+//
+//  JSONIndexParser.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+
+#include "slice.hh"
+#include <vector>
+
+namespace fleece {
+    class Encoder;
+
+    /** A JSON parser that works in two passes, in the style of simdjson. The first pass finds
+        the structural characters -- brackets, braces, colons, commas, and the first bytes of
+        strings and other values, ignoring anything inside strings -- 64 bytes at a time using
+        SIMD compares and bit arithmetic, and records their offsets in an index. The second pass
+        walks the index, validating the grammar and writing the values to an Encoder.
+        JSONConverter uses this in place of jsonsl when its engine is kIndexEngine. Errors are
+        reported with the same codes (jsonsl_error_t, or JSONConverter::kErrTruncatedJSON), at
+        the same positions as jsonsl where it detects them too; but this parser is stricter. */
+    class JSONIndexParser {
+    public:
+        JSONIndexParser(Encoder &encoder, unsigned maxDepth) noexcept
+        :_encoder(encoder), _maxDepth(maxDepth) { }
+
+        /** The largest input this parser supports (since the index holds 32-bit offsets.) */
+        static const size_t kMaxInputSize = 0xFFFFFFFF;
+
+        /** Parses JSON and writes the value to the encoder. Returns false on a parse error. */
+        bool parse(slice json);
+
+        int error() const noexcept              {return _error;}
+        size_t errorPos() const noexcept        {return _errorPos;}
+
+    private:
+        void buildIndex();
+        void walkIndex();
+        const char* parseString(const char *start, slice &str);
+        const char* parseNumber(const char *start);
+        const char* parseLiteral(const char *start);
+        const char* endOfWord(const char *start);
+        void checkTokenEnd(const char *token, const char *tokenEnd, size_t nextIndex);
+        [[noreturn]] void fail(int error, const char *at);
+        [[noreturn]] void failNumber(const char *start, const char *at);
+        [[noreturn]] void failTruncated();
+
+        Encoder &_encoder;
+        const unsigned _maxDepth;
+        slice _input;
+        std::vector<uint32_t> _index;       // Offsets of structural characters in _input
+        size_t _indexCount {0};             // Number of entries used in _index
+        std::vector<bool> _stack;           // Open collections, innermost last; true for a dict
+        std::vector<char> _unescaped;       // Buffer for strings with escape sequences
+        int _error {0};
+        size_t _errorPos {0};
+    };
+
+}
@@ -0,0 +1,248 @@
+//
+//  JSONStreamer.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "JSONStreamer.hh"
+#include "Internal.hh"
+#include "FleeceException.hh"
+#include "NumConversion.hh"
+#include "PlatformCompat.hh"
+#include "Base64.hh"
+#include <algorithm>
+#include <string.h>
+
+
+namespace fleece {
+
+    JSONStreamer::JSONStreamer(const Value *root, const SharedKeys *sk, bool json5)
+    :_sharedKeys(sk)
+    ,_json5(json5)
+    ,_nextValue(root)
+    {
+        throwIf(root == nullptr, InvalidData, "no value to convert to JSON");
+    }
+
+
+    size_t JSONStreamer::read(void *dst, size_t maxSize) {
+        auto out = (uint8_t*)dst;
+        size_t n = 0;
+        while (n < maxSize) {
+            if (_pending.size == 0) {
+                if (!nextToken()) {
+                    _done = true;
+                    break;
+                }
+                continue;
+            }
+            size_t count = std::min(_pending.size, maxSize - n);
+            memcpy(out + n, _pending.buf, count);
+            _pending.moveStart(count);
+            n += count;
+        }
+        return n;
+    }
+
+
+    void JSONStreamer::readAll(const Writer::OutputCallback &callback, size_t bufferSize) {
+        std::vector<uint8_t> buffer(bufferSize);
+        while (!_done) {
+            size_t n = read(buffer.data(), bufferSize);
+            if (n > 0)
+                callback(slice(buffer.data(), n));
+        }
+    }
+
+
+    void JSONStreamer::add(slice s) {
+        memcpy(&_token[_tokenLength], s.buf, s.size);
+        _tokenLength += s.size;
+    }
+
+
+    // Produces the next piece of output and points _pending to it. Returns false at the end.
+    bool JSONStreamer::nextToken() {
+        _tokenLength = 0;
+        if (_inString) {
+            nextStringToken();
+            return true;
+        } else if (_inData) {
+            nextDataToken();
+            return true;
+        } else if (_nextValue) {
+            auto value = _nextValue;
+            _nextValue = nullptr;
+            beginValue(value);
+        } else if (_frames.empty()) {
+            return false;
+        } else if (!_frames.back().isDict) {
+            auto &iter = _arrays.back();
+            if (!iter) {
+                add(']');
+                _arrays.pop_back();
+                _frames.pop_back();
+            } else {
+                if (_frames.back().first)
+                    _frames.back().first = false;
+                else
+                    add(',');
+                beginValue(iter.read());
+            }
+        } else {
+            auto &iter = _dicts.back();
+            if (!iter) {
+                add('}');
+                _dicts.pop_back();
+                _frames.pop_back();
+            } else {
+                if (_frames.back().first)
+                    _frames.back().first = false;
+                else
+                    add(',');
+                slice keyStr = iter.keyString();
+                if (keyStr) {
+                    // Write the key like a string, then the value after it:
+                    _quoted = !(_json5 && internal::canBeUnquotedJSON5Key(keyStr));
+                    if (_quoted)
+                        add('"');
+                    _inString = _isKey = true;
+                    _strPos = (const uint8_t*)keyStr.buf;
+                    _strEnd = (const uint8_t*)keyStr.end();
+                } else {
+                    char str[kMinNumberBufferSize];
+                    add(slice(str, WriteInteger(iter.key()->asInt(), str)));
+                    add(':');
+                }
+                _nextValue = iter.value();
+                ++iter;
+            }
+        }
+        _pending = slice(_token, _tokenLength);
+        return true;
+    }
+
+
+    // Adds the start of a value to the token. Strings, data and collections continue in later
+    // tokens.
+    void JSONStreamer::beginValue(const Value *value) {
+        switch (value->type()) {
+            case kNull:
+                add(slice("null"));
+                break;
+            case kBoolean:
+                add(value->asBool() ? slice("true") : slice("false"));
+                break;
+            case kNumber: {
+                char str[kMinNumberBufferSize];
+                size_t len;
+                if (value->isInteger()) {
+                    if (value->isUnsigned())
+                        len = WriteUInteger(value->asUnsigned(), str);
+                    else
+                        len = WriteInteger(value->asInt(), str);
+                } else if (value->isDouble()) {
+                    len = WriteFloat(value->asDouble(), str);
+                } else {
+                    len = WriteFloat(value->asFloat(), str);
+                }
+                add(slice(str, len));
+                break;
+            }
+            case kString: {
+                add('"');
+                slice str = value->asString();
+                _inString = _quoted = true;
+                _isKey = false;
+                _strPos = (const uint8_t*)str.buf;
+                _strEnd = (const uint8_t*)str.end();
+                break;
+            }
+            case kData: {
+                add('"');
+                slice data = value->asData();
+                _inData = true;
+                _strPos = (const uint8_t*)data.buf;
+                _strEnd = (const uint8_t*)data.end();
+                break;
+            }
+            case kArray:
+                add('[');
+                _frames.push_back({false, true});
+                _arrays.emplace_back(value->asArray());
+                break;
+            case kDict:
+                add('{');
+                _frames.push_back({true, true});
+                _dicts.emplace_back(value->asDict(), _sharedKeys);
+                break;
+            default:
+                FleeceException::_throw(UnknownValue, "illegal typecode in Value; corrupt data?");
+        }
+    }
+
+
+    // Produces the next piece of a string being written: either a run of characters that
+    // don't need escaping (pointing directly into the Fleece data), an escape sequence, or
+    // the closing quote.
+    void JSONStreamer::nextStringToken() {
+        static const char kHexDigits[] = "0123456789abcdef";
+        if (_strPos < _strEnd) {
+            size_t n = _quoted ? internal::countUnescapedJSONBytes(_strPos, _strEnd)
+                               : (_strEnd - _strPos);
+            if (n > 0) {
+                _pending = slice(_strPos, n);
+                _strPos += n;
+                return;
+            }
+            uint8_t ch = *_strPos++;
+            switch (ch) {
+                case '"':
+                case '\\':
+                    add('\\');
+                    add((char)ch);
+                    break;
+                case '\n':
+                    add(slice("\\n"));
+                    break;
+                case '\t':
+                    add(slice("\\t"));
+                    break;
+                default: {
+                    char buf[6] = {'\\', 'u', '0', '0', kHexDigits[ch >> 4], kHexDigits[ch & 0xF]};
+                    add(slice(buf, sizeof(buf)));
+                    break;
+                }
+            }
+        } else {
+            _inString = false;
+            if (_quoted)
+                add('"');
+            if (_isKey)
+                add(':');
+        }
+        _pending = slice(_token, _tokenLength);
+    }
+
+
+    // Produces the next piece of base64-encoded data, or the closing quote.
+    void JSONStreamer::nextDataToken() {
+        if (_strPos < _strEnd) {
+            // Chunks are a multiple of 3 bytes long, so only the last one is padded:
+            size_t n = std::min((size_t)(_strEnd - _strPos), (size_t)kDataChunkSize);
+            _tokenLength = EncodeBase64(slice(_strPos, n), _token);
+            _strPos += n;
+        } else {
+            _inData = false;
+            add('"');
+        }
+        _pending = slice(_token, _tokenLength);
+    }
+
+}
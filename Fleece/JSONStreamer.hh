@@ -0,0 +1,86 @@
+//
+//  JSONStreamer.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+
+#include "Array.hh"
+#include "Writer.hh"
+#include <vector>
+
+namespace fleece {
+
+    /** Generates the JSON representation of a Fleece value incrementally, into buffers supplied
+        by the caller. Unlike Value::toJSON, it never holds more than a small fixed amount of
+        the output, so converting a huge document takes constant memory; and since the caller
+        asks for output when it's ready for it, it can stop at any point (when a socket's send
+        buffer is full, say) and resume later.
+        String contents are copied straight from the Fleece data to the caller's buffer.
+        The Fleece data, and the SharedKeys if any, must remain valid and unchanged until the
+        streamer is done or destructed. */
+    class JSONStreamer {
+    public:
+        /** Constructs a streamer for a value.
+            @param root  The value to convert.
+            @param sharedKeys  The SharedKeys used when encoding the data, if any.
+            @param json5  If true, writes JSON5, which leaves most dict keys unquoted. */
+        JSONStreamer(const Value *root,
+                     const SharedKeys *sharedKeys =nullptr,
+                     bool json5 =false);
+
+        /** Writes up to `maxSize` bytes of the next JSON output to `dst`, and returns the
+            number of bytes written. It only writes fewer than `maxSize` bytes once it reaches
+            the end of the output, after which it returns 0 (as does done().) */
+        size_t read(void *dst, size_t maxSize);
+
+        /** Returns true when all the output has been read. */
+        bool done() const                       {return _done;}
+
+        /** Passes all the remaining output to a callback, in pieces of up to `bufferSize` bytes
+            (using a single buffer of that size.) */
+        void readAll(const Writer::OutputCallback&,
+                     size_t bufferSize =Writer::kDefaultStreamingChunkSize);
+
+    private:
+        bool nextToken();
+        void beginValue(const Value*);
+        void nextStringToken();
+        void nextDataToken();
+        void add(char c)                        {_token[_tokenLength++] = c;}
+        void add(slice);
+
+        // Each collection being written has a Frame, and an iterator in _arrays or _dicts:
+        struct Frame {
+            bool isDict;
+            bool first;
+        };
+
+        static const size_t kDataChunkSize = 768;   // Bytes of data base64-encoded per token
+
+        const SharedKeys* const _sharedKeys;
+        const bool _json5;
+        std::vector<Frame> _frames;
+        std::vector<Array::iterator> _arrays;
+        std::vector<Dict::iterator> _dicts;
+        const Value *_nextValue;            // Value to begin writing next, if any
+        slice _pending;                     // Output not yet read
+        const uint8_t *_strPos {nullptr};   // Position in string (or data) being written
+        const uint8_t *_strEnd {nullptr};   // End of string (or data) being written
+        bool _inString {false};             // Writing a string's contents?
+        bool _inData {false};               // Writing a data value's (base64) contents?
+        bool _quoted {true};                // Is the string being written quoted?
+        bool _isKey {false};                // Is the string being written a dict key?
+        bool _done {false};
+        size_t _tokenLength {0};
+        char _token[1040];                  // Buffer for output that's not copied from the data
+    };
+
+}
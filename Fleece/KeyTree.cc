@@ -8,6 +8,7 @@
 
 #include "KeyTree.hh"
 #include "varint.hh"
+#include "Endian.hh"
 #include <assert.h>
 #include <math.h>
 #include <iostream>
@@ -30,6 +31,27 @@ namespace fleece {
     //
     // Offset to right subtree is 0 if there is no right subtree,
     // and the field is entirely missing in the bottom nodes (which have no subtrees.)
+    //
+    // Data format of an Eytzinger tree is:
+    // marker                   1 byte (kEytzingerMarker, which is never a valid depth)
+    // [padding]                3 bytes
+    // count                    uint32
+    // [padding]                8 bytes
+    // [nodes 1...count]        16 bytes each
+    // [strings longer than 8 bytes]
+    //
+    // Data format of an Eytzinger node is:
+    // prefix                   8 bytes: first 8 bytes of string, padded with 00
+    // offset of string         uint32, from the start of the tree (0 if string fits in prefix)
+    // string length            uint32
+    //
+    // Node 1 is the root, and the children of node i are nodes 2i and 2i+1. So the header
+    // takes the place of node 0, and node i starts at byte 16*i. A string's id is its node
+    // number. Integers are little-endian.
+
+    static const uint8_t kEytzingerMarker = 0xFF;
+    static const size_t kNodeSize = 16;
+    static const size_t kPrefixSize = 8;
 
 
 #pragma mark - WRITING:
@@ -118,13 +140,72 @@ namespace fleece {
     };
     
 
-    KeyTree KeyTree::fromSortedStrings(const std::vector<slice>& strings) {
+
+    class eytzingerWriter {
+    public:
+        eytzingerWriter(const std::vector<slice> &strings)
+        :_strings(strings)
+        { }
+
+        alloc_slice writeTree() {
+            auto n = _strings.size();
+            assert(n <= UINT32_MAX);
+            size_t totalSize = kNodeSize * (n + 1);
+            for (slice str : _strings)
+                if (str.size > kPrefixSize)
+                    totalSize += str.size;
+            alloc_slice output(totalSize);
+            _tree = (uint8_t*)output.buf;
+            memset(_tree, 0, kNodeSize * (n + 1));
+            _tree[0] = kEytzingerMarker;
+            writeUInt32(&_tree[4], (uint32_t)n);
+            _stringsPos = kNodeSize * (n + 1);
+            _next = 0;
+            writeNodes(1);
+            assert(_next == n && _stringsPos == totalSize);
+            return output;
+        }
+
+    private:
+        // Fills in the subtree rooted at node i, taking strings in order (an in-order walk):
+        void writeNodes(size_t i) {
+            if (i > _strings.size())
+                return;
+            writeNodes(2*i);
+            slice str = _strings[_next++];
+            assert(str.size <= UINT32_MAX);
+            uint8_t *node = &_tree[kNodeSize * i];
+            memcpy(node, str.buf, std::min(str.size, kPrefixSize));
+            if (str.size > kPrefixSize) {
+                writeUInt32(&node[8], (uint32_t)_stringsPos);
+                memcpy(&_tree[_stringsPos], str.buf, str.size);
+                _stringsPos += str.size;
+            }
+            writeUInt32(&node[12], (uint32_t)str.size);
+            writeNodes(2*i + 1);
+        }
+
+        static void writeUInt32(uint8_t *dst, uint32_t n) {
+            n = _encLittle32(n);
+            memcpy(dst, &n, sizeof(n));
+        }
+
+        const std::vector<slice> &_strings;
+        uint8_t* _tree;
+        size_t _stringsPos;
+        size_t _next;
+    };
+
+
+    KeyTree KeyTree::fromSortedStrings(const std::vector<slice>& strings, Layout layout) {
+        if (layout == kEytzinger)
+            return KeyTree(eytzingerWriter(strings).writeTree());
         return KeyTree(keyTreeWriter(strings).writeTree());
     }
 
-    KeyTree KeyTree::fromStrings(std::vector<slice> strings) {
+    KeyTree KeyTree::fromStrings(std::vector<slice> strings, Layout layout) {
         std::sort(strings.begin(), strings.end());
-        return fromSortedStrings(strings);
+        return fromSortedStrings(strings, layout);
     }
 
 
@@ -135,8 +216,8 @@ namespace fleece {
     { }
 
     KeyTree::KeyTree(alloc_slice encoded)
-    :_ownedData(encoded),
-    _data(encoded.buf)
+    :_ownedData(std::move(encoded)),
+    _data(_ownedData.buf)
     { }
     
     static int32_t readVarInt(const uint8_t* &tree) {
@@ -162,6 +243,8 @@ namespace fleece {
 
     unsigned KeyTree::operator[] (slice str) const {
         const uint8_t* tree = (const uint8_t*)_data;
+        if (*tree == kEytzingerMarker)
+            return eytzingerLookup(str);
         unsigned id = 0;
         unsigned mask = 1;
         for (unsigned depth = *tree++; depth > 0; --depth) {
@@ -189,6 +272,8 @@ namespace fleece {
         if (id == 0)
             return nullslice;
         const uint8_t* tree = (const uint8_t*)_data;
+        if (*tree == kEytzingerMarker)
+            return eytzingerLookup(id);
         for (unsigned depth = *tree++; depth > 0; --depth) {
             slice key = readKey(tree);
             if (!key.buf)
@@ -210,4 +295,68 @@ namespace fleece {
         return nullslice;
     }
 
+
+#pragma mark - EYTZINGER LAYOUT:
+
+    static inline uint32_t readUInt32(const uint8_t *src) {
+        uint32_t n;
+        memcpy(&n, src, sizeof(n));
+        return _decLittle32(n);
+    }
+
+    // Reads 8 bytes as a big-endian number, so that comparing numbers compares the bytes.
+    static inline uint64_t readPrefix(const uint8_t *src) {
+        uint64_t n;
+        memcpy(&n, src, sizeof(n));
+        return _dec64(n);
+    }
+
+    unsigned KeyTree::eytzingerLookup(slice str) const {
+        const uint8_t* tree = (const uint8_t*)_data;
+        const size_t count = readUInt32(&tree[4]);
+        uint8_t prefixBytes[kPrefixSize] = {0};
+        memcpy(prefixBytes, str.buf, std::min(str.size, kPrefixSize));
+        const uint64_t prefix = readPrefix(prefixBytes);
+
+        size_t i = 1;
+        while (i <= count) {
+            // The four grandchildren are adjacent, so start loading them now:
+            if (4*i <= count)
+                _prefetch(&tree[kNodeSize * 4*i]);
+            const uint8_t *node = &tree[kNodeSize * i];
+            uint64_t nodePrefix = readPrefix(node);
+            int cmp;
+            if (prefix != nodePrefix) {
+                cmp = (prefix < nodePrefix) ? -1 : 1;
+            } else {
+                // The prefixes match, so either the strings differ after them,
+                // or one is shorter (padding looks the same as 00 bytes):
+                size_t size = readUInt32(&node[12]);
+                if (str.size > kPrefixSize && size > kPrefixSize) {
+                    slice rest(offsetby(tree, readUInt32(&node[8]) + kPrefixSize),
+                               size - kPrefixSize);
+                    cmp = slice(offsetby(str.buf, kPrefixSize), str.size - kPrefixSize)
+                                .compare(rest);
+                } else {
+                    cmp = (str.size > size) - (str.size < size);
+                }
+                if (cmp == 0)
+                    return (unsigned)i;
+            }
+            i = 2*i + (cmp > 0);
+        }
+        return 0;
+    }
+
+    slice KeyTree::eytzingerLookup(unsigned id) const {
+        const uint8_t* tree = (const uint8_t*)_data;
+        if (id > readUInt32(&tree[4]))
+            return nullslice;
+        const uint8_t *node = &tree[kNodeSize * id];
+        size_t size = readUInt32(&node[12]);
+        if (size <= kPrefixSize)
+            return slice(node, size);
+        return slice(&tree[readUInt32(&node[8])], size);
+    }
+
 }
@@ -17,14 +17,27 @@ namespace fleece {
         one to a small positive integer. Internally it's stored as a tree, so lookup time is
         O(log n). The total storage overhead (beyond the sizes of the strings themselves) is
         about 1.5n bytes, although this increases somewhat as the length of the strings or the
-        total size of the dictionary increase. */
+        total size of the dictionary increase.
+        Alternatively the tree can be stored in a larger layout that's faster to search; see
+        kEytzinger. Either encoding can be read by the same KeyTree class. */
     class KeyTree {
     public:
+        enum Layout {
+            kCompact,       ///< Varint offsets, depth-first order; about 1.5 bytes per string
+            kEytzinger,     ///< Fixed-size nodes in breadth-first order; 16 bytes per string
+        };
+
         KeyTree(const void *encodedDataStart);
         KeyTree(alloc_slice encodedData);
-        
-        static KeyTree fromSortedStrings(const std::vector<slice>&);
-        static KeyTree fromStrings(std::vector<slice>);
+
+        /** Builds a tree from strings, which must be sorted and unique.
+            The kEytzinger layout stores the nodes in an array in breadth-first order (an
+            "Eytzinger" layout, like a binary heap), each with the string's first 8 bytes inline,
+            so most comparisons don't touch the string data; and a lookup can prefetch the
+            grandchildren of a node while comparing it. That's fewer and more predictable cache
+            misses than the compact layout, whose lookup decodes varints along the way. */
+        static KeyTree fromSortedStrings(const std::vector<slice>&, Layout =kCompact);
+        static KeyTree fromStrings(std::vector<slice>, Layout =kCompact);
 
         unsigned operator[] (slice str) const;
         slice operator[] (unsigned id) const;
@@ -32,6 +45,9 @@ namespace fleece {
         slice encodedData() const       {return _ownedData;}
 
     private:
+        unsigned eytzingerLookup(slice str) const;
+        slice eytzingerLookup(unsigned id) const;
+
         alloc_slice _ownedData;
         const void * _data;
     };
@@ -0,0 +1,130 @@
+//
+//  MappedFile.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "MappedFile.hh"
+#include "FleeceException.hh"
+#include "PlatformCompat.hh"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace fleece {
+
+    // Owns the OS-level mapping of a file.
+    class mapped_slice::mapping {
+    public:
+        mapping(const char *path) {
+#ifdef _MSC_VER
+            _file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+            throwIf(_file == INVALID_HANDLE_VALUE, IOError, "can't open file");
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(_file, &fileSize)) {
+                close();
+                FleeceException::_throw(IOError, "can't get file size");
+            }
+            _contents.size = (size_t)fileSize.QuadPart;
+            if (_contents.size == 0)
+                return;
+            _mapHandle = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (_mapHandle)
+                _contents.buf = MapViewOfFile(_mapHandle, FILE_MAP_READ, 0, 0, 0);
+#else
+            _fd = ::open(path, O_RDONLY);
+            throwIf(_fd < 0, IOError, "can't open file");
+            struct stat st;
+            if (::fstat(_fd, &st) != 0) {
+                close();
+                FleeceException::_throw(IOError, "can't get file size");
+            }
+            _contents.size = (size_t)st.st_size;
+            if (_contents.size == 0)
+                return;
+            void *mapped = ::mmap(nullptr, _contents.size, PROT_READ, MAP_PRIVATE, _fd, 0);
+            if (mapped != MAP_FAILED)
+                _contents.buf = mapped;
+#endif
+            if (!_contents.buf) {
+                close();
+                FleeceException::_throw(IOError, "can't memory-map file");
+            }
+        }
+
+        ~mapping() {
+            close();
+        }
+
+        slice contents() const      {return _contents;}
+
+    private:
+        void close() noexcept {
+#ifdef _MSC_VER
+            if (_contents.buf)
+                UnmapViewOfFile(_contents.buf);
+            if (_mapHandle)
+                CloseHandle(_mapHandle);
+            if (_file != INVALID_HANDLE_VALUE)
+                CloseHandle(_file);
+            _mapHandle = nullptr;
+            _file = INVALID_HANDLE_VALUE;
+#else
+            if (_contents.buf)
+                ::munmap((void*)_contents.buf, _contents.size);
+            if (_fd >= 0)
+                ::close(_fd);
+            _fd = -1;
+#endif
+            _contents = nullslice;
+        }
+
+        mapping(const mapping&) =delete;
+        mapping& operator=(const mapping&) =delete;
+
+        slice _contents;
+#ifdef _MSC_VER
+        HANDLE _file {INVALID_HANDLE_VALUE};
+        HANDLE _mapHandle {nullptr};
+#else
+        int _fd {-1};
+#endif
+    };
+
+
+    mapped_slice::mapped_slice(const char *path)
+    :_mapping(std::make_shared<mapping>(path))
+    {
+        slice contents = _mapping->contents();
+        // An empty file has no mapping, but should still be a non-null (empty) slice:
+        buf = contents.buf ? contents.buf : "";
+        size = contents.size;
+    }
+
+
+    void mapped_slice::willNeed(slice range) const noexcept {
+#ifndef _MSC_VER
+        if (!_mapping || range.size == 0)
+            return;
+        // The address has to be page-aligned:
+        static const uintptr_t pageSize = (uintptr_t)::sysconf(_SC_PAGESIZE);
+        auto start = (uintptr_t)range.buf & ~(pageSize - 1);
+        (void)::posix_madvise((void*)start, (uintptr_t)range.end() - start, POSIX_MADV_WILLNEED);
+#endif
+    }
+
+}
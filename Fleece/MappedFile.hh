@@ -0,0 +1,45 @@
+//
+//  MappedFile.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+
+#include "slice.hh"
+#include <memory>
+
+
+namespace fleece {
+
+    /** A read-only slice pointing to the memory-mapped contents of a file. Opening a file takes
+        constant time regardless of its size; pages are read from disk as they're accessed.
+        Like alloc_slice, copies share ownership of the memory, which is unmapped when the last
+        copy is destroyed. */
+    struct mapped_slice : public slice {
+        mapped_slice()                                  { }
+
+        /** Maps the file at the given path. Throws a FleeceException if it can't be opened. */
+        explicit mapped_slice(const char *path);
+
+        explicit operator bool() const                  {return buf != nullptr;}
+
+        /** Tells the OS that a range of the mapped file will be read soon, so it can start
+            reading it from disk in the background. (Does nothing on Windows.) */
+        void willNeed(slice range) const noexcept;
+
+        /** Unmaps the file (if this is the last reference to it.) */
+        void reset() noexcept                           {_mapping.reset(); buf = nullptr; size = 0;}
+
+    private:
+        class mapping;
+        std::shared_ptr<mapping> _mapping;
+    };
+
+}
@@ -0,0 +1,368 @@
+//
+//  MutableArray.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "MutableArray.hh"
+#include "Encoder.hh"
+#include "FleeceException.hh"
+#include "Internal.hh"
+#include "PlatformCompat.hh"
+
+namespace fleece {
+
+    using namespace internal;
+
+    // A null Value, which slots set to null point to instead of encoding one.
+    static const uint8_t kNullValue[2] = {kSpecialTag << 4 | kSpecialValueNull, 0};
+
+    // Each slot that's set to a new scalar owns a tiny Fleece document containing just it.
+    template <class FN>
+    static alloc_slice encodeScalar(FN fn) {
+        Encoder enc;
+        fn(enc);
+        return enc.extractOutput();
+    }
+
+
+#pragma mark - SLOT:
+
+
+    MutableSlot::MutableSlot(MutableSlot&&) noexcept = default;
+    MutableSlot& MutableSlot::operator=(MutableSlot&&) noexcept = default;
+    MutableSlot::~MutableSlot() = default;
+
+    bool MutableSlot::isChanged() const {
+        return _changed || (_array && _array->isChanged()) || (_dict && _dict->isChanged());
+    }
+
+    void MutableSlot::clear() {
+        _value = nullptr;
+        _encoded = nullslice;
+        _array.reset();
+        _dict.reset();
+        _changed = true;
+    }
+
+    void MutableSlot::setEncoded(alloc_slice encoded) {
+        clear();
+        _encoded = encoded;
+        _value = Value::fromTrustedData(_encoded);
+    }
+
+    void MutableSlot::setNull() {
+        clear();
+        _value = (const Value*)kNullValue;
+    }
+
+    void MutableSlot::setBool(bool b) {
+        setEncoded(encodeScalar([=](Encoder &enc) {enc.writeBool(b);}));
+    }
+
+    void MutableSlot::setInt(int64_t i) {
+        setEncoded(encodeScalar([=](Encoder &enc) {enc.writeInt(i);}));
+    }
+
+    void MutableSlot::setUInt(uint64_t i) {
+        setEncoded(encodeScalar([=](Encoder &enc) {enc.writeUInt(i);}));
+    }
+
+    void MutableSlot::setDouble(double d) {
+        setEncoded(encodeScalar([=](Encoder &enc) {enc.writeDouble(d);}));
+    }
+
+    void MutableSlot::setString(slice s) {
+        setEncoded(encodeScalar([=](Encoder &enc) {enc.writeString(s);}));
+    }
+
+    void MutableSlot::setData(slice s) {
+        setEncoded(encodeScalar([=](Encoder &enc) {enc.writeData(s);}));
+    }
+
+    void MutableSlot::setValue(const Value *v) {
+        throwIf(!v, InvalidData, "can't set a slot to a null pointer");
+        clear();
+        _value = v;
+    }
+
+    void MutableSlot::remove() {
+        clear();
+    }
+
+    MutableArray& MutableSlot::setArray() {
+        clear();
+        _array.reset(new MutableArray());
+        return *_array;
+    }
+
+    MutableDict& MutableSlot::setDict(SharedKeys *sk) {
+        clear();
+        _dict.reset(new MutableDict(sk));
+        return *_dict;
+    }
+
+    MutableArray* MutableSlot::makeMutableArray(SharedKeys *sk) {
+        if (!_array) {
+            auto a = _value ? _value->asArray() : nullptr;
+            if (!a)
+                return nullptr;
+            _array.reset(new MutableArray(a, sk));
+            _value = nullptr;
+        }
+        return _array.get();
+    }
+
+    MutableDict* MutableSlot::makeMutableDict(SharedKeys *sk) {
+        if (!_dict) {
+            auto d = _value ? _value->asDict() : nullptr;
+            if (!d)
+                return nullptr;
+            _dict.reset(new MutableDict(d, sk));
+            _value = nullptr;
+        }
+        return _dict.get();
+    }
+
+    void MutableSlot::writeTo(Encoder &enc) const {
+        if (_array)
+            _array->writeTo(enc);
+        else if (_dict)
+            _dict->writeTo(enc);
+        else if (_value)
+            enc.writeValue(_value);
+        else
+            enc.writeNull();
+    }
+
+
+#pragma mark - ARRAY:
+
+
+    MutableArray::MutableArray(const Array *a, SharedKeys *sk)
+    :_source(a),
+     _sharedKeys(sk)
+    { }
+
+    uint32_t MutableArray::count() const noexcept {
+        if (_materialized)
+            return (uint32_t)_items.size();
+        return _source ? _source->count() : 0;
+    }
+
+    const Value* MutableArray::get(uint32_t index) const noexcept {
+        if (!_materialized)
+            return _source ? _source->get(index) : nullptr;
+        if (index >= _items.size())
+            return nullptr;
+        return _items[index].value();
+    }
+
+    // Copies the source's item pointers into _items, so they can be changed.
+    void MutableArray::materialize() {
+        if (_usuallyTrue(_materialized))
+            return;
+        if (_source) {
+            _items.reserve(_source->count());
+            for (Array::iterator i(_source); i; ++i)
+                _items.emplace_back(i.value());
+        }
+        _materialized = true;
+    }
+
+    void MutableArray::checkIndex(uint32_t index, uint32_t n) const {
+        throwIf(index > count() || n > count() - index, OutOfRange, "array index out of range");
+    }
+
+    MutableSlot& MutableArray::set(uint32_t index) {
+        checkIndex(index, 1);
+        materialize();
+        return _items[index];
+    }
+
+    MutableSlot& MutableArray::append() {
+        insert(count());
+        return _items.back();
+    }
+
+    void MutableArray::insert(uint32_t index, uint32_t n) {
+        checkIndex(index, 0);
+        materialize();
+        std::vector<MutableSlot> added(n);
+        for (auto &slot : added)
+            slot.setNull();
+        _items.insert(_items.begin() + index,
+                      std::make_move_iterator(added.begin()), std::make_move_iterator(added.end()));
+        _changed = true;
+    }
+
+    void MutableArray::remove(uint32_t index, uint32_t n) {
+        checkIndex(index, n);
+        if (n == 0)
+            return;
+        materialize();
+        _items.erase(_items.begin() + index, _items.begin() + index + n);
+        _changed = true;
+    }
+
+    MutableArray* MutableArray::getMutableArray(uint32_t index) {
+        if (index >= count())
+            return nullptr;
+        return set(index).makeMutableArray(_sharedKeys);
+    }
+
+    MutableDict* MutableArray::getMutableDict(uint32_t index) {
+        if (index >= count())
+            return nullptr;
+        return set(index).makeMutableDict(_sharedKeys);
+    }
+
+    bool MutableArray::isChanged() const {
+        if (_changed)
+            return true;
+        for (auto &slot : _items)
+            if (slot.isChanged())
+                return true;
+        return false;
+    }
+
+    void MutableArray::writeTo(Encoder &enc) const {
+        if (_source && !isChanged()) {
+            enc.writeValue(_source);
+            return;
+        }
+        enc.beginArray(_items.size());
+        for (auto &slot : _items)
+            slot.writeTo(enc);
+        enc.endArray();
+    }
+
+
+#pragma mark - DICT:
+
+
+    MutableDict::MutableDict(const Dict *d, SharedKeys *sk)
+    :_source(d),
+     _sharedKeys(sk),
+     _count(d ? d->count() : 0)
+    { }
+
+    const Value* MutableDict::getSource(slice key) const noexcept {
+        return _source ? _source->get(key, _sharedKeys) : nullptr;
+    }
+
+    MutableSlot* MutableDict::findChange(slice key) noexcept {
+        if (_changes.empty())
+            return nullptr;
+        auto i = _changes.find((std::string)key);
+        return (i != _changes.end()) ? &i->second : nullptr;
+    }
+
+    const Value* MutableDict::get(slice key) const noexcept {
+        auto slot = const_cast<MutableDict*>(this)->findChange(key);
+        return slot ? slot->value() : getSource(key);
+    }
+
+    MutableSlot& MutableDict::set(slice key) {
+        auto slot = findChange(key);
+        if (!slot) {
+            auto value = getSource(key);
+            slot = &_changes.emplace((std::string)key, MutableSlot(value)).first->second;
+            if (value)
+                return *slot;
+        } else if (slot->exists()) {
+            return *slot;
+        }
+        slot->setNull();
+        ++_count;
+        return *slot;
+    }
+
+    void MutableDict::remove(slice key) {
+        auto slot = findChange(key);
+        if (slot) {
+            if (!slot->exists())
+                return;
+            if (getSource(key))
+                slot->remove();
+            else
+                _changes.erase((std::string)key);
+        } else {
+            if (!getSource(key))
+                return;
+            _changes.emplace((std::string)key, MutableSlot()).first->second.remove();
+        }
+        --_count;
+    }
+
+    MutableSlot* MutableDict::findMutable(slice key, valueType type) {
+        auto slot = findChange(key);
+        if (slot)
+            return slot->exists() ? slot : nullptr;
+        auto value = getSource(key);
+        if (!value || value->type() != type)
+            return nullptr;
+        return &set(key);
+    }
+
+    MutableArray* MutableDict::getMutableArray(slice key) {
+        auto slot = findMutable(key, kArray);
+        return slot ? slot->makeMutableArray(_sharedKeys) : nullptr;
+    }
+
+    MutableDict* MutableDict::getMutableDict(slice key) {
+        auto slot = findMutable(key, kDict);
+        return slot ? slot->makeMutableDict(_sharedKeys) : nullptr;
+    }
+
+    bool MutableDict::isChanged() const {
+        for (auto &change : _changes)
+            if (change.second.isChanged())
+                return true;
+        return false;
+    }
+
+    void MutableDict::writeTo(Encoder &enc) const {
+        if (_source && !isChanged()) {
+            enc.writeValue(_source);
+            return;
+        }
+        enc.beginDictionary(_count);
+        // The original entries, with the changed ones replaced or left out:
+        size_t changesWritten = 0;
+        if (_source) {
+            for (Dict::iterator i(_source, _sharedKeys); i; ++i) {
+                auto change = _changes.end();
+                if (!_changes.empty())
+                    change = _changes.find((std::string)i.keyString());
+                if (change == _changes.end()) {
+                    enc.writeKey(i.key());
+                    enc.writeValue(i.value());
+                } else {
+                    ++changesWritten;
+                    if (change->second.exists()) {
+                        enc.writeKey(i.key());
+                        change->second.writeTo(enc);
+                    }
+                }
+            }
+        }
+        // Then the added entries:
+        if (changesWritten < _changes.size()) {
+            for (auto &change : _changes) {
+                if (change.second.exists() && !getSource(slice(change.first))) {
+                    enc.writeKey(slice(change.first));
+                    change.second.writeTo(enc);
+                }
+            }
+        }
+        enc.endDictionary();
+    }
+
+}
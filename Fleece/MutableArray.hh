@@ -0,0 +1,206 @@
+//
+//  MutableArray.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "Array.hh"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fleece {
+    class Encoder;
+    class MutableArray;
+    class MutableDict;
+
+
+    /** An item of a MutableArray or MutableDict. It holds either an immutable Value -- one in
+        the original document, or a new one it encoded itself when set -- or a mutable array or
+        dict nested in its collection. */
+    class MutableSlot {
+    public:
+        MutableSlot() { }
+        explicit MutableSlot(const Value *v)        :_value(v) { }
+        MutableSlot(MutableSlot&&) noexcept;
+        MutableSlot& operator=(MutableSlot&&) noexcept;
+        ~MutableSlot();
+
+        /** False if the slot's been removed from its dict. */
+        bool exists() const                         {return _value || _array || _dict;}
+
+        /** The slot's value, or nullptr if it doesn't exist or holds a mutable collection. */
+        const Value* value() const                  {return _value;}
+
+        MutableArray* asMutableArray() const        {return _array.get();}
+        MutableDict* asMutableDict() const          {return _dict.get();}
+
+        /** True if the slot has been set, or its mutable collection has changed. */
+        bool isChanged() const;
+
+        void setNull();
+        void setBool(bool);
+        void setInt(int64_t);
+        void setUInt(uint64_t);
+        void setDouble(double);
+        void setString(slice);
+        void setData(slice);
+
+        /** Sets the slot to an existing Value, which is referenced, not copied, so it must
+            remain valid as long as the slot does. */
+        void setValue(const Value*);
+
+        /** Replaces the slot's value with a new empty mutable array or dict, and returns it. */
+        MutableArray& setArray();
+        MutableDict& setDict(SharedKeys* =nullptr);
+
+        /** If the slot's value is an array (or dict), replaces it with a mutable one that
+            wraps it, and returns that. (The SharedKeys are for nested dicts.) This doesn't
+            count as a change until the mutable collection is changed. Returns nullptr if the
+            value is some other type. */
+        MutableArray* makeMutableArray(SharedKeys* =nullptr);
+        MutableDict* makeMutableDict(SharedKeys* =nullptr);
+
+        /** Ends a dict entry; it won't be written. */
+        void remove();
+
+        /** Writes the slot's value (or null, if it doesn't exist) to an Encoder. */
+        void writeTo(Encoder&) const;
+
+    private:
+        void clear();
+        void setEncoded(alloc_slice);
+
+        const Value *_value {nullptr};
+        alloc_slice _encoded;                   // Owns _value if the slot created it
+        std::unique_ptr<MutableArray> _array;
+        std::unique_ptr<MutableDict> _dict;
+        bool _changed {false};
+
+        MutableSlot(const MutableSlot&) = delete;
+        MutableSlot& operator=(const MutableSlot&) = delete;
+    };
+
+
+    /** A mutable wrapper around an immutable Array. Reading an unchanged array goes straight
+        to the original; the first change copies its item pointers (not the items themselves)
+        into a vector of MutableSlots, which then record the changes.
+        Nested arrays and dicts become mutable, copy-on-write, only when they're accessed
+        through getMutableArray() or getMutableDict().
+        The original data must remain valid and unchanged while this object is in use. */
+    class MutableArray {
+    public:
+        /** Creates a new, empty array. */
+        MutableArray() { }
+
+        /** Wraps an existing Array. The SharedKeys are used by nested MutableDicts. */
+        explicit MutableArray(const Array*, SharedKeys* =nullptr);
+
+        const Array* source() const                 {return _source;}
+
+        uint32_t count() const noexcept;
+
+        /** The item at an index, or nullptr if the index is out of range. Also returns nullptr
+            if the item has been made mutable; use getMutableArray/getMutableDict for those. */
+        const Value* get(uint32_t index) const noexcept;
+
+        /** The slot for an existing item, to change it through. Throws if out of range. */
+        MutableSlot& set(uint32_t index);
+
+        /** Adds a null item at the end, and returns its slot. */
+        MutableSlot& append();
+
+        /** Inserts `n` null items at an index (which may equal the count.) */
+        void insert(uint32_t index, uint32_t n =1);
+
+        /** Removes `n` items starting at an index. */
+        void remove(uint32_t index, uint32_t n =1);
+
+        /** The item at an index as a mutable array or dict, making it mutable if it isn't yet.
+            Returns nullptr if the index is out of range or the item isn't an array (or dict.) */
+        MutableArray* getMutableArray(uint32_t index);
+        MutableDict* getMutableDict(uint32_t index);
+
+        /** True if the array, or anything in it, has changed since it was created. */
+        bool isChanged() const;
+
+        /** Writes the array to an Encoder. If it hasn't changed, the original is written with
+            writeValue; so are any unchanged items of a changed array. That means if the
+            Encoder's base (see Encoder::setBase) is the original document, unchanged items
+            become pointers into it instead of copies, and the output is only the changes. */
+        void writeTo(Encoder&) const;
+
+    private:
+        void materialize();
+        void checkIndex(uint32_t index, uint32_t n) const;
+
+        const Array *_source {nullptr};
+        SharedKeys *_sharedKeys {nullptr};
+        std::vector<MutableSlot> _items;
+        bool _materialized {false};     // Has _items been copied from _source yet?
+        bool _changed {false};          // Have items been added or removed?
+    };
+
+
+    /** A mutable wrapper around an immutable Dict. Changed, added and removed entries are
+        kept in a small map that's checked before the original; everything else is read from
+        the original. Nested arrays and dicts become mutable, copy-on-write, only when they're
+        accessed through getMutableArray() or getMutableDict().
+        The original data must remain valid and unchanged while this object is in use. */
+    class MutableDict {
+    public:
+        /** Creates a new, empty dict. */
+        explicit MutableDict(SharedKeys *sk =nullptr)     :_sharedKeys(sk) { }
+
+        /** Wraps an existing Dict. If its keys were encoded with SharedKeys, pass them, so
+            keys can be looked up by string. */
+        explicit MutableDict(const Dict*, SharedKeys* =nullptr);
+
+        const Dict* source() const                  {return _source;}
+
+        uint32_t count() const noexcept             {return _count;}
+
+        /** The value for a key, or nullptr if there isn't one. Also returns nullptr if the
+            value has been made mutable; use getMutableArray/getMutableDict for those. */
+        const Value* get(slice key) const noexcept;
+
+        /** The slot for a key, to change its value through. If the key doesn't exist yet, it's
+            added, with a null value. */
+        MutableSlot& set(slice key);
+
+        /** Removes a key, if it exists. */
+        void remove(slice key);
+
+        /** The value for a key as a mutable array or dict, making it mutable if it isn't yet.
+            Returns nullptr if there's no such key or the value isn't an array (or dict.) */
+        MutableArray* getMutableArray(slice key);
+        MutableDict* getMutableDict(slice key);
+
+        /** True if the dict, or anything in it, has changed since it was created. */
+        bool isChanged() const;
+
+        /** Writes the dict to an Encoder. If it hasn't changed, the original is written with
+            writeValue; so are the unchanged entries of a changed dict, with their original
+            keys. (See MutableArray::writeTo about using the original as the Encoder's base.) */
+        void writeTo(Encoder&) const;
+
+    private:
+        const Value* getSource(slice key) const noexcept;
+        MutableSlot* findChange(slice key) noexcept;
+        MutableSlot* findMutable(slice key, valueType);
+
+        const Dict *_source {nullptr};
+        SharedKeys *_sharedKeys {nullptr};
+        uint32_t _count {0};
+        std::map<std::string, MutableSlot> _changes;    // Entries that may differ from _source
+    };
+
+}
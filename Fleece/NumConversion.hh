@@ -0,0 +1,49 @@
+//
+//  NumConversion.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "slice.hh"
+#include <stdint.h>
+#include <stddef.h>
+
+namespace fleece {
+
+    /** The minimum size of a buffer passed to WriteInteger or WriteFloat. */
+    static const size_t kMinNumberBufferSize = 32;
+
+    /** Writes the decimal form of an integer to `dst`, without a trailing NUL byte.
+        Returns the number of characters written. */
+    size_t WriteInteger(int64_t n, char *dst) noexcept;
+    size_t WriteUInteger(uint64_t n, char *dst) noexcept;
+
+    /** Writes the shortest decimal form of a number that will parse back (with strtod or
+        strtof) to exactly the same value. It's formatted like printf's "%g": exponential
+        notation is used only for very large or small magnitudes. The output doesn't depend on
+        the current locale, and has no trailing NUL byte. Infinities are written as "inf" or
+        "-inf", and NaN as "nan".
+        Returns the number of characters written. */
+    size_t WriteFloat(double n, char *dst) noexcept;
+    size_t WriteFloat(float n, char *dst) noexcept;
+
+    /** Parses a decimal integer, with an optional leading sign, that fills the entire slice.
+        Returns false if the syntax is invalid or the number doesn't fit in the result type. */
+    bool ParseInteger(slice str, int64_t &result) noexcept;
+    bool ParseUInteger(slice str, uint64_t &result) noexcept;
+
+    /** Parses a decimal floating-point number that fills the entire slice, returning the
+        correctly rounded result like strtod, but much faster and independent of the current
+        locale. The syntax is that of JSON, plus an optional '+' sign and an optional integer
+        or fraction part (like ".5" or "5."). Numbers too large for a double become infinity.
+        Returns false if the syntax is invalid. */
+    bool ParseDouble(slice str, double &result) noexcept;
+
+}
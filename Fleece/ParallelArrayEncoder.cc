@@ -0,0 +1,82 @@
+//
+//  ParallelArrayEncoder.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "ParallelArrayEncoder.hh"
+#include "Encoder.hh"
+#include "Array.hh"
+#include "FleeceException.hh"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace fleece {
+
+    ParallelArrayEncoder::ParallelArrayEncoder(unsigned nThreads)
+    :_nThreads(nThreads ? nThreads : std::max(std::thread::hardware_concurrency(), 1u))
+    { }
+
+
+    void ParallelArrayEncoder::writeArray(Encoder &out, size_t count, const ItemWriter &writer) {
+        // Each chunk of items gets encoded as an array of its own, a segment:
+        size_t nChunks = (count + _chunkSize - 1) / _chunkSize;
+        struct segment {
+            alloc_slice output;
+            std::exception_ptr exception;
+        };
+        std::vector<segment> segments(nChunks);
+        std::atomic<size_t> nextChunk {0};
+        std::atomic<bool> failed {false};
+
+        auto work = [&]() {
+            Encoder enc;
+            enc.copyOptionsFrom(out);
+            for (size_t chunk; !failed && (chunk = nextChunk++) < nChunks; ) {
+                try {
+                    size_t start = chunk * _chunkSize;
+                    size_t n = std::min(_chunkSize, count - start);
+                    enc.reset();
+                    enc.beginArray(n);
+                    for (size_t i = start; i < start + n; ++i)
+                        writer(i, enc);
+                    enc.endArray();
+                    segments[chunk].output = enc.extractOutput();
+                    throwIf(Value::fromTrustedData(segments[chunk].output)->asArray()->count() != n,
+                            EncodeError, "ItemWriter must write exactly one value");
+                } catch (...) {
+                    segments[chunk].exception = std::current_exception();
+                    failed = true;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        unsigned nThreads = (unsigned)std::min((size_t)_nThreads, nChunks);
+        for (unsigned t = 1; t < nThreads; ++t)
+            threads.emplace_back(work);
+        work();                                     // The calling thread does its share too
+        for (auto &t : threads)
+            t.join();
+
+        for (auto &seg : segments)
+            if (seg.exception)
+                std::rethrow_exception(seg.exception);
+
+        // Merge the segments, in order, into one array:
+        out.beginArray(count);
+        for (auto &seg : segments)
+            out.writeEncodedArrayItems(seg.output);
+        out.endArray();
+    }
+
+}
@@ -0,0 +1,57 @@
+//
+//  ParallelArrayEncoder.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include <functional>
+#include <stddef.h>
+
+namespace fleece {
+    class Encoder;
+
+
+    /** Encodes a big array on multiple threads. The items are divided into chunks of
+        consecutive items, which worker threads take one at a time as they finish the last, so
+        a thread that gets small items just takes more chunks. Each worker writes its chunks
+        into segments with its own Encoder (and string table); then the segments are copied,
+        in order, into the destination Encoder's array. Fleece pointers are relative, so the
+        segments' data is copied as-is. The workers' Encoders get the destination's options.
+        Strings are uniqued only within a segment, not across segments. That keeps them close
+        to the values that use them, so more collections stay narrow, and the result is
+        usually no bigger than if it had been encoded sequentially.
+        The ItemWriter is called on many threads at once, so it must be thread-safe. The
+        workers' Encoders don't use SharedKeys, which aren't thread-safe. */
+    class ParallelArrayEncoder {
+    public:
+        /** Writes item number `index` to an Encoder, as a single value. */
+        typedef std::function<void(size_t index, Encoder&)> ItemWriter;
+
+        /** The default number of items a worker takes at a time. */
+        static const size_t kDefaultChunkSize = 256;
+
+        /** @param nThreads  Maximum number of threads to use; 0 means one per CPU core. */
+        explicit ParallelArrayEncoder(unsigned nThreads =0);
+
+        /** Sets how many items a worker takes at a time. Smaller chunks balance the work
+            better when items vary a lot in size, but have more overhead. */
+        void setChunkSize(size_t size)              {_chunkSize = size ? size : 1;}
+
+        /** Writes an array of `count` items, produced by calling `writer` for each index, to
+            `out`. If a call to `writer` throws, no more items are started, and the exception
+            is rethrown from here after all the threads have stopped. */
+        void writeArray(Encoder &out, size_t count, const ItemWriter &writer);
+
+    private:
+        unsigned const _nThreads;
+        size_t _chunkSize {kDefaultChunkSize};
+    };
+
+}
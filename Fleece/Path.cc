@@ -8,8 +8,12 @@
 
 #include "Path.hh"
 #include "SharedKeys.hh"
+#include "Encoder.hh"
 #include "FleeceException.hh"
+#include "Internal.hh"
+#include "NumConversion.hh"
 #include "PlatformCompat.hh"
+#include <ctype.h>
 
 using namespace std;
 
@@ -46,17 +50,32 @@ namespace fleece {
                     next = (const uint8_t*)in.end();
                 param = slice(in.buf, next);
             } else if (token == '[') {
-                // Find end of array index:
+                // Find end of array index (or of a filter, which may contain brackets):
                 next = in.findByteOrEnd(']');
-                if (!next)
+                if (in.size > 0 && in[0] == '?') {
+                    int depth = 0;
+                    for (next = (const uint8_t*)in.buf; next < in.end(); ++next) {
+                        if (*next == '[')
+                            ++depth;
+                        else if (*next == ']' && depth-- == 0)
+                            break;
+                    }
+                }
+                if (!next || next >= in.end())
                     FleeceException::_throw(PathSyntaxError, "Missing ']'");
                 param = slice(in.buf, next++);
-                // Parse array index:
-                slice n = param;
-                int64_t i = n.readSignedDecimal();
-                if (_usuallyFalse(n.size > 0 || i > INT32_MAX || i < INT32_MIN))
-                    FleeceException::_throw(PathSyntaxError, "Invalid array index");
-                index = (int32_t)i;
+                if (isMultiComponent(token, param)) {
+                    // Wildcard or filter:
+                    if (param[0] == '*' && param.size > 1)
+                        FleeceException::_throw(PathSyntaxError, "Invalid array index");
+                } else {
+                    // Parse array index:
+                    slice n = param;
+                    int64_t i = n.readSignedDecimal();
+                    if (_usuallyFalse(n.size > 0 || i > INT32_MAX || i < INT32_MIN))
+                        FleeceException::_throw(PathSyntaxError, "Invalid array index");
+                    index = (int32_t)i;
+                }
             } else {
                 FleeceException::_throw(PathSyntaxError, "Invalid path component");
             }
@@ -78,14 +97,27 @@ namespace fleece {
     }
 
 
+    // Is this component a wildcard ("*") or a filter ("?...")?
+    /*static*/ bool Path::isMultiComponent(char token, slice param) noexcept {
+        return param.size > 0 && (param[0] == '*' || (token == '[' && param[0] == '?'));
+    }
+
+
     /*static*/ const Value* Path::eval(slice specifier, SharedKeys *sk, const Value *root) {
         const Value *item = root;
         if (_usuallyFalse(!item))
             return nullptr;
+        bool multi = false;
         forEachComponent(specifier, [&](char token, slice component, int32_t index) {
+            if (isMultiComponent(token, component)) {
+                multi = true;
+                return false;
+            }
             item = Element::eval(token, component, index, sk, item);
             return (item != nullptr);
         });
+        if (multi)
+            return Path((string)specifier, sk).eval(root);
         return item;
     }
 
@@ -94,10 +126,17 @@ namespace fleece {
     :_specifier(specifier)
     {
         forEachComponent(slice(_specifier), [&](char token, slice component, int32_t index) {
-            if (token == '.')
+            if (isMultiComponent(token, component)) {
+                if (component[0] == '*')
+                    _path.emplace_back(Element::kWildcard, nullslice, sk);
+                else
+                    _path.emplace_back(Element::kFilter, slice(&component[1], component.size - 1), sk);
+                _isMulti = true;
+            } else if (token == '.') {
                 _path.emplace_back(component, sk);
-            else
+            } else {
                 _path.emplace_back(index);
+            }
             return true;
         });
     }
@@ -107,6 +146,14 @@ namespace fleece {
         const Value *item = root;
         if (_usuallyFalse(!item))
             return nullptr;
+        if (_usuallyFalse(_isMulti)) {
+            const Value *result = nullptr;
+            forEach(root, [&](const Value *v) {
+                result = v;
+                return false;
+            });
+            return result;
+        }
         for (auto &e : _path) {
             item = e.eval(item);
             if (!item)
@@ -116,12 +163,97 @@ namespace fleece {
     }
 
 
+    const Value* Path::eval(const Value *root, const PathIndex &index) const noexcept {
+        if (root && root == index.root()) {
+            auto value = index.get(slice(_specifier));
+            if (value)
+                return value;
+        }
+        return eval(root);
+    }
+
+
+    bool Path::forEach(const Value *root, const Callback &callback) const {
+        if (_usuallyFalse(!root))
+            return true;
+        return forEach(_path.data(), _path.data() + _path.size(), root, callback);
+    }
+
+    // Evaluates elements [e, end) starting from `item`, calling the callback with each result.
+    /*static*/ bool Path::forEach(const Element *e, const Element *end, const Value *item,
+                                  const Callback &callback)
+    {
+        for (; e != end; ++e) {
+            if (_usuallyTrue(!e->isMulti())) {
+                item = e->eval(item);
+                if (!item)
+                    return true;
+            } else {
+                // Apply the rest of the path to each matching child:
+                if (item->type() == kArray) {
+                    for (Array::iterator i(item->asArray()); i; ++i) {
+                        auto child = i.value();
+                        if (e->matches(child) && !forEach(e + 1, end, child, callback))
+                            return false;
+                    }
+                } else if (item->type() == kDict) {
+                    for (Dict::iterator i(item->asDict()); i; ++i) {
+                        auto child = i.value();
+                        if (e->matches(child) && !forEach(e + 1, end, child, callback))
+                            return false;
+                    }
+                }
+                return true;
+            }
+        }
+        return callback(item);
+    }
+
+
+    /*static*/ void Path::evalMany(const Path* const paths[], size_t count,
+                                     const Value *root, const Value* results[])
+    {
+        // `items` holds the values reached by the elements of the previous path; items[i] is
+        // the value after i elements, so items[0] is the root.
+        vector<const Value*> items;
+        items.push_back(root);
+        const Path *prev = nullptr;
+        for (size_t p = 0; p < count; ++p) {
+            if (_usuallyFalse(paths[p]->_isMulti)) {
+                // A wildcard doesn't lead to a single value, so its prefix can't be shared:
+                results[p] = paths[p]->eval(root);
+                items.resize(1);
+                prev = nullptr;
+                continue;
+            }
+            auto &path = paths[p]->_path;
+            // Skip the elements shared with the previous path, whose results are in `items`:
+            size_t depth = 0;
+            if (prev) {
+                auto &prevPath = prev->_path;
+                size_t maxDepth = min(min(path.size(), prevPath.size()), items.size() - 1);
+                while (depth < maxDepth && path[depth] == prevPath[depth])
+                    ++depth;
+            }
+            items.resize(depth + 1);
+            const Value *item = items.back();
+            for (auto e = path.begin() + depth; item && e != path.end(); ++e) {
+                item = e->eval(item);
+                if (item)
+                    items.push_back(item);
+            }
+            results[p] = (items.size() == path.size() + 1) ? item : nullptr;
+            prev = paths[p];
+        }
+    }
+
+
     const Value* Path::Element::eval(const Value *item) const noexcept {
-        if (_key) {
+        if (_kind == kProperty) {
             auto d = item->asDict();
             if (_usuallyFalse(!d))
                 return nullptr;
-            return d->get(*_key);
+            return d->get(_key);
         } else {
             return getFromArray(item, _index);
         }
@@ -144,6 +276,134 @@ namespace fleece {
     }
 
 
+    // A filter element's parsed expression.
+    struct Path::Element::Filter {
+        enum Op {kExists, kEq, kNe, kLt, kLe, kGt, kGe};
+
+        unique_ptr<Path> property;          // Path from the item, or null for the item itself
+        Op op {kExists};
+        alloc_slice literalData;            // Fleece-encoded value to compare with
+        const Value *literal {nullptr};
+
+        Filter(slice expr, SharedKeys *sk) {
+            expr = trim(expr);
+            if (expr.size >= 2 && expr[0] == '(' && expr[expr.size - 1] == ')')
+                expr = trim(slice(&expr[1], expr.size - 2));
+
+            // The property path ends at the operator, if any:
+            auto end = (const char*)expr.end(), opStart = (const char*)expr.buf;
+            while (opStart < end && !strchr("=!<> ", *opStart))
+                ++opStart;
+            slice prop(expr.buf, opStart);
+            if (prop.size > 0 && prop[0] == '@') {
+                prop.moveStart(1);
+                if (prop.size > 0 && prop[0] == '.')
+                    prop.moveStart(1);
+                else if (prop.size > 0 && prop[0] != '[')
+                    FleeceException::_throw(PathSyntaxError, "Invalid property in filter");
+            }
+            if (prop.size > 0)
+                property.reset(new Path((string)prop, sk));
+            throwIf(property && property->isMulti(), PathSyntaxError,
+                    "Filter property can't have wildcards");
+
+            slice rest = trim(slice(opStart, end));
+            if (rest.size == 0) {
+                throwIf(!property, PathSyntaxError, "Empty filter");
+                return;
+            }
+            static const struct {const char *str; Op op;} kOps[] = {
+                {"==", kEq}, {"!=", kNe}, {"<=", kLe}, {">=", kGe}, {"<", kLt}, {">", kGt}};
+            for (auto &o : kOps) {
+                size_t len = strlen(o.str);
+                if (rest.size >= len && memcmp(rest.buf, o.str, len) == 0) {
+                    op = o.op;
+                    rest = trim(slice(&rest[len], rest.size - len));
+                    break;
+                }
+            }
+            throwIf(op == kExists, PathSyntaxError, "Invalid filter operator");
+            parseLiteral(rest);
+        }
+
+        static slice trim(slice s) {
+            while (s.size > 0 && isspace(s[0]))
+                s.moveStart(1);
+            while (s.size > 0 && isspace(s[s.size - 1]))
+                --s.size;
+            return s;
+        }
+
+        void parseLiteral(slice str) {
+            Encoder enc;
+            int64_t i;
+            double d;
+            if (str.size >= 2 && (str[0] == '\'' || str[0] == '"') && str[str.size-1] == str[0])
+                enc.writeString(slice(&str[1], str.size - 2));
+            else if (str == "true"_sl)
+                enc.writeBool(true);
+            else if (str == "false"_sl)
+                enc.writeBool(false);
+            else if (str == "null"_sl)
+                enc.writeNull();
+            else if (ParseInteger(str, i))
+                enc.writeInt(i);
+            else if (ParseDouble(str, d))
+                enc.writeDouble(d);
+            else
+                FleeceException::_throw(PathSyntaxError, "Invalid literal in filter");
+            literalData = enc.extractOutput();
+            literal = Value::fromTrustedData(literalData);
+        }
+
+        bool matches(const Value *item) const noexcept {
+            if (property)
+                item = property->eval(item);
+            if (!item)
+                return false;
+            if (op == kExists)
+                return true;
+            int cmp;
+            if (item->type() == kNumber && literal->type() == kNumber) {
+                if (item->isInteger() && literal->isInteger() && !item->isUnsigned()) {
+                    int64_t a = item->asInt(), b = literal->asInt();
+                    cmp = (a > b) - (a < b);
+                } else {
+                    double a = item->asDouble(), b = literal->asDouble();
+                    cmp = (a > b) - (a < b);
+                }
+            } else if (item->type() == kString && literal->type() == kString) {
+                cmp = item->asString().compare(literal->asString());
+            } else {
+                // Other types, or mismatched ones, can only be tested for equality:
+                bool equal = item->isEqual(literal);
+                return (op == kEq) ? equal : (op == kNe ? !equal : false);
+            }
+            switch (op) {
+                case kEq:   return cmp == 0;
+                case kNe:   return cmp != 0;
+                case kLt:   return cmp < 0;
+                case kLe:   return cmp <= 0;
+                case kGt:   return cmp > 0;
+                default:    return cmp >= 0;
+            }
+        }
+    };
+
+
+    Path::Element::Element(Kind kind, slice expression, SharedKeys *sk)
+    :_key(expression)
+    ,_kind(kind)
+    {
+        if (kind == kFilter)
+            _filter = make_shared<Filter>(expression, sk);
+    }
+
+    bool Path::Element::matches(const Value *item) const noexcept {
+        return !_filter || _filter->matches(item);
+    }
+
+
     const Value* Path::Element::getFromArray(const Value* item, int32_t index) noexcept {
         auto a = item->asArray();
         if (_usuallyFalse(!a))
@@ -157,4 +417,57 @@ namespace fleece {
         return a->get((uint32_t)index);
     }
 
+
+#pragma mark - PATH INDEX:
+
+
+    /*static*/ alloc_slice PathIndex::create(slice document, const vector<string> &specifiers,
+                                             SharedKeys *sk)
+    {
+        auto root = Value::fromData(document);
+        throwIf(!root, InvalidData, "invalid Fleece document to index");
+        Encoder enc;
+        enc.beginArray(2);
+        enc.writeUInt(document.size);
+        enc.beginDictionary(specifiers.size());
+        for (auto &specifier : specifiers) {
+            Path path(specifier, sk);
+            throwIf(path.isMulti(), PathSyntaxError, "can't index a path with wildcards or filters");
+            auto value = path.eval(root);
+            if (value && value >= document.buf && value < document.end()) {
+                enc.writeKey(slice(specifier));
+                enc.writeUInt((uint8_t*)value - (uint8_t*)document.buf);
+            }
+        }
+        enc.endDictionary();
+        enc.endArray();
+        return enc.extractOutput();
+    }
+
+
+    PathIndex::PathIndex(slice indexData, slice document)
+    :_document(document)
+    ,_root(Value::fromTrustedData(document))
+    ,_offsets(nullptr)
+    {
+        auto index = Value::fromData(indexData);
+        auto array = index ? index->asArray() : nullptr;
+        throwIf(!array || array->count() != 2 || !array->get(1)->asDict(),
+                InvalidData, "invalid PathIndex data");
+        throwIf(array->get(0)->asUnsigned() != document.size,
+                InvalidData, "PathIndex is for a different document");
+        _offsets = array->get(1)->asDict();
+    }
+
+
+    const Value* PathIndex::get(slice specifier) const noexcept {
+        auto offsetValue = _offsets->get(specifier);
+        if (!offsetValue)
+            return nullptr;
+        uint64_t offset = offsetValue->asUnsigned();
+        if (_usuallyFalse(offset + internal::kNarrow > _document.size || (offset & 1)))
+            return nullptr;
+        return (const Value*)_document.offset(offset);
+    }
+
 }
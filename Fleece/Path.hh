@@ -8,13 +8,14 @@
 
 #pragma once
 #include "Array.hh"
-#include <memory>
 #include <string>
 #include <vector>
 #include <functional>
+#include <memory>
 
 namespace fleece {
     class SharedKeys;
+    class PathIndex;
 
     /** Describes a location in a Fleece object tree, as a path from the root that follows
         dictionary properties and array elements.
@@ -22,6 +23,14 @@ namespace fleece {
         It looks like "foo.bar[2][-3].baz" -- that is, properties prefixed with a ".", and array
         indexes in brackets. (Negative indexes count from the end of the array.)
         A leading JSONPath-like "$." is allowed but ignored.
+        A path can also match many values, with JSONPath-like wildcards and filters:
+        - ".*" or "[*]" matches every item of an array, or every value of a dict.
+        - "[?expr]" matches the items (or values) for which `expr` is true. It's a property path
+          relative to the item, such as "@.price" or just "price" ("@" alone is the item
+          itself), optionally followed by a comparison -- "==", "!=", "<", "<=", ">" or ">=" --
+          with a number, a 'string' or "string" (without escapes), true, false or null. Without
+          a comparison it's true if the property exists. Parentheses around it are optional.
+        So "items[?price < 10].name" matches the names of the items that cost less than 10.
         This class is pretty experimental ... syntax may change without warning! */
     class Path {
     public:
@@ -32,34 +41,136 @@ namespace fleece {
         const std::string& specifier() const        {return _specifier;}
         const std::vector<Element>& path() const    {return _path;}
 
+        /** True if the path has wildcards or filters, so it can match more than one value. */
+        bool isMulti() const                        {return _isMulti;}
+
+        /** Evaluates the path. A Path is meant to be compiled once and then evaluated against
+            many documents: each property element remembers the index where it found its key,
+            and checks that index first next time, so documents with the same shape are
+            searched in constant time. (This means a Path shouldn't be evaluated on multiple
+            threads at once.)
+            If the path has wildcards or filters, returns the first value it matches. */
         const Value* eval(const Value *root) const noexcept;
 
-        /** One-shot evaluation; faster if you're only doing it once */
+        /** Evaluates the path, first looking it up in a PathIndex of the document: if `root` is
+            the index's root and the index has this path's specifier, that takes constant time.
+            Otherwise the path is evaluated normally. */
+        const Value* eval(const Value *root, const PathIndex&) const noexcept;
+
+        /** Called with each value a path matches; returns false to stop evaluation. */
+        typedef std::function<bool(const Value*)> Callback;
+
+        /** Evaluates the path, calling the callback with every value it matches, in document
+            order. The matches are found by iterating directly over the arrays and dicts, and
+            each property element looks up its key in all of them with the same cached hint,
+            so nothing is allocated.
+            @return  False if the callback stopped the evaluation, else true. */
+        bool forEach(const Value *root, const Callback&) const;
+
+        /** Evaluates multiple paths against the same root, writing the results to `results`.
+            Each path reuses the traversal of any leading elements it shares with the previous
+            path, so paths with common prefixes (like "address.city" and "address.zip") should
+            be listed next to each other, ideally in sorted order. */
+        static void evalMany(const Path* const paths[], size_t count,
+                             const Value *root, const Value* results[]);
+
+        /** One-shot evaluation; faster if you're only doing it once. (If the path has wildcards
+            or filters, returns the first value it matches.) */
         static const Value* eval(slice specifier, SharedKeys*, const Value *root);
 
         class Element {
         public:
-            Element(slice property, SharedKeys *sk) :_key(new Dict::key(property, sk, false)) { }
-            Element(int32_t arrayIndex)             :_index(arrayIndex) { }
+            enum Kind : uint8_t {
+                kProperty,          ///< ".name": a dict's value for a key
+                kIndex,             ///< "[n]": an array item
+                kWildcard,          ///< ".*" or "[*]": every item of an array or dict
+                kFilter,            ///< "[?expr]": every item or value for which expr is true
+            };
+
+            Element(slice property, SharedKeys *sk) :_key(property, sk, false), _kind(kProperty) { }
+            Element(int32_t arrayIndex)             :_key(nullslice), _index(arrayIndex), _kind(kIndex) { }
+            /** Creates a wildcard, or a filter with an expression (without the "?"). */
+            Element(Kind, slice expression, SharedKeys*);
+
+            /** Evaluates a property or index element. */
             const Value* eval(const Value*) const noexcept;
-            bool isKey() const                      {return _key != nullptr;}
-            Dict::key& key() const                  {return *_key;}
+            /** For a filter, returns true if the value matches; for a wildcard, always true. */
+            bool matches(const Value*) const noexcept;
+
+            Kind kind() const                       {return _kind;}
+            bool isKey() const                      {return _kind == kProperty;}
+            bool isMulti() const                    {return _kind >= kWildcard;}
+            Dict::key& key() const                  {return _key;}
             int32_t index() const                   {return _index;}
 
+            bool operator== (const Element &e) const noexcept {
+                return _kind == e._kind && (_kind == kIndex ? _index == e._index
+                                                            : _key.string() == e._key.string());
+            }
+
             static const Value* eval(char token, slice property, int32_t index, SharedKeys*,
                                      const Value *item) noexcept;
         private:
+            struct Filter;
+
             static const Value* getFromArray(const Value*, int32_t index) noexcept;
 
-            std::unique_ptr<Dict::key> _key {nullptr};
+            mutable Dict::key _key;     // Mutable because it caches the index it was found at
+                                        // (For a filter, holds the expression's text)
             int32_t _index {0};
+            Kind _kind;
+            std::shared_ptr<const Filter> _filter;
         };
 
     private:
         static void forEachComponent(slice in, std::function<bool(char,slice,int32_t)> callback);
+        static bool isMultiComponent(char token, slice param) noexcept;
+        static bool forEach(const Element *e, const Element *end, const Value *item,
+                            const Callback&);
+
+        Path(const Path&) = delete;
+        Path& operator=(const Path&) = delete;
 
-        const std::string _specifier;
+        const std::string _specifier;   // The Elements' keys point into this string
         std::vector<Element> _path;
+        bool _isMulti {false};          // Does _path have wildcards or filters?
+    };
+
+
+    /** A "sidecar" index of a Fleece document, which maps Path specifiers to the values they
+        resolve to, so that reading those paths takes constant time however big the document
+        is. It's a small Fleece document of its own, stored alongside the one it's for: an
+        array of the indexed document's size and a dict mapping each specifier to the offset of
+        its value in the document.
+        Create one with PathIndex::create, or have an Encoder create one (Encoder::indexPaths).
+        Specifiers are matched verbatim, so they have to be written the same way in the Paths
+        that are evaluated with the index. */
+    class PathIndex {
+    public:
+        /** Evaluates each path on the document, and returns the encoded index. Paths that
+            don't resolve to a value are left out. Throws if a path has wildcards or filters,
+            since they don't resolve to a single value. */
+        static alloc_slice create(slice document, const std::vector<std::string> &specifiers,
+                                  SharedKeys* =nullptr);
+
+        /** Opens a PathIndex for a document. The index data is validated, but the document
+            isn't (as with Value::fromTrustedData), so that opening it doesn't take time
+            proportional to its size. Both must remain valid and unchanged while the PathIndex
+            is in use. Throws if the index is invalid, or wasn't made from a document of this
+            size. */
+        PathIndex(slice indexData, slice document);
+
+        /** The root value of the indexed document. */
+        const Value* root() const                   {return _root;}
+
+        /** The value the path with this specifier resolves to, or nullptr if it's not in the
+            index (which includes paths that didn't resolve when the index was created.) */
+        const Value* get(slice specifier) const noexcept;
+
+    private:
+        slice _document;
+        const Value *_root;
+        const Dict *_offsets;
     };
 
 }
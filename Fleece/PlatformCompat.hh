@@ -14,6 +14,7 @@
     #define _usuallyTrue(VAL)               (VAL)
     #define _usuallyFalse(VAL)              (VAL)
     #define NOINLINE                        __declspec(noinline)
+    #define _prefetch(ADDR)                 ((void)0)
 
     #define __has_extension(X)              0
     #define __has_feature(F)                0
@@ -50,6 +51,7 @@
     #define _usuallyTrue(VAL)               __builtin_expect(VAL, true)
     #define _usuallyFalse(VAL)              __builtin_expect(VAL, false)
     #define NOINLINE                        __attribute((noinline))
+    #define _prefetch(ADDR)                 __builtin_prefetch(ADDR)
 
     #ifndef __printflike
     #define __printflike(fmtarg, firstvararg) __attribute__((__format__ (__printf__, fmtarg, firstvararg)))
@@ -9,27 +9,102 @@
 #include "SharedKeys.hh"
 #include "Fleece.hh"
 #include "FleeceException.hh"
+#include <algorithm>
 
 namespace fleece {
     using namespace std;
 
+    typedef std::lock_guard<std::recursive_mutex> lock_guard;
+
+    static const uint32_t kInitialCapacity = 32;
+
+
+    // Hash tables are a power of two in size, and never more than half full.
+    static uint32_t hashTableSize(uint32_t capacity) {
+        uint32_t size = 4;
+        while (size < 2 * capacity)
+            size *= 2;
+        return size;
+    }
+
+
+    SharedKeys::State::State(uint32_t cap)
+    :capacity(cap)
+    ,hashMask(hashTableSize(cap) - 1)
+    ,keys(new slice[cap])
+    ,hashTable(new std::atomic<uint32_t>[hashMask + 1])
+    ,platformStrings(new std::atomic<PlatformString>[cap])
+    {
+        for (uint32_t i = 0; i <= hashMask; ++i)
+            hashTable[i].store(0, std::memory_order_relaxed);
+        for (uint32_t i = 0; i < cap; ++i)
+            platformStrings[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+
+    SharedKeys::SharedKeys() {
+        publishState(kInitialCapacity, 0);
+    }
+
     SharedKeys::~SharedKeys()
     { }
 
 
+    // Creates a State with room for `capacity` keys, holding the first `count` strings in _byKey,
+    // and makes it current. The old State is kept, since lookups may still be reading it.
+    SharedKeys::State* SharedKeys::publishState(uint32_t capacity, uint32_t count) {
+        State *oldState = _state.load(std::memory_order_relaxed);
+        auto state = new State(capacity);
+        _states.emplace_back(state);
+        uint32_t oldCount = oldState ? oldState->count.load(std::memory_order_relaxed) : 0;
+        for (uint32_t key = 0; key < count; ++key) {
+            state->keys[key] = _byKey[key];
+            addToHashTable(state, _byKey[key], key);
+            if (key < oldCount)
+                state->platformStrings[key].store(oldState->platformStrings[key].load());
+        }
+        state->count.store(count, std::memory_order_relaxed);
+        _state.store(state, std::memory_order_release);
+        return state;
+    }
+
+
+    // Adds a key to the State's hash table. Its string must already be in `keys`.
+    void SharedKeys::addToHashTable(State *state, slice str, uint32_t key) {
+        uint32_t i = str.hash() & state->hashMask;
+        while (state->hashTable[i].load(std::memory_order_relaxed) != 0)
+            i = (i + 1) & state->hashMask;
+        state->hashTable[i].store(key + 1, std::memory_order_release);
+    }
+
+
     bool SharedKeys::encode(slice str, int &key) const {
-        // Is this string already encoded?
-        auto &slot = _table.find(str);
-        if (_usuallyTrue(slot.first.buf != nullptr)) {
-            key = slot.second.offset;
-            return true;
+        // The table is never more than half full, so the probe always finds an empty slot.
+        // Entries for keys past `count` are being added right now; ignore them so that a key
+        // can't be encoded before it can be decoded.
+        State *state = currentState();
+        uint32_t count = state->count.load(std::memory_order_acquire);
+        for (uint32_t i = str.hash() & state->hashMask; ; i = (i + 1) & state->hashMask) {
+            uint32_t entry = state->hashTable[i].load(std::memory_order_acquire);
+            if (entry == 0)
+                return false;
+            if (entry <= count && _usuallyTrue(state->keys[entry - 1] == str)) {
+                key = (int)entry - 1;
+                return true;
+            }
         }
-        return false;
     }
 
     bool SharedKeys::encodeAndAdd(slice str, int &key) {
         if (encode(str, key))
             return true;
+        lock_guard lock(_mutex);
+        if (encode(str, key))       // (another thread may have added it in the meantime)
+            return true;
+        if (_usuallyFalse(_training != nullptr)) {
+            trainKey(str);
+            return false;
+        }
         // Should this string be encoded?
         if (count() >= _maxCount || str.size > _maxKeyLength || !isEligibleToEncode(str))
             return false;
@@ -49,57 +124,135 @@ namespace fleece {
 
     slice SharedKeys::decode(int key) const {
         throwIf(key < 0, InvalidData, "key must be non-negative");
-        if (_usuallyFalse(isUnknownKey(key))) {
-            // Unrecognized key -- if not in a transaction, try reloading
-            const_cast<SharedKeys*>(this)->refresh();
-            if (key >= (int)_byKey.size())
-                return nullslice;
-        }
-        return _byKey[key];
+        State *state = currentState();
+        if (_usuallyTrue((uint32_t)key < state->count.load(std::memory_order_acquire)))
+            return state->keys[key];
+        // Unrecognized key -- if not in a transaction, try reloading
+        const_cast<SharedKeys*>(this)->refresh();
+        state = currentState();
+        if ((uint32_t)key >= state->count.load(std::memory_order_acquire))
+            return nullslice;
+        return state->keys[key];
     }
 
     
     SharedKeys::PlatformString SharedKeys::platformStringForKey(int key) const {
         throwIf(key < 0, InvalidData, "key must be non-negative");
-        if ((unsigned)key >= _platformStringsByKey.size())
+        State *state = currentState();
+        if ((uint32_t)key >= state->count.load(std::memory_order_acquire))
             return nullptr;
-        return _platformStringsByKey[key];
+        return state->platformStrings[key].load(std::memory_order_acquire);
     }
 
 
     void SharedKeys::setPlatformStringForKey(int key, SharedKeys::PlatformString platformKey) const {
         throwIf(key < 0, InvalidData, "key must be non-negative");
-        throwIf((unsigned)key >= _byKey.size(), InvalidData, "key is not yet known");
-        auto &strings = const_cast<SharedKeys*>(this)->_platformStringsByKey;
-        if ((unsigned)key >= _platformStringsByKey.size())
-            strings.resize(key + 1);
-        strings[key] = platformKey;
+        lock_guard lock(_mutex);
+        State *state = currentState();
+        throwIf((uint32_t)key >= state->count.load(), InvalidData, "key is not yet known");
+        state->platformStrings[key].store(platformKey, std::memory_order_release);
     }
 
 
     int SharedKeys::add(slice str) {
+        lock_guard lock(_mutex);
+        auto key = (uint32_t)_byKey.size();
         _byKey.emplace_back(str);
         str = _byKey.back();
-        auto id = (uint32_t)count();
-        StringTable::info info{true, id};
-        _table.add(str, info);
-        return id;
+        State *state = currentState();
+        if (key >= state->capacity)
+            state = publishState(2 * state->capacity, key);
+        state->keys[key] = str;
+        addToHashTable(state, str, key);
+        state->count.store(key + 1, std::memory_order_release);
+        return key;
     }
 
 
     void SharedKeys::revertToCount(size_t toCount) {
+        lock_guard lock(_mutex);
         if (toCount >= count()) {
             throwIf(toCount > count(), InternalError, "can't revert to a bigger count");
             return;
         }
+        // Entries can't be removed from a State in place, so replace it. No lookups are running
+        // (see the header), so the old States and the removed strings can be freed now:
         _byKey.resize(toCount);
-        // StringTable doesn't support removing, so rebuild it:
-        _table.clear();
-        uint32_t key = 0;
-        for (auto i = _byKey.begin(); i != _byKey.end(); ++i) {
-            StringTable::info info{true, key++};
-            _table.add(*i, info);
+        publishState(currentState()->capacity, (uint32_t)toCount);
+        _states.erase(_states.begin(), _states.end() - 1);
+    }
+
+
+
+#pragma mark - TRAINING:
+
+
+    void SharedKeys::beginTraining() {
+        lock_guard lock(_mutex);
+        _training.reset(new Training);
+    }
+
+
+    void SharedKeys::train(const Value *v) {
+        lock_guard lock(_mutex);
+        throwIf(!_training, InternalError, "not training");
+        switch (v->type()) {
+            case kArray:
+                for (Array::iterator i(v->asArray()); i; ++i)
+                    train(i.value());
+                break;
+            case kDict:
+                for (Dict::iterator i(v->asDict()); i; ++i) {
+                    int key;
+                    slice str = i.key()->asString();
+                    if (str && !encode(str, key))
+                        trainKey(str);
+                    train(i.value());
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+
+    // Counts an occurrence of a string that isn't mapped yet.
+    void SharedKeys::trainKey(slice str) {
+        auto i = _training->counts.find(str);
+        if (i != _training->counts.end()) {
+            ++i->second.count;
+        } else if (str.size <= kMaxTrainedKeyLength && isEligibleToEncode(str)) {
+            _training->strings.emplace_back(str);
+            Training::Frequency freq = {1, (uint32_t)_training->counts.size()};
+            _training->counts[_training->strings.back()] = freq;
+        }
+    }
+
+
+    size_t SharedKeys::endTraining(unsigned minCount) {
+        lock_guard lock(_mutex);
+        throwIf(!_training, InternalError, "not training");
+        std::unique_ptr<Training> training(std::move(_training));
+
+        typedef std::pair<slice, Training::Frequency> entry;
+        std::vector<entry> entries;
+        for (auto &e : training->counts)
+            if (e.second.count >= minCount)
+                entries.push_back(e);
+        std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+            if (a.second.count != b.second.count)
+                return a.second.count > b.second.count;
+            return a.second.order < b.second.order;
+        });
+
+        size_t added = 0;
+        for (auto &e : entries) {
+            if (count() >= _maxCount)
+                break;
+            add(e.first);
+            ++added;
         }
+        return added;
     }
 
 
@@ -112,11 +265,13 @@ namespace fleece {
 
     
     bool PersistentSharedKeys::refresh() {
+        lock_guard lock(_mutex);
         return !_inTransaction && read();
     }
 
 
     void PersistentSharedKeys::transactionBegan() {
+        lock_guard lock(_mutex);
         throwIf(_inTransaction, InternalError, "already in transaction");
         _inTransaction = true;
         read();     // Catch up with any external changes
@@ -124,6 +279,7 @@ namespace fleece {
 
     
     void PersistentSharedKeys::transactionEnded() {
+        lock_guard lock(_mutex);
         if (_inTransaction) {
             _committedPersistedCount = _persistedCount;
             _inTransaction = false;
@@ -133,6 +289,7 @@ namespace fleece {
 
     // Subclass's read() method calls this
     bool PersistentSharedKeys::loadFrom(slice fleeceData) {
+        lock_guard lock(_mutex);
         throwIf(changed(), InternalError, "can't load when already changed");
         const Value *v = Value::fromData(fleeceData);
         if (!v)
@@ -141,15 +298,42 @@ namespace fleece {
         if (!strs)
             return false;
 
-        Array::iterator i(strs);
-        if (i.count() <= count())
+        // Each appended segment's first item is the previous root; walk back to the first one:
+        std::vector<const Array*> segments;
+        size_t total = 0;
+        while (strs) {
+            segments.push_back(strs);
+            const Array *prev = strs->count() > 0 ? strs->get(0)->asArray() : nullptr;
+            total += strs->count() - (prev != nullptr);
+            strs = prev;
+        }
+
+        // Appends must be relative to the exact data in storage, so keep a copy of it:
+        if (fleeceData != slice(_persistedData.data(), _persistedData.size())) {
+            _persistedData.assign((const uint8_t*)fleeceData.buf,
+                                  (const uint8_t*)fleeceData.end());
+            _logSegments = (unsigned)segments.size() - 1;
+        }
+
+        if (total <= count())
             return false;
-        i += (unsigned)count();           // Start at the first new string
-        for (; i; ++i) {
-            slice str = i.value()->asString();
-            if (!str)
-                return false;
-            SharedKeys::add(str);
+        size_t skip = count();            // Start at the first new string
+        for (auto seg = segments.rbegin(); seg != segments.rend(); ++seg) {
+            Array::iterator i(*seg);
+            if (seg != segments.rbegin())
+                ++i;                      // Skip the pointer to the previous segment
+            if (skip >= i.count()) {
+                skip -= i.count();
+                continue;
+            }
+            i += (unsigned)skip;
+            skip = 0;
+            for (; i; ++i) {
+                slice str = i.value()->asString();
+                if (!str)
+                    return false;
+                SharedKeys::add(str);
+            }
         }
         _committedPersistedCount = _persistedCount = count();
         return true;
@@ -157,25 +341,67 @@ namespace fleece {
 
 
     void PersistentSharedKeys::save() {
+        lock_guard lock(_mutex);
         if (!changed())
             return;
+        if (!saveIncrementally())
+            saveAll();
+        _persistedCount = count();
+    }
+
+
+    // Appends a segment containing just the new strings, if possible.
+    bool PersistentSharedKeys::saveIncrementally() {
+        if (!_canAppend || _persistedData.empty() || _logSegments >= kMaxLogSegments)
+            return false;
+        slice base(_persistedData.data(), _persistedData.size());
+        Encoder enc;
+        enc.setBase(base);
+        enc.beginArray(count() - _persistedCount + 1);
+        enc.writeValue(Value::fromTrustedData(base));    // Pointer to previous root
+        for (auto i = byKey().begin() + _persistedCount; i != byKey().end(); ++i)
+            enc.writeString(*i);
+        enc.endArray();
+        alloc_slice segment = enc.extractOutput();
+        if (!append(segment)) {     // subclass hook
+            _canAppend = false;
+            return false;
+        }
+        _persistedData.insert(_persistedData.end(),
+                              (const uint8_t*)segment.buf, (const uint8_t*)segment.end());
+        ++_logSegments;
+        return true;
+    }
+
+
+    // Writes all the strings, replacing the persisted data.
+    void PersistentSharedKeys::saveAll() {
         Encoder enc;
         enc.beginArray(count());
         for (auto i = byKey().begin(); i != byKey().end(); ++i)
             enc.writeString(*i);
         enc.endArray();
-        write(enc.extractOutput());     // subclass hook
-        _persistedCount = count();
+        alloc_slice data = enc.extractOutput();
+        write(data);                // subclass hook
+        _persistedData.assign((const uint8_t*)data.buf, (const uint8_t*)data.end());
+        _logSegments = 0;
     }
 
 
     void PersistentSharedKeys::revert() {
+        lock_guard lock(_mutex);
         revertToCount(_committedPersistedCount);
+        if (_persistedCount > _committedPersistedCount) {
+            // Storage is rolling back whatever was saved, and the copy of it is now wrong:
+            _persistedData.clear();
+            _logSegments = 0;
+        }
         _persistedCount = _committedPersistedCount;
     }
 
 
     int PersistentSharedKeys::add(slice str) {
+        lock_guard lock(_mutex);
         throwIf(!_inTransaction, InternalError, "not in transaction");
         return SharedKeys::add(str);
     }
@@ -7,16 +7,28 @@
 //
 
 #pragma once
-#include "StringTable.hh"
+#include "slice.hh"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 
 namespace fleece {
+    class Value;
 
     /** Keeps track of a set of dictionary keys that are stored in abbreviated (small integer) form.
 
         Encoders can be configured to use an instance of this, and will use it to abbreviate keys
-        that are given to them as strings. (Note: This class is not thread-safe!)
+        that are given to them as strings.
+
+        This class is thread-safe, except for revertToCount. Lookups (encode, decode, count,
+        platformStringForKey) don't lock or write to shared memory: they read an immutable
+        snapshot of the mapping that's atomically replaced when it has to grow. (Snapshots
+        double in size when they grow, so keeping the replaced ones around for lookups that may
+        still be using them costs less than the current one.) Methods that add keys are
+        serialized by a mutex.
 
         The Dict class does _not_ use this; it has no outside context to be able to find shared
         state such as this object. The client is responsible for using this object to map between
@@ -24,7 +36,7 @@ namespace fleece {
     class SharedKeys {
     public:
 
-        SharedKeys() { }
+        SharedKeys();
         virtual ~SharedKeys();
 
         /** Sets the maximum number of keys that can be stored in the mapping. After this number is
@@ -35,7 +47,7 @@ namespace fleece {
         void setMaxKeyLength(size_t m)          {_maxKeyLength = m;}
 
         /** The number of stored keys. */
-        size_t count() const                    {return _table.count();}
+        size_t count() const                    {return currentState()->count.load(std::memory_order_acquire);}
 
         /** Maps a string to an integer, or returns false if there is no mapping. */
         bool encode(slice string, int &key) const;
@@ -47,23 +59,50 @@ namespace fleece {
         /** Decodes an integer back to a string. */
         slice decode(int key) const;
 
-        /** A vector whose indices are encoded keys and values are the strings. */
+        /** A vector whose indices are encoded keys and values are the strings.
+            (Unlike the other accessors, this must not be called while keys are being added.) */
         const std::vector<alloc_slice>& byKey() const   {return _byKey;}
 
         /** Reverts the mapping to an earlier state by removing the mappings with keys greater than
-            or equal to the new count. (I.e. it truncates the byKey vector.) */
+            or equal to the new count. (I.e. it truncates the byKey vector.) This frees the
+            removed strings and the replaced snapshots, so unlike the other methods it must not
+            be called while other threads may be using this object, and strings returned by
+            decode() for the removed keys become invalid. */
         void revertToCount(size_t count);
 
         /** Determines whether a new string should be added. Default implementation returns true
             if the string contains only alphanumeric characters, '_' or '-'. */
         virtual bool isEligibleToEncode(slice str);
 
-        bool isUnknownKey(int key) const                {return key >= (int)_byKey.size();}
+        bool isUnknownKey(int key) const                {return key >= (int)count();}
 
         virtual bool refresh()                          {return false;}
 
+        /////// Training:
+
+        /** Starts learning which keys are the most common, so that they can be given the
+            lowest numbers instead of being numbered in the order they're first seen.
+            While training, encodeAndAdd() counts each eligible string it doesn't already know,
+            instead of adding it; so encoding a sample of documents trains the mapping (although
+            those documents will have string keys.) train() can also be used to count the keys
+            of existing documents. Keys that are already mapped are unaffected. */
+        void beginTraining();
+
+        /** Counts the string keys of all dicts in a value, including nested ones. */
+        void train(const Value*);
+
+        bool isTraining() const                         {return _training != nullptr;}
+
+        /** Ends training, adding the keys that were counted at least `minCount` times in
+            descending order of frequency (ties in the order they were first seen), until the
+            max count is reached. Frequent keys can be longer than the max key length, up to
+            kMaxTrainedKeyLength bytes, since the space saved makes up for them. Returns the
+            number of keys added. (With PersistentSharedKeys, call this in a transaction.) */
+        size_t endTraining(unsigned minCount =2);
+
         static const size_t kDefaultMaxCount = 2048;        // Max number of keys to store
         static const size_t kDefaultMaxKeyLength = 16;      // Max length of string to store
+        static const size_t kMaxTrainedKeyLength = 64;      // Max length of string trained on
 
         typedef const void* PlatformString;
 
@@ -72,16 +111,45 @@ namespace fleece {
         void setPlatformStringForKey(int key, PlatformString) const;
         PlatformString platformStringForKey(int key) const;
 
+    protected:
+        /** Serializes changes to the mapping. Subclasses must hold it while modifying state. */
+        mutable std::recursive_mutex _mutex;
+
     private:
         friend class PersistentSharedKeys;
 
-        virtual int add(slice string);
+        // An immutable-except-for-appending snapshot of the mapping. Readers only ever see
+        // fully-written entries: an entry is filled in before `count` is incremented past it.
+        struct State {
+            State(uint32_t capacity);
+            std::atomic<uint32_t> count {0};        // Number of keys
+            const uint32_t capacity;                // Max keys before a bigger State is needed
+            const uint32_t hashMask;                // Size of hash table, minus 1
+            std::unique_ptr<slice[]> keys;          // Reverse mapping, int->slice
+            std::unique_ptr<std::atomic<uint32_t>[]> hashTable; // Maps hash to key+1, or 0
+            std::unique_ptr<std::atomic<PlatformString>[]> platformStrings; // int->platform key
+        };
+
+        State* currentState() const             {return _state.load(std::memory_order_acquire);}
+        State* publishState(uint32_t capacity, uint32_t count);
+        static void addToHashTable(State*, slice, uint32_t key);
 
-        fleece::StringTable _table;                     // Hash table mapping slice->int
-        std::vector<alloc_slice> _byKey;                // Reverse mapping, int->slice
-        std::vector<PlatformString> _platformStringsByKey; // Reverse mapping, int->platform key
+        virtual int add(slice string);
+        void trainKey(slice string);
+
+        // Key frequencies counted during training:
+        struct Training {
+            struct Frequency {uint32_t count; uint32_t order;};
+            std::unordered_map<slice, Frequency, sliceHash> counts;
+            std::vector<alloc_slice> strings;       // Owns the keys of `counts`
+        };
+
+        std::atomic<State*> _state {nullptr};           // Current snapshot, read without locking
+        std::vector<std::unique_ptr<State>> _states;    // Old States that may be in use, & current
+        std::vector<alloc_slice> _byKey;                // Owns the key strings
         size_t _maxCount {kDefaultMaxCount};            // Max number of strings I will hold
         size_t _maxKeyLength {kDefaultMaxKeyLength};    // Max length of string I will add
+        std::unique_ptr<Training> _training;            // Non-null while training
     };
 
 
@@ -89,6 +157,12 @@ namespace fleece {
     /** Subclass of SharedKeys that supports persistence of the string-to-int mapping via some
         kind of transactional storage.
 
+        The persisted data is a Fleece array of the strings. If the subclass implements append(),
+        save() writes only the strings added since the last save, as a small Fleece document that
+        extends the persisted one: its root is an array whose first item points to the previous
+        root, followed by the new strings. So the cost of a save is proportional to the number
+        of new keys. After kMaxLogSegments appends, save() compacts the data by writing it all.
+
         Note: This is an abstract class. You must implement the read() and write() methods to
         implement the actual persistence. */
     class PersistentSharedKeys : public SharedKeys {
@@ -105,7 +179,8 @@ namespace fleece {
         void save();
 
         /** Reverts to persisted state as of the end of the last transaction.
-            Call if aborting a transaction, or a transaction failed to commit. */
+            Call if aborting a transaction, or a transaction failed to commit.
+            Like revertToCount, this must not be called while other threads are using the keys. */
         void revert();
 
         /** Call this after a transaction ends, after calling save() or revert(). */
@@ -114,6 +189,9 @@ namespace fleece {
         /** Returns true if the table has changed from its persisted state. */
         bool changed() const                    {return _persistedCount < count();}
 
+        /** Max number of appended segments before save() rewrites all the data. */
+        static const unsigned kMaxLogSegments = 32;
+
     protected:
         /** Abstract: Should read the persisted data and call loadFrom() with it. */
         virtual bool read() =0;
@@ -121,14 +199,24 @@ namespace fleece {
         /** Abstract: Should write the given encoded data to persistent storage. */
         virtual void write(slice encodedData) =0;
 
+        /** Should append the given data to the persisted data, so that read() will pass the
+            concatenation to loadFrom(). The default implementation returns false, meaning that
+            appending isn't supported; then save() always calls write() with all the data. */
+        virtual bool append(slice encodedData)  {return false;}
+
         /** Updates state given previously-persisted data. */
         bool loadFrom(slice fleeceData);
 
     private:
         virtual int add(slice str) override;
+        bool saveIncrementally();
+        void saveAll();
 
         size_t _persistedCount {0};             // Number of strings written to storage
         size_t _committedPersistedCount {0};    // Number of strings written to storage & committed
         bool _inTransaction {false};            // True during a transaction
+        std::vector<uint8_t> _persistedData;    // Copy of the data in storage (if known)
+        unsigned _logSegments {0};              // Number of segments appended to _persistedData
+        bool _canAppend {true};                 // False if append() isn't implemented
     };
 }
@@ -0,0 +1,93 @@
+//
+//  StringCache.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "StringCache.hh"
+#include "Value.hh"
+#include "Internal.hh"
+#include "PlatformCompat.hh"
+
+namespace fleece {
+
+    using namespace internal;
+
+
+    StringCache::StringCache(Converter converter, Releaser releaser, void *context,
+                             bool threadSafe)
+    :_converter(converter),
+     _releaser(releaser),
+     _context(context),
+     _threadSafe(threadSafe)
+    { }
+
+    StringCache::~StringCache() {
+        clear();
+    }
+
+    // Returns a lock on the mutex if the cache is thread-safe, else an empty one.
+    std::unique_lock<std::mutex> StringCache::lock() const {
+        if (_threadSafe)
+            return std::unique_lock<std::mutex>(_mutex);
+        return std::unique_lock<std::mutex>();
+    }
+
+    bool StringCache::isCacheable(const Value *v) noexcept {
+        if (!v || v->type() != kString)
+            return false;
+        size_t size = v->asString().size;
+        return size >= kMinSharedStringSize && size <= kMaxSharedStringSize;
+    }
+
+    StringCache::PlatformString StringCache::get(const Value *v) {
+        if (!isCacheable(v))
+            return nullptr;
+        {
+            auto l = lock();
+            auto i = _strings.find(v);
+            if (_usuallyTrue(i != _strings.end()))
+                return i->second;
+        }
+        // Convert without holding the lock, since the converter may be slow:
+        PlatformString str = _converter(_context, v->asString());
+        if (!str)
+            return nullptr;
+        PlatformString existing;
+        {
+            auto l = lock();
+            auto result = _strings.emplace(v, str);
+            if (_usuallyTrue(result.second))
+                return str;
+            existing = result.first->second;
+        }
+        // Another thread converted the same string meanwhile; use that one instead:
+        if (_releaser)
+            _releaser(_context, str);
+        return existing;
+    }
+
+    size_t StringCache::count() const {
+        auto l = lock();
+        return _strings.size();
+    }
+
+    void StringCache::clear() {
+        std::unordered_map<const Value*, PlatformString> strings;
+        {
+            auto l = lock();
+            strings.swap(_strings);
+        }
+        if (_releaser) {
+            for (auto &entry : strings)
+                _releaser(_context, entry.second);
+        }
+    }
+
+}
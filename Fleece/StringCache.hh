@@ -0,0 +1,80 @@
+//
+//  StringCache.hh
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#pragma once
+#include "slice.hh"
+#include <mutex>
+#include <unordered_map>
+
+namespace fleece {
+    class Value;
+
+
+    /** Caches the platform (host-language) strings that string Values have been converted to,
+        so a string that appears many times in a document is only converted once. This is the
+        same idea as the strings table the Objective-C API uses, made available to any binding.
+
+        It works because the Encoder uniques short strings (2 to 15 bytes): every occurrence of
+        one in a document is a pointer to the same Value, so the Value's address identifies the
+        string. Longer strings aren't uniqued, so they aren't cached; get() returns nullptr for
+        them and the caller should convert them itself.
+
+        Since entries are keyed by address, the cache must be cleared (or deleted) before the
+        data it's been used with is freed, or a different string at the same address would
+        get the old one's platform string. */
+    class StringCache {
+    public:
+        typedef const void* PlatformString;
+
+        /** Converts a string to a platform string; the cache then owns the result. */
+        typedef PlatformString (*Converter)(void *context, slice str);
+
+        /** Frees a platform string created by the Converter. */
+        typedef void (*Releaser)(void *context, PlatformString);
+
+        /** Creates a cache. The Releaser may be nullptr, if the platform strings don't need to
+            be freed. If `threadSafe` is true the cache can be used from multiple threads at
+            once (the Converter may then be called on any of them.) */
+        StringCache(Converter, Releaser, void *context, bool threadSafe =false);
+
+        /** Releases all the cached platform strings. */
+        ~StringCache();
+
+        /** Returns the platform string for a string Value, converting it the first time. The
+            result belongs to the cache, and remains valid until the cache is cleared.
+            Returns nullptr if the Value isn't a string, or isn't one that can be cached. */
+        PlatformString get(const Value*);
+
+        /** True if the Value is a string whose platform string can be cached. */
+        static bool isCacheable(const Value*) noexcept;
+
+        /** The number of cached strings. */
+        size_t count() const;
+
+        /** Releases all the cached platform strings. */
+        void clear();
+
+    private:
+        std::unique_lock<std::mutex> lock() const;
+
+        StringCache(const StringCache&) = delete;
+        StringCache& operator=(const StringCache&) = delete;
+
+        Converter const _converter;
+        Releaser const _releaser;
+        void* const _context;
+        bool const _threadSafe;
+        mutable std::mutex _mutex;          // Only used if _threadSafe
+        std::unordered_map<const Value*, PlatformString> _strings;
+    };
+
+}
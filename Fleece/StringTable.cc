@@ -19,6 +19,14 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FL_STRINGTABLE_SSE2
+    #include <emmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
 namespace fleece {
 
     static_assert(sizeof(StringTable::info) == 8, "info isn't packed");
@@ -34,32 +42,86 @@ namespace fleece {
     }
 
     StringTable::~StringTable() {
-        if (_table != _initialTable)
+        if (_table != _initialTable) {
             ::free(_table);
+            ::free(_control);
+        }
     }
 
     void StringTable::clear() noexcept {
         ::memset(_table, 0, _size * sizeof(slot));
+        ::memset(_control, 0, _size + kGroupSize);
         _count = 0;
     }
 
+    // The control byte of an occupied slot: the high 7 bits of its hash (the table index comes
+    // from the low bits), with the high bit set so that it's never 0.
+    static inline uint8_t fingerprint(uint32_t hash) noexcept {
+        return (uint8_t)(0x80 | (hash >> 25));
+    }
+
+#ifdef FL_STRINGTABLE_SSE2
+    static inline unsigned lowestBit(unsigned mask) noexcept {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return index;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+#endif
+
     StringTable::slot& StringTable::find(fleece::slice key, uint32_t hash) const noexcept {
         assert(key.buf != nullptr);
-        size_t index = hash & (_size - 1);
-        slot *s = &_table[index];
-        if (_usuallyFalse(s->first.buf != nullptr && s->first != key)) {
-            slot *end = &_table[_size];
-            do {
-                if (++s >= end)
-                    s = &_table[0];
-            } while (_usuallyFalse(s->first.buf != nullptr && s->first != key));
+        // The table is never full, so the probe always ends at an empty slot.
+        size_t mask = _size - 1;
+        size_t index = hash & mask;
+        uint8_t fp = fingerprint(hash);
+        slot *s;
+#ifdef FL_STRINGTABLE_SSE2
+        // Probe a group of 16 control bytes at a time. The control array has copies of the
+        // first kGroupSize bytes at its end, so a group starting near the end doesn't wrap.
+        const __m128i fpVec = _mm_set1_epi8((char)fp), zero = _mm_setzero_si128();
+        for (;;) {
+            __m128i group = _mm_loadu_si128((const __m128i*)&_control[index]);
+            unsigned empty = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, zero));
+            unsigned match = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(group, fpVec));
+            if (empty)
+                match &= (empty & (0 - empty)) - 1;     // Ignore matches past the first empty slot
+            while (match) {
+                s = &_table[(index + lowestBit(match)) & mask];
+                if (_usuallyTrue(s->first == key))
+                    return *s;
+                match &= match - 1;
+            }
+            if (empty) {
+                s = &_table[(index + lowestBit(empty)) & mask];
+                break;
+            }
+            index = (index + kGroupSize) & mask;
         }
-        if (s->first.buf == nullptr) {
-            s->second.hash = hash;
+#else
+        for (;; index = (index + 1) & mask) {
+            uint8_t control = _control[index];
+            if (control == 0)
+                break;
+            if (control == fp && _usuallyTrue(_table[index].first == key))
+                return _table[index];
         }
+        s = &_table[index];
+#endif
+        s->second.hash = hash;
         return *s;
     }
 
+    void StringTable::setControl(const slot &s, uint32_t hash) noexcept {
+        size_t index = &s - _table;
+        _control[index] = fingerprint(hash);
+        if (index < kGroupSize)
+            _control[_size + index] = fingerprint(hash);
+    }
+
     bool StringTable::_add(fleece::slice key, uint32_t h, const info& n) noexcept {
         slot &s = find(key, h);
         if (s.first.buf)
@@ -68,6 +130,7 @@ namespace fleece {
             s.first = key;
             s.second = n;
             s.second.hash = h;
+            setControl(s, h);
             return true;
         }
     }
@@ -79,6 +142,7 @@ namespace fleece {
         auto hash = s.second.hash;
         s.second = n;
         s.second.hash = hash;
+        setControl(s, hash);
         incCount();
     }
 
@@ -89,29 +153,40 @@ namespace fleece {
 
     void StringTable::allocTable(size_t size) {
         slot* table;
+        uint8_t *control;
         if (size <= kInitialTableSize) {
             table = _initialTable;
+            control = _initialControl;
             memset(table, 0, sizeof(_initialTable));
+            memset(control, 0, sizeof(_initialControl));
             size = kInitialTableSize;
         } else {
             table = (slot*)::calloc(size, sizeof(slot));
-            if (!table)
+            control = (uint8_t*)::calloc(size + kGroupSize, 1);
+            if (!table || !control) {
+                ::free(table);
+                ::free(control);
                 throw std::bad_alloc();
+            }
         }
         _table = table;
+        _control = control;
         _size = size;
         _maxCount = (size_t)(size * kMaxLoad);
     }
 
     void StringTable::grow() {
         slot *oldTable = _table, *end = &_table[_size];
+        uint8_t *oldControl = _control;
         allocTable(2*_size);
         for (auto s = oldTable; s < end; ++s) {
             if (s->first.buf != nullptr)
                 _add(s->first, s->second.hash, s->second);
         }
-        if (oldTable != _initialTable)
+        if (oldTable != _initialTable) {
             ::free(oldTable);
+            ::free(oldControl);
+        }
     }
 
 }
@@ -12,7 +12,10 @@
 
 namespace fleece {
 
-    /** Internal hash table mapping strings (slices) to offsets (uint32_t). */
+    /** Internal hash table mapping strings (slices) to offsets (uint32_t).
+        Alongside the slots is a packed array of one-byte control codes, each either 0 (empty) or
+        7 bits of the slot's hash. Probing scans the control bytes (16 at a time, with SIMD where
+        available) and only looks at a slot, and compares its string, on a fingerprint match. */
     class StringTable {
     public:
         StringTable(size_t capacity =0);
@@ -59,16 +62,20 @@ namespace fleece {
         void allocTable(size_t size);
         slot& find(fleece::slice key, uint32_t hash) const noexcept;
         bool _add(slice, uint32_t h, const info&) noexcept;
+        void setControl(const slot&, uint32_t hash) noexcept;
         void incCount()                             {if (++_count > _maxCount) grow();}
         void grow();
 
         static const size_t kInitialTableSize = 64;
+        static const size_t kGroupSize = 16;        // Number of control bytes probed at once
 
         slot *_table;
+        uint8_t *_control;      // _size control bytes, then copies of the first kGroupSize
         size_t _size;
         size_t _count;
         size_t _maxCount;
         slot _initialTable[kInitialTableSize];
+        uint8_t _initialControl[kInitialTableSize + kGroupSize];
     };
 
 }
@@ -15,92 +15,111 @@
 
 #include "Value.hh"
 #include "Array.hh"
+#include "Writer.hh"
+#include "SharedKeys.hh"
+#include "varint.hh"
+#include "PlatformCompat.hh"
+#include <algorithm>
+#include <stdarg.h>
+#include <stdio.h>
 #include <ostream>
 #include <iomanip>
 #include <map>
 #include <sstream>
+#include <unordered_set>
+#include <vector>
 
 namespace fleece {
     using namespace internal;
 
-    void Value::writeDumpBrief(std::ostream &out, const void *base, bool wide) const {
+    static void writef(Writer &out, const char *fmt, ...) __printflike(2, 3);
+
+    static void writef(Writer &out, const char *fmt, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        out.write(buf, std::min((size_t)n, sizeof(buf) - 1));
+    }
+
+    void Value::writeDumpBrief(Writer &out, const void *base, int width) const {
         if (tag() >= kPointerTagFirst)
-            out << "&";
+            out << slice("&");
         switch (tag()) {
             case kSpecialTag:
             case kShortIntTag:
             case kIntTag:
             case kFloatTag:
             case kStringTag:
-                out << std::string(toJSON());
+                toJSON(out);
                 break;
             case kBinaryTag:
                 // TODO: show data
-                out << "Binary[";
-                out << std::string(toJSON());
-                out << "]";
+                out << slice("Binary[");
+                toJSON(out);
+                out << slice("]");
                 break;
             case kArrayTag: {
-                out << "Array[" << asArray()->count() << "]";
+                writef(out, "Array[%u]", asArray()->count());
                 break;
             }
             case kDictTag: {
-                out << "Dict[" << asDict()->count() << "]";
+                writef(out, "Dict[%u]", asDict()->count());
                 break;
             }
             default: { // Pointer:
-                deref(this, wide)->writeDumpBrief(out, base, true);
-                auto offset = - (int64_t)(wide ? pointerValue<true>() : pointerValue<false>());
-                char buf[32];
+                derefItem(this, width)->writeDumpBrief(out, base, kWide);
+                int64_t offset;
+                if (width == kExtraWide)
+                    offset = - (int64_t)extraWidePointerValue();
+                else
+                    offset = - (int64_t)(width == kWide ? pointerValue<true>() : pointerValue<false>());
                 if (base)
-                    sprintf(buf, " (@%04llx)", (long long)((_byte + offset) - (uint8_t*)base)); // absolute
+                    writef(out, " (@%04llx)", (long long)((_byte + offset) - (uint8_t*)base)); // absolute
                 else
-                    sprintf(buf, " (@-%04llx)", (long long)-offset);
-                out << buf;
+                    writef(out, " (@-%04llx)", (long long)-offset);
                 break;
             }
         }
     }
 
     // writes an ASCII dump of this value and its contained values (NOT following pointers).
-    void Value::dump(std::ostream &out, bool wide, int indent, const void *base) const {
+    void Value::dump(Writer &out, int width, int indent, const void *base) const {
         size_t pos = _byte - (uint8_t*)base;
-        char buf[64];
-        sprintf(buf, "%04zx: %02x %02x", pos, _byte[0], _byte[1]);
-        out << buf;
+        writef(out, "%04zx: %02x %02x", pos, _byte[0], _byte[1]);
         auto size = dataSize();
-        if (wide && size < kWide)
-            size = kWide;
+        if (size < (size_t)width)
+            size = width;
         if (size > 2) {
-            sprintf(buf, " %02x %02x", _byte[2], _byte[3]);
-            out << buf;
-            out << (size > 4 ? "…" : " ");
+            writef(out, " %02x %02x", _byte[2], _byte[3]);
+            out << slice(size > 4 ? "…" : " ");
         } else {
-            out << "       ";
+            out << slice("       ");
         }
-        out << ": ";
+        out << slice(": ");
 
         while (indent-- > 0)
-            out << "  ";
-        writeDumpBrief(out, base, (size > 2));
+            out << slice("  ");
+        writeDumpBrief(out, base, width);
         switch (tag()) {
             case kArrayTag: {
-                out << ":\n";
+                out << slice(":\n");
                 for (auto i = asArray()->begin(); i; ++i) {
-                    i.rawValue()->dump(out, isWideArray(), 1, base);
+                    i.rawValue()->dump(out, i._a._width, 1, base);
                 }
                 break;
             }
             case kDictTag: {
-                out << ":\n";
+                out << slice(":\n");
                 for (auto i = asDict()->begin(); i; ++i) {
-                    i.rawKey()  ->dump(out, isWideArray(), 1, base);
-                    i.rawValue()->dump(out, isWideArray(), 2, base);
+                    i.rawKey()  ->dump(out, i._a._width, 1, base);
+                    i.rawValue()->dump(out, i._a._width, 2, base);
                 }
                 break;
             }
             default:
-                out << "\n";
+                out << slice("\n");
                 break;
         }
     }
@@ -142,9 +161,153 @@ namespace fleece {
         if (actualRoot != root)
             actualRoot->mapAddresses(byAddress);
         // Dump them ordered by address:
+        Writer writer;
         for (auto &i : byAddress) {
-            i.second->dump(out, false, 0, data.buf);
+            i.second->dump(writer, kNarrow, 0, data.buf);
         }
+        alloc_slice output = writer.extractOutput();
+        out.write((const char*)output.buf, output.size);
+        return true;
+    }
+
+
+#pragma mark - LINEAR DUMP:
+
+
+    // Returns the number of bytes of the value (including a collection's items) at `pos`,
+    // up to `end`, or 0 if it doesn't look like a valid value or doesn't fit.
+    // A pointer can only be the root, which is 4 bytes if it's wide: then it's followed by a
+    // narrow pointer back to it, as the trailer.
+    static size_t linearSize(const uint8_t *pos, const uint8_t *end) noexcept {
+        if (end - pos < 2)
+            return 0;
+        auto v = (const Value*)pos;
+        if (pos[0] & 0x80) {
+            // Pointer (see above):
+            return (end - pos >= 6 && pos[4] == 0x80 && pos[5] == 0x02) ? kWide : kNarrow;
+        }
+        size_t size;
+        switch (v->type()) {
+            case kString:
+            case kData: {
+                size = 1;
+                uint32_t length = pos[0] & 0x0F;
+                if (length == 0x0F) {
+                    size_t lengthSize = GetUVarInt32(slice(pos + 1, end), &length);
+                    if (lengthSize == 0)
+                        return 0;
+                    size += lengthSize;
+                }
+                size += length;
+                break;
+            }
+            case kArray:
+            case kDict: {
+                uint32_t count = ((pos[0] << 8) | pos[1]) & 0x07FF;
+                size = 2;
+                if (count == kLongArrayCount) {
+                    uint32_t extraCount;
+                    size_t countSize = GetUVarInt32(slice(pos + 2, end), &extraCount);
+                    if (countSize == 0)
+                        return 0;
+                    count += extraCount;
+                    size += countSize + (countSize & 1);
+                }
+                size_t itemWidth = (pos[0] & 0x08) ? kWide : kNarrow;
+                if (itemWidth == kWide && count > 0 && size < (size_t)(end - pos)
+                                       && pos[size] == kExtraWideMarker) {
+                    itemWidth = kExtraWide;             // (see kExtraWideMarker)
+                    size += kExtraWide;
+                }
+                size += count * (v->type() == kDict ? 2 : 1) * itemWidth;
+                break;
+            }
+            case kNumber:
+                if ((pos[0] >> 4) == kIntTag)
+                    size = 2 + (pos[0] & 0x07);
+                else if ((pos[0] >> 4) == kFloatTag)
+                    size = (pos[0] & 0x08) ? 10 : 6;
+                else
+                    size = 2;
+                break;
+            default:
+                size = 2;
+                break;
+        }
+        return (size <= (size_t)(end - pos)) ? size : 0;
+    }
+
+    bool Value::dumpLinear(slice data, Writer &out, size_t startPos, size_t endPos) {
+        auto begin = (const uint8_t*)data.buf, end = (const uint8_t*)data.end();
+
+        // Checks that a pointer `width` bytes wide, and any pointers it leads to, point to a
+        // value in the data before `limit`, so it's safe to dump; likewise the data of a packed
+        // number. (External pointers resolve safely to null if their base is unknown.)
+        auto inBounds = [&](const Value *item, int width, const void *limit) {
+            while (item->isPointer()) {
+                const Value *externTarget;
+                if (width == kWide && resolveExternPointer(item, externTarget))
+                    return true;
+                size_t offset;
+                if (width == kExtraWide)
+                    offset = (size_t)item->extraWidePointerValue();
+                else
+                    offset = (width == kWide) ? item->pointerValue<true>()
+                                              : item->pointerValue<false>();
+                if (offset == 0 || offset > (size_t)((const uint8_t*)item - begin))
+                    return false;
+                auto target = (const uint8_t*)item - offset;
+                if (target >= (const uint8_t*)limit
+                        || linearSize(target, (const uint8_t*)limit) == 0)
+                    return false;
+                item = (const Value*)target;
+                limit = target;
+                width = kWide;                          // (pointers pointed to are wide)
+            }
+            if (item->isPackedNumber()) {
+                auto numData = (const uint8_t*)item->packedNumberData();
+                return numData >= begin && numData + item->packedNumberSize() <= (uint8_t*)item;
+            }
+            return true;
+        };
+        auto allInBounds = [&](const Value *v, int width) {
+            if (v->tag() == kArrayTag || v->tag() == kDictTag) {
+                // (Not using iterators, since they dereference items as they go)
+                Array::impl a(v, false);
+                uint32_t nItems = a._count * (v->tag() == kDictTag ? 2 : 1);
+                for (uint32_t i = 0; i < nItems; ++i) {
+                    auto item = (const Value*)offsetby(a._first, i * a._width);
+                    // An inline item has to fit in its slot:
+                    if (!item->isPointer() && !item->isPackedNumber()
+                            && linearSize((const uint8_t*)item,
+                                          (const uint8_t*)offsetby(item, a._width)) == 0)
+                        return false;
+                    if (!inBounds(item, a._width, v))
+                        return false;
+                }
+            }
+            return inBounds(v, width, v);
+        };
+
+        endPos = std::min(endPos, data.size);
+        for (auto pos = begin; pos < begin + endPos; ) {
+            size_t size = linearSize(pos, end);
+            if (size == 0) {
+                writef(out, "%04zx: (invalid value)\n", (size_t)(pos - begin));
+                return false;
+            }
+            if (pos >= begin + startPos) {
+                auto v = (const Value*)pos;
+                int width = (size == kWide && v->isPointer()) ? kWide : kNarrow;
+                if (!allInBounds(v, width)) {
+                    writef(out, "%04zx: (invalid pointer)\n", (size_t)(pos - begin));
+                    return false;
+                }
+                v->dump(out, width, 0, begin);
+            }
+            pos += size + (size & 1);
+        }
+        out.flush();
         return true;
     }
 
@@ -154,4 +317,221 @@ namespace fleece {
         return out.str();
     }
 
+
+#pragma mark - SIZE PROFILE:
+
+
+    // Walks a document's tree, attributing the bytes of each value to its path. A value reached
+    // through more than one pointer (usually a uniqued string) is counted the first time only.
+    class SizeProfiler {
+    public:
+        SizeProfiler(slice data, const SharedKeys *sk)
+        :_data(data), _sharedKeys(sk)
+        { }
+
+        void profile(const Value *root) {
+            _seen.insert(root);
+            _total = visit(root, std::string());
+        }
+
+        void write(Writer &out) {
+            writef(out, "Size profile of %zu bytes:\n", _data.size);
+            out << slice("  Inclusive  Exclusive     Shared    Count  Path\n");
+            for (auto &p : _paths) {
+                auto &stats = p.second;
+                writef(out, "%11zu %10zu %10zu %8zu  ",
+                       stats.inclusive, stats.exclusive, stats.shared, stats.count);
+                out << (p.first.empty() ? slice("(root)") : slice(p.first)) << slice("\n");
+            }
+            writef(out, "Not in any value (root pointer, hash indexes, unused): %zu bytes\n",
+                   _data.size - std::min(_total, _data.size));
+
+            writef(out, "\nStrings: %zu, %zu bytes\n", _stringCount, _stringBytes);
+            writef(out, "Uniquing: %zu pointers to already-written strings or keys, "
+                        "saving %zu bytes\n", _sharedCount, _sharedBytes);
+            static const char* const kCollectionNames[2] = {"Arrays", "Dicts"};
+            for (int dict = 0; dict <= 1; ++dict) {
+                writef(out, "%s: %zu narrow (%zu bytes), %zu wide (%zu bytes)\n",
+                       kCollectionNames[dict],
+                       _collectionCount[dict][0], _collectionBytes[dict][0],
+                       _collectionCount[dict][1], _collectionBytes[dict][1]);
+            }
+
+            // String keys used the most are the ones SharedKeys would help most with:
+            size_t keyUses = 0;
+            std::vector<std::pair<size_t, const std::string*>> candidates;
+            for (auto &k : _keys) {
+                keyUses += k.second.uses;
+                if (!k.second.isInt)
+                    candidates.push_back({k.second.uses, &k.first});
+            }
+            writef(out, "Dict keys: %zu distinct, %zu uses, %zu bytes of strings\n",
+                   _keys.size(), keyUses, _keyBytes);
+            if (candidates.empty())
+                return;
+            std::sort(candidates.begin(), candidates.end(),
+                      [](const std::pair<size_t, const std::string*> &a,
+                         const std::pair<size_t, const std::string*> &b) {
+                          return a.first > b.first || (a.first == b.first && *a.second < *b.second);
+                      });
+            candidates.resize(std::min(candidates.size(), (size_t)kMaxCandidates));
+            out << slice("\nMost-used string keys (candidates for SharedKeys):\n"
+                         "     Uses   Bytes  Key\n");
+            SharedKeys defaults;
+            for (auto &c : candidates) {
+                slice key(*c.second);
+                writef(out, "%9zu %7zu  ", c.first, _keys[*c.second].bytes);
+                out << key;
+                if (key.size > SharedKeys::kDefaultMaxKeyLength || !defaults.isEligibleToEncode(key))
+                    out << slice("  (not eligible)");
+                out << slice("\n");
+            }
+        }
+
+    private:
+        static const size_t kMaxCandidates = 20;
+
+        struct PathStats {
+            size_t count {0};           // Number of values at this path
+            size_t inclusive {0};       // Bytes of them and of the values first reached from them
+            size_t exclusive {0};       // Bytes of them alone (including collections' items)
+            size_t shared {0};          // Bytes of already-counted values they point to
+        };
+
+        struct KeyStats {
+            size_t uses {0};            // Number of dicts it's in
+            size_t bytes {0};           // Bytes of its string (once, if the string's uniqued)
+            bool isInt {false};         // Is it an integer (SharedKeys) key?
+        };
+
+        // The bytes a value takes by itself, including a collection's items, and padding.
+        size_t ownSize(const Value *v) const {
+            size_t size = linearSize((const uint8_t*)v, (const uint8_t*)_data.end());
+            return (size + 1) & ~1;
+        }
+
+        // Counts a value and what's first reached from it; returns the bytes counted.
+        size_t visit(const Value *v, const std::string &path) {
+            size_t own = ownSize(v), children = 0;
+            switch (v->tag()) {
+                case kStringTag:
+                    ++_stringCount;
+                    _stringBytes += own;
+                    break;
+                case kArrayTag: {
+                    std::string itemPath = path + "[]";
+                    for (Array::iterator i(v->asArray()); i; ++i) {
+                        if (i.rawValue()->isPackedNumber())
+                            own += i.rawValue()->packedNumberSize();    // number is elsewhere
+                        children += visitItem(i.rawValue(), i.value(), itemPath);
+                    }
+                    countCollection(v, false, own);
+                    break;
+                }
+                case kDictTag: {
+                    std::string valuePath;
+                    for (Dict::iterator i(v->asDict()); i; ++i) {
+                        valuePath = path;
+                        valuePath += '.';
+                        children += visitKey(i.rawKey(), i.key(), valuePath);
+                        children += visitItem(i.rawValue(), i.value(), valuePath);
+                    }
+                    countCollection(v, true, own);
+                    break;
+                }
+                default:
+                    break;
+            }
+            PathStats &stats = _paths[path];
+            ++stats.count;
+            stats.exclusive += own;
+            stats.inclusive += own + children;
+            return own + children;
+        }
+
+        // Counts an array item or dict value, given its raw (maybe pointer) and actual Values.
+        size_t visitItem(const Value *raw, const Value *item, const std::string &path) {
+            if (!raw->isPointer()) {
+                ++_paths[path].count;       // Inline; its bytes belong to its collection
+                return 0;
+            }
+            if (!item)
+                return 0;                   // External pointer into an unknown base
+            if (!_seen.insert(item).second) {
+                size_t size = ownSize(item);
+                PathStats &stats = _paths[path];
+                ++stats.count;
+                stats.shared += size;
+                countShared(size);
+                return 0;
+            }
+            return visit(item, path);
+        }
+
+        // Counts a dict key, and appends its name to the path; returns the bytes counted.
+        size_t visitKey(const Value *raw, const Value *key, std::string &path) {
+            size_t size = 0;
+            std::string name;
+            bool isInt = key && key->isInteger();
+            if (isInt) {
+                int intKey = (int)key->asInt();
+                slice str;
+                if (_sharedKeys && intKey >= 0 && !_sharedKeys->isUnknownKey(intKey))
+                    str = _sharedKeys->decode(intKey);
+                name = str ? std::string(str) : "#" + std::to_string(intKey);
+            } else if (key) {
+                name = std::string(key->asString());
+                if (raw->isPointer()) {
+                    size = ownSize(key);
+                    if (_seen.insert(key).second) {
+                        _keyBytes += size;
+                    } else {
+                        countShared(size);
+                        size = 0;
+                    }
+                }
+            }
+            path += name;
+            KeyStats &stats = _keys[name];
+            ++stats.uses;
+            stats.bytes += size;
+            stats.isInt = isInt;
+            return size;
+        }
+
+        void countCollection(const Value *v, bool isDict, size_t size) {
+            bool wide = v->isWideArray();
+            ++_collectionCount[isDict][wide];
+            _collectionBytes[isDict][wide] += size;
+        }
+
+        void countShared(size_t size) {
+            ++_sharedCount;
+            _sharedBytes += size;
+        }
+
+        slice const _data;
+        const SharedKeys* const _sharedKeys;
+        std::unordered_set<const Value*> _seen;     // Values that have been counted
+        std::map<std::string, PathStats> _paths;    // Sorted, so children follow their parents
+        std::map<std::string, KeyStats> _keys;
+        size_t _total {0};
+        size_t _stringCount {0}, _stringBytes {0};
+        size_t _sharedCount {0}, _sharedBytes {0};
+        size_t _keyBytes {0};
+        size_t _collectionCount[2][2] {}, _collectionBytes[2][2] {};    // [isDict][isWide]
+    };
+
+
+    bool Value::writeSizeProfile(slice data, Writer &out, const SharedKeys *sk) {
+        auto root = fromData(data);
+        if (!root)
+            return false;
+        SizeProfiler profiler(data, sk);
+        profiler.profile(root);
+        profiler.write(out);
+        out.flush();
+        return true;
+    }
+
 }
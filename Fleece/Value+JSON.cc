@@ -18,51 +18,113 @@
 #include "Writer.hh"
 #include "SharedKeys.hh"
 #include "FleeceException.hh"
+#include "NumConversion.hh"
 #include <ostream>
 #include <ctime>
 #include <iomanip>
 #include <sstream>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FL_JSON_SSE2
+    #include <emmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #define FL_JSON_NEON
+    #include <arm_neon.h>
+#endif
+
 
 namespace fleece {
 
+    static inline bool needsJSONEscape(uint8_t ch) {
+        return ch == '"' || ch == '\\' || ch < 32 || ch == 127;
+    }
+
+    size_t internal::countUnescapedJSONBytesScalar(const uint8_t *begin, const uint8_t *end) {
+        auto p = begin;
+        while (p < end && !needsJSONEscape(*p))
+            ++p;
+        return p - begin;
+    }
+
+    size_t internal::countUnescapedJSONBytes(const uint8_t *begin, const uint8_t *end) {
+        auto p = begin;
+#if defined(FL_JSON_SSE2)
+        const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'),
+                      del = _mm_set1_epi8(127), maxControl = _mm_set1_epi8(31);
+        for (; end - p >= 16; p += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+            __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(chunk, maxControl), chunk); // chunk<32
+            __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                                        _mm_cmpeq_epi8(chunk, backslash)),
+                                           _mm_or_si128(_mm_cmpeq_epi8(chunk, del), control));
+            unsigned mask = (unsigned)_mm_movemask_epi8(special);
+            if (mask) {
+#ifdef _MSC_VER
+                unsigned long index;
+                _BitScanForward(&index, mask);
+#else
+                unsigned index = __builtin_ctz(mask);
+#endif
+                return (p - begin) + index;
+            }
+        }
+#elif defined(FL_JSON_NEON)
+        const uint8x16_t quote = vdupq_n_u8('"'), backslash = vdupq_n_u8('\\'),
+                         del = vdupq_n_u8(127), firstPrintable = vdupq_n_u8(32);
+        for (; end - p >= 16; p += 16) {
+            uint8x16_t chunk = vld1q_u8(p);
+            uint8x16_t special = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote),
+                                                   vceqq_u8(chunk, backslash)),
+                                          vorrq_u8(vceqq_u8(chunk, del),
+                                                   vcltq_u8(chunk, firstPrintable)));
+            if (vmaxvq_u8(special))
+                break;          // the scalar loop below will find the exact position
+        }
+#endif
+        return (p - begin) + countUnescapedJSONBytesScalar(p, end);
+    }
+
     // Writes a JSON string, with all necessary escapes
     static void writeJSONString(Writer &out, slice str) {
+        static const char kHexDigits[] = "0123456789abcdef";
         out << '"';
-        auto start = (const uint8_t*)str.buf;
+        auto p = (const uint8_t*)str.buf;
         auto end = (const uint8_t*)str.end();
-        for (auto p = start; p < end; p++) {
-            uint8_t ch = *p;
-            if (ch == '"' || ch == '\\' || ch < 32 || ch == 127) {
-                // Write characters from start up to p-1:
-                out.write((char*)start, p-start);
-                start = p + 1;
-                switch (ch) {
-                    case '"':
-                    case '\\':
-                        out << '\\';
-                        --start; // ch will be written in next pass
-                        break;
-                    case '\n':
-                        out << slice("\\n");
-                        break;
-                    case '\t':
-                        out << slice("\\t");
-                        break;
-                    default: {
-                        char buf[7];
-                        sprintf(buf, "\\u%04u", (unsigned)ch);
-                        out << slice(buf);
-                        break;
-                    }
+        while (true) {
+            // Copy the run of characters that don't need escaping:
+            size_t n = internal::countUnescapedJSONBytes(p, end);
+            out.write(p, n);
+            p += n;
+            if (p >= end)
+                break;
+            uint8_t ch = *p++;
+            switch (ch) {
+                case '"':
+                case '\\': {
+                    char escaped[2] = {'\\', (char)ch};
+                    out.write(escaped, 2);
+                    break;
+                }
+                case '\n':
+                    out << slice("\\n");
+                    break;
+                case '\t':
+                    out << slice("\\t");
+                    break;
+                default: {
+                    char buf[6] = {'\\', 'u', '0', '0', kHexDigits[ch >> 4], kHexDigits[ch & 0xF]};
+                    out.write(buf, sizeof(buf));
+                    break;
                 }
             }
         }
-        out.write((char*)start, end-start);
         out << '"';
     }
 
-    static bool canBeUnquotedJSON5Key(slice key) {
+    bool internal::canBeUnquotedJSON5Key(slice key) {
         if (key.size == 0 || isdigit(key[0]))
             return false;
         for (unsigned i = 0; i < key.size; i++) {
@@ -90,19 +152,19 @@ namespace fleece {
                 out << (asBool() ? slice("true") : slice("false"));
                 return;
             case kNumber: {
-                char str[32];
+                char str[kMinNumberBufferSize];
+                size_t len;
                 if (isInteger()) {
-                    int64_t i = asInt();
                     if (isUnsigned())
-                        sprintf(str, "%llu", (unsigned long long)i);
+                        len = WriteUInteger(asUnsigned(), str);
                     else
-                        sprintf(str, "%lld", (long long)i);
+                        len = WriteInteger(asInt(), str);
                 } else if (isDouble()) {
-                    sprintf(str, "%.16g", asDouble());
+                    len = WriteFloat(asDouble(), str);
                 } else {
-                    sprintf(str, "%.6g", asFloat());
+                    len = WriteFloat(asFloat(), str);
                 }
-                out << slice(str);
+                out.write(str, len);
                 return;
             }
             case kString:
@@ -136,7 +198,7 @@ namespace fleece {
                         out << ',';
                     slice keyStr = iter.keyString();
                     if (keyStr) {
-                        if (VER == 5 && canBeUnquotedJSON5Key(keyStr))
+                        if (VER == 5 && internal::canBeUnquotedJSON5Key(keyStr))
                             out.write((char*)keyStr.buf, keyStr.size);
                         else
                             writeJSONString(out, keyStr);
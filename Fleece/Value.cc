@@ -18,10 +18,17 @@
 #include "Internal.hh"
 #include "Endian.hh"
 #include "FleeceException.hh"
+#include "MappedFile.hh"
+#include "NumConversion.hh"
 #include "varint.hh"
 #include "PlatformCompat.hh"
+#include <algorithm>
 #include <assert.h>
+#include <map>
 #include <math.h>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 
 namespace fleece {
@@ -98,6 +105,19 @@ namespace fleece {
                 return _decLittle64(n);
             }
             case kFloatTag:
+                if (_usuallyFalse((_byte[0] & (kPackedNumberFlag | kPackedIntFlag))
+                                            == (kPackedNumberFlag | kPackedIntFlag))) {
+                    // Packed integer:
+                    if (_byte[0] & 0x8) {
+                        int64_t n;
+                        memcpy(&n, packedNumberData(), sizeof(n));
+                        return _decLittle64(n);
+                    } else {
+                        int32_t n;
+                        memcpy(&n, packedNumberData(), sizeof(n));
+                        return (int32_t)_decLittle32(n);
+                    }
+                }
                 return (int64_t)round(asDouble());
             default:
                 return 0;
@@ -112,13 +132,19 @@ namespace fleece {
     T Value::asFloatOfType() const noexcept {
         switch (tag()) {
             case kFloatTag: {
+                const void *data = &_byte[2];
+                if (_usuallyFalse(isPackedNumber())) {
+                    if (_byte[0] & kPackedIntFlag)
+                        return (T)asInt();
+                    data = packedNumberData();
+                }
                 if (_byte[0] & 0x8) {
                     littleEndianDouble d;
-                    memcpy(&d, &_byte[2], sizeof(d));
+                    memcpy(&d, data, sizeof(d));
                     return (T)d;
                 } else {
                     littleEndianFloat f;
-                    memcpy(&f, &_byte[2], sizeof(f));
+                    memcpy(&f, data, sizeof(f));
                     return (T)f;
                 }
             }
@@ -142,16 +168,16 @@ namespace fleece {
     }
 
     alloc_slice Value::toString() const {
-        char buf[32], *str = buf;
+        char buf[kMinNumberBufferSize], *str = buf;
         switch (tag()) {
             case kShortIntTag:
             case kIntTag: {
-                int64_t i = asInt();
+                size_t len;
                 if (isUnsigned())
-                    sprintf(str, "%llu", (unsigned long long)i);
+                    len = WriteUInteger(asUnsigned(), str);
                 else
-                    sprintf(str, "%lld", (long long)i);
-                break;
+                    len = WriteInteger(asInt(), str);
+                return alloc_slice(str, len);
             }
             case kSpecialTag: {
                 switch (tinyValue()) {
@@ -171,11 +197,14 @@ namespace fleece {
                 break;
             }
             case kFloatTag: {
-                if (_byte[0] & 0x8)
-                    sprintf(str, "%.16g", asDouble());
+                size_t len;
+                if (isInteger())
+                    len = WriteInteger(asInt(), str);       // packed integer
+                else if (isDouble())
+                    len = WriteFloat(asDouble(), str);
                 else
-                    sprintf(str, "%.6g", asFloat());
-                break;
+                    len = WriteFloat(asFloat(), str);
+                return alloc_slice(str, len);
             }
             default:
                 return alloc_slice(asString());
@@ -204,6 +233,193 @@ namespace fleece {
     }
 
 
+#pragma mark - EQUALITY:
+
+
+    // Compares two numbers exactly, whether they're integers or floating-point.
+    static bool numbersEqual(const Value *a, const Value *b) noexcept {
+        if (a->isInteger() != b->isInteger()) {
+            if (b->isInteger())
+                std::swap(a, b);
+            // a is an integer, b is floating-point:
+            double d = b->asDouble();
+            if (d != floor(d) || d < -9223372036854775808.0 || d >= 18446744073709551616.0)
+                return false;
+            if (d >= 0 && (a->isUnsigned() || a->asInt() >= 0))
+                return d < 9223372036854775808.0 ? (int64_t)d == a->asInt()
+                                                 : (uint64_t)d == a->asUnsigned();
+            return d < 0 && !a->isUnsigned() && (int64_t)d == a->asInt();
+        } else if (a->isInteger()) {
+            // (A negative int64 isn't equal to a huge uint64, despite having the same bits)
+            return a->asInt() == b->asInt()
+                && (a->isUnsigned() == b->isUnsigned() || a->asInt() >= 0);
+        } else {
+            return a->asDouble() == b->asDouble();
+        }
+    }
+
+    static bool keysEqual(const Value *a, const Value *b) noexcept {
+        if (a->isInteger())
+            return b->isInteger() && a->asInt() == b->asInt();
+        else
+            return !b->isInteger() && a->asString() == b->asString();
+    }
+
+    // Compares dicts whose keys aren't in the same order (i.e. they weren't both sorted.)
+    static bool unorderedDictsEqual(const Dict *a, const Dict *b) noexcept {
+        for (Dict::iterator i(a); i; ++i) {
+            const Value *value = nullptr;
+            for (Dict::iterator j(b); j; ++j) {
+                if (keysEqual(i.key(), j.key())) {
+                    value = j.value();
+                    break;
+                }
+            }
+            if (!value || !i.value()->isEqual(value))
+                return false;
+        }
+        return true;
+    }
+
+    static bool dictsEqual(const Dict *a, const Dict *b) noexcept {
+        Dict::iterator i(a), j(b);
+        if (i.count() != j.count())
+            return false;
+        // Sorted dicts with the same keys have them in the same order, so walk them together:
+        for (; i; ++i, ++j) {
+            if (!keysEqual(i.key(), j.key()))
+                return unorderedDictsEqual(a, b);
+            if (!i.value()->isEqual(j.value()))
+                return false;
+        }
+        return true;
+    }
+
+    bool Value::isEqual(const Value *v) const noexcept {
+        if (v == this)
+            return true;
+        if (!v || type() != v->type())
+            return false;
+        switch (type()) {
+            case kNull:
+                return true;
+            case kBoolean:
+                return asBool() == v->asBool();
+            case kNumber:
+                return numbersEqual(this, v);
+            case kString:
+            case kData:
+                return getStringBytes() == v->getStringBytes();
+            case kArray: {
+                Array::iterator i(asArray()), j(v->asArray());
+                if (i.count() != j.count())
+                    return false;
+                for (; i; ++i, ++j) {
+                    if (!i.value()->isEqual(j.value()))
+                        return false;
+                }
+                return true;
+            }
+            case kDict:
+                return dictsEqual(asDict(), v->asDict());
+            default:
+                return false;
+        }
+    }
+
+
+#pragma mark - HASHING:
+
+
+    // The hash is built from MurmurHash3's 64-bit mixing functions. Since hashes may be stored,
+    // none of this can ever change.
+
+    static inline uint64_t rotl64(uint64_t n, int bits) {
+        return (n << bits) | (n >> (64 - bits));
+    }
+
+    static inline uint64_t hashMix(uint64_t h, uint64_t k) {
+        k *= 0x87c37b91114253d5ull;
+        k = rotl64(k, 31);
+        k *= 0x4cf5ad432745937full;
+        h ^= k;
+        return rotl64(h, 27) * 5 + 0x52dce729;
+    }
+
+    static inline uint64_t hashFinish(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint64_t hashBytes(uint64_t h, slice s) {
+        auto bytes = (const uint8_t*)s.buf;
+        size_t n = s.size;
+        for (; n >= 8; n -= 8, bytes += 8) {
+            uint64_t k;
+            memcpy(&k, bytes, 8);
+            h = hashMix(h, _decLittle64(k));
+        }
+        uint64_t k = 0;
+        for (size_t i = 0; i < n; i++)
+            k |= (uint64_t)bytes[i] << (8 * i);
+        return hashMix(hashMix(h, k), s.size);
+    }
+
+    static uint64_t hashValue(const Value *v) noexcept {
+        auto type = v->type();
+        uint64_t h = hashMix(0, 0x466C656563650000ull | type);
+        switch (type) {
+            case kNull:
+                return h;
+            case kBoolean:
+                return hashMix(h, v->asBool());
+            case kNumber: {
+                // Numbers that are equal must hash the same, whether they're integer or float:
+                if (v->isInteger())
+                    return hashMix(h, v->asUnsigned());
+                double d = v->asDouble();
+                if (d == floor(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+                    return hashMix(h, (uint64_t)(int64_t)d);
+                if (d == floor(d) && d >= 0 && d < 18446744073709551616.0)
+                    return hashMix(h, (uint64_t)d);
+                uint64_t bits;
+                memcpy(&bits, &d, sizeof(bits));
+                return hashMix(hashMix(h, 0x466C6F6174ull), bits);
+            }
+            case kString:
+                return hashBytes(h, v->asString());
+            case kData:
+                return hashBytes(h, v->asData());
+            case kArray: {
+                Array::iterator i(v->asArray());
+                h = hashMix(h, i.count());
+                for (; i; ++i)
+                    h = hashMix(h, hashValue(i.value()));
+                return h;
+            }
+            case kDict: {
+                // Combine the entries' hashes in a way that doesn't depend on their order:
+                Dict::iterator i(v->asDict());
+                h = hashMix(h, i.count());
+                uint64_t sum = 0;
+                for (; i; ++i)
+                    sum += hashFinish(hashMix(hashValue(i.key()), hashValue(i.value())));
+                return hashMix(h, sum);
+            }
+            default:
+                return h;
+        }
+    }
+
+    uint64_t Value::hash() const noexcept {
+        return hashFinish(hashValue(this));
+    }
+
+
 #pragma mark - VALIDATION:
 
     
@@ -216,11 +432,38 @@ namespace fleece {
 
     const Value* Value::fromData(slice s) noexcept {
         auto root = fastValidate(s);
-        if (root && !root->validate(s.buf, s.end(), true))
-            root = nullptr;
+        if (root) {
+            slice range = rootDataRange(root, s);
+            if (!root->validate(range.buf, range.end(), true))
+                root = nullptr;
+        }
         return root;
     }
 
+    const Value* Value::fromDataInParallel(slice s, unsigned nThreads) noexcept {
+        static const size_t kMinParallelValidationSize = 64*1024;
+        auto root = fastValidate(s);
+        if (!root)
+            return nullptr;
+        if (nThreads == 0)
+            nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+        if (s.size < kMinParallelValidationSize)
+            nThreads = 1;
+        slice range = rootDataRange(root, s);
+        auto t = root->tag();
+        bool valid;
+        if (t == kArrayTag || t == kDictTag)
+            valid = root->validateCollection(range.buf, range.end(), true, nThreads);
+        else
+            valid = root->validate(range.buf, range.end(), true);
+        return valid ? root : nullptr;
+    }
+
+    const Value* Value::fromMappedFile(const char *path, mapped_slice &file, bool trusted) {
+        file = mapped_slice(path);
+        return trusted ? fromTrustedData(file) : fromData(file);
+    }
+
     const Value* Value::fastValidate(slice s) noexcept {
         if (s.size < kNarrow || (s.size % kNarrow))
             return nullptr;
@@ -233,6 +476,9 @@ namespace fleece {
             root = derefed;
             // The root itself might point to a wide pointer, if the actual value is too far away:
             if (root->isPointer()) {
+                const Value *target;
+                if (_usuallyFalse(resolveExternPointer(root, target)))
+                    return target;                              // the root is in the base
                 derefed = derefPointer<true>(root);
                 if (derefed >= root || derefed < s.buf)
                     return nullptr;
@@ -249,51 +495,396 @@ namespace fleece {
     bool Value::validate(const void *dataStart, const void *dataEnd, bool wide) const noexcept {
         // First dereference a pointer:
         if (isPointer()) {
+            // An external pointer is valid if it resolves to a valid value in its base:
+            const Value *target;
+            slice base;
+            if (wide && _usuallyFalse(resolveExternPointer(this, target, &base)))
+                return target && target->validate(base.buf, base.end(), true);
             auto derefed = derefPointer(this, wide);
             return derefed >= dataStart
                 && derefed < this  // could fail if ptr wraps around past 0
                 && derefed->validate(dataStart, this, true);
         }
         auto t = tag();
-        size_t size = dataSize();
         if (t == kArrayTag || t == kDictTag) {
-            wide = isWideArray();
-            size_t itemCount = ((const Array*)this)->count();
-            if (t == kDictTag)
-                itemCount *= 2;
-            // Check that size fits:
-            size += itemCount * width(wide);
-            if (offsetby(this, size) > dataEnd)
+            return validateCollection(dataStart, dataEnd, true);
+        } else if (isPackedNumber()) {
+            // Packed number; check that its data comes before it:
+            auto data = packedNumberData();
+            return wide && data >= dataStart && offsetby(data, packedNumberSize()) <= this;
+        } else {
+            // Non-collection; just check that size fits:
+            return offsetby(this, dataSize()) <= dataEnd;
+        }
+    }
+
+    // Validates an Array or Dict. If `recursive` is false, collections pointed to by its items
+    // are only checked for being in bounds; they have to be validated separately before use.
+    // If `nThreads` is greater than 1, the items are validated by that many threads at once.
+    bool Value::validateCollection(const void *dataStart, const void *dataEnd,
+                                   bool recursive, unsigned nThreads) const noexcept {
+        Array::impl a(this, false);
+        size_t itemCount = a._count;
+        if (tag() == kDictTag)
+            itemCount *= 2;
+        // Check that size fits:
+        size_t itemWidth = a._width;
+        bool wideItems = (itemWidth != kNarrow);
+        if (offsetby(a._first, itemCount * itemWidth) > dataEnd)
+            return false;
+
+        // An item of an extra-wide collection that's a pointer is replaced by the value it
+        // points to, which must come before it; that value is then checked like one pointed to
+        // by a wide pointer. (Other items are left alone.)
+        auto derefExtraWideItem = [=](const Value* &item, const void* &itemEnd) noexcept -> bool {
+            if (_usuallyTrue(itemWidth != kExtraWide) || !item->isPointer())
+                return true;
+            if (item->_byte[0] & kExternPointerFlag)
+                return false;                           // (extra-wide pointers can't be external)
+            auto derefed = offsetby(item, -(ptrdiff_t)item->extraWidePointerValue());
+            if (derefed < dataStart || derefed >= item)
                 return false;
+            itemEnd = item;
+            item = derefed;
+            return true;
+        };
 
-            // Check each Array/Dict element:
-            if (itemCount > 0) {
-                auto item = Array::impl(this)._first;
-                while (itemCount-- > 0) {
-                    auto second = item->next(wide);
-                    if (!item->validate(dataStart, second, wide))
+        if (a._hasHashIndex) {
+            // Check the dict's hash index entry (which comes before the prefix index entry):
+            const void *indexEnd = offsetby(a._first,
+                                            -(ptrdiff_t)itemWidth * (a._hasPrefixIndex ? 2 : 0));
+            auto indexValue = (const Value*)offsetby(indexEnd, -(ptrdiff_t)itemWidth);
+            if (!derefExtraWideItem(indexValue, indexEnd)
+                    || !indexValue->validate(dataStart, indexEnd, wideItems))
+                return false;
+        }
+        if (a._hasPrefixIndex) {
+            // Check the dict's prefix index entry:
+            auto indexValue = offsetby(a._first, -(ptrdiff_t)itemWidth);
+            const void *indexEnd = a._first;
+            if (!derefExtraWideItem(indexValue, indexEnd)
+                    || !indexValue->validate(dataStart, indexEnd, wideItems))
+                return false;
+        }
+
+        // Checks items [begin, end):
+        auto validateItems = [=](size_t begin, size_t end) noexcept -> bool {
+            for (size_t i = begin; i < end; ++i) {
+                auto item = offsetby(a._first, i * itemWidth);
+                const void *itemEnd = offsetby(item, itemWidth);
+                if (!derefExtraWideItem(item, itemEnd))
+                    return false;
+                if (recursive) {
+                    if (!item->validate(dataStart, itemEnd, wideItems))
+                        return false;
+                    continue;
+                }
+                // Non-recursive: follow pointers, but don't descend into collections:
+                bool wide = wideItems;
+                while (item->isPointer()) {
+                    const Value *target;
+                    if (wide && _usuallyFalse(item->_byte[0] & kExternPointerFlag)
+                             && resolveExternPointer(item, target))
+                        break;
+                    auto derefed = derefPointer(item, wide);
+                    if (derefed < dataStart || derefed >= item)
                         return false;
-                    item = second;
+                    itemEnd = item;
+                    item = derefed;
+                    wide = true;
+                }
+                if (item->isPointer()) {
+                    if (!item->validate(dataStart, itemEnd, true))      // (external pointer)
+                        return false;
+                    continue;
+                }
+                auto t = item->tag();
+                if (t == kArrayTag || t == kDictTag) {
+                    if (offsetby(item, kNarrow) > itemEnd)
+                        return false;
+                } else if (!item->validate(dataStart, itemEnd, wide)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        if (nThreads > 1 && itemCount >= 2 * nThreads) {
+            // Give each thread a contiguous range of items:
+            size_t perThread = (itemCount + nThreads - 1) / nThreads;
+            std::vector<char> results(nThreads, true);
+            std::vector<std::thread> threads;
+            try {
+                for (unsigned t = 1; t < nThreads; ++t) {
+                    threads.emplace_back([&, t] {
+                        results[t] = validateItems(t * perThread,
+                                                   std::min((t + 1) * perThread, itemCount));
+                    });
                 }
+            } catch (const std::exception&) {
+                // Couldn't start a thread; its items, and the ones after, will be checked by
+                // this one instead
+                results[threads.size() + 1] = validateItems((threads.size() + 1) * perThread,
+                                                            itemCount);
             }
+            results[0] = validateItems(0, std::min(perThread, itemCount));
+            for (auto &thread : threads)
+                thread.join();
+            for (unsigned t = 0; t < nThreads; ++t)
+                if (!results[t])
+                    return false;
             return true;
         } else {
-            // Non-collection; just check that size fits:
-            return offsetby(this, size) <= dataEnd;
+            return validateItems(0, itemCount);
+        }
+    }
+
+#pragma mark - EXTERNAL POINTERS:
+
+    // Registry of the bases of extension documents, so external pointers can find the base
+    // they point into. Lookups are on the read path, so they don't lock: it's a list of entries
+    // that are reused rather than freed, each guarded by a sequence number that's odd while the
+    // entry is being changed (a "seqlock"), so a reader can tell if it read a torn entry and
+    // try again. Only changes to the registry take the mutex.
+    namespace internal {
+        std::atomic<unsigned> gExternBaseCount {0};
+
+        struct externBase {
+            std::atomic<unsigned> seq {0};
+            std::atomic<const void*> extensionStart {nullptr}, extensionEnd {nullptr};
+            std::atomic<const void*> baseStart {nullptr};
+            std::atomic<size_t> baseSize {0};
+            bool inUse {false};                         // Claimed by a scope (guarded by mutex)
+            externBase *next {nullptr};                 // (never changes once it's in the list)
+
+            // Changes the entry; must be called with sExternBasesMutex locked. (All the accesses
+            // are sequentially consistent, which makes the seqlock work without fences.)
+            void set(slice extension, slice b) noexcept {
+                unsigned s = seq;
+                seq = s + 1;
+                extensionStart = extension.buf;
+                extensionEnd = extension.end();
+                baseStart = b.buf;
+                baseSize = b.size;
+                seq = s + 2;
+            }
+
+            // Reads the entry consistently. Returns false if it's unused.
+            bool get(slice &extension, slice &b) const noexcept {
+                while (true) {
+                    unsigned s = seq;
+                    if (_usuallyFalse(s & 1))
+                        continue;                       // being changed; try again
+                    extension = slice(extensionStart.load(), extensionEnd.load());
+                    b = slice(baseStart.load(), baseSize.load());
+                    if (_usuallyTrue(seq == s))
+                        return extension.buf != nullptr;
+                }
+            }
+        };
+    }
+
+    static std::mutex sExternBasesMutex;
+    static std::atomic<externBase*> sExternBases {nullptr};
+
+    // Finds the registered extension containing `addr`, returning its range and its base.
+    static bool findExtension(const void *addr, slice &outExtension, slice &outBase) noexcept {
+        for (auto e = sExternBases.load(std::memory_order_acquire); e; e = e->next) {
+            if (e->get(outExtension, outBase) && addr >= outExtension.buf
+                                              && addr < outExtension.end())
+                return true;
         }
+        return false;
     }
 
+    ExtensionScope::ExtensionScope(const alloc_slice &base, const alloc_slice &extension)
+    :_base(base)
+    ,_extension(extension)
+    {
+        if (!base || !(slice)extension)
+            return;
+        {
+            // Register the base first, since validating the extension has to resolve pointers
+            // into it. Claim an unused registry entry, or add a new one:
+            std::lock_guard<std::mutex> lock(sExternBasesMutex);
+            externBase *e;
+            for (e = sExternBases.load(std::memory_order_relaxed); e && e->inUse; e = e->next)
+                ;
+            if (!e) {
+                e = new externBase;
+                e->next = sExternBases.load(std::memory_order_relaxed);
+                sExternBases.store(e, std::memory_order_release);
+            }
+            e->inUse = true;
+            e->set(extension, base);
+            ++gExternBaseCount;
+            _entry = e;
+        }
+        _root = Value::fromData((slice)extension);
+        if (!_root)
+            unregister();                               // Invalid, so don't leave it registered
+    }
+
+    ExtensionScope::~ExtensionScope() {
+        unregister();
+    }
+
+    void ExtensionScope::unregister() noexcept {
+        if (!_entry)
+            return;
+        std::lock_guard<std::mutex> lock(sExternBasesMutex);
+        _entry->set(nullslice, nullslice);
+        _entry->inUse = false;
+        _entry = nullptr;
+        --gExternBaseCount;
+    }
+
+    // If `v` is an external pointer -- a wide pointer with kExternPointerFlag set, in a
+    // registered extension -- sets `outTarget` to the Value in the base that it points to, or to
+    // nullptr if that's out of range, and returns true. Otherwise the flag is just part of the
+    // offset, as in documents predating extensions, so it returns false.
+    bool Value::resolveExternPointer(const Value *v, const Value* &outTarget,
+                                     slice *outBase) noexcept {
+        if (!(v->_byte[0] & kExternPointerFlag)
+                || gExternBaseCount.load(std::memory_order_relaxed) == 0)
+            return false;
+        slice extension, base;
+        if (!findExtension(v, extension, base))
+            return false;
+        // The offset is as though the extension came right after the base:
+        size_t pos = base.size + ((uint8_t*)v - (uint8_t*)extension.buf);
+        size_t offset = v->externPointerValue();
+        if (offset > pos || pos - offset >= base.size)
+            outTarget = nullptr;
+        else
+            outTarget = (const Value*)offsetby(base.buf, pos - offset);
+        if (outBase)
+            *outBase = base;
+        return true;
+    }
+
+    const Value* Value::derefExternPointer(const Value *v) noexcept {
+        const Value *dst;
+        if (!resolveExternPointer(v, dst, nullptr))
+            return offsetby(v, -(ptrdiff_t)v->pointerValue<true>());     // not external
+        if (_usuallyFalse(!dst)) {
+            // It points out of its base (the data wasn't validated); act like a null value
+            static const uint8_t kNullValue[2] = {kSpecialTag << 4 | kSpecialValueNull, 0};
+            dst = (const Value*)kNullValue;
+        }
+        return dst;
+    }
+
+    // The data a root Value has to be validated against: normally the document containing it,
+    // but an extension's root may be in its base.
+    slice Value::rootDataRange(const Value *root, slice data) noexcept {
+        if (root >= data.buf && root < data.end())
+            return data;
+        slice extension, base;
+        if (findExtension(data.buf, extension, base) && extension.buf == data.buf)
+            return base;
+        return nullslice;
+    }
+
+
+#pragma mark - LAZY VALIDATION:
+
+    // Registry of all LazyValidator instances, so Array::impl can find the one (if any) whose
+    // data contains a collection it's accessing. It's a lock-free list of entries that are
+    // reused rather than freed, so looking up a collection doesn't take a process-wide lock.
+    // An entry's range is set before its validator is published, and cleared after it's
+    // unpublished; a reader checks that the validator didn't change while it read the range.
+    struct LazyValidator::registration {
+        std::atomic<bool> inUse {true};
+        std::atomic<const void*> start {nullptr}, end {nullptr};
+        std::atomic<LazyValidator*> validator {nullptr};
+        registration *next {nullptr};                   // (never changes once it's in the list)
+    };
+
+    std::atomic<unsigned> LazyValidator::sCount {0};
+    std::atomic<LazyValidator::registration*> LazyValidator::sRegistry {nullptr};
+
+    LazyValidator::LazyValidator(slice data)
+    :_data(data)
+    {
+        auto root = Value::fastValidate(data);
+        if (root) {
+            // A root collection gets validated when it's accessed, like any other:
+            auto t = root->tag();
+            if ((t == kArrayTag || t == kDictTag) ? offsetby(root, kNarrow) <= data.end()
+                                                  : root->validate(data.buf, data.end(), true))
+                _root = root;
+        }
+
+        // Claim an unused registry entry, or add a new one:
+        registration *r;
+        for (r = sRegistry.load(); r; r = r->next) {
+            bool inUse = false;
+            if (r->inUse.compare_exchange_strong(inUse, true))
+                break;
+        }
+        if (!r) {
+            r = new registration;
+            r->next = sRegistry.load();
+            while (!sRegistry.compare_exchange_weak(r->next, r))
+                ;
+        }
+        r->start = data.buf;
+        r->end = data.end();
+        r->validator.store(this, std::memory_order_release);
+        _registration = r;
+        ++sCount;
+    }
+
+    LazyValidator::~LazyValidator() {
+        --sCount;
+        _registration->validator = nullptr;
+        _registration->start = nullptr;
+        _registration->end = nullptr;
+        _registration->inUse = false;
+    }
+
+    // Called by Array::impl before it reads a collection. Returns false if it's invalid.
+    bool LazyValidator::check(const Value *collection) noexcept {
+        for (auto r = sRegistry.load(std::memory_order_acquire); r; r = r->next) {
+            auto validator = r->validator.load(std::memory_order_acquire);
+            if (!validator)
+                continue;
+            const void *start = r->start, *end = r->end;
+            if (collection >= start && collection < end && r->validator == validator)
+                return validator->checkCollection(collection);
+        }
+        return true;        // It's not in any lazily-validated data
+    }
+
+    bool LazyValidator::checkCollection(const Value *collection) noexcept {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_validated.find(collection) != _validated.end())
+                return true;
+        }
+        if (offsetby(collection, kNarrow) > _data.end()
+                || !collection->validateCollection(_data.buf, _data.end(), false))
+            return false;
+        try {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _validated.insert(collection);
+        } catch (const std::exception&) { }     // (it'll just get validated again next time)
+        return true;
+    }
+
+
     // This does not include the inline items in arrays/dicts
     size_t Value::dataSize() const noexcept {
         switch(tag()) {
             case kShortIntTag:
             case kSpecialTag:   return 2;
-            case kFloatTag:     return isDouble() ? 10 : 6;
+            case kFloatTag:     return isPackedNumber() ? kWide : (isDouble() ? 10 : 6);
             case kIntTag:       return 2 + (tinyValue() & 0x07);
             case kStringTag:
             case kBinaryTag:    return (uint8_t*)getStringBytes().end() - (uint8_t*)this;
             case kArrayTag:
-            case kDictTag:      return (uint8_t*)Array::impl(this)._first - (uint8_t*)this;
+            case kDictTag:      return (uint8_t*)Array::impl(this, false)._first - (uint8_t*)this;
             case kPointerTagFirst:
             default:            return 2;   // size might actually be 4; depends on context
         }
@@ -20,9 +20,13 @@
 #include "Endian.hh"
 #include "varint.hh"
 #include <stdint.h>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <unordered_set>
 #ifdef __OBJC__
 #import <Foundation/NSMapTable.h>
+@class NSArray;
 #endif
 
 
@@ -32,6 +36,10 @@ namespace fleece {
     class Dict;
     class Writer;
     class SharedKeys;
+    struct mapped_slice;
+    namespace internal {
+        struct externBase;
+    }
 
 
     /* Types of values -- same as JSON types, plus binary data */
@@ -60,6 +68,21 @@ namespace fleece {
             This is a lot faster, but "undefined behavior" occurs if the data is corrupt... */
         static const Value* fromTrustedData(slice s) noexcept;
 
+        /** Memory-maps a Fleece file and returns a pointer to its root value, or nullptr if the
+            data is invalid. The file is used in place; its pages are read from disk as they're
+            accessed. The mapping is stored in `file`, and the returned Value is only valid as
+            long as that (or a copy of it) exists.
+            If `trusted` is true, the data isn't validated (see fromTrustedData), which avoids
+            having to read the entire file up front.
+            Throws a FleeceException if the file can't be opened. */
+        static const Value* fromMappedFile(const char *path, mapped_slice &file,
+                                           bool trusted =false);
+
+        /** Like fromData, but validates large documents faster by splitting the root array or
+            dict's items among multiple threads.
+            @param nThreads  Number of threads to use; 0 means one per CPU core. */
+        static const Value* fromDataInParallel(slice, unsigned nThreads =0) noexcept;
+
         /** The overall type of a value (JSON types plus Data) */
         valueType type() const noexcept;
 
@@ -83,14 +106,16 @@ namespace fleece {
         double asDouble() const noexcept    {return asFloatOfType<double>();}
 
         /** Is this value an integer? */
-        bool isInteger() const noexcept     {return tag() <= internal::kIntTag;}
+        bool isInteger() const noexcept     {return tag() <= internal::kIntTag
+                                                        || (_byte[0] & 0xF6) == 0x26;}
 
         /** Is this value an unsigned integer? (This does _not_ mean it's positive; it means
             that you should treat it as possibly overflowing an int64_t.) */
         bool isUnsigned() const noexcept    {return tag() == internal::kIntTag && (_byte[0] & 0x08) != 0;}
 
         /** Is this a 64-bit floating-point value? */
-        bool isDouble() const noexcept      {return tag() == internal::kFloatTag && (_byte[0] & 0x8);}
+        bool isDouble() const noexcept      {return tag() == internal::kFloatTag
+                                                        && (_byte[0] & 0x0A) == 0x08;}
 
         //////// Non-scalars:
 
@@ -109,6 +134,22 @@ namespace fleece {
         /** Converts any _non-collection_ type to string form. */
         alloc_slice toString() const;
 
+        //////// Equality:
+
+        /** Deep comparison of two values. Numbers are equal if their values are (so an int and
+            a float can be equal); arrays if their items are; dicts if they have equal values for
+            the same keys, in any order. Encoding details like narrow/wide collections, shared
+            strings or packed arrays don't matter. Dict keys are compared as encoded, so an
+            integer (SharedKeys) key never equals a string key.
+            Values at the same address are equal without being examined, which makes comparing
+            a document with an updated version of itself (based on it) fast. */
+        bool isEqual(const Value*) const noexcept;
+
+        /** A 64-bit hash of a value's contents: values that are isEqual have the same hash.
+            It's stable -- independent of platform, process and encoding -- so it may be stored,
+            e.g. as a cache key. */
+        uint64_t hash() const noexcept;
+
         //////// Conversion:
 
         /** Writes a JSON representation to a Writer.
@@ -117,7 +158,9 @@ namespace fleece {
         void toJSON(Writer&, const SharedKeys* =nullptr) const;
 
         /** Returns a JSON representation.
-            If you call it as toJSON<5>(...), writes JSON5, which leaves most keys unquoted. */
+            If you call it as toJSON<5>(...), writes JSON5, which leaves most keys unquoted.
+            (To convert a large value without building all the JSON in memory, use a
+            JSONStreamer instead.) */
         template <int VER =1>
         alloc_slice toJSON(const SharedKeys* =nullptr) const;
 
@@ -127,6 +170,28 @@ namespace fleece {
         /** Returns a full dump of the values in the data, including offsets and hex. */
         static std::string dump(slice data);
 
+        /** Writes a dump like dump() does, but by scanning the data from front to back
+            (values are stored in the order they were written) instead of walking the tree and
+            sorting every value by address. It uses no memory beyond the Writer's buffer and
+            starts writing immediately, which makes it practical for huge files; give the
+            Writer an OutputCallback to stream it. Only values starting in the byte range
+            [startPos, endPos) are dumped.
+            The data isn't validated first, but each value is bounds-checked as it's reached,
+            and the dump stops at the first invalid one, returning false.
+            (The raw numbers of packed arrays precede the array and can't be recognized this
+            way, so they appear as whatever values their bytes look like.) */
+        static bool dumpLinear(slice data, Writer&, size_t startPos =0, size_t endPos =SIZE_MAX);
+
+        /** Writes a report of where the bytes of a document go, for finding out what makes it
+            big. For every path in the document (with array indexes generalized to "[]") it
+            shows the number of values, their inclusive bytes (including everything first
+            reached from them), exclusive bytes (their own headers and items), and the bytes of
+            values they share with earlier ones through string uniquing. Then it totals the
+            strings, narrow and wide collections, and dict keys, and lists the keys used most
+            often, which would gain the most from SharedKeys. Integer keys are decoded with the
+            SharedKeys, if given. Returns false if the data isn't valid Fleece. */
+        static bool writeSizeProfile(slice data, Writer&, const SharedKeys* =nullptr);
+
 #ifdef __OBJC__
         //////// Convenience methods for Objective-C (Cocoa):
 
@@ -137,6 +202,21 @@ namespace fleece {
             (Not noexcept, but can only throw Objective-C exceptions.) */
         id toNSObject(NSMapTable *sharedStrings =nil, const SharedKeys* = nullptr) const;
 
+        /** Like toNSObject, but arrays with many items (at any level of nesting, below
+            dictionaries) are split into slices that are converted concurrently on GCD's
+            global queue. Each slice has its own shared-string table; the tables are merged
+            into `sharedStrings`, if given, when the conversion finishes. Still returns only
+            when the whole conversion is done. */
+        id toNSObjectConcurrently(NSMapTable *sharedStrings =nil,
+                                  const SharedKeys* = nullptr) const;
+
+        /** Returns an NSArray whose items are converted from this array's a slice at a time,
+            the first time an item in the slice is accessed, and then kept. Useful for sources
+            of table views, which only look at the visible rows. Returns nil if this isn't an
+            array. The Fleece data must remain valid as long as the NSArray is in use.
+            The shared-string table, if given, is retained and used by the array. */
+        NSArray* toLazyNSArray(NSMapTable *sharedStrings =nil, const SharedKeys* = nullptr) const;
+
         /** Creates a new shared-string table for use with toNSObject. */
         static NSMapTable* createSharedStringsTable() noexcept;
 #endif
@@ -152,6 +232,11 @@ namespace fleece {
                 return (_dec16(*(uint16_t*)_byte) & ~0x8000) << 1;
         }
 
+        // offset of an external pointer (see kExternPointerFlag):
+        uint32_t externPointerValue() const noexcept {
+            return (_dec32(*(uint32_t*)_byte) & ~0xC0000000) << 1;
+        }
+
         void shrinkPointer() noexcept {
             _byte[0] = _byte[2] | 0x80;
             _byte[1] = _byte[3];
@@ -159,6 +244,9 @@ namespace fleece {
 
         template <bool WIDE>
         static const Value* derefPointer(const Value *v) {
+            if (WIDE && (v->_byte[0] & internal::kExternPointerFlag)
+                     && internal::gExternBaseCount.load(std::memory_order_relaxed) > 0)
+                return derefExternPointer(v);
             return offsetby(v, -(ptrdiff_t)v->pointerValue<WIDE>());
         }
         static const Value* derefPointer(const Value *v, bool wide) {
@@ -169,6 +257,27 @@ namespace fleece {
         template <bool WIDE>
         static const Value* deref(const Value *v);
 
+        // extra-wide pointer (an item of an extra-wide collection; see kExtraWideMarker):
+        uint64_t extraWidePointerValue() const noexcept {
+            uint64_t n;
+            memcpy(&n, _byte, sizeof(n));
+            return (_dec64(n) & ~0xC000000000000000ull) << 1;
+        }
+        static const Value* derefExtraWide(const Value *v) noexcept;
+
+        // Dereferences an item of a collection whose items are WIDTH bytes wide.
+        template <int WIDTH>
+        static const Value* derefItem(const Value *v) {
+            if (WIDTH == internal::kExtraWide)
+                return v->isPointer() ? derefExtraWide(v) : v;
+            return deref<(WIDTH == internal::kWide)>(v);
+        }
+        static const Value* derefItem(const Value *v, int width) {
+            if (width == internal::kExtraWide)
+                return derefItem<internal::kExtraWide>(v);
+            return deref(v, width == internal::kWide);
+        }
+
         const Value* next(bool wide) const noexcept
                                 {return offsetby(this, wide ? internal::kWide : internal::kNarrow);}
         template <bool WIDE>
@@ -176,6 +285,14 @@ namespace fleece {
 
         bool isWideArray() const noexcept {return (_byte[0] & 0x08) != 0;}
 
+        // packed number (an item of a packed array; see Internal.hh):
+        bool isPackedNumber() const noexcept  {return (_byte[0] & 0xF4) == 0x24;}
+        size_t packedNumberSize() const noexcept {return (_byte[0] & 0x08) ? 8 : 4;}
+        const void* packedNumberData() const noexcept {
+            return offsetby(this, -(ptrdiff_t)(((uint32_t)_byte[1] << 17) | (_byte[2] << 9)
+                                                                          | (_byte[3] << 1)));
+        }
+
     private:
         Value(internal::tags tag, int tiny, int byte1 = 0) {
             _byte[0] = (uint8_t)((tag<<4) | tiny);
@@ -209,11 +326,18 @@ namespace fleece {
         size_t dataSize() const noexcept;
         typedef std::map<size_t, const Value*> mapByAddress;
         void mapAddresses(mapByAddress&) const;
-        void dump(std::ostream &out, bool wide, int indent, const void *base) const;
-        void writeDumpBrief(std::ostream &out, const void *base, bool wide =false) const;
+        void dump(Writer &out, int width, int indent, const void *base) const;
+        void writeDumpBrief(Writer &out, const void *base, int width =internal::kNarrow) const;
+
+        static const Value* derefExternPointer(const Value*) noexcept;
+        static bool resolveExternPointer(const Value*, const Value* &outTarget,
+                                         slice *outBase =nullptr) noexcept;
+        static slice rootDataRange(const Value *root, slice data) noexcept;
 
         static const Value* fastValidate(slice) noexcept;
         bool validate(const void* dataStart, const void *dataEnd, bool wide) const noexcept;
+        bool validateCollection(const void* dataStart, const void *dataEnd,
+                                bool recursive, unsigned nThreads =1) const noexcept;
 
         //////// Here's the data:
 
@@ -224,7 +348,72 @@ namespace fleece {
         friend class Encoder;
         friend class ValueTests;
         friend class EncoderTests;
-        template <bool WIDE> friend struct dictImpl;
+        template <int WIDTH> friend struct dictImpl;
+        friend class LazyValidator;
+        friend class Arr;
+        friend class SizeProfiler;
+    };
+
+
+    /** Provides access to untrusted Fleece data without validating all of it up front.
+        Instead, each array and dict is checked (non-recursively) the first time an Array or Dict
+        method or iterator accesses it; if it's invalid it acts as though it were empty.
+        This is much faster than Value::fromData when only a few values will be read.
+        All Values obtained from the data must only be used while this object exists. */
+    class LazyValidator {
+    public:
+        explicit LazyValidator(slice data);
+        ~LazyValidator();
+
+        /** The root value, or nullptr if the data is obviously invalid. */
+        const Value* root() const noexcept          {return _root;}
+
+    private:
+        struct registration;
+
+        static bool check(const Value *collection) noexcept;
+        bool checkCollection(const Value *collection) noexcept;
+
+        LazyValidator(const LazyValidator&) =delete;
+        LazyValidator& operator=(const LazyValidator&) =delete;
+
+        static std::atomic<unsigned> sCount;            // Number of instances in existence
+        static std::atomic<registration*> sRegistry;    // List of registered instances
+
+        slice const _data;
+        const Value* _root {nullptr};
+        registration* _registration {nullptr};          // My entry in the registry
+        std::mutex _mutex;                              // Protects _validated
+        std::unordered_set<const Value*> _validated;    // Collections known to be valid
+
+        friend class Array;
+    };
+
+
+    /** Makes an extension document readable: one written by an Encoder whose base was `base`
+        and had `externPointers` set (see Encoder::setBase.) While this object exists, the
+        extension's pointers into the base refer to it directly, so the two needn't be
+        concatenated, and Value::fromData etc. can be used on the extension too. The extension
+        is validated, including the values in the base it refers to. Both buffers are retained,
+        and all Values obtained from the extension must only be used while this object exists.
+        (An extension buffer should only be in one ExtensionScope at a time.) */
+    class ExtensionScope {
+    public:
+        ExtensionScope(const alloc_slice &base, const alloc_slice &extension);
+        ~ExtensionScope();
+
+        /** The extension's root value, or nullptr if it's invalid. */
+        const Value* root() const noexcept          {return _root;}
+
+    private:
+        ExtensionScope(const ExtensionScope&) =delete;
+        ExtensionScope& operator=(const ExtensionScope&) =delete;
+
+        void unregister() noexcept;
+
+        alloc_slice const _base, _extension;
+        const Value* _root {nullptr};
+        internal::externBase* _entry {nullptr};         // My entry in the registry, if any
     };
 
 }
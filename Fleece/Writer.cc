@@ -16,8 +16,7 @@
 #include "Writer.hh"
 #include "FleeceException.hh"
 #include "PlatformCompat.hh"
-#include "decode.h"
-#include "encode.h"
+#include "Base64.hh"
 #include <assert.h>
 #include <algorithm>
 
@@ -34,36 +33,68 @@ namespace fleece {
             addChunk(initialCapacity);
     }
 
+    Writer::Writer(OutputCallback callback, size_t chunkSize)
+    :_chunkSize(chunkSize),
+     _length(0),
+     _outputCallback(callback)
+    {
+        addChunk(chunkSize);
+    }
+
     Writer::Writer(Writer&& w) noexcept
-    :_chunks(std::move(w._chunks))
+    :_chunks(std::move(w._chunks)),
+     _chunkSize(w._chunkSize),
+     _length(w._length),
+     _flushedLength(w._flushedLength),
+     _pendingReservations(w._pendingReservations),
+     _outputCallback(std::move(w._outputCallback)),
+     _spareChunks(std::move(w._spareChunks)),
+     _recentLength(w._recentLength)
     {
         w._chunks.clear();
     }
 
-    Writer::~Writer() {
-        for (auto &chunk : _chunks)
-            freeChunk(chunk);
-    }
+    Writer::~Writer() =default;
 
     Writer& Writer::operator= (Writer&& w) noexcept {
         _chunks = std::move(w._chunks);
+        _chunkSize = w._chunkSize;
+        _length = w._length;
+        _flushedLength = w._flushedLength;
+        _pendingReservations = w._pendingReservations;
+        _outputCallback = std::move(w._outputCallback);
+        _spareChunks = std::move(w._spareChunks);
+        _recentLength = w._recentLength;
         w._chunks.clear();
         return *this;
     }
 
+    Writer::OutputCallback Writer::outputToFile(FILE *f) {
+        return [f](slice data) {
+            if (fwrite(data.buf, 1, data.size, f) < data.size)
+                FleeceException::_throw(InternalError, "error writing to output file");
+        };
+    }
+
     void Writer::reset() {
-        size_t size = _chunks.size();
-        if (size == 0) {
-            addChunk(_chunkSize);
+        if (_chunks.empty()) {
+            addFirstChunk();
         } else {
-            if (size > 1) {
-                for (size_t i = 0; i < size-1; i++)
-                    freeChunk(_chunks[i]);
-                _chunks.erase(_chunks.begin(), _chunks.end() - 1);
-            }
+            recycleChunks(1);
             _chunks[0].reset();
         }
         _length = 0;
+        _flushedLength = 0;
+        _pendingReservations = 0;
+    }
+
+    size_t Writer::capacity() const {
+        size_t capacity = 0;
+        for (auto &chunk : _chunks)
+            capacity += chunk.capacity();
+        for (auto &chunk : _spareChunks)
+            capacity += chunk.capacity();
+        return capacity;
     }
 
     const void* Writer::curPos() const {
@@ -71,7 +102,7 @@ namespace fleece {
     }
 
     size_t Writer::posToOffset(const void *pos) const {
-        size_t offset = 0;
+        size_t offset = _flushedLength;
         for (auto &chunk : _chunks) {
             if (chunk.contains(pos))
                 return offset + chunk.offsetOf(pos);
@@ -89,8 +120,17 @@ namespace fleece {
     }
 
     const void* Writer::writeToNewChunk(const void* data, size_t length) {
-        if (_usuallyTrue(_chunkSize <= 64*1024))
+        if (isStreaming()) {
+            if (_pendingReservations == 0) {
+                // Hand off everything written so far, then reuse the remaining chunk if it's
+                // big enough:
+                flush();
+                if (_chunks.back().capacity() >= length)
+                    return _chunks.back().write(data, length);
+            }
+        } else if (_usuallyTrue(_chunkSize <= 64*1024)) {
             _chunkSize *= 2;
+        }
         addChunk(std::max(length, _chunkSize));
         const void *result = _chunks.back().write(data, length);
         assert(result);
@@ -100,37 +140,90 @@ namespace fleece {
     void Writer::rewrite(const void *pos, slice data) {
         assert(pos); //FIX: Check that it's actually inside a chunk
         ::memcpy((void*)pos, data.buf, data.size);
+        if (_pendingReservations > 0)
+            --_pendingReservations;
+    }
+
+    void Writer::flush() {
+        if (!isStreaming())
+            return;
+        throwIf(_pendingReservations > 0, InternalError, "can't flush Writer with reserved space");
+        for (auto &chunk : _chunks) {
+            slice contents = chunk.contents();
+            if (contents.size > 0)
+                _outputCallback(contents);
+        }
+        _flushedLength = _length;
+        recycleChunks(1);
+        _chunks[0].reset();
     }
 
     void Writer::addChunk(size_t capacity) {
-        _chunks.emplace_back(capacity);
+        // Reuse the smallest spare chunk that's big enough, if any:
+        auto best = _spareChunks.end();
+        for (auto i = _spareChunks.begin(); i != _spareChunks.end(); ++i) {
+            if (i->capacity() >= capacity
+                    && (best == _spareChunks.end() || i->capacity() < best->capacity()))
+                best = i;
+        }
+        if (best != _spareChunks.end()) {
+            _chunks.push_back(std::move(*best));
+            _spareChunks.erase(best);
+        } else {
+            _chunks.emplace_back(capacity);
+        }
     }
 
-    void Writer::freeChunk(Chunk &chunk) {
-        if (chunk.start() != &_initialBuf)
-            chunk.free();
+    // Adds the first chunk of a new output. It's made big enough for the recent outputs, so
+    // that (in the common case of similar-sized outputs) extractOutput can hand it over whole.
+    void Writer::addFirstChunk() {
+        size_t capacity = isStreaming() ? _chunkSize : _recentLength + _recentLength / 8;
+        if (capacity <= sizeof(_initialBuf))
+            _chunks.emplace_back(_initialBuf, sizeof(_initialBuf));
+        else
+            addChunk(capacity);
+    }
+
+    // Removes all but the last `keeping` chunks, saving them in _spareChunks if there's room.
+    void Writer::recycleChunks(size_t keeping) {
+        if (_chunks.size() <= keeping)
+            return;
+        auto last = _chunks.end() - keeping;
+        for (auto i = _chunks.begin(); i != last; ++i) {
+            if (i->isOwned() && _spareChunks.size() < kMaxSpareChunks) {
+                i->reset();
+                _spareChunks.push_back(std::move(*i));
+            }
+        }
+        _chunks.erase(_chunks.begin(), last);   // (this frees the ones that weren't saved)
     }
 
     alloc_slice Writer::extractOutput() {
         alloc_slice output;
-#if 0 //TODO: Restore this optimization
-        if (_chunks.size() == 1 && _chunks[0].start() != &_initialBuf) {
-            _chunks[0].resizeToFit();
-            output = alloc_slice::adopt(_chunks[0].contents());
+        if (isStreaming()) {
+            flush();
+            return output;
+        }
+        size_t length = _length;
+        _recentLength = std::max(length, _recentLength - _recentLength / 8);
+        if (_chunks.size() == 1 && _chunks[0].isOwned() && length >= _chunks[0].capacity() / 2) {
+            // The output fills most of a single chunk, so hand over the chunk itself:
+            output = _chunks[0].extractContents();
             _chunks.clear();
-            _length = 0;
-        } else
-#endif
-        {
-            output = alloc_slice(length());
+        } else {
+            output = alloc_slice(length);
             void* dst = (void*)output.buf;
             for (auto &chunk : _chunks) {
                 auto contents = chunk.contents();
                 memcpy(dst, contents.buf, contents.size);
                 dst = offsetby(dst, contents.size);
             }
-            reset();
+            // If the output overflowed into more chunks, start the next one in a single chunk
+            // that should be big enough:
+            if (_chunks.size() > 1)
+                recycleChunks(0);
         }
+        reset();
         return output;
     }
 
@@ -142,32 +235,37 @@ namespace fleece {
      _available(buf, size)
     { }
 
+    // The chunk's memory is an alloc_slice's buffer, so extractContents can hand it over.
     Writer::Chunk::Chunk(size_t capacity)
-    :_start(::malloc(capacity)),
-    _available(_start, capacity)
-    {
-        if (_usuallyFalse(!_start))
-            throw std::bad_alloc();
-    }
+    :_buffer(capacity),
+     _start((void*)_buffer.buf),
+     _available(_start, capacity)
+    { }
 
     Writer::Chunk::Chunk(Chunk&& c) noexcept
-    :_start(c._start),
+    :_buffer(std::move(c._buffer)),
+     _start(c._start),
      _available(c._available)
     {
         c._start = nullptr;
+        c._available = nullslice;
     }
 
     Writer::Chunk& Writer::Chunk::operator=(Chunk&& c) noexcept {
+        _buffer = std::move(c._buffer);
         _start = c._start;
         _available = c._available;
         c._start = nullptr;
+        c._available = nullslice;
         return *this;
     }
 
-
-    void Writer::Chunk::free() noexcept {
-        ::free(_start);
+    alloc_slice Writer::Chunk::extractContents() {
+        alloc_slice contents = std::move(_buffer);
+        contents.resize(length());          // Shrinks the buffer to fit, usually in place
         _start = nullptr;
+        _available = nullslice;
+        return contents;
     }
 
     const void* Writer::Chunk::write(const void* data, size_t length) {
@@ -180,35 +278,26 @@ namespace fleece {
         return result;
     }
 
-    void Writer::Chunk::resizeToFit() noexcept {
-        size_t len = length();
-        void *newStart = ::realloc(_start, len);
-        if (newStart)
-            _start = newStart;
-        _available = slice(offsetby(newStart,len), (size_t)0);
-    }
-
 
 #pragma mark - BASE64:
 
 
     void Writer::writeBase64(slice data) {
-        size_t base64size = ((data.size + 2) / 3) * 4;
-        auto dst = (char*)reserveSpace(base64size);
-        base64::encoder enc;
-        enc.set_chars_per_line(0);
-        size_t written = enc.encode(data.buf, data.size, dst);
-        written += enc.encode_end(dst + written);
-        assert((size_t)written == base64size);
+        size_t base64size = Base64EncodedSize(data.size);
+        auto dst = (char*)write(nullptr, base64size);
+        size_t written = EncodeBase64(data, dst);
+        assert(written == base64size);
         (void)written;      // suppresses 'unused value' warning in release builds
     }
 
 
     void Writer::writeDecodedBase64(slice base64) {
-        base64::decoder dec;
-        std::vector<char> buf((base64.size + 3) / 4 * 3);
-        size_t len = dec.decode(base64.buf, base64.size, buf.data());
-        write(buf.data(), len);
+        // Decode straight into the output, then give back the space that wasn't used:
+        size_t maxSize = Base64DecodedMaxSize(base64.size);
+        auto dst = (void*)write(nullptr, maxSize);
+        size_t unused = maxSize - DecodeBase64(base64, dst);
+        _chunks.back().unwrite(unused);
+        _length -= unused;
     }
 
 }
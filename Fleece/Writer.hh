@@ -16,30 +16,68 @@
 #pragma once
 
 #include "slice.hh"
+#include <functional>
 #include <vector>
+#include <stdio.h>
 
 namespace fleece {
 
     /** A simple write-only stream that buffers its output into a slice.
-        (Used instead of C++ ostreams because those have too much overhead.) */
+        (Used instead of C++ ostreams because those have too much overhead.)
+        It can instead pass its output to a callback as it goes, so that the entire output
+        never has to be in memory at once.
+        A Writer is meant to be reused (via reset() or extractOutput()) for a series of outputs:
+        it keeps a few spare chunks of memory instead of freeing them, and sizes its first chunk
+        to fit the recent outputs, so that extractOutput() can usually hand over that chunk
+        instead of copying it. */
     class Writer {
     public:
         static const size_t kDefaultInitialCapacity = 256;
+        static const size_t kDefaultStreamingChunkSize = 64*1024;
+        static const size_t kMaxSpareChunks = 4;
+
+        /** A function that's handed the Writer's output, piece by piece, in order. */
+        typedef std::function<void(slice)> OutputCallback;
 
         Writer(size_t initialCapacity =kDefaultInitialCapacity);
+
+        /** Constructs a Writer that streams its output to a callback instead of accumulating
+            it. Whenever a chunk fills up, every completed chunk is passed to the callback and
+            its memory is reused, unless a region allocated by reserveSpace() hasn't been
+            filled in by rewrite() yet. */
+        Writer(OutputCallback, size_t chunkSize =kDefaultStreamingChunkSize);
+
         ~Writer();
 
         Writer(Writer&&) noexcept;
         Writer& operator= (Writer&&) noexcept;
 
+        /** Returns an OutputCallback that writes to a stdio file. It throws on I/O errors. */
+        static OutputCallback outputToFile(FILE*);
+
+        /** Discards the output. The memory is kept for reuse. */
         void reset();
 
         size_t length() const                   {return _length;}
+
+        /** The number of bytes of output buffer space allocated, including spare chunks. */
+        size_t capacity() const;
         const void* curPos() const;
         size_t posToOffset(const void *pos) const;
 
-        /** Returns the data written. The Writer stops managing this memory; it now belongs to
-            the caller and will be freed when no more alloc_slices refer to it. */
+        /** True if the output is going to an OutputCallback. */
+        bool isStreaming() const                {return (bool)_outputCallback;}
+
+        /** Passes all the output written so far to the OutputCallback, if there is one.
+            After this, the only valid pointers into the output are ones returned from
+            subsequent writes. */
+        void flush();
+
+        /** Returns the data written, and resets the Writer. The Writer stops managing this
+            memory; it now belongs to the caller and will be freed when no more alloc_slices
+            refer to it. If the output is all in one chunk, that chunk itself is returned
+            (trimmed to fit) instead of a copy.
+            If the Writer is streaming, this instead flushes and returns a null slice. */
         alloc_slice extractOutput();
 
         const void* write(const void* data, size_t length);
@@ -52,8 +90,10 @@ namespace fleece {
 
         /** Reserves space for data without actually writing anything yet.
             The data must be written later using rewrite() otherwise there will be garbage in
-            the output. */
-        const void* reserveSpace(size_t length)      {return write(nullptr, length);}
+            the output. (A streaming Writer won't flush until every reservation has been
+            rewritten.) */
+        const void* reserveSpace(size_t length)      {++_pendingReservations;
+                                                      return write(nullptr, length);}
 
         /** Overwrites already-written data.
             @param pos  The position in the output at which to start overwriting
@@ -68,10 +108,11 @@ namespace fleece {
             Chunk(Chunk&&) noexcept;
             Chunk(const Chunk&) =delete;
             Chunk& operator=(Chunk&&) noexcept;
-            void free() noexcept;
             void reset()              {_available.setStart(_start);}
             const void* write(const void* data, size_t length);
-            void resizeToFit() noexcept;
+            void unwrite(size_t length)  {_available.moveStart(-(ptrdiff_t)length);}
+            alloc_slice extractContents();
+            bool isOwned() const      {return _buffer.buf != nullptr;}
             void* start()             {return _start;}
             size_t length() const     {return (int8_t*)_available.buf - (int8_t*)_start;}
             size_t capacity() const   {return (int8_t*)_available.end() - (int8_t*)_start;}
@@ -80,13 +121,15 @@ namespace fleece {
             bool contains(const void *ptr) const   {return ptr >= _start && ptr <= _available.buf;}
             size_t offsetOf(const void *ptr) const {return (int8_t*)ptr - (int8_t*)_start;}
         private:
+            alloc_slice _buffer;      // Owns the memory, unless it's the Writer's _initialBuf
             void *_start;
             slice _available;
         };
 
         const void* writeToNewChunk(const void* data, size_t length);
         void addChunk(size_t capacity);
-        void freeChunk(Chunk &chunk);
+        void addFirstChunk();
+        void recycleChunks(size_t keeping);
 
         Writer(const Writer&) = delete;
         const Writer& operator=(const Writer&) = delete;
@@ -94,6 +137,11 @@ namespace fleece {
         std::vector<Chunk> _chunks;
         size_t _chunkSize;
         size_t _length;
+        size_t _flushedLength {0};          // Number of bytes already given to _outputCallback
+        unsigned _pendingReservations {0};  // Number of reserveSpace calls not yet rewritten
+        OutputCallback _outputCallback;
+        std::vector<Chunk> _spareChunks;    // Recycled chunks, reused by addChunk
+        size_t _recentLength {0};           // Decaying max of the lengths of recent outputs
         uint8_t _initialBuf[kDefaultInitialCapacity];
     };
 
@@ -14,12 +14,13 @@
 //  and limitations under the License.
 
 #include "slice.hh"
-#include "encode.h"
-#include "decode.h"
+#include "PlatformCompat.hh"
+#include "Base64.hh"
 #include <algorithm>
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <atomic>
 
 namespace fleece {
@@ -30,6 +31,87 @@ namespace fleece {
         buf = s;
     }
 
+#pragma mark - HASHING:
+
+
+    // 64x64->128-bit multiply, returning the XOR of the high and low halves of the product.
+    static inline uint64_t foldedMultiply(uint64_t a, uint64_t b) noexcept {
+#if defined(__SIZEOF_INT128__)
+        __uint128_t r = (__uint128_t)a * b;
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        uint64_t hi, lo = _umul128(a, b, &hi);
+        return lo ^ hi;
+#else
+        uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32), carry = t < rl;
+        uint64_t lo = t + (rm1 << 32);
+        carry += lo < t;
+        uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+        return lo ^ hi;
+#endif
+    }
+
+    // Unaligned native-endian reads (the hash doesn't need to be portable):
+    static inline uint64_t read64(const uint8_t *p) noexcept {
+        uint64_t v; memcpy(&v, p, 8); return v;
+    }
+    static inline uint64_t read32(const uint8_t *p) noexcept {
+        uint32_t v; memcpy(&v, p, 4); return v;
+    }
+
+    uint32_t slice::hash() const noexcept {
+        static const uint64_t kSecret0 = 0xa0761d6478bd642full, kSecret1 = 0xe7037ed1a0b428dbull,
+                              kSecret2 = 0x8ebc6af09c88c6e3ull;
+        auto p = (const uint8_t*)buf;
+        size_t len = size;
+        uint64_t seed = kSecret0, a, b;
+        if (_usuallyTrue(len <= 16)) {
+            if (len >= 4) {
+                // Two overlapping pairs of 4-byte reads cover 4..16 bytes:
+                size_t mid = (len >> 3) << 2;
+                a = (read32(p) << 32) | read32(p + mid);
+                b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+            } else if (len > 0) {
+                a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if (i > 48) {
+                // Three independent lanes, so the multiplies can execute in parallel:
+                uint64_t seed1 = seed, seed2 = seed;
+                do {
+                    seed  = foldedMultiply(read64(p)      ^ kSecret1, read64(p + 8)  ^ seed);
+                    seed1 = foldedMultiply(read64(p + 16) ^ kSecret2, read64(p + 24) ^ seed1);
+                    seed2 = foldedMultiply(read64(p + 32) ^ kSecret0, read64(p + 40) ^ seed2);
+                    p += 48;
+                    i -= 48;
+                } while (i > 48);
+                seed ^= seed1 ^ seed2;
+            }
+            while (i > 16) {
+                seed = foldedMultiply(read64(p) ^ kSecret1, read64(p + 8) ^ seed);
+                p += 16;
+                i -= 16;
+            }
+            // The last 16 bytes (possibly overlapping ones already read):
+            a = read64(p + i - 16);
+            b = read64(p + i - 8);
+        }
+        a ^= kSecret1;
+        b ^= seed;
+        uint64_t h = foldedMultiply(kSecret1 ^ len, foldedMultiply(a, b));
+        return (uint32_t)h ^ (uint32_t)(h >> 32);
+    }
+
+
+#pragma mark - COMPARISON:
+
+
     int slice::compare(slice b) const noexcept {
         // Optimized for speed
         if (this->size == b.size)
@@ -196,13 +278,9 @@ namespace fleece {
 
     std::string slice::base64String() const {
         std::string str;
-        size_t strLen = ((size + 2) / 3) * 4;
+        size_t strLen = Base64EncodedSize(size);
         str.resize(strLen);
-        char *dst = &str[0];
-        base64::encoder enc;
-        enc.set_chars_per_line(0);
-        size_t written = enc.encode(buf, size, dst);
-        written += enc.encode_end(dst + written);
+        size_t written = EncodeBase64(*this, &str[0]);
         assert(written == strLen);
         (void)written;  // avoid compiler warning in release build when 'assert' is a no-op
         return str;
@@ -210,11 +288,10 @@ namespace fleece {
 
 
     slice slice::readBase64Into(slice output) const {
-        size_t expectedLen = (size + 3) / 4 * 3;
+        size_t expectedLen = Base64DecodedMaxSize(size);
         if (expectedLen > output.size)
             return nullslice;
-        base64::decoder dec;
-        size_t len = dec.decode(buf, size, (void*)output.buf);
+        size_t len = DecodeBase64(*this, (void*)output.buf);
         assert(len <= output.size);
         return slice(output.buf, len);
     }
@@ -225,16 +302,22 @@ namespace fleece {
 
     struct alloc_slice::sharedBuffer {
         std::atomic<uint32_t> _refCount {1};
-        uint8_t _buf[4];
+        alignas(8) uint8_t _buf[8];     // (aligned so the numbers in packed arrays will be)
 
+        // Taking a reference needs no ordering, since the caller already holds one.
         inline sharedBuffer* retain() noexcept {
-            ++_refCount;
+            _refCount.fetch_add(1, std::memory_order_relaxed);
             return this;
         }
 
+        // If the count is 1, the caller holds the only reference, so no other thread can be
+        // changing it; that skips the (much more expensive) atomic decrement when freeing an
+        // unshared buffer, which is the common case.
         inline void release() noexcept {
-            if (--_refCount == 0)
+            if (_refCount.load(std::memory_order_acquire) == 1
+                    || _refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
                 delete this;
+            }
         }
 
         static inline void* operator new(size_t basicSize, size_t bufferSize) {
@@ -287,8 +370,10 @@ namespace fleece {
     }
 
     alloc_slice& alloc_slice::operator=(const alloc_slice& s) noexcept {
-        const_cast<alloc_slice&>(s).retain();
-        release();
+        if (s.buf != buf) {
+            const_cast<alloc_slice&>(s).retain();
+            release();
+        }
         assignFrom(s);
         return *this;
     }
@@ -325,7 +410,7 @@ namespace fleece {
             reset(newSize);
         } else {
             sharedBuffer* newBuf;
-            if (shared()->_refCount == 1) {
+            if (shared()->_refCount.load(std::memory_order_acquire) == 1) {
                 newBuf = shared()->realloc(newSize);
             } else {
                 newBuf = sharedBuffer::newBuffer(newSize);
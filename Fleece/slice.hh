@@ -135,13 +135,10 @@ namespace fleece {
         #define hexCString() hexString().c_str()    // has to be a macro else dtor called too early
         #define cString() asString().c_str()        // has to be a macro else dtor called too early
 
-        /** djb2 hash algorithm */
-        uint32_t hash() const {
-            uint32_t h = 5381;
-            for (size_t i = 0; i < size; i++)
-                h = (h<<5) + h + (*this)[i];
-            return h;
-        }
+        /** Fast non-cryptographic hash of the contents (in the style of wyhash: it reads 8 or 16
+            bytes at a time and mixes them with 64x64->128-bit multiplies.) The result is not
+            guaranteed to be the same across versions or platforms, so don't persist it. */
+        uint32_t hash() const noexcept;
 
 
 #ifdef __OBJC__
@@ -259,7 +256,7 @@ namespace fleece {
 #endif
 
 
-    /** Functor class for hashing the contents of a slice (using the djb2 hash algorithm.)
+    /** Functor class for hashing the contents of a slice (using slice::hash.)
         Suitable for use with std::unordered_map. */
     struct sliceHash {
         std::size_t operator() (slice const& s) const {return s.hash();}
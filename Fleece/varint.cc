@@ -18,6 +18,9 @@
 #include "Endian.hh"
 #include <assert.h>
 #include <stdio.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
 namespace fleece {
@@ -43,7 +46,19 @@ size_t PutUVarInt(void *buf, uint64_t n) {
 }
 
 
-size_t GetUVarInt(slice buf, uint64_t *n) {
+static inline unsigned countTrailingZeros(uint64_t n) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, n);
+    return index;
+#else
+    return __builtin_ctzll(n);
+#endif
+}
+
+
+// Decodes a varint a byte at a time. Handles any length, and any buffer size.
+static size_t getUVarIntBytewise(slice buf, uint64_t *n) {
     uint64_t result = 0;
     int shift = 0;
     for (size_t i = 0; i < buf.size; i++) {
@@ -61,9 +76,45 @@ size_t GetUVarInt(slice buf, uint64_t *n) {
     return 0; // buffer too short
 }
 
-size_t GetUVarInt32(slice buf, uint32_t *n) {
+
+// Decodes a varint from the first 8 bytes of the input, loaded as a little-endian word,
+// without branching on each byte. Returns its length, or 0 if it's longer than 8 bytes.
+static inline size_t decodeWord(uint64_t word, uint64_t *n) {
+    uint64_t stops = ~word & 0x8080808080808080ull;    // High bit of each byte ending a varint
+    if (_usuallyFalse(stops == 0))
+        return 0;
+    unsigned nBits = countTrailingZeros(stops) + 1;   // = 8 * length
+    uint64_t x = word & 0x7F7F7F7F7F7F7F7Full;
+    if (nBits < 64)
+        x &= (1ull << nBits) - 1;
+    // Squeeze out the gaps between the 7-bit groups: join pairs of them, then pairs of those...
+    x = ((x & 0x7F007F007F007F00ull) >> 1) | (x & 0x007F007F007F007Full);
+    x = ((x & 0x3FFF00003FFF0000ull) >> 2) | (x & 0x00003FFF00003FFFull);
+    x = ((x & 0x0FFFFFFF00000000ull) >> 4) | (x & 0x000000000FFFFFFFull);
+    *n = x;
+    return nBits / 8;
+}
+
+
+static inline uint64_t loadWord(const void *src) {
+    uint64_t word;
+    memcpy(&word, src, 8);
+    return _decLittle64(word);
+}
+
+
+size_t _GetUVarInt(slice buf, uint64_t *n) {
+    if (_usuallyTrue(buf.size >= 8)) {
+        size_t size = decodeWord(loadWord(buf.buf), n);
+        if (_usuallyTrue(size > 0))
+            return size;
+    }
+    return getUVarIntBytewise(buf, n);
+}
+
+size_t _GetUVarInt32(slice buf, uint32_t *n) {
     uint64_t n64;
-    size_t size = GetUVarInt(buf, &n64);
+    size_t size = _GetUVarInt(buf, &n64);
     if (size == 0 || n64 > UINT32_MAX) // Numeric overflow
         return 0;
     *n = (uint32_t)n64;
@@ -71,24 +122,53 @@ size_t GetUVarInt32(slice buf, uint32_t *n) {
 }
 
 
-bool ReadUVarInt(slice *buf, uint64_t *n) {
-    if (buf->size == 0)
-        return false;
-    size_t bytesRead = GetUVarInt(*buf, n);
-    if (bytesRead == 0)
-        return false;
-    buf->moveStart(bytesRead);
-    return true;
+template <class INT>
+static inline size_t getUVarInts(slice buf, INT n[], size_t count) {
+    static const uint64_t kMax = (INT)-1;
+    auto start = (const uint8_t*)buf.buf, pos = start, end = start + buf.size;
+    INT *out = n, *outEnd = n + count;
+    while (out < outEnd) {
+        uint64_t value;
+        size_t size;
+        if (_usuallyTrue(end - pos >= 8)) {
+            uint64_t word = loadWord(pos);
+            uint64_t highBits = word & 0x8080808080808080ull;
+            if (!(highBits & 0x80) && outEnd - out >= 8) {
+                // Copy all 8 bytes out, then keep only the leading run of 1-byte varints:
+                for (int i = 0; i < 8; ++i)
+                    out[i] = pos[i];
+                unsigned run = highBits ? (countTrailingZeros(highBits) >> 3) : 8;
+                out += run;
+                pos += run;
+                continue;
+            } else if (!(word & 0x80)) {
+                value = word & 0x7F;
+                size = 1;
+            } else if (!(word & 0x8000)) {
+                value = (word & 0x7F) | ((word >> 1) & 0x3F80);
+                size = 2;
+            } else {
+                size = decodeWord(word, &value);
+                if (_usuallyFalse(size == 0))
+                    size = getUVarIntBytewise(slice(pos, end), &value);
+            }
+        } else {
+            size = getUVarIntBytewise(slice(pos, end), &value);
+        }
+        if (_usuallyFalse(size == 0 || value > kMax))
+            return 0;
+        *out++ = (INT)value;
+        pos += size;
+    }
+    return pos - start;
 }
 
-bool ReadUVarInt32(slice *buf, uint32_t *n) {
-    if (buf->size == 0)
-        return false;
-    size_t bytesRead = GetUVarInt32(*buf, n);
-    if (bytesRead == 0)
-        return false;
-    buf->moveStart(bytesRead);
-    return true;
+size_t GetUVarInts(slice buf, uint64_t n[], size_t count) {
+    return getUVarInts(buf, n, count);
+}
+
+size_t GetUVarInts32(slice buf, uint32_t n[], size_t count) {
+    return getUVarInts(buf, n, count);
 }
 
 
@@ -120,6 +200,9 @@ bool WriteUVarInt(slice *buf, uint64_t n) {
             if (((uint8_t*)buf)[size-1] != trim)
                 break;
         }
+        // A signed number needs its last byte's high bit to match its sign, for sign extension:
+        if (!isUnsigned && size < 8 && (((uint8_t*)buf)[size-1] & 0x80) != (trim & 0x80))
+            ++size;
         return size;
     }
 
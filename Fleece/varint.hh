@@ -17,6 +17,7 @@
 
 #include <stddef.h>
 #include "slice.hh"
+#include "PlatformCompat.hh"
 
 namespace fleece {
 
@@ -42,16 +43,63 @@ size_t SizeOfVarInt(uint64_t n);
 /** Encodes n as a varint, writing it to buf. Returns the number of bytes written. */
 size_t PutUVarInt(void *buf, uint64_t n);
 
+// Out-of-line implementations of GetUVarInt and GetUVarInt32, for varints over 2 bytes:
+size_t _GetUVarInt(slice buf, uint64_t *n);
+size_t _GetUVarInt32(slice buf, uint32_t *n);
+
 /** Decodes a varint from the bytes in buf, storing it into *n.
     Returns the number of bytes read, or 0 if the data is invalid (buffer too short or number
-    too long.) */
-size_t GetUVarInt(slice buf, uint64_t *n);
-size_t GetUVarInt32(slice buf, uint32_t *n);
+    too long.)
+    1- and 2-byte varints (values below 16384), which are most of the ones in Fleece data, are
+    decoded inline. */
+inline size_t GetUVarInt(slice buf, uint64_t *n) {
+    auto bytes = (const uint8_t*)buf.buf;
+    if (_usuallyTrue(buf.size >= 1 && bytes[0] < 0x80)) {
+        *n = bytes[0];
+        return 1;
+    } else if (_usuallyTrue(buf.size >= 2 && bytes[1] < 0x80)) {
+        *n = (bytes[0] & 0x7F) | ((uint64_t)bytes[1] << 7);
+        return 2;
+    }
+    return _GetUVarInt(buf, n);
+}
+
+inline size_t GetUVarInt32(slice buf, uint32_t *n) {
+    auto bytes = (const uint8_t*)buf.buf;
+    if (_usuallyTrue(buf.size >= 1 && bytes[0] < 0x80)) {
+        *n = bytes[0];
+        return 1;
+    } else if (_usuallyTrue(buf.size >= 2 && bytes[1] < 0x80)) {
+        *n = (bytes[0] & 0x7F) | ((uint32_t)bytes[1] << 7);
+        return 2;
+    }
+    return _GetUVarInt32(buf, n);
+}
 
 /** Decodes a varint from buf, and advances buf to the remaining space after it.
     Returns false if the end of the buffer is reached or there is a parse error. */
-bool ReadUVarInt(slice *buf, uint64_t *n);
-bool ReadUVarInt32(slice *buf, uint32_t *n);
+inline bool ReadUVarInt(slice *buf, uint64_t *n) {
+    size_t bytesRead = GetUVarInt(*buf, n);
+    if (bytesRead == 0)
+        return false;
+    buf->moveStart(bytesRead);
+    return true;
+}
+
+inline bool ReadUVarInt32(slice *buf, uint32_t *n) {
+    size_t bytesRead = GetUVarInt32(*buf, n);
+    if (bytesRead == 0)
+        return false;
+    buf->moveStart(bytesRead);
+    return true;
+}
+
+/** Decodes `count` consecutive varints from buf into the array `n`, eight bytes at a time:
+    runs of 1-byte varints are copied out directly, and longer ones are decoded without a
+    loop over their bytes. Returns the total number of bytes read, or 0 if the data is invalid
+    (if it's too short, or any number is too long.) */
+size_t GetUVarInts(slice buf, uint64_t n[], size_t count);
+size_t GetUVarInts32(slice buf, uint32_t n[], size_t count);
 
 /** Encodes a varint into buf, and advances buf to the remaining space after it.
     Returns false if there isn't enough room. */
@@ -15,7 +15,9 @@
 
 #import <Foundation/Foundation.h>
 #import "Encoder.hh"
+#include "SharedKeys.hh"
 #include "FleeceException.hh"
+#include <unordered_map>
 
 
 @interface NSObject (Fleece)
@@ -30,6 +32,94 @@ namespace fleece {
         [obj fl_encodeTo: this];
     }
 
+
+    // Maps NSString objects to their UTF-8 bytes, so that strings written over and over (mostly
+    // dictionary keys) are only converted once per Encoder. It's keyed by object pointer, which
+    // is safe because each entry retains its NSString, so the address can't be reused by a
+    // different string. Only immutable strings are cached, since a mutable one could change;
+    // a mutable string gets an entry just to remember that, so it's only tested once.
+    struct NSStringCache {
+        struct Entry {
+            NSString *string;                   // (strong ref; keeps the key pointer valid)
+            bool isMutable {false};             // If true, the string isn't cached
+            alloc_slice utf8;
+            const SharedKeys *sharedKeys {nullptr}; // The SharedKeys that sharedKey is from
+            int sharedKey {-1};                 // Integer encoding of the string, if known
+        };
+
+        static const NSUInteger kMaxLength = 64;    // Longer strings aren't worth caching
+        static const size_t kMaxEntries = 4096;     // The cache is cleared when it hits this
+
+        Entry* lookup(__unsafe_unretained NSString *str) {
+            if (str.length > kMaxLength)
+                return nullptr;
+            auto i = _entries.find((__bridge const void*)str);
+            if (i != _entries.end())
+                return i->second.isMutable ? nullptr : &i->second;
+            if (_entries.size() >= kMaxEntries)
+                _entries.clear();
+            Entry &entry = _entries[(__bridge const void*)str];
+            entry.string = str;
+            // Copying an immutable string just retains it; a mutable one makes a real copy:
+            if ([str copy] != str) {
+                entry.isMutable = true;
+                return nullptr;
+            }
+            entry.utf8 = alloc_slice(nsstring_slice(str));
+            return &entry;
+        }
+
+    private:
+        std::unordered_map<const void*, Entry> _entries;
+    };
+
+
+    static NSStringCache* cacheFor(std::shared_ptr<NSStringCache> &cache) {
+        if (!cache)
+            cache = std::make_shared<NSStringCache>();
+        return cache.get();
+    }
+
+
+    void Encoder::writeString(__unsafe_unretained NSString *str) {
+        auto entry = cacheFor(_nsStringCache)->lookup(str);
+        if (entry) {
+            writeString(entry->utf8);
+        } else {
+            nsstring_slice s(str);
+            writeString(s);
+        }
+    }
+
+
+    void Encoder::writeKey(__unsafe_unretained NSString *key) {
+        throwIf(![key isKindOfClass: [NSString class]], InvalidData,
+                "Dictionary keys must be strings");
+        auto entry = cacheFor(_nsStringCache)->lookup(key);
+        if (!entry) {
+            nsstring_slice s(key);
+            writeKey(s);
+            return;
+        }
+        if (_sharedKeys) {
+            // Use the cached integer key if it's from this SharedKeys and still valid (it won't
+            // be if the SharedKeys has been reverted since):
+            if (entry->sharedKeys == _sharedKeys && entry->sharedKey >= 0
+                        && _sharedKeys->decode(entry->sharedKey) == entry->utf8) {
+                writeKey(entry->sharedKey);
+                return;
+            }
+            int n;
+            if (_sharedKeys->encodeAndAdd(entry->utf8, n)) {
+                entry->sharedKeys = _sharedKeys;
+                entry->sharedKey = n;
+                writeKey(n);
+                return;
+            }
+        }
+        writeKey(entry->utf8);
+    }
+
 }
 
 
@@ -76,8 +166,7 @@ using namespace fleece;
 
 @implementation NSString (CBJSONEncoder)
 - (void) fl_encodeTo: (Encoder*)enc {
-    nsstring_slice s(self);
-    enc->writeString(s);
+    enc->writeString(self);
 }
 @end
 
@@ -102,8 +191,7 @@ using namespace fleece;
     enc->beginDictionary((uint32_t)self.count);
     [self enumerateKeysAndObjectsUsingBlock:^(__unsafe_unretained id key,
                                               __unsafe_unretained id value, BOOL *stop) {
-        nsstring_slice slice(key);
-        enc->writeKey(slice);
+        enc->writeKey((NSString*)key);
         [value fl_encodeTo: enc];
     }];
     enc->endDictionary();
@@ -18,11 +18,22 @@
 #import "Array.hh"
 #import "Encoder.hh"
 #import "Fleece+CoreFoundation.h"
+#import <memory>
 using namespace fleece;
 
 #define UU __unsafe_unretained
 
 
+// NSMapXXX C API isn't available in iOS (as in Value+ObjC.mm)
+#if TARGET_OS_IPHONE
+#define MapGet(MAP, KEY)           [(MAP) objectForKey: (__bridge id)(KEY)]
+#define MapInsert(MAP, KEY, VALUE) [(MAP) setObject: (VALUE) forKey: (__bridge id)(KEY)]
+#else
+#define MapGet(MAP, KEY)           (__bridge id)NSMapGet((MAP), (KEY))
+#define MapInsert(MAP, KEY, VALUE) NSMapInsert((MAP), (KEY), (__bridge void*)(VALUE))
+#endif
+
+
 @interface FleeceDictionary ()
 - (instancetype) initWithDict: (const fleece::Dict*)dictValue
                      document: (FleeceDocument*)document;
@@ -42,11 +53,15 @@ using namespace fleece;
 
 // FleeceDocument is instantiated to hold onto the encoded data and the shared strings,
 // but clients never see it; the public objects (FleeceDictionary, FleeceArray) hold references.
+// Values are converted lazily, only when accessed, and the resulting objects are cached (weakly,
+// so they don't keep the document alive) so that accessing the same value again returns the
+// same object without converting it again.
 @implementation FleeceDocument
 {
     NSData* _fleeceData;
+    const Value* _rootValue;
     NSMapTable* _sharedStrings;
-    id _root;
+    NSMapTable* _objects;       // Maps const Value* -> converted object (weak)
 }
 
 - (instancetype) initWithFleeceData: (UU NSData*)fleece
@@ -56,12 +71,16 @@ using namespace fleece;
     self = [super init];
     if (self) {
         _fleeceData = [fleece copy];
-        slice data(fleece);
-        const Value *root = trusted ? Value::fromTrustedData(data) : Value::fromData(data);
-        _sharedStrings = Value::createSharedStringsTable();
-        _root = [self objectForValue: root];
-        if (!_root)
+        slice data(_fleeceData);
+        _rootValue = trusted ? Value::fromTrustedData(data) : Value::fromData(data);
+        if (!_rootValue)
             return nil;
+        _sharedStrings = Value::createSharedStringsTable();
+        _objects = [[NSMapTable alloc] initWithKeyOptions: NSPointerFunctionsOpaquePersonality |
+                                                           NSPointerFunctionsOpaqueMemory
+                                             valueOptions: NSPointerFunctionsObjectPersonality |
+                                                           NSPointerFunctionsWeakMemory
+                                                 capacity: 16];
     }
     return self;
 }
@@ -70,19 +89,36 @@ using namespace fleece;
 - (id) objectForValue: (const Value*)v {
     if (!v)
         return nil;
+    id object;
+    switch (v->type()) {
+        case kNull:
+        case kBoolean:
+        case kNumber:
+            return v->toNSObject();     // cheap enough not to be worth caching
+        default:
+            object = MapGet(_objects, v);
+            if (object)
+                return object;
+            break;
+    }
     switch (v->type()) {
         case kArray:
-            return [[FleeceArray alloc] initWithArray: v->asArray() document: self];
+            object = [[FleeceArray alloc] initWithArray: v->asArray() document: self];
+            break;
         case kDict:
-            return [[FleeceDictionary alloc] initWithDict: v->asDict() document: self];
+            object = [[FleeceDictionary alloc] initWithDict: v->asDict() document: self];
+            break;
         default:
-            return v->toNSObject(_sharedStrings);
+            object = v->toNSObject(_sharedStrings);
+            break;
     }
+    MapInsert(_objects, v, object);
+    return object;
 }
 
 
 - (id) rootObject {
-    return _root;
+    return [self objectForValue: _rootValue];
 }
 
 
@@ -124,6 +160,12 @@ using namespace fleece;
 #pragma mark - DICTIONARY:
 
 
+// Enumerates a FleeceDictionary's keys directly with a Dict::iterator.
+@interface FleeceDictionaryKeyEnumerator : NSEnumerator
+- (instancetype) initWithDict: (const Dict*)dict document: (FleeceDocument*)document;
+@end
+
+
 @implementation FleeceDictionary
 {
     const Dict* _dict;
@@ -207,7 +249,7 @@ using namespace fleece;
 
 
 - (NSEnumerator *)keyEnumerator {
-    return self.allKeys.objectEnumerator;
+    return [[FleeceDictionaryKeyEnumerator alloc] initWithDict: _dict document: _document];
 }
 
 
@@ -269,6 +311,35 @@ using namespace fleece;
 
 
 
+@implementation FleeceDictionaryKeyEnumerator
+{
+    // (An ivar has to be default-constructible, which Dict::iterator isn't)
+    std::unique_ptr<Dict::iterator> _iter;
+    FleeceDocument *_document;
+}
+
+- (instancetype) initWithDict: (const Dict*)dict document: (UU FleeceDocument*)document {
+    self = [super init];
+    if (self) {
+        _iter.reset(new Dict::iterator(dict));
+        _document = document;
+    }
+    return self;
+}
+
+- (id) nextObject {
+    if (!*_iter)
+        return nil;
+    id key = [_document objectForValue: _iter->key()];
+    ++*_iter;
+    return key;
+}
+
+@end
+
+
+
+
 #pragma mark - ARRAY:
 
 
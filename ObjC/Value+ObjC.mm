@@ -18,6 +18,9 @@
 #include "Array.hh"
 #include "SharedKeys.hh"
 #include "FleeceException.hh"
+#include <algorithm>
+#include <exception>
+#include <vector>
 
 
 // NSMapXXX C API isn't available in iOS
@@ -31,6 +34,19 @@
 #endif
 
 
+namespace fleece {
+    class SharedKeys;
+}
+
+
+// An NSArray that converts the items of a Fleece array lazily, a slice at a time.
+@interface FleeceSlicedArray : NSArray
+- (instancetype) initWithArray: (const fleece::Array*)array
+                 sharedStrings: (NSMapTable*)sharedStrings
+                    sharedKeys: (const fleece::SharedKeys*)sk;
+@end
+
+
 namespace fleece {
 
     // Creates an NSMapTable that maps opaque pointers to Obj-C objects (NSStrings).
@@ -50,6 +66,30 @@ namespace fleece {
     }
 
 
+    static NSString* convertKey(const Value *keyValue,
+                                __unsafe_unretained NSMapTable *sharedStrings,
+                                const SharedKeys *sk)
+    {
+        NSString* key = nil;
+        if (keyValue->isInteger() && sk) {
+            // Decode int key using SharedKeys:
+            auto encodedKey = (int)keyValue->asInt();
+            key = (__bridge NSString*)sk->platformStringForKey(encodedKey);
+            if (!key) {
+                slice strSlice = sk->decode(encodedKey);
+                if (strSlice) {
+                    key = convertString(strSlice);
+                    sk->setPlatformStringForKey(encodedKey, CFRetain((__bridge CFStringRef)key));
+                    //TODO: Strings need to be CFRelease'd when the SharedKeys is destructed.
+                }
+            }
+        }
+        if (!key)
+            key = keyValue->toNSObject(sharedStrings, sk);
+        return key;
+    }
+
+
     id Value::toNSObject(__unsafe_unretained NSMapTable *sharedStrings, const SharedKeys *sk) const
     {
         switch (type()) {
@@ -102,23 +142,7 @@ namespace fleece {
                 Dict::iterator iter(asDict());
                 auto result = [[NSMutableDictionary alloc] initWithCapacity: iter.count()];
                 for (; iter; ++iter) {
-                    NSString* key = nil;
-                    if (iter.key()->isInteger() && sk) {
-                        // Decode int key using SharedKeys:
-                        auto encodedKey = (int)iter.key()->asInt();
-                        key = (__bridge NSString*)sk->platformStringForKey(encodedKey);
-                        if (!key) {
-                            slice strSlice = sk->decode(encodedKey);
-                            if (strSlice) {
-                                key = convertString(strSlice);
-                                sk->setPlatformStringForKey(encodedKey,
-                                                            CFRetain((__bridge CFStringRef)key));
-                                //TODO: Strings need to be CFRelease'd when the SharedKeys is destructed.
-                            }
-                        }
-                    }
-                    if (!key)
-                        key = iter.key()->toNSObject(sharedStrings, sk);
+                    NSString* key = convertKey(iter.key(), sharedStrings, sk);
                     result[key] = iter.value()->toNSObject(sharedStrings, sk);
                 }
                 return result;
@@ -129,4 +153,209 @@ namespace fleece {
     }
 
 
+#pragma mark - CONCURRENT CONVERSION:
+
+
+    // Arrays with fewer items than this are converted on the calling thread.
+    static const uint32_t kMinConcurrentArrayCount = 1024;
+
+    // Minimum number of items in each slice of an array that's converted concurrently.
+    static const uint32_t kMinConcurrentSliceSize = 256;
+
+
+    // Adds the entries of `src` that aren't in `dst` to it.
+    static void mergeSharedStrings(__unsafe_unretained NSMapTable *dst,
+                                   __unsafe_unretained NSMapTable *src)
+    {
+        for (__unsafe_unretained id key in src) {
+            auto value = (__bridge const void*)key;     // keys are really const Value*
+            if (!MapGet(dst, value))
+                MapInsert(dst, value, [src objectForKey: key]);
+        }
+    }
+
+
+    static id convertArrayConcurrently(const Array *array,
+                                       __unsafe_unretained NSMapTable *sharedStrings,
+                                       const SharedKeys *sk)
+    {
+        // Split the array into a few slices per CPU, so workers that finish early can pick up
+        // more of them:
+        uint32_t count = array->count();
+        auto nCPUs = (uint32_t)std::max(NSProcessInfo.processInfo.activeProcessorCount,
+                                        (NSUInteger)1);
+        uint32_t sliceSize = std::max((count + 4*nCPUs - 1) / (4*nCPUs), kMinConcurrentSliceSize);
+        size_t nSlices = (count + sliceSize - 1) / sliceSize;
+
+        // NSMapTable isn't thread-safe, so each slice gets its own shared-string table.
+        // (SharedKeys is thread-safe.)
+        std::vector<id> items(count);
+        std::vector<NSMapTable*> sliceStrings(nSlices);
+        std::vector<std::exception_ptr> errors(nSlices);
+        __strong id *itemsPtr = items.data();
+        NSMapTable* __strong *sliceStringsPtr = sliceStrings.data();
+        std::exception_ptr *errorsPtr = errors.data();
+        auto queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+        dispatch_apply(nSlices, queue, ^(size_t slice) {
+            try {
+                @autoreleasepool {
+                    NSMapTable *strings = nil;
+                    if (sharedStrings)
+                        strings = sliceStringsPtr[slice] = Value::createSharedStringsTable();
+                    uint32_t i = (uint32_t)slice * sliceSize;
+                    uint32_t end = std::min(i + sliceSize, count);
+                    Array::iterator iter(array);
+                    for (iter += i; i < end; ++i, ++iter)
+                        itemsPtr[i] = iter->toNSObject(strings, sk);
+                }
+            } catch (...) {
+                errorsPtr[slice] = std::current_exception();    // Can't throw out of the block
+            }
+        });
+
+        for (auto &error : errors)
+            if (error)
+                std::rethrow_exception(error);
+        if (sharedStrings) {
+            for (NSMapTable *strings : sliceStrings)
+                mergeSharedStrings(sharedStrings, strings);
+        }
+        return [[NSMutableArray alloc] initWithObjects: items.data() count: count];
+    }
+
+
+    id Value::toNSObjectConcurrently(__unsafe_unretained NSMapTable *sharedStrings,
+                                     const SharedKeys *sk) const
+    {
+        switch (type()) {
+            case kArray:
+                if (asArray()->count() >= kMinConcurrentArrayCount)
+                    return convertArrayConcurrently(asArray(), sharedStrings, sk);
+                break;
+            case kDict: {
+                // Look for large arrays among the values:
+                Dict::iterator iter(asDict());
+                auto result = [[NSMutableDictionary alloc] initWithCapacity: iter.count()];
+                for (; iter; ++iter) {
+                    NSString* key = convertKey(iter.key(), sharedStrings, sk);
+                    result[key] = iter.value()->toNSObjectConcurrently(sharedStrings, sk);
+                }
+                return result;
+            }
+            default:
+                break;
+        }
+        return toNSObject(sharedStrings, sk);
+    }
+
+
+    NSArray* Value::toLazyNSArray(__unsafe_unretained NSMapTable *sharedStrings,
+                                  const SharedKeys *sk) const
+    {
+        const Array *array = asArray();
+        if (!array)
+            return nil;
+        return [[FleeceSlicedArray alloc] initWithArray: array
+                                          sharedStrings: sharedStrings
+                                             sharedKeys: sk];
+    }
+
+}
+
+
+
+#pragma mark - SLICED ARRAY:
+
+
+using namespace fleece;
+
+
+// Number of items converted at once by a FleeceSlicedArray.
+static const NSUInteger kLazySliceSize = 64;
+
+
+@implementation FleeceSlicedArray
+{
+    const Array* _array;
+    NSUInteger _count;
+    NSMapTable* _sharedStrings;
+    const SharedKeys* _sharedKeys;
+    std::vector<NSArray*> _slices;      // Converted slices; nil until first accessed
+}
+
+
+- (instancetype) initWithArray: (const Array*)array
+                 sharedStrings: (__unsafe_unretained NSMapTable*)sharedStrings
+                    sharedKeys: (const SharedKeys*)sk
+{
+    NSParameterAssert(array);
+    self = [super init];
+    if (self) {
+        _array = array;
+        _count = array->count();
+        _sharedStrings = sharedStrings;
+        _sharedKeys = sk;
+        _slices.resize((_count + kLazySliceSize - 1) / kLazySliceSize);
+    }
+    return self;
 }
+
+
+- (id) copyWithZone:(NSZone *)zone {
+    return self;
+}
+
+
+- (NSUInteger) count {
+    return _count;
+}
+
+
+// Returns the slice with the given index, converting it if this is the first time.
+- (NSArray*) slice: (NSUInteger)sliceIndex {
+    @synchronized(self) {       // The NSMapTable isn't thread-safe, and neither is _slices
+        NSArray *slice = _slices[sliceIndex];
+        if (!slice) {
+            auto start = (uint32_t)(sliceIndex * kLazySliceSize);
+            auto end = (uint32_t)std::min(start + kLazySliceSize, _count);
+            NSMutableArray *items = [[NSMutableArray alloc] initWithCapacity: end - start];
+            Array::iterator iter(_array);
+            iter += start;
+            for (uint32_t i = start; i < end; ++i, ++iter)
+                [items addObject: iter->toNSObject(_sharedStrings, _sharedKeys)];
+            _slices[sliceIndex] = slice = items;
+        }
+        return slice;
+    }
+}
+
+
+- (id) objectAtIndex: (NSUInteger)index {
+    if (index >= _count)
+        [NSException raise: NSRangeException format: @"Array index out of range"];
+    return [self slice: index / kLazySliceSize][index % kLazySliceSize];
+}
+
+
+// Fast enumeration -- for(in) loops use this. Returns the rest of one slice at a time.
+- (NSUInteger) countByEnumeratingWithState: (NSFastEnumerationState *)state
+                                   objects: (id __unsafe_unretained [])stackBuf
+                                     count: (NSUInteger)stackBufCount
+{
+    NSUInteger index = state->state;
+    if (index == 0)
+        state->mutationsPtr = &state->extra[0]; // this has to be pointed to something non-nullptr
+    if (index >= _count)
+        return 0;
+
+    NSArray *slice = [self slice: index / kLazySliceSize];
+    NSUInteger n = std::min(slice.count - index % kLazySliceSize, stackBufCount);
+    [slice getObjects: stackBuf range: NSMakeRange(index % kLazySliceSize, n)];
+
+    state->itemsPtr = stackBuf;
+    state->state += n;
+    return n;
+}
+
+
+@end
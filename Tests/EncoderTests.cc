@@ -7,12 +7,23 @@
 //
 
 #include "FleeceTests.hh"
+#include "Base64.hh"
+#include "Compression.hh"
+#include "DocumentFile.hh"
 #include "JSONConverter.hh"
 #include "KeyTree.hh"
+#include "MutableArray.hh"
+#include "ParallelArrayEncoder.hh"
 #include "Path.hh"
+#include "Schema.hh"
+#include "StringCache.hh"
+#include "decode.h"
+#include "encode.h"
 #include "jsonsl.h"
 #include "mn_wordlist.h"
+#include <atomic>
 #include <iostream>
+#include <thread>
 
 
 namespace fleece {
@@ -41,6 +52,11 @@ public:
         return v->pointerValue<WIDE>();
     }
 
+    // Makes the encoder treat pointers as too long for wide items past this many bytes.
+    void setWideOffsetLimit(size_t limit) {
+        enc._wideOffsetLimit = limit;
+    }
+
     void checkOutput(const char *expected) {
         endEncoding();
         std::string hex;
@@ -240,6 +256,8 @@ public:
         enc.writeInt( 2048);    checkOutput("1100 0800 8002");    checkRead(2048);
         enc.writeInt(-2049);    checkOutput("11FF F700 8002");    checkRead(-2049);
         enc.writeInt(0x223344); checkOutput("1244 3322 8002");    checkRead(0x223344);
+        enc.writeInt( 40000);   checkOutput("1240 9C00 8002");    checkRead(40000);
+        enc.writeInt(-34567);   checkOutput("12F9 78FF 8002");    checkRead(-34567);
         enc.writeInt(0x11223344556677);    checkOutput("1677 6655 4433 2211 8004");
         checkRead(0x11223344556677);
         enc.writeInt(0x1122334455667788);  checkOutput("1788 7766 5544 3322 1100 8005");
@@ -406,6 +424,96 @@ public:
         }
     }
 
+    TEST_CASE_METHOD(EncoderTests, "DictionaryKeyLookup") {
+        // Keys that differ only past their first 8 bytes, by length, or by zero bytes:
+        const std::string keys[] = {"", std::string("\0", 1), "a", std::string("a\0", 2), "ab",
+                                    "abc", "abcd", "abcdefg", std::string("abcdefg\0", 8),
+                                    "abcdefgh", std::string("abcdefgh\0", 9), "abcdefghi",
+                                    "abcdefghij_0001", "abcdefghij_0002", "abcdefghij_0002_x",
+                                    "abcdefghijklmnopqrstuvwxyz", "b", "\xff\xff"};
+        for (int sorted = 0; sorted <= 1; ++sorted) {
+            enc.sortKeys(sorted);
+            enc.beginDictionary();
+            for (int i = (int)(sizeof(keys)/sizeof(keys[0])) - 1; i >= 0; --i) {
+                enc.writeKey(slice(keys[i]));
+                enc.writeInt(i);
+            }
+            enc.endDictionary();
+            endEncoding();
+            auto d = Value::fromData(result)->asDict();
+            REQUIRE(d);
+            int i = 0;
+            for (auto &key : keys) {
+                if (sorted) {
+                    REQUIRE(d->get(slice(key)));
+                    CHECK(d->get(slice(key))->asInt() == i);
+                }
+                REQUIRE(d->get_unsorted(slice(key)));
+                CHECK(d->get_unsorted(slice(key))->asInt() == i);
+                ++i;
+            }
+            for (const char *missing : {"abcdefgh\x01", "abcdefghij_0003", "abd", "abcdefghij_000", "c"}) {
+                if (sorted)
+                    CHECK(d->get(slice(missing)) == nullptr);
+                CHECK(d->get_unsorted(slice(missing)) == nullptr);
+            }
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DictionaryKeysInOrder") {
+        {
+            enc.beginDictionary(2, true);
+            enc.writeKey("a");
+            enc.writeInt(1);
+            enc.writeKey("b");
+            enc.writeInt(2);
+            enc.endDictionary();
+            checkOutput("7002 4161 0001 4162 0002 8005");
+            auto d = checkDict(2);
+            REQUIRE(d->get(slice("b"))->asInt() == 2);
+        }
+        {
+            // The encoder trusts the caller, so out-of-order keys stay out of order:
+            enc.beginDictionary(2, true);
+            enc.writeKey("b");
+            enc.writeInt(2);
+            enc.writeKey("a");
+            enc.writeInt(1);
+            enc.endDictionary();
+            checkOutput("7002 4162 0002 4161 0001 8005");
+            auto d = checkDict(2);
+            REQUIRE(d->toJSON() == alloc_slice("{\"b\":2,\"a\":1}"));
+            REQUIRE(d->get_unsorted(slice("a"))->asInt() == 1);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DictionaryKeyOrderTracking") {
+        // Keys in order (including inline and integer keys) and out of order must both come
+        // out sorted:
+        static const char* const kKeys[] = {"", "a", "ab", "abc", "b", "ba"};
+        for (int reversed = 0; reversed <= 1; ++reversed) {
+            enc.beginDictionary();
+            for (int i = 0; i < 6; ++i) {
+                int k = reversed ? 5 - i : i;
+                enc.writeKey(kKeys[k]);
+                enc.writeInt(k);
+            }
+            enc.writeKey(-5);
+            enc.writeInt(-5);
+            enc.writeKey(reversed ? 3 : 2);
+            enc.writeInt(0);
+            enc.writeKey(reversed ? 2 : 3);
+            enc.writeInt(0);
+            enc.endDictionary();
+            endEncoding();
+            auto d = checkDict(9);
+            REQUIRE(d->toJSON() ==
+                    alloc_slice("{-5:-5,2:0,3:0,\"\":0,\"a\":1,\"ab\":2,\"abc\":3,\"b\":4,\"ba\":5}"));
+            for (int k = 0; k < 6; ++k)
+                REQUIRE(d->get(slice(kKeys[k]))->asInt() == k);
+        }
+    }
+
     TEST_CASE_METHOD(EncoderTests, "DictionaryNumericKeys") {
         {
             enc.beginDictionary();
@@ -430,6 +538,209 @@ public:
             REQUIRE(d->get(slice("barrr")) == (const Value*)nullptr);
             REQUIRE(d->toJSON() == alloc_slice("{0:23,1:42,2047:-1}"));
         }
+        // Dense ranges of keys, with no gaps, one gap, many gaps; and with string keys too:
+        for (int variant = 0; variant < 4; ++variant) {
+            auto present = [&](int k) {
+                switch (variant) {
+                    case 1:  return k != 17;
+                    case 2:  return k % 3 != 0;
+                    default: return true;
+                }
+            };
+            enc.beginDictionary();
+            if (variant == 3) {
+                enc.writeKey("zzz");
+                enc.writeInt(-1);
+            }
+            for (int k = 5; k < 45; ++k) {
+                if (present(k)) {
+                    enc.writeKey(k);
+                    enc.writeInt(k * 10);
+                }
+            }
+            enc.endDictionary();
+            endEncoding();
+            auto d = Value::fromData(result)->asDict();
+            REQUIRE(d);
+            for (int k = -3; k < 50; ++k) {
+                auto v = d->get(k);
+                if (k >= 5 && k < 45 && present(k)) {
+                    REQUIRE(v);
+                    CHECK(v->asInt() == k * 10);
+                } else {
+                    CHECK(v == nullptr);
+                }
+            }
+            if (variant == 3)
+                CHECK(d->get(slice("zzz"))->asInt() == -1);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DictionaryHashIndex") {
+        for (int sorted = 0; sorted <= 1; ++sorted) {
+            alloc_slice plainJSON;
+            for (int indexed = 0; indexed <= 1; ++indexed) {
+                enc.sortKeys(sorted);
+                enc.hashIndexMinCount(indexed ? 100 : 0);
+                enc.beginArray();
+                enc.beginDictionary();
+                enc.writeKey("x");
+                enc.writeInt(-1);
+                for (int i = 0; i < 5000; ++i) {
+                    char key[32];
+                    snprintf(key, sizeof(key), "key%d", i);
+                    enc.writeKey(slice(key));
+                    enc.writeInt(i);
+                }
+                enc.endDictionary();
+                enc.beginDictionary();          // too small to be indexed
+                enc.writeKey("a");
+                enc.writeInt(1);
+                enc.endDictionary();
+                enc.endArray();
+                endEncoding();
+
+                auto a = checkArray(2);
+                auto d = a->get(0)->asDict();
+                REQUIRE(d->count() == 5001);
+                bool canGet = sorted || indexed;    // get() needs sorted keys, or an index
+                REQUIRE(d->get_unsorted(slice("x"))->asInt() == -1);
+                if (canGet) {
+                    REQUIRE(d->get(slice("x"))->asInt() == -1);
+                    Dict::key nameKey(slice("key1234"));
+                    REQUIRE(d->get(nameKey)->asInt() == 1234);
+                    REQUIRE(d->get(slice("nope")) == nullptr);
+                }
+                for (int i = 0; i < 5000; i += 7) {
+                    char key[32];
+                    snprintf(key, sizeof(key), "key%d", i);
+                    if (canGet)
+                        REQUIRE(d->get(slice(key))->asInt() == i);
+                    REQUIRE(d->get_unsorted(slice(key))->asInt() == i);
+                }
+                REQUIRE(d->get_unsorted(slice("key5000")) == nullptr);
+                REQUIRE(a->get(1)->asDict()->get(slice("a"))->asInt() == 1);
+
+                unsigned n = 0;
+                for (Dict::iterator i(d); i; ++i) {
+                    REQUIRE(i.key()->asString().size > 0);    // index entry isn't visible
+                    ++n;
+                }
+                REQUIRE(n == 5001);
+
+                alloc_slice json = a->toJSON();
+                if (indexed) {
+                    REQUIRE(json == plainJSON);
+                    REQUIRE(result.size > 5000*4);
+                } else {
+                    plainJSON = json;
+                }
+            }
+        }
+        enc.sortKeys(true);
+        enc.hashIndexMinCount(0);
+
+        // The index's key can't be written as a real key, even when indexing is off, else a
+        // reader would mistake that entry for an index and hide it:
+        enc.beginDictionary();
+        CHECK_THROWS_AS(enc.writeKey(-2048), const FleeceException&);
+        enc.reset();
+        enc.beginDictionary();
+        enc.writeKey(-2046);
+        enc.writeInt(1);
+        enc.endDictionary();
+        endEncoding();
+        auto d = Value::fromData(result)->asDict();
+        REQUIRE(d->count() == 1);
+        Dict::iterator i(d);
+        REQUIRE(i.key()->asInt() == -2046);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DictionaryPrefixIndex") {
+        alloc_slice plainJSON;
+        size_t plainSize = 0;
+        for (int variant = 0; variant < 3; ++variant) {
+            // 0: no index; 1: prefix index; 2: prefix and hash indexes
+            enc.prefixIndexMinCount(variant >= 1 ? 10 : 0);
+            enc.hashIndexMinCount(variant >= 2 ? 10 : 0);
+            enc.beginArray();
+            enc.beginDictionary();
+            for (int i = 2000; i >= 0; --i) {
+                char key[32];
+                snprintf(key, sizeof(key), "attr_user_%d", i);
+                enc.writeKey(slice(key));
+                enc.writeInt(i);
+            }
+            enc.writeKey(7);
+            enc.writeInt(-7);
+            enc.writeKey(3);
+            enc.writeInt(-3);
+            enc.endDictionary();
+            enc.beginDictionary();              // short keys with no common prefix
+            for (char c = 'z'; c >= 'a'; --c) {
+                enc.writeKey(slice(&c, 1));
+                enc.writeInt(c);
+            }
+            enc.endDictionary();
+            enc.beginDictionary();              // too small to be indexed
+            enc.writeKey("attr_user_1");
+            enc.writeInt(1);
+            enc.endDictionary();
+            enc.endArray();
+            endEncoding();
+
+            auto a = checkArray(3);
+            auto d = a->get(0)->asDict();
+            REQUIRE(d->count() == 2003);
+            for (int i = 0; i <= 2000; i += 3) {
+                char key[32];
+                snprintf(key, sizeof(key), "attr_user_%d", i);
+                REQUIRE(d->get(slice(key))->asInt() == i);
+                Dict::key dk((slice(key)));
+                REQUIRE(d->get(dk)->asInt() == i);
+                REQUIRE(d->get(dk)->asInt() == i);          // (now using the hint)
+            }
+            REQUIRE(d->get(3)->asInt() == -3);
+            REQUIRE(d->get(7)->asInt() == -7);
+            REQUIRE(d->get(5) == nullptr);
+            for (const char *missing : {"attr_user_2001", "attr_user_", "attr_user_00",
+                                        "attr_user_1000x", "attr_usex_1", "attr_", "", "zzz"}) {
+                INFO("Looking up '" << missing << "'");
+                REQUIRE(d->get(slice(missing)) == nullptr);
+                Dict::key dk((slice(missing)));
+                REQUIRE(d->get(dk) == nullptr);
+            }
+
+            auto shortKeys = a->get(1)->asDict();
+            REQUIRE(shortKeys->count() == 26);
+            for (char c = 'a'; c <= 'z'; ++c)
+                REQUIRE(shortKeys->get(slice(&c, 1))->asInt() == c);
+            REQUIRE(shortKeys->get(slice("aa")) == nullptr);
+            REQUIRE(shortKeys->get(slice("")) == nullptr);
+            REQUIRE(a->get(2)->asDict()->get(slice("attr_user_1"))->asInt() == 1);
+
+            unsigned n = 0;
+            for (Dict::iterator i(d); i; ++i) {
+                REQUIRE(i.key()->asInt() >= 0);         // index entries aren't visible
+                ++n;
+            }
+            REQUIRE(n == 2003);
+
+            alloc_slice json = a->toJSON();
+            if (variant == 0) {
+                plainJSON = json;
+                plainSize = result.size;
+            } else {
+                REQUIRE(json == plainJSON);
+                if (variant == 1)
+                    REQUIRE(result.size >= plainSize + 2027*4);
+            }
+        }
+        enc.prefixIndexMinCount(0);
+        enc.hashIndexMinCount(0);
+        enc.beginDictionary();
+        CHECK_THROWS_AS(enc.writeKey(-2047), const FleeceException&);     // reserved for the index
+        enc.reset();
     }
 
     TEST_CASE_METHOD(EncoderTests, "SharedStrings") {
@@ -491,6 +802,192 @@ public:
         REQUIRE((slice)output == json);
     }
 
+    TEST_CASE_METHOD(EncoderTests, "JSON Numbers") {
+        slice json("[0,-1,18446744073709551615,-9223372036854775808,18446744073709551616,"
+                   "-9223372036854775809,1E-2,2.5e+3,12.345678,-0.001]");
+        JSONConverter j(enc);
+        REQUIRE(j.encodeJSON(json));
+        endEncoding();
+        auto a = checkArray(10);
+        CHECK(a->get(2)->asUnsigned() == UINT64_MAX);
+        CHECK(a->get(3)->asInt() == INT64_MIN);
+        CHECK(a->get(4)->asDouble() == 18446744073709551616.0);
+        CHECK(a->get(5)->asDouble() == -9223372036854775809.0);
+        CHECK(a->toJSON() == alloc_slice("[0,-1,18446744073709551615,-9223372036854775808,"
+                                         "1.8446744e+19,-9223372036854775808,0.01,2500,"
+                                         "12.345678,-0.001]"));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSON Index Engine") {
+        auto convert = [&](slice json, JSONConverter::Engine engine, std::string &output) {
+            Encoder e;
+            JSONConverter jc(e);
+            jc.setEngine(engine);
+            if (!jc.encodeJSON(json))
+                return std::make_pair(jc.error(), jc.errorPos());
+            alloc_slice data = e.extractOutput();
+            auto v = Value::fromData(data);
+            output = v ? (std::string)v->toJSON() : "";
+            return std::make_pair(0, (size_t)0);
+        };
+
+        // Valid JSON gives the same result with both engines:
+        alloc_slice people = readFile(kTestFilesDir "1000people.json");
+        const char* valid[] = {"", "  ", "[]", " { } ", "[null,true,false]", "\"x\"",
+            "[-100,0,100,123.456,6.02e+23,-0,18446744073709551615,-9223372036854775808]",
+            "[1E-2,18446744073709551616,-9223372036854775809]",
+            "{\"\":\"hello\\nt\\\\here\",\"\\\"ironic\\\"\":[null,false,true]}",
+            "[\"\\\\\",\"\\\\\\\\\",\"a\\\\\\\"b\"]", "[\"\\u20ac\\uD83D\\uDE1C\"]",
+            "{\"b\":[1,{\"c\":[[[]]]}],\"a\":\"[{,:}]\"}\n"};
+        for (const char *str : valid) {
+            INFO("Input: " << str);
+            slice json(str);
+            std::string out1, out2;
+            CHECK(convert(json, JSONConverter::kJsonslEngine, out1).first == 0);
+            CHECK(convert(json, JSONConverter::kIndexEngine, out2).first == 0);
+            CHECK(out1 == out2);
+        }
+        std::string out1, out2;
+        REQUIRE(convert(people, JSONConverter::kJsonslEngine, out1).first == 0);
+        REQUIRE(convert(people, JSONConverter::kIndexEngine, out2).first == 0);
+        CHECK(out1 == out2);
+
+        // jsonsl can't tell where a top-level number ends, but the index engine can:
+        CHECK(convert("123"_sl, JSONConverter::kIndexEngine, out2).first == 0);
+        CHECK(out2 == "123");
+
+        // Invalid JSON that both engines reject with the same error at the same position:
+        struct {const char *json; int error; size_t pos;} invalid[] = {
+            {"[1,",             JSONConverter::kErrTruncatedJSON, 3},
+            {"[\"abc",          JSONConverter::kErrTruncatedJSON, 5},
+            {"{\"a\":tru",       JSONConverter::kErrTruncatedJSON, 8},
+            {"[1] 2",           JSONSL_ERROR_GARBAGE_TRAILING, 4},
+            {"{1:2}",           JSONSL_ERROR_HKEY_EXPECTED, 1},
+            {"{\"a\":1 x}",      JSONSL_ERROR_HKEY_EXPECTED, 7},
+            {"[1}",             JSONSL_ERROR_BRACKET_MISMATCH, 2},
+            {"]",               JSONSL_ERROR_BRACKET_MISMATCH, 0},
+            {" }",              JSONSL_ERROR_BRACKET_MISMATCH, 1},
+            {"[]]",             JSONSL_ERROR_BRACKET_MISMATCH, 2},
+            {"[tru]",           JSONSL_ERROR_SPECIAL_EXPECTED, 4},
+            {"[truex]",         JSONSL_ERROR_SPECIAL_EXPECTED, 6},
+            {"[t]",             JSONSL_ERROR_SPECIAL_EXPECTED, 2},
+            {"[\"a\"x]",         JSONSL_ERROR_STRAY_TOKEN, 4},
+            {"[1 x]",           JSONSL_ERROR_STRAY_TOKEN, 3},
+            {"[x]",             JSONSL_ERROR_STRAY_TOKEN, 1},
+            {"[1x]",            JSONSL_ERROR_INVALID_NUMBER, 2},
+            {"[-x]",            JSONSL_ERROR_INVALID_NUMBER, 2},
+            {"[-]",             JSONSL_ERROR_INVALID_NUMBER, 1},
+            {"[1-2]",           JSONSL_ERROR_INVALID_NUMBER, 2},
+            {"[1.2.3]",         JSONSL_ERROR_INVALID_NUMBER, 1},
+            {"[1e+]",           JSONSL_ERROR_INVALID_NUMBER, 1},
+            {"[\"\\x\"]",        JSONSL_ERROR_ESCAPE_INVALID, 3},
+            {"{\"a\":}",         JSONSL_ERROR_VALUE_EXPECTED, 5},
+        };
+        for (auto &test : invalid) {
+            INFO("Input: " << test.json);
+            for (int engine = 0; engine < 2; ++engine) {
+                std::string out;
+                auto result = convert(slice(test.json), (JSONConverter::Engine)engine, out);
+                CHECK(result.first == test.error);
+                CHECK(result.second == test.pos);
+            }
+        }
+
+        // Invalid JSON the engines disagree on. jsonsl accepts stray, missing and trailing
+        // commas, missing colons, leading zeros and "1."; the index engine rejects them all.
+        // And jsonsl reports a key with no colon or value as a missing value.
+        struct {const char *json; int error, jsonslError; size_t pos, jsonslPos;} differ[] = {
+            {"[1,]",            JSONSL_ERROR_TRAILING_COMMA,  0, 2, 0},
+            {"{\"a\":1,}",       JSONSL_ERROR_TRAILING_COMMA,  0, 6, 0},
+            {"[,1]",            JSONSL_ERROR_VALUE_EXPECTED,  0, 1, 0},
+            {"[1,,2]",          JSONSL_ERROR_VALUE_EXPECTED,  0, 3, 0},
+            {",",               JSONSL_ERROR_VALUE_EXPECTED,  0, 0, 0},
+            {"{,}",             JSONSL_ERROR_HKEY_EXPECTED,   0, 1, 0},
+            {"[1 2]",           JSONSL_ERROR_MISSING_TOKEN,   0, 3, 0},
+            {"[\"a\"1]",         JSONSL_ERROR_MISSING_TOKEN,   0, 4, 0},
+            {"[1:2]",           JSONSL_ERROR_MISSING_TOKEN,   0, 2, 0},
+            {"{\"a\" 1}",        JSONSL_ERROR_MISSING_TOKEN,   0, 5, 0},
+            {"{\"a\":1:2}",      JSONSL_ERROR_MISSING_TOKEN,   JSONSL_ERROR_HKEY_EXPECTED, 6, 7},
+            {"[01]",            JSONSL_ERROR_INVALID_NUMBER,  0, 2, 0},
+            {"[1.]",            JSONSL_ERROR_INVALID_NUMBER,  0, 1, 0},
+            {"{\"a\"}",          JSONSL_ERROR_MISSING_TOKEN,   JSONSL_ERROR_VALUE_EXPECTED, 4, 4},
+        };
+        for (auto &test : differ) {
+            INFO("Input: " << test.json);
+            std::string out;
+            auto result = convert(slice(test.json), JSONConverter::kIndexEngine, out);
+            CHECK(result.first == test.error);
+            CHECK(result.second == test.pos);
+            result = convert(slice(test.json), JSONConverter::kJsonslEngine, out);
+            CHECK(result.first == test.jsonslError);
+            CHECK(result.second == test.jsonslPos);
+        }
+
+        // The depth limit:
+        std::string deep(JSONConverter::kMaxNestingDepth + 1, '[');
+        deep += std::string(JSONConverter::kMaxNestingDepth + 1, ']');
+        CHECK(convert(slice(deep), JSONConverter::kIndexEngine, out1).first
+              == JSONSL_ERROR_LEVELS_EXCEEDED);
+        CHECK(convert(slice(deep), JSONConverter::kJsonslEngine, out1).first
+              == JSONSL_ERROR_LEVELS_EXCEEDED);
+
+        // Both engines let exceptions from the Encoder propagate:
+        for (auto engine : {JSONConverter::kJsonslEngine, JSONConverter::kIndexEngine}) {
+            Encoder e;
+            e.beginDictionary();                // so writing a value without a key fails
+            JSONConverter jc(e);
+            jc.setEngine(engine);
+            CHECK_THROWS_AS(jc.encodeJSON("[1, 2]"_sl), const FleeceException&);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONDeeplyNested") {
+        // Much deeper than the Encoder's initial stack:
+        static const int kDepth = 200;
+        std::string json;
+        for (int i = 0; i < kDepth; i++)
+            json += (i % 2) ? "{\"a\":" : "[";
+        json += "17";
+        for (int i = kDepth - 1; i >= 0; i--)
+            json += (i % 2) ? "}" : "]";
+
+        JSONConverter j(enc);
+        REQUIRE(j.encodeJSON(slice(json)));
+        endEncoding();
+        const Value *v = Value::fromData(result);
+        REQUIRE(v);
+        REQUIRE((std::string)v->toJSON() == json);
+        for (int i = 0; i < kDepth; i++)
+            v = (i % 2) ? v->asDict()->get(slice("a")) : v->asArray()->get(0);
+        REQUIRE(v->asInt() == 17);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONEscaping") {
+        // Put a special character at each position of a long-ish string, to exercise both the
+        // vectorized and the scalar parts of the escaping code:
+        const char* specials[] = {"\"", "\\", "\n", "\t", "\x01", "\x1f", "\x7f"};
+        const char* escaped[]  = {"\\\"", "\\\\", "\\n", "\\t",
+                                  "\\u0001", "\\u001f", "\\u007f"};
+        for (size_t i = 0; i < sizeof(specials)/sizeof(specials[0]); ++i) {
+            for (size_t pos = 0; pos <= 40; ++pos) {
+                std::string str(40, 'x'), expected(40, 'x');
+                str.insert(pos, specials[i]);
+                str += "\xc2\xa2";         // non-ASCII UTF-8 shouldn't be escaped
+                expected.insert(pos, escaped[i]);
+                expected = "[\"" + expected + "\xc2\xa2\"]";
+                enc.beginArray();
+                enc.writeString(str);
+                enc.endArray();
+                endEncoding();
+                REQUIRE(Value::fromData(result)->toJSON() == alloc_slice(expected));
+
+                auto begin = (const uint8_t*)str.data(), end = begin + str.size();
+                REQUIRE(internal::countUnescapedJSONBytes(begin, end) == pos);
+                REQUIRE(internal::countUnescapedJSONBytesScalar(begin, end) == pos);
+            }
+        }
+    }
+
     TEST_CASE_METHOD(EncoderTests, "JSONBinary") {
         enc.beginArray();
         enc.writeData(slice("not-really-binary"));
@@ -504,6 +1001,168 @@ public:
         REQUIRE(w.extractOutput() == alloc_slice("not-really-binary"));
     }
 
+    TEST_CASE_METHOD(EncoderTests, "Base64") {
+        // Compare with libb64, at sizes that exercise the SIMD loops and the scalar tail:
+        std::string data;
+        for (size_t size = 0; size <= 200; ++size) {
+            std::string encoded = slice(data).base64String();
+            base64::encoder enc;
+            enc.set_chars_per_line(0);
+            std::string expected(encoded.size(), '\0');
+            size_t n = enc.encode(data.data(), data.size(), &expected[0]);
+            n += enc.encode_end(&expected[n]);
+            REQUIRE(n == encoded.size());
+            REQUIRE(encoded == expected);
+
+            Writer w;
+            w.writeDecodedBase64(slice(encoded));
+            REQUIRE(w.extractOutput() == slice(data));
+
+            data += (char)(size * 37 + 11);
+        }
+
+        // Decoding skips non-base64 characters, like libb64:
+        std::string encoded = slice(data).base64String();
+        for (size_t i = 76; i < encoded.size(); i += 77)
+            encoded.insert(i, i % 2 ? "\r\n" : " ");
+        encoded.insert(40, "=");
+        std::vector<char> buf(Base64DecodedMaxSize(encoded.size()));
+        REQUIRE(slice(encoded).readBase64Into(slice(buf.data(), buf.size())) == slice(data));
+        base64::decoder dec;
+        std::vector<char> expected(buf.size());
+        size_t n = dec.decode(encoded.data(), encoded.size(), expected.data());
+        REQUIRE(slice(expected.data(), n) == slice(data));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "Base64 SIMD") {
+        // Each SIMD instruction set the CPU supports must match the scalar code exactly, at
+        // every length around its block sizes, and with a non-digit at every position:
+        Base64SIMD supported = Base64SupportedSIMD();
+        INFO("CPU supports SIMD level " << supported);
+        std::string data;
+        for (size_t size = 0; size <= 300; ++size) {
+            std::string encoded(Base64EncodedSize(size), '\0');
+            REQUIRE(EncodeBase64(slice(data), &encoded[0], kBase64Scalar) == encoded.size());
+            std::vector<char> decoded(Base64DecodedMaxSize(encoded.size()));
+            for (int simd = kBase64SSSE3; simd <= supported; ++simd) {
+                INFO("SIMD level " << simd << ", size " << size);
+                std::string simdEncoded(encoded.size(), '\0');
+                REQUIRE(EncodeBase64(slice(data), &simdEncoded[0], (Base64SIMD)simd)
+                        == encoded.size());
+                CHECK(simdEncoded == encoded);
+                size_t n = DecodeBase64(slice(encoded), decoded.data(), (Base64SIMD)simd);
+                CHECK(slice(decoded.data(), n) == slice(data));
+            }
+            data += (char)(size * 37 + 11);
+        }
+
+        std::string encoded = slice(data).base64String();
+        std::vector<char> expected(Base64DecodedMaxSize(encoded.size() + 1));
+        std::vector<char> decoded(expected.size());
+        for (size_t pos = 0; pos <= 100; ++pos) {
+            std::string withSpace = encoded;
+            withSpace.insert(pos, " ");
+            size_t expectedLen = DecodeBase64(slice(withSpace), expected.data(), kBase64Scalar);
+            REQUIRE(slice(expected.data(), expectedLen) == slice(data));
+            for (int simd = kBase64SSSE3; simd <= supported; ++simd) {
+                INFO("SIMD level " << simd << ", space at " << pos);
+                size_t n = DecodeBase64(slice(withSpace), decoded.data(), (Base64SIMD)simd);
+                CHECK(slice(decoded.data(), n) == slice(data));
+            }
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "WriterReuse") {
+        // Outputs of varying sizes; each must be intact and independent of later ones:
+        Writer w;
+        std::vector<alloc_slice> outputs;
+        std::vector<std::string> expected;
+        for (size_t i = 0; i < 40; ++i) {
+            size_t size = (i % 10 == 9) ? 200000 : 1000 + 100 * (i % 7);
+            std::string data(size, (char)('a' + i % 26));
+            for (size_t pos = 0; pos < size; pos += 1000)
+                w << slice(&data[pos], std::min((size_t)1000, size - pos));
+            outputs.push_back(w.extractOutput());
+            expected.push_back(data);
+            REQUIRE(w.length() == 0);
+        }
+        for (size_t i = 0; i < outputs.size(); ++i)
+            REQUIRE(outputs[i] == slice(expected[i]));
+        // The Writer keeps some memory around, but not every chunk it ever allocated:
+        CHECK(w.capacity() > 0);
+        CHECK(w.capacity() < 2 * (200000 + 4 * 128*1024));
+
+        // Reset reuses the memory:
+        w << slice("hello");
+        size_t capacity = w.capacity();
+        w.reset();
+        w << slice("goodbye");
+        CHECK(w.capacity() == capacity);
+        CHECK(w.extractOutput() == slice("goodbye"));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSONStreamer") {
+        enc.beginDictionary();
+        enc.writeKey("data");
+        std::string bytes;
+        for (int i = 0; i < 2000; i++)
+            bytes += (char)i;
+        enc.writeData(slice(bytes));
+        enc.writeKey("list");
+        enc.beginArray();
+        enc.writeNull();
+        enc.writeBool(true);
+        enc.writeInt(-17);
+        enc.writeDouble(3.25);
+        enc.writeString("");
+        enc.writeString(std::string(5000, 'x') + "\"quote\"\n\x01");
+        enc.beginDictionary();
+        enc.endDictionary();
+        enc.beginArray();
+        enc.endArray();
+        enc.endArray();
+        enc.writeKey("not a JSON5 identifier");
+        enc.writeInt(1);
+        enc.writeKey(7);
+        enc.writeString("seven");
+        enc.endDictionary();
+        endEncoding();
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+
+        for (int json5 = 0; json5 <= 1; ++json5) {
+            alloc_slice expected = json5 ? root->toJSON<5>() : root->toJSON();
+            for (size_t bufSize : {1, 7, 100, 100000}) {
+                JSONStreamer streamer(root, nullptr, json5);
+                std::string output;
+                char buf[100000];
+                size_t n;
+                do {
+                    n = streamer.read(buf, bufSize);
+                    REQUIRE(n <= bufSize);
+                    output.append(buf, n);
+                } while (n == bufSize);
+                REQUIRE(streamer.done());
+                REQUIRE(streamer.read(buf, bufSize) == 0);
+                REQUIRE(slice(output) == expected);
+            }
+        }
+
+        // readAll, in fixed-size pieces:
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        JSONConverter jr(enc);
+        jr.encodeJSON(input);
+        endEncoding();
+        root = Value::fromData(result);
+        JSONStreamer streamer(root);
+        std::string output;
+        streamer.readAll([&](slice chunk) {
+            REQUIRE(chunk.size <= 1000);
+            output.append((const char*)chunk.buf, chunk.size);
+        }, 1000);
+        REQUIRE(slice(output) == root->toJSON());
+    }
+
     TEST_CASE_METHOD(EncoderTests, "Dump") {
         std::string json = json5("{'foo':123,"
                                  "'\"ironic\"':[null,false,true,-100,0,100,123.456,6.02e+23],"
@@ -536,12 +1195,68 @@ public:
             "004c: 80 26       :   &\"foo\" (@0000)\n"
             "004e: 00 7b       :     123\n"
             "0050: 80 07       : &Dict[3] (@0042)\n"));
+
+        // The linear dump gives the same output, or any part of it:
+        Writer out;
+        REQUIRE(Value::dumpLinear(result, out));
+        CHECK(std::string(out.extractOutput()) == dumped);
+        REQUIRE(Value::dumpLinear(result, out, 0x22, 0x34));
+        CHECK(std::string(out.extractOutput()) == dumped.substr(dumped.find("0022:"),
+                                                                 dumped.find("0034:") - dumped.find("0022:")));
+
+        // It stops at invalid data:
+        std::string bad((const char*)result.buf, result.size);
+        bad[0x47] = 0x40;                   // pointer past the start of the data
+        CHECK(!Value::dumpLinear(slice(bad), out));
+        CHECK(std::string(out.extractOutput()).find("0042: (invalid pointer)") != std::string::npos);
+
+        // Including pointers that aren't in a collection, and pointers to pointers:
+        CHECK(!Value::dumpLinear(slice("\x80\x40"), out));
+        CHECK(!Value::dumpLinear(slice("\x80\x00"), out));
+        CHECK(!Value::dumpLinear(slice("\x80\x40\x80\x01"), out));
+        CHECK(!Value::dumpLinear(slice("\x80\x40\x00\x00\x80\x02"), out));
+        out.extractOutput();
+
+        // And it doesn't crash on garbage:
+        srand(12345);
+        for (int n = 0; n < 1000; ++n) {
+            std::string garbage(2 + rand() % 64, '\0');
+            for (auto &c : garbage)
+                c = (char)rand();
+            Value::dumpLinear(slice(garbage), out);
+            out.extractOutput();
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DumpPeopleLinear") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice doc = JSONConverter::convertJSON(input);
+        Writer out;
+        REQUIRE(Value::dumpLinear(doc, out));
+        REQUIRE(std::string(out.extractOutput()) == Value::dump(doc));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "SizeProfile") {
+        alloc_slice doc = JSONConverter::convertJSON(
+                            slice("[{\"name\":\"alpha\",\"tags\":[\"xx\",\"xx\"]},{\"name\":\"alpha\"}]"));
+        Writer out;
+        REQUIRE(Value::writeSizeProfile(doc, out));
+        std::string profile = std::string(out.extractOutput());
+        // The second "alpha" and "xx" are pointers to the first ones (6 and 4 bytes):
+        CHECK(profile.find("          6          6          6        2  [].name\n") != std::string::npos);
+        CHECK(profile.find("          4          4          4        2  [].tags[]\n") != std::string::npos);
+        CHECK(profile.find("Uniquing: 3 pointers") != std::string::npos);   // incl. "name" key
+        CHECK(profile.find("        2       6  name\n") != std::string::npos);
+        CHECK(profile.find("Not in any value (root pointer, hash indexes, unused): 2 bytes")
+              != std::string::npos);
+        CHECK(!Value::writeSizeProfile(slice("xx"), out));
     }
 
     TEST_CASE_METHOD(EncoderTests, "ConvertPeople") {
         alloc_slice input = readFile(kTestFilesDir "1000people.json");
 
         enc.uniqueStrings(true);
+        enc.collectStats(true);
 
         JSONConverter jr(enc);
         jr.encodeJSON(input);
@@ -587,11 +1302,474 @@ public:
 
         fprintf(stderr, "\nJSON size: %zu bytes; Fleece size: %zu bytes (%.2f%%)\n",
                 input.size, result.size, (result.size*100.0/input.size));
-#ifndef NDEBUG
-        fprintf(stderr, "Narrow: %u, Wide: %u (total %u)\n", enc._numNarrow, enc._numWide, enc._numNarrow+enc._numWide);
-        fprintf(stderr, "Narrow count: %u, Wide count: %u (total %u)\n", enc._narrowCount, enc._wideCount, enc._narrowCount+enc._wideCount);
-        fprintf(stderr, "Used %u pointers to shared strings\n", enc._numSavedStrings);
-#endif
+        auto &stats = enc.stats();
+        fprintf(stderr, "Narrow: %llu, Wide: %llu; Narrow count: %llu, Wide count: %llu\n",
+                (unsigned long long)stats.narrowCollections, (unsigned long long)stats.wideCollections,
+                (unsigned long long)stats.narrowItems, (unsigned long long)stats.wideItems);
+        fprintf(stderr, "Used %llu pointers to shared strings, saving %llu bytes\n",
+                (unsigned long long)stats.stringsDeduped, (unsigned long long)stats.bytesSaved);
+        CHECK(stats.bytesWritten == result.size);
+        CHECK(stats.narrowCollections + stats.wideCollections > 3000);
+        CHECK(stats.wideCollections >= 1);
+        CHECK(stats.stringsDeduped > 1000 * 10);
+        CHECK(stats.bytesSaved > stats.stringsDeduped * 2);
+        CHECK(stats.narrowPointers + stats.widePointers > stats.stringsDeduped);
+        CHECK(stats.dictsSorted == 1000);
+        CHECK(stats.maxDepth == 4);          // people, person, friends, friend
+        CHECK(stats.stringTableLoad > 0.0);
+        CHECK(stats.stringTableLoad < 1.0);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ReemitFarStrings") {
+        // An array of many small dicts with the same keys, and long (non-uniqued) strings that
+        // push the first copies of the keys more than 64KB back:
+        auto encode = [](Encoder &e) {
+            e.collectStats(true);
+            e.beginArray();
+            for (int i = 0; i < 4000; i++) {
+                e.beginDictionary();
+                e.writeKey("name");
+                char name[40];
+                snprintf(name, sizeof(name), "Person number %06d, or so", i);
+                e.writeString(name);
+                e.writeKey("tags");
+                e.beginArray();
+                e.writeString("alpha");
+                e.writeString("beta");
+                e.endArray();
+                e.endDictionary();
+            }
+            e.endArray();
+            return e.extractOutput();
+        };
+        alloc_slice plain = encode(enc);
+        Encoder enc2;
+        enc2.reemitFarStrings(true);
+        alloc_slice reemitted = encode(enc2);
+
+        auto &stats = enc.stats(), &stats2 = enc2.stats();
+        CHECK(stats.stringsReemitted == 0);
+        CHECK(stats.wideCollections > 3000);
+        CHECK(stats2.stringsReemitted > 0);
+        CHECK(stats2.stringsReemitted < 100);
+        CHECK(stats2.wideCollections == 1);          // just the root array
+        CHECK(reemitted.size < plain.size);
+        REQUIRE(Value::fromData(reemitted));
+        CHECK(Value::fromData(reemitted)->isEqual(Value::fromData(plain)));
+
+        // 1000 people is also smaller:
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice people = JSONConverter::convertJSON(input);
+        Encoder enc3;
+        enc3.reemitFarStrings(true);
+        JSONConverter jc(enc3);
+        REQUIRE(jc.encodeJSON(input));
+        alloc_slice people2 = enc3.extractOutput();
+        CHECK(people2.size < people.size);
+        CHECK(Value::fromData(people2)->isEqual(Value::fromData(people)));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleStreaming") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        JSONConverter jr(enc);
+        jr.encodeJSON(input);
+        alloc_slice expected = enc.extractOutput();
+
+        // Use a tiny chunk size to force lots of flushes:
+        std::string streamed;
+        unsigned flushes = 0;
+        Encoder streamingEnc([&](slice data) {
+            streamed.append((const char*)data.buf, data.size);
+            ++flushes;
+        }, 1000);
+        JSONConverter jr2(streamingEnc);
+        jr2.encodeJSON(input);
+        REQUIRE(streamingEnc.extractOutput() == nullslice);
+
+        REQUIRE(flushes > 100);
+        REQUIRE(slice(streamed) == expected);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleInParallel") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice serial = JSONConverter::convertJSON(input);
+
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSONInParallel(input, 8));
+        endEncoding();
+        auto people = checkArray(1000);
+        REQUIRE(people->toJSON() == Value::fromData(serial)->toJSON());
+
+        // Errors are reported at their position in the original input:
+        std::string bad((const char*)input.buf, input.size);
+        size_t badPos = bad.rfind("\"isActive\": ") + 12;
+        bad[badPos] = '?';
+        enc.reset();
+        JSONConverter jr2(enc);
+        REQUIRE(!jr2.encodeJSONInParallel(slice(bad), 8));
+        REQUIRE(jr2.errorPos() == badPos);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertJSONInParallelWithOptions") {
+        alloc_slice people = readFile(kTestFilesDir "1000people.json");
+        std::string numbers = "[", arrays = "[";
+        for (int i = 0; i < 5000; ++i) {
+            if (i > 0) {
+                numbers += ',';
+                arrays += ',';
+            }
+            numbers += std::to_string(i) + ".5";
+            arrays += "[";
+            for (int j = 0; j < 20; ++j)
+                arrays += (j ? "," : "") + std::to_string(i * j) + ".1";
+            arrays += "]";
+        }
+        numbers += "]";
+        arrays += "]";
+
+        // Each option set is applied to both encoders; the parallel conversion must honor it.
+        // Without uniquing, the parallel output should be the same size (give or take padding),
+        // so that shows that the indexes got written:
+        struct optionSet {
+            std::function<void(Encoder&)> apply;
+            bool uniqueStrings;
+        };
+        std::vector<optionSet> optionSets = {
+            {[](Encoder &e) {e.uniqueStrings(false); e.sortKeys(false); e.hashIndexMinCount(5);},
+             false},
+            {[](Encoder &e) {e.uniqueStrings(false); e.hashIndexMinCount(5);
+                             e.prefixIndexMinCount(5);},
+             false},
+            {[](Encoder &e) {e.packNumericArrays(true); e.reemitFarStrings(true);},
+             true},
+        };
+        for (auto &options : optionSets) {
+            for (slice input : {slice(people), slice(numbers), slice(arrays)}) {
+                Encoder serialEnc, parallelEnc;
+                options.apply(serialEnc);
+                options.apply(parallelEnc);
+                JSONConverter serialCvt(serialEnc), parallelCvt(parallelEnc);
+                REQUIRE(serialCvt.encodeJSON(input));
+                REQUIRE(parallelCvt.encodeJSONInParallel(input, 8));
+                alloc_slice serial = serialEnc.extractOutput();
+                alloc_slice parallel = parallelEnc.extractOutput();
+                if (!options.uniqueStrings)
+                    CHECK(parallel.size >= serial.size - serial.size / 100);
+                CHECK(parallel.size <= serial.size + serial.size / 100);
+
+                auto s = Value::fromData(serial)->asArray();
+                auto p = Value::fromData(parallel)->asArray();
+                REQUIRE(p);
+                CHECK(p->toJSON() == s->toJSON());      // (also checks that key order matches)
+                if (input == slice(people))             // (unsorted keys need the hash index)
+                    CHECK(p->get(999)->asDict()->get(slice("name")) != nullptr);
+                CHECK(p->packedType() == s->packedType());
+                for (Array::iterator si(s), pi(p); si; ++si, ++pi) {
+                    auto sa = si.value()->asArray(), pa = pi.value()->asArray();
+                    if (sa) {
+                        CHECK(pa->packedType() == sa->packedType());
+                        CHECK((pa->packedDoubles() == nullptr) == (sa->packedDoubles() == nullptr));
+                    }
+                }
+            }
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleIncrementally") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice expected = JSONConverter::convertJSON(input);
+
+        // Feed the JSON in small pieces, from a buffer that's overwritten each time:
+        for (size_t pieceSize : {1, 7, 16384}) {
+            INFO("Piece size " << pieceSize);
+            Encoder e;
+            JSONConverter jc(e);
+            std::string buffer;
+            for (size_t pos = 0; pos < input.size; pos += pieceSize) {
+                buffer.assign((const char*)input.buf + pos, std::min(pieceSize, input.size - pos));
+                REQUIRE(jc.feed(slice(buffer)));
+                buffer.assign(buffer.size(), '#');
+            }
+            REQUIRE(jc.finish());
+            REQUIRE(e.extractOutput() == expected);
+        }
+
+        // Errors are reported at their position in the document:
+        Encoder e;
+        JSONConverter jc(e);
+        CHECK(jc.feed("[1, \"tw"_sl));
+        CHECK(!jc.feed("o\", tru!]"_sl));
+        CHECK(jc.error() == JSONSL_ERROR_SPECIAL_EXPECTED);
+        CHECK(jc.errorPos() == 14);
+        CHECK(!jc.finish());
+
+        // Truncation is detected by finish:
+        e.reset();
+        CHECK(jc.feed("{\"a\":[1"_sl));
+        CHECK(!jc.finish());
+        CHECK(jc.error() == JSONConverter::kErrTruncatedJSON);
+        CHECK(jc.errorPos() == 7);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleProjected") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice full = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(full)->asArray();
+
+        JSONConverter jc(enc);
+        jc.setProjection({"[*].name", "[*].friends[*].id", "[3].tags", "[3].name.first"});
+        REQUIRE(jc.encodeJSON(input));
+        alloc_slice projected = enc.extractOutput();
+        CHECK(projected.size < full.size / 5);
+        auto result = Value::fromData(projected)->asArray();
+        REQUIRE(result);
+        REQUIRE(result->count() == 1000);
+        for (uint32_t i = 0; i < 1000; ++i) {
+            auto person = result->get(i)->asDict(), original = people->get(i)->asDict();
+            REQUIRE(person);
+            CHECK(person->count() == (i == 3 ? 3 : 2));
+            CHECK(person->get(slice("name"))->isEqual(original->get(slice("name"))));
+            CHECK(person->get(slice("guid")) == nullptr);
+            auto friends = person->get(slice("friends"))->asArray();
+            auto originalFriends = original->get(slice("friends"))->asArray();
+            REQUIRE(friends);
+            REQUIRE(friends->count() == originalFriends->count());
+            for (uint32_t f = 0; f < friends->count(); ++f) {
+                auto aFriend = friends->get(f)->asDict();
+                CHECK(aFriend->count() == 1);
+                CHECK(aFriend->get(slice("id"))->isEqual(originalFriends->get(f)->asDict()->get(slice("id"))));
+            }
+        }
+        CHECK(result->get(3)->asDict()->get(slice("tags"))->isEqual(people->get(3)->asDict()->get(slice("tags"))));
+
+        // Feeding it in pieces gives the same result:
+        enc.reset();
+        for (size_t pos = 0; pos < input.size; pos += 1000)
+            REQUIRE(jc.feed(slice(&input[pos], std::min((size_t)1000, input.size - pos))));
+        REQUIRE(jc.finish());
+        CHECK(enc.extractOutput() == projected);
+
+        // Array indexes, unmatched paths, and a root that isn't kept:
+        enc.reset();
+        jc.setProjection({"[1]", "[3].x", "[4][1]", "[5].missing"});
+        REQUIRE(jc.encodeJSON("[0, \"one\", 2, {\"x\":[1,{\"y\":\"z\"}], \"w\":9}, [7,8,9], {}]"_sl));
+        CHECK(Value::fromData(enc.extractOutput())->toJSON() == "[\"one\",{\"x\":[1,{\"y\":\"z\"}]},[8],{}]"_sl);
+        enc.reset();
+        REQUIRE(jc.encodeJSON("{\"a\":1}"_sl));
+        CHECK(Value::fromData(enc.extractOutput())->type() == kNull);
+
+        // Errors are still caught in skipped values:
+        enc.reset();
+        CHECK(!jc.encodeJSON("[0, [1, tru]]"_sl));
+
+        CHECK_THROWS(jc.setProjection({"[-1]"}));
+        CHECK_THROWS(jc.setProjection({"[?price]"}));
+
+        // Turning it off converts everything again:
+        enc.reset();
+        jc.setProjection({});
+        REQUIRE(jc.encodeJSON(input));
+        CHECK(enc.extractOutput() == full);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeopleDelta") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice base = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(base)->asArray();
+
+        // Append an update that renames person 123 and leaves everything else alone:
+        enc.setBase(base);
+        enc.beginArray(people->count());
+        uint32_t index = 0;
+        for (Array::iterator i(people); i; ++i, ++index) {
+            if (index != 123) {
+                enc.writeValue(i.value());
+                continue;
+            }
+            auto person = i.value()->asDict();
+            enc.beginDictionary(person->count());
+            for (Dict::iterator j(person); j; ++j) {
+                enc.writeKey(j.key());
+                if (j.key()->asString() == slice("name"))
+                    enc.writeString("Nobody In Particular");
+                else
+                    enc.writeValue(j.value());
+            }
+            enc.endDictionary();
+        }
+        enc.endArray();
+        alloc_slice delta = enc.extractOutput();
+        REQUIRE(delta.size < base.size / 10);
+
+        std::string combined = (std::string)base + (std::string)delta;
+        auto updated = Value::fromData(slice(combined))->asArray();
+        REQUIRE(updated);
+        REQUIRE(updated->count() == 1000);
+        REQUIRE(updated->get(123)->asDict()->get(slice("name"))->asString() == slice("Nobody In Particular"));
+        REQUIRE(updated->get(123)->asDict()->get(slice("guid"))->toJSON()
+                    == people->get(123)->asDict()->get(slice("guid"))->toJSON());
+        for (uint32_t i = 0; i < 1000; ++i) {
+            if (i != 123)
+                REQUIRE(updated->get(i)->toJSON() == people->get(i)->toJSON());
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "MultipleDocuments") {
+        std::vector<size_t> ends;
+        for (int i = 0; i < 3; i++) {
+            enc.beginDictionary();
+            enc.writeKey("status");
+            enc.writeString(i == 1 ? "inactive" : "active");
+            enc.writeKey("index");
+            enc.writeInt(i);
+            enc.endDictionary();
+            ends.push_back(enc.finishDocument());
+        }
+        endEncoding();
+        REQUIRE(result.size == ends.back());
+        // Later documents point to the strings in the first one, so they're smaller:
+        REQUIRE(ends[2] - ends[1] < ends[0]);
+
+        for (int i = 0; i < 3; i++) {
+            auto doc = Value::fromData(slice(result.buf, ends[i]));
+            REQUIRE(doc);
+            REQUIRE(doc->asDict()->get(slice("index"))->asInt() == i);
+            REQUIRE(doc->asDict()->get(slice("status"))->asString()
+                        == slice(i == 1 ? "inactive" : "active"));
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "SharedPrefix") {
+        // A prefix document containing common strings:
+        enc.beginArray();
+        for (auto str : {"name", "status", "active", "inactive", "tags"})
+            enc.writeString(str);
+        enc.endArray();
+        alloc_slice prefix = enc.extractOutput();
+        enc.reset();
+
+        enc.setBase(prefix, true);
+        for (int i = 0; i < 3; i++) {
+            enc.beginDictionary();
+            enc.writeKey("name");
+            enc.writeString("Arnold");
+            enc.writeKey("status");
+            enc.writeString(i == 1 ? "inactive" : "active");
+            enc.endDictionary();
+            alloc_slice record = enc.extractOutput();
+            enc.reset();
+
+            std::string full = (std::string)prefix + (std::string)record;
+            auto doc = Value::fromData(slice(full))->asDict();
+            REQUIRE(doc);
+            REQUIRE(doc->count() == 2);
+            REQUIRE(doc->get(slice("name"))->asString() == slice("Arnold"));
+            REQUIRE(doc->get(slice("status"))->asString() == slice(i == 1 ? "inactive" : "active"));
+            // Only "Arnold" was written; the keys and the status are pointers into the prefix:
+            REQUIRE(record.size < 24);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ExternalBase") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice base = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(base)->asArray();
+        unsigned registered = internal::gExternBaseCount;
+
+        // Wrap the people in an envelope:
+        enc.setBase(base, false, true);
+        enc.beginDictionary();
+        enc.writeKey("type");
+        enc.writeString("envelope");
+        enc.writeKey("body");
+        enc.writeValue(people);
+        enc.writeKey("featured");
+        enc.writeValue(people->get(123));
+        enc.endDictionary();
+        alloc_slice envelope = enc.extractOutput();
+        REQUIRE(envelope.size < 64);
+
+        // It can't be read without its base:
+        CHECK(Value::fromData(envelope) == nullptr);
+
+        std::unique_ptr<ExtensionScope> scope(new ExtensionScope(base, envelope));
+        auto root = scope->root();
+        REQUIRE(root);
+        CHECK(internal::gExternBaseCount == registered + 1);
+        auto dict = root->asDict();
+        CHECK(dict->get(slice("type"))->asString() == slice("envelope"));
+        CHECK(dict->get(slice("body")) == people);
+        CHECK(dict->get(slice("featured"))->asDict()->get(slice("name"))->asString()
+                  == slice("Concepcion Burns"));
+        CHECK(Value::fromData(envelope) == root);   // (now that the base is registered)
+        CHECK(root->toJSON().size > input.size / 2);
+
+        // A root value that's entirely in the base:
+        enc.reset();
+        enc.writeValue(people->get(123));
+        alloc_slice alias = enc.extractOutput();
+        CHECK(alias.size == 6);
+        {
+            ExtensionScope aliasScope(base, alias);
+            CHECK(aliasScope.root() == people->get(123));
+            CHECK(internal::gExternBaseCount == registered + 2);
+        }
+        CHECK(internal::gExternBaseCount == registered + 1);
+
+        // A bad external pointer is detected, and the invalid extension isn't left registered:
+        alloc_slice bad(alias);
+        ((uint8_t*)bad.buf)[1] = 0x7F;
+        {
+            ExtensionScope badScope(base, bad);
+            CHECK(badScope.root() == nullptr);
+            CHECK(internal::gExternBaseCount == registered + 1);
+        }
+
+        // Lookups don't interfere with extensions being registered and freed on other threads:
+        {
+            std::atomic<int> mismatches {0};
+            std::atomic<bool> done {false};
+            std::vector<std::thread> readers;
+            for (int t = 0; t < 3; ++t) {
+                readers.emplace_back([&] {
+                    while (!done) {
+                        auto featured = dict->get(slice("featured"))->asDict();
+                        if (!featured || featured->get(slice("name"))->asString()
+                                                != slice("Concepcion Burns"))
+                            ++mismatches;
+                    }
+                });
+            }
+            for (int i = 0; i < 1000; ++i) {
+                alloc_slice copy(envelope.buf, envelope.size);
+                ExtensionScope copyScope(base, copy);
+                if (copyScope.root() == nullptr)
+                    ++mismatches;
+            }
+            done = true;
+            for (auto &reader : readers)
+                reader.join();
+            CHECK(mismatches == 0);
+            CHECK(internal::gExternBaseCount == registered + 1);
+        }
+
+        // In other documents the external bit is still part of a wide pointer's offset, which
+        // could reach back 4GB. Make one that reaches back just over 2GB (most of the buffer is
+        // never touched, so it doesn't use much memory):
+        {
+            const size_t pos = 0x80000004;
+            std::unique_ptr<uint8_t[]> big(new uint8_t[pos + 8]);
+            memcpy(&big[0], "\x42hi\x00", 4);                 // "hi"
+            memcpy(&big[pos], "\x68\x01\xC0\x00\x00\x03\x80\x03", 8); // ["hi"], and the root
+            auto farRoot = Value::fromData(slice(big.get(), pos + 8));
+            REQUIRE(farRoot);
+            CHECK(farRoot->asArray()->get(0)->asString() == slice("hi"));
+        }
+
+        // Ending the scope unregisters the extension:
+        scope.reset();
+        CHECK(internal::gExternBaseCount == registered);
+        CHECK(Value::fromData(envelope) == nullptr);
     }
 
     TEST_CASE_METHOD(EncoderTests, "FindPersonByIndexUnsorted") {
@@ -613,6 +1791,220 @@ public:
         REQUIRE(nameStr == std::string("Concepcion Burns"));
     }
 
+    TEST_CASE_METHOD(EncoderTests, "ValidatePeople") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice doc = JSONConverter::convertJSON(input);
+        auto root = Value::fromData(doc);
+        REQUIRE(root);
+        REQUIRE(Value::fromDataInParallel(doc, 4) == root);
+
+        // Corrupt the first item of person 0 into a pointer to before the start of the data:
+        alloc_slice corrupt(doc);
+        auto person0 = Value::fromTrustedData(corrupt)->asArray()->get(0)->asDict();
+        auto firstItem = (uint8_t*)person0 + 2;
+        REQUIRE(person0->count() < 2047);       // (so items start right after the header)
+        REQUIRE((const void*)firstItem < (const void*)offsetby(corrupt.buf, 0x10000));
+        memset(firstItem, 0xFF, 2);
+
+        REQUIRE(Value::fromData(corrupt) == nullptr);
+        REQUIRE(Value::fromDataInParallel(corrupt, 4) == nullptr);
+        {
+            LazyValidator lazy(corrupt);
+            auto people = lazy.root()->asArray();
+            REQUIRE(people);
+            REQUIRE(people->count() == 1000);
+            REQUIRE(people->get(123)->asDict()->get(slice("name"))->asString()
+                        == slice("Concepcion Burns"));
+            auto badPerson = people->get(0)->asDict();
+            REQUIRE(badPerson);
+            REQUIRE(badPerson->count() == 0);
+            REQUIRE(badPerson->get(slice("name")) == nullptr);
+            Dict::iterator badIter(badPerson);
+            REQUIRE(!badIter);
+        }
+        // Without the LazyValidator the (unvalidated) data is taken at face value again:
+        REQUIRE(person0->count() > 0);
+
+        // LazyValidators can be used on several threads at once, on their own data or shared:
+        std::atomic<int> mismatches {0};
+        auto readPeople = [&](const LazyValidator &lazy) {
+            auto people = lazy.root()->asArray();
+            for (uint32_t i = 0; i < people->count(); ++i) {
+                auto person = people->get(i)->asDict();
+                if (!person || (i > 0) != (person->get(slice("name")) != nullptr))
+                    ++mismatches;
+            }
+        };
+        {
+            LazyValidator shared(corrupt);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&, t] {
+                    if (t % 2) {
+                        readPeople(shared);
+                    } else {
+                        alloc_slice copy(corrupt.buf, corrupt.size);
+                        LazyValidator own(copy);
+                        readPeople(own);
+                    }
+                });
+            }
+            for (auto &thread : threads)
+                thread.join();
+        }
+        CHECK(mismatches == 0);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "PointersNearNarrowLimit") {
+        // The last narrow pointer reaches 64KB back, from where the item is, after its
+        // collection's header; line the items up around there:
+        const size_t kMaxFillerSize = 65540;
+        std::string filler(kMaxFillerSize, 'x');
+        for (size_t fillerSize = 65500; fillerSize < kMaxFillerSize; ++fillerSize) {
+            INFO("fillerSize = " << fillerSize);
+            enc.beginArray();
+            enc.writeString("uniqued str");             // written at offset 0
+            enc.writeData(slice(filler.data(), fillerSize));
+            enc.beginArray();
+            enc.writeString("uniqued str");             // a pointer back to offset 0
+            enc.endArray();
+            enc.endArray();
+            endEncoding();
+            auto root = Value::fromData(result);
+            REQUIRE(root);
+            CHECK(root->asArray()->get(2)->asArray()->get(0)->asString() == slice("uniqued str"));
+            enc.reset();
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ExtraWideCollections") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        std::string json = "{\"people\": " + (std::string)input + "}";
+        alloc_slice normal = JSONConverter::convertJSON(slice(json));
+        auto normalPeople = Value::fromData(normal)->asDict()->get(slice("people"))->asArray();
+
+        for (int hashIndex = 0; hashIndex <= 1; ++hashIndex) {
+            // Pretending wide pointers only reach back 4KB makes most collections extra-wide:
+            setWideOffsetLimit(4096);
+            enc.hashIndexMinCount(hashIndex ? 4 : 0);
+            JSONConverter jc(enc);
+            REQUIRE(jc.encodeJSON(slice(json)));
+            endEncoding();
+            REQUIRE(result.size > normal.size);
+
+            auto root = Value::fromData(result);
+            REQUIRE(root);
+            REQUIRE(((const uint8_t*)root)[2] == internal::kExtraWideMarker);
+            REQUIRE(root->isEqual(Value::fromData(normal)));
+            REQUIRE(root->toJSON() == Value::fromData(normal)->toJSON());
+
+            auto people = root->asDict()->get(slice("people"))->asArray();
+            REQUIRE(people);
+            REQUIRE(people->count() == 1000);
+            REQUIRE(people->get(123)->asDict()->get(slice("name"))->asString()
+                        == slice("Concepcion Burns"));
+            Dict::key nameKey(slice("name"), nullptr, true);
+            uint32_t n = 0;
+            for (Array::iterator i(people, 4); i; ++i, ++n) {
+                auto person = i.value()->asDict();
+                auto normalPerson = normalPeople->get(n)->asDict();
+                REQUIRE(person->count() == normalPerson->count());
+                REQUIRE(person->get(nameKey)->isEqual(normalPerson->get(slice("name"))));
+                REQUIRE(person->get_unsorted(slice("guid"))->asString()
+                            == normalPerson->get(slice("guid"))->asString());
+                Dict::iterator j(person), k(normalPerson);
+                for (; j; ++j, ++k) {
+                    REQUIRE(j.keyString() == k.keyString());
+                    REQUIRE(j.value()->isEqual(k.value()));
+                }
+                REQUIRE(!k);
+            }
+            REQUIRE(n == 1000);
+
+            std::string dump = Value::dump(result);
+            REQUIRE(dump.find("Concepcion Burns") != std::string::npos);
+            Writer out;
+            REQUIRE(Value::dumpLinear(result, out));
+
+            // Break an extra-wide pointer (the first value, after the marker and any hash
+            // index entry) by making it external, which they can't be:
+            alloc_slice corrupt(result);
+            auto person = (uint8_t*)Value::fromTrustedData(corrupt)->asDict()
+                                                ->get(slice("people"))->asArray()->get(999);
+            REQUIRE(person[2] == internal::kExtraWideMarker);
+            REQUIRE(person[2 + 8 * (hashIndex ? 4 : 2)] >= 0x80);      // (a pointer)
+            person[2 + 8 * (hashIndex ? 4 : 2)] |= internal::kExternPointerFlag;
+            REQUIRE(Value::fromData(corrupt) == nullptr);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "MappedFile") {
+        mapped_slice file;
+        auto root = Value::fromMappedFile(kTestFilesDir "1000people.fleece", file);
+        REQUIRE(root);
+        REQUIRE(root->asArray()->count() == 1000);
+        {
+            mapped_slice copy = file;   // copies share the mapping
+            file.reset();
+            REQUIRE(root->asArray()->get(123)->asDict()->get(slice("name"))->asString()
+                        == slice("Concepcion Burns"));
+        }
+
+        // Not Fleece data:
+        REQUIRE(Value::fromMappedFile(kTestFilesDir "1000people.json", file) == nullptr);
+        // Missing file:
+        try {
+            Value::fromMappedFile(kTestFilesDir "nonexistent.fleece", file);
+            FAIL("Opening a missing file should have thrown");
+        } catch (const FleeceException &x) {
+            REQUIRE(x.code == IOError);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "DocumentFile") {
+        static const char *kPath = kTestFilesDir "1000people.fleecedocs";
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice doc = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(doc)->asArray();
+
+        // Write each person as a document, with shared keys:
+        {
+            SharedKeys sk;
+            DocumentFileWriter writer(kPath, &sk);
+            size_t docNumber = 0;
+            for (Array::iterator i(people); i; ++i) {
+                writer.encoder().writeValue(i.value());
+                CHECK(writer.writeDocument() == docNumber++);
+            }
+            CHECK(sk.count() > 10);
+            writer.finish();
+        }
+
+        DocumentFile file(kPath);
+        REQUIRE(file.count() == 1000);
+        SharedKeys *sk = file.sharedKeys();
+        REQUIRE(sk);
+        auto person = file.get(999)->asDict();
+        REQUIRE(person);
+        CHECK(person->get(slice("name"), sk)->asString() == people->get(999)->asDict()->get(slice("name"))->asString());
+        CHECK(person->count() == people->get(999)->asDict()->count());
+        CHECK_THROWS(file.get(1000));
+
+        size_t n = 0;
+        for (auto i = file.begin(); i; ++i, ++n) {
+            CHECK(i.docNumber() == n);
+            REQUIRE(i.value()->asDict()->get(slice("_id"), sk) != nullptr);
+        }
+        CHECK(n == 1000);
+
+        // An empty file, and garbage:
+        DocumentFileWriter(kPath).finish();
+        CHECK(DocumentFile(kPath).count() == 0);
+        CHECK(DocumentFile(kPath).sharedKeys() == nullptr);
+        CHECK_THROWS(DocumentFile(slice(input)));
+        remove(kPath);
+    }
+
     TEST_CASE_METHOD(EncoderTests, "FindPersonByIndexKeyed") {
         {
             Dict::key nameKey(slice("name"), nullptr, true);
@@ -719,6 +2111,382 @@ public:
 #endif
     }
 
+    TEST_CASE_METHOD(EncoderTests, "FLEECE_KEYS") {
+        static_assert(internal::constDictHashIndexHash("name", 4) == 0x8D39BDE6, "wrong hash");
+        static_assert(internal::constKeysSorted("a", "ab", "b", "ba"), "should be sorted");
+        static_assert(!internal::constKeysSorted("ab", "a"), "shouldn't be sorted");
+        static_assert(!internal::constKeysSorted("a", "a"), "duplicates aren't sorted");
+        static_assert(!internal::constKeysSorted("a", "\xC3\xA9", "b"), "bytes are unsigned");
+        CHECK(internal::constDictHashIndexHash("guid", 4)
+                  == internal::dictHashIndexHash("guid", 4));
+
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        for (unsigned hashIndexMinCount : {0u, 4u}) {
+            enc.hashIndexMinCount(hashIndexMinCount);
+            JSONConverter jc(enc);
+            REQUIRE(jc.encodeJSON(input));
+            endEncoding();
+            auto people = Value::fromData(result)->asArray();
+            REQUIRE(people);
+
+            static FLEECE_KEYS(fewKeys, "age", "name", "nope");
+            FLEECE_KEYS(manyKeys, "about", "age", "balance", "guid", "isActive", "latitude",
+                                  "name", "nope", "zzz");
+            CHECK(fewKeys.size() == 3);
+            CHECK(manyKeys[3].string() == slice("guid"));
+            for (Array::iterator i(people); i; ++i) {
+                auto person = i.value()->asDict();
+                const Value* fewValues[3];
+                REQUIRE(person->get(fewKeys, fewValues) == 2);
+                CHECK(fewValues[0] == person->get(slice("age")));
+                CHECK(fewValues[1] == person->get(slice("name")));
+                CHECK(fewValues[2] == nullptr);
+                const Value* manyValues[9];
+                REQUIRE(person->get(manyKeys, manyValues) == 7);
+                for (size_t k = 0; k < manyKeys.size(); ++k)
+                    CHECK(manyValues[k] == person->get(manyKeys[k].string()));
+            }
+            enc.reset();
+        }
+
+        // With SharedKeys, the keys have to be told about them:
+        SharedKeys sk;
+        enc.setSharedKeys(&sk);
+        JSONConverter jc(enc);
+        REQUIRE(jc.encodeJSON(input));
+        endEncoding();
+        enc.setSharedKeys(nullptr);
+        auto people = Value::fromData(result)->asArray();
+        REQUIRE(people);
+        FLEECE_KEYS(fewKeys, "age", "name", "nope");
+        FLEECE_KEYS(manyKeys, "about", "age", "balance", "guid", "isActive", "latitude",
+                              "name", "nope", "zzz");
+        const Value* fewValues[3];
+        const Value* manyValues[9];
+        auto first = people->get(0)->asDict();
+        CHECK(first->get(fewKeys, fewValues) == 0);            // (doesn't find integer keys)
+        for (Array::iterator i(people); i; ++i) {
+            auto person = i.value()->asDict();
+            REQUIRE(person->get(fewKeys, fewValues, &sk) == 2);
+            CHECK(fewValues[0] == person->get(slice("age"), &sk));
+            CHECK(fewValues[1] == person->get(slice("name"), &sk));
+            CHECK(fewValues[2] == nullptr);
+            REQUIRE(person->get(manyKeys, manyValues, &sk) == 7);
+            for (size_t k = 0; k < manyKeys.size(); ++k)
+                CHECK(manyValues[k] == person->get(manyKeys[k].string(), &sk));
+        }
+        CHECK(fewKeys[1].sharedKeys() == &sk);
+    }
+
+    // Structs for the Schema test below, mapping some of the properties in 1000people.json.
+    struct TestFriend {
+        int id;
+        std::string name;
+
+        FLEECE_SCHEMA(TestFriend, (id, "id"), (name, "name"));
+    };
+
+    struct TestPerson {
+        int age {-1};
+        std::vector<TestFriend> friends;
+        bool isActive {false};
+        double latitude {0};
+        slice name;
+        std::vector<std::string> tags;
+        std::string missing {"default"};
+
+        FLEECE_SCHEMA(TestPerson, (age, "age"), (friends, "friends"), (isActive, "isActive"),
+                      (latitude, "latitude"), (name, "name"), (tags, "tags"),
+                      (missing, "zzz"));
+    };
+
+    TEST_CASE_METHOD(EncoderTests, "Schema") {
+        static_assert(TestPerson::schema::kCount == 7, "wrong field count");
+        CHECK(slice(TestPerson::schema::kKeys[2]) == slice("isActive"));
+
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice data = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(data)->asArray();
+        for (int pass = 0; pass < 2; ++pass) {      // (the second pass reuses the keys' hints)
+            for (Array::iterator i(people); i; ++i) {
+                auto dict = i.value()->asDict();
+                TestPerson person;
+                REQUIRE(TestPerson::schema::read(dict, person) == 6);
+                CHECK(person.age == dict->get(slice("age"))->asInt());
+                CHECK(person.isActive == dict->get(slice("isActive"))->asBool());
+                CHECK(person.latitude == dict->get(slice("latitude"))->asDouble());
+                CHECK(person.name == dict->get(slice("name"))->asString());
+                CHECK(person.tags.size() == dict->get(slice("tags"))->asArray()->count());
+                CHECK(person.missing == "default");
+                auto friends = dict->get(slice("friends"))->asArray();
+                REQUIRE(person.friends.size() == friends->count());
+                CHECK(person.friends[1].name
+                          == (std::string)friends->get(1)->asDict()->get(slice("name"))
+                                                                   ->asString());
+
+                // Write it back out, and check that reading that gives the same struct:
+                Encoder enc2;
+                TestPerson::schema::write(enc2, person);
+                alloc_slice written = enc2.extractOutput();
+                auto writtenDict = Value::fromData(written)->asDict();
+                REQUIRE(writtenDict);
+                CHECK(writtenDict->count() == 7);
+                TestPerson again;
+                REQUIRE(TestPerson::schema::read(writtenDict, again) == 7);
+                CHECK(again.age == person.age);
+                CHECK(again.name == person.name);
+                CHECK(again.tags == person.tags);
+                CHECK(again.friends.size() == person.friends.size());
+                CHECK(again.friends[2].id == person.friends[2].id);
+            }
+        }
+        TestPerson person;
+        CHECK(TestPerson::schema::read(nullptr, person) == 0);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "PrefetchingIterators") {
+        mmap_slice doc(kTestFilesDir "1000people.fleece");
+        auto people = Value::fromData(doc)->asArray();
+        for (unsigned distance : {1u, 4u, 999u, 5000u}) {
+            Array::iterator plain(people), ahead(people, distance);
+            for (; plain; ++plain, ++ahead) {
+                REQUIRE(ahead);
+                REQUIRE(ahead.count() == plain.count());
+                REQUIRE(ahead.value() == plain.value());
+                auto person = plain.value()->asDict();
+                Dict::iterator j(person), k(person, nullptr, distance);
+                for (; j; ++j, ++k) {
+                    REQUIRE(k.key() == j.key());
+                    REQUIRE(k.value() == j.value());
+                }
+                REQUIRE(!k);
+            }
+            REQUIRE(!ahead);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ExtractColumn") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        JSONConverter jr(enc);
+        jr.encodeJSON(input);
+        endEncoding();
+        auto people = Value::fromData(result)->asArray();
+        uint32_t n = people->count();
+
+        std::vector<double> latitudes(n), balances(n);
+        std::vector<int64_t> ages(n), missing(n);
+        std::vector<slice> names(n), notStrings(n);
+        Dict::key latitudeKey(slice("latitude")), balanceKey(slice("balance")),
+                  ageKey(slice("age")), nameKey(slice("name")), junkKey(slice("jUNK"));
+        REQUIRE(people->extractColumn(ageKey, ages.data()) == n);
+        REQUIRE(people->extractColumn(latitudeKey, latitudes.data()) == n);
+        REQUIRE(people->extractColumn(nameKey, names.data()) == n);
+        REQUIRE(people->extractColumn(ageKey, notStrings.data()) == 0);
+        REQUIRE(people->extractColumn(junkKey, missing.data(), -1) == 0);
+        REQUIRE(people->extractColumn(balanceKey, balances.data(), -1.0) == 0);  // strings
+
+        uint32_t i = 0;
+        for (Array::iterator iter(people); iter; ++iter, ++i) {
+            auto person = iter->asDict();
+            CHECK(ages[i] == person->get(slice("age"))->asInt());
+            CHECK(names[i] == person->get(slice("name"))->asString());
+            CHECK(notStrings[i] == nullslice);
+            CHECK(latitudes[i] == person->get(slice("latitude"))->asDouble());
+            CHECK(missing[i] == -1);
+            CHECK(balances[i] == -1.0);
+        }
+        CHECK(names[123] == slice("Concepcion Burns"));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "PackedArrays") {
+        static const unsigned n = 100;
+        enc.packNumericArrays(true);
+        enc.beginDictionary();
+        enc.writeKey("doubles");
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeDouble(i * 1.1);
+        enc.endArray();
+        enc.writeKey("floats");
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeFloat(i + 0.5f);
+        enc.endArray();
+        enc.writeKey("int32s");
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeInt((int)i * 100000 - 1234567);
+        enc.endArray();
+        enc.writeKey("int64s");
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeInt(i * 12345678901ll);
+        enc.endArray();
+        enc.writeKey("mixed");
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeDouble(i * 1.1);
+        enc.writeString("not a number");
+        enc.endArray();
+        enc.writeKey("small");
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeInt(i);
+        enc.endArray();
+        enc.endDictionary();
+        endEncoding();
+
+        auto root = Value::fromData(result)->asDict();
+        REQUIRE(root);
+        auto doubles = root->get(slice("doubles"))->asArray();
+        REQUIRE(doubles->packedType() == Array::kPackedDouble);
+        auto d = doubles->packedDoubles();
+        REQUIRE(d);
+        CHECK(doubles->packedFloats() == nullptr);
+        auto floats = root->get(slice("floats"))->asArray();
+        REQUIRE(floats->packedType() == Array::kPackedFloat);
+        auto f = floats->packedFloats();
+        REQUIRE(f);
+        auto int32s = root->get(slice("int32s"))->asArray();
+        REQUIRE(int32s->packedType() == Array::kPackedInt32);
+        auto i32 = int32s->packedInt32s();
+        REQUIRE(i32);
+        auto int64s = root->get(slice("int64s"))->asArray();
+        REQUIRE(int64s->packedType() == Array::kPackedInt64);
+        auto i64 = int64s->packedInt64s();
+        REQUIRE(i64);
+        auto mixed = root->get(slice("mixed"))->asArray();
+        CHECK(mixed->packedType() == Array::kNotPacked);
+        CHECK(mixed->packedDoubles() == nullptr);
+        auto small = root->get(slice("small"))->asArray();
+        CHECK(small->packedType() == Array::kNotPacked);
+
+        for (unsigned i = 0; i < n; i++) {
+            CHECK(d[i] == i * 1.1);
+            CHECK(f[i] == i + 0.5f);
+            CHECK(i32[i] == (int)i * 100000 - 1234567);
+            CHECK(i64[i] == i * 12345678901ll);
+
+            // The items still act as ordinary numbers:
+            auto v = doubles->get(i);
+            CHECK(v->type() == kNumber);
+            CHECK(v->isDouble());
+            CHECK(!v->isInteger());
+            CHECK(v->asDouble() == i * 1.1);
+            CHECK(floats->get(i)->asFloat() == i + 0.5f);
+            CHECK(!floats->get(i)->isDouble());
+            v = int64s->get(i);
+            CHECK(v->isInteger());
+            CHECK(!v->isDouble());
+            CHECK(v->asInt() == (int64_t)(i * 12345678901ll));
+            CHECK(v->asDouble() == (double)(i * 12345678901ll));
+            CHECK(int32s->get(i)->asInt() == (int)i * 100000 - 1234567);
+            CHECK(mixed->get(i)->asDouble() == i * 1.1);
+        }
+        CHECK(mixed->get(n)->asString() == slice("not a number"));
+        CHECK(int32s->get(1)->toString() == slice("-1134567"));
+        CHECK(std::string(floats->toJSON()).substr(0, 12) == "[0.5,1.5,2.5");
+
+        // Re-encoding without packing gives the same values:
+        alloc_slice original = result;
+        enc.packNumericArrays(false);
+        enc.writeValue(root);
+        endEncoding();
+        auto copy = Value::fromData(result);
+        REQUIRE(copy);
+        CHECK(copy->asDict()->get(slice("doubles"))->asArray()->packedType() == Array::kNotPacked);
+        CHECK(copy->toJSON() == root->toJSON());
+
+        // Corrupting a packed number's offset makes the data invalid:
+        enc.packNumericArrays(true);
+        enc.beginArray();
+        for (unsigned i = 0; i < n; i++)
+            enc.writeDouble(i * 1.1);
+        enc.endArray();
+        endEncoding();
+        REQUIRE(Value::fromData(result)->asArray()->packedDoubles());
+        alloc_slice corrupt((slice)result);
+        auto item = (uint8_t*)Value::fromData(corrupt)->asArray()->get(3);
+        item[1] = 0xFF;
+        CHECK(Value::fromData(corrupt) == nullptr);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "Compression") {
+        // Empty, tiny and incompressible data are stored as-is:
+        for (slice data : {slice(""), slice("x"), slice("0123456789abcdefghij")}) {
+            alloc_slice compressed = CompressFleece(data);
+            CHECK(IsCompressedFleece(compressed));
+            CHECK(compressed.size == data.size + 16);
+            CHECK(DecompressFleece(compressed) == data);
+        }
+        CHECK(!IsCompressedFleece(slice("not compressed Fleece data")));
+
+        // Compress each person separately, as a document store would:
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice fleece = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(fleece)->asArray();
+        std::vector<alloc_slice> docs;
+        for (Array::iterator i(people); i; ++i) {
+            enc.writeValue(i.value());
+            endEncoding();
+            docs.push_back(result);
+        }
+        std::vector<slice> samples(docs.begin(), docs.begin() + 100);
+        auto dict = CompressionDictionary::fromSamples(samples);
+        CHECK(dict.id() != 0);
+        CHECK(dict.data().size <= CompressionDictionary::kMaxSize);
+
+        size_t totalSize = 0, totalPlain = 0, totalWithDict = 0;
+        for (size_t i = 100; i < docs.size(); i++) {
+            alloc_slice plain = CompressFleece(docs[i]);
+            alloc_slice withDict = CompressFleece(docs[i], &dict);
+            CHECK(CompressedFleeceDictionaryID(plain) == 0);
+            CHECK(CompressedFleeceDictionaryID(withDict) == dict.id());
+            REQUIRE(DecompressFleece(plain) == docs[i]);
+            alloc_slice decompressed = DecompressFleece(withDict, &dict);
+            REQUIRE(decompressed == docs[i]);
+            REQUIRE(Value::fromTrustedData(decompressed)->asDict() != nullptr);
+            totalSize += docs[i].size;
+            totalPlain += plain.size;
+            totalWithDict += withDict.size;
+        }
+        CHECK(totalPlain < totalSize);
+        CHECK(totalWithDict < totalPlain * 2 / 3);
+
+        // The right dictionary is required:
+        alloc_slice compressed = CompressFleece(docs[500], &dict);
+        CHECK_THROWS(DecompressFleece(compressed));
+        auto otherDict = CompressionDictionary::fromStrings(nullptr, {slice("name"), slice("age")});
+        CHECK(otherDict.id() != dict.id());
+        CHECK_THROWS(DecompressFleece(compressed, &otherDict));
+
+        // Corrupt data is detected (if not always, then at least without crashing):
+        for (size_t i = 16; i < compressed.size; i += 7) {
+            alloc_slice corrupt((slice)compressed);
+            ((uint8_t*)corrupt.buf)[i] ^= 0x5A;
+            try {
+                DecompressFleece(corrupt, &dict);
+            } catch (const FleeceException&) { }
+        }
+        alloc_slice truncated(compressed.buf, compressed.size - 1);
+        CHECK_THROWS(DecompressFleece(truncated, &dict));
+
+        // Data too small to compress is stored as-is, and still decompresses with the dictionary:
+        slice tiny("\x17\x9c\x02\xe5\x4b\x88\x3e\xd1");
+        alloc_slice stored = CompressFleece(tiny, &dict);
+        CHECK(stored.size == 16 + tiny.size);
+        CHECK(CompressedFleeceDictionaryID(stored) == dict.id());
+        CHECK(DecompressFleece(stored, &dict) == tiny);
+        CHECK(DecompressFleece(stored) == tiny);
+
+        // A match that starts in the dictionary and runs on into the data:
+        CompressionDictionary abcDict(alloc_slice("no match here, but: abcdefghijklmnop"));
+        std::string abc = "abcdefghijklmnopabcdefghijklmnopabcdefghijklmnop, and then some";
+        alloc_slice abcCompressed = CompressFleece(slice(abc), &abcDict);
+        CHECK(abcCompressed.size < 16 + 24);
+        CHECK(DecompressFleece(abcCompressed, &abcDict) == slice(abc));
+    }
+
     TEST_CASE_METHOD(EncoderTests, "Paths") {
         alloc_slice input = readFile(kTestFilesDir "1000people.json");
         JSONConverter jr(enc);
@@ -738,12 +2506,470 @@ public:
         REQUIRE(name);
         REQUIRE(name->type() == kString);
         REQUIRE(name->asString() == slice("Marva Morse"));
+
+        // Evaluating a path on many documents of the same shape:
+        Path p3{"name"};
+        for (Array::iterator i(root->asArray()); i; ++i)
+            REQUIRE(p3.eval(i.value()) == i.value()->asDict()->get("name"_sl));
+
+        // Evaluating several paths at once, some sharing prefixes:
+        Path p4{"[123]"}, p5{"[123].name"}, p6{"[123].age"}, p7{"[123].nope.x"}, p8{"[999999]"};
+        const Path* paths[] = {&p1, &p4, &p5, &p6, &p7, &p8, &p2};
+        const Value* results[7];
+        Path::evalMany(paths, 7, root, results);
+        CHECK(results[0] == p1.eval(root));
+        CHECK(results[1] == root->asArray()->get(123));
+        CHECK(results[2] == results[0]);
+        CHECK(results[3] == p6.eval(root));
+        CHECK(results[3] != nullptr);
+        CHECK(results[4] == nullptr);
+        CHECK(results[5] == nullptr);
+        CHECK(results[6]->asString() == slice("Marva Morse"));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "Path Wildcards") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice fleeceData = JSONConverter::convertJSON(input);
+        const Value *root = Value::fromData(fleeceData);
+        auto people = root->asArray();
+
+        auto countMatches = [&](const char *specifier) {
+            Path path{specifier};
+            CHECK(path.isMulti());
+            size_t n = 0;
+            path.forEach(root, [&](const Value *v) {
+                ++n;
+                return true;
+            });
+            return n;
+        };
+
+        // Wildcards visit every item, in order:
+        Path names{"[*].name"};
+        uint32_t i = 0;
+        CHECK(names.forEach(root, [&](const Value *name) {
+            CHECK(name == people->get(i++)->asDict()->get("name"_sl));
+            return true;
+        }));
+        CHECK(i == 1000);
+        CHECK(names.eval(root) == people->get(0)->asDict()->get("name"_sl));
+        CHECK(countMatches("$[*].friends[*].id") == 3000);
+        CHECK(countMatches("[0].*") == people->get(0)->asDict()->count());
+        CHECK(countMatches("[*].nope") == 0);
+
+        // The callback can stop early:
+        size_t n = 0;
+        CHECK(!names.forEach(root, [&](const Value*) {return ++n < 10;}));
+        CHECK(n == 10);
+
+        // Filters:
+        size_t active = 0, young = 0;
+        for (Array::iterator p(people); p; ++p) {
+            auto person = p.value()->asDict();
+            active += person->get("isActive"_sl)->asBool();
+            young += (person->get("age"_sl)->asInt() < 30);
+        }
+        CHECK(countMatches("[?isActive == true]") == active);
+        CHECK(countMatches("[?(@.isActive != true)]") == 1000 - active);
+        CHECK(countMatches("[?@.age<30].name") == young);
+        CHECK(countMatches("[?age >= 30.0]") == 1000 - young);
+        CHECK(countMatches("[?name == 'Concepcion Burns']") == 1);
+        CHECK(Path("[?name == \"Concepcion Burns\"]").eval(root) == people->get(123));
+        CHECK(countMatches("[?friends]") == 1000);
+        CHECK(countMatches("[?friends[2].id == 2]") == 1000);
+        CHECK(countMatches("[*].tags[?@ == 'et']") > 0);
+        CHECK(Path::eval("[?age > 1000]"_sl, nullptr, root) == nullptr);
+
+        CHECK_THROWS(Path("[?]"));
+        CHECK_THROWS(Path("[?age ~ 3]"));
+        CHECK_THROWS(Path("[?age > oops]"));
+        CHECK_THROWS(Path("[**]"));
     }
 
 #pragma mark - KEY TREE:
 
+    TEST_CASE_METHOD(EncoderTests, "PathIndex") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        std::vector<std::string> specifiers = {"[0].name", "[999].friends[2].name",
+                                               "[500].tags[-1]", "[3].missing", "[-1].guid"};
+        enc.indexPaths(specifiers);
+        JSONConverter jc(enc);
+        REQUIRE(jc.encodeJSON(input));
+        alloc_slice doc = enc.extractOutput();
+        alloc_slice indexData = enc.extractPathIndex();
+        REQUIRE(indexData);
+        CHECK(indexData.size < 200);
+        CHECK(PathIndex::create(doc, specifiers) == indexData);
+
+        PathIndex index(indexData, doc);
+        auto root = Value::fromData(doc);
+        REQUIRE(index.root() == root);
+        for (auto &specifier : specifiers) {
+            Path path(specifier);
+            auto expected = path.eval(root);
+            CHECK(path.eval(root, index) == expected);
+            CHECK(index.get(slice(specifier)) == expected);    // nullptr for "[3].missing"
+        }
+        CHECK(index.get(slice("[0].name"))->asString() == slice("Glenda Morse"));
+
+        // Paths that aren't indexed, or a different root, fall back to evaluating the path:
+        Path other("[1].name");
+        CHECK(index.get(slice("[1].name")) == nullptr);
+        CHECK(other.eval(root, index) == other.eval(root));
+        auto person = root->asArray()->get(0);
+        CHECK(Path("name").eval(person, index)->asString() == slice("Glenda Morse"));
+
+        // An index only opens with the document it was made from:
+        alloc_slice otherDoc = JSONConverter::convertJSON(slice("[1, 2, 3]"));
+        CHECK_THROWS(PathIndex(indexData, otherDoc));
+        CHECK_THROWS(PathIndex(otherDoc, doc));
+        CHECK_THROWS(PathIndex::create(doc, {"[*].name"}));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ReEncodeSourceStrings") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice doc = JSONConverter::convertJSON(input);
+        auto root = Value::fromData(doc);
+
+        // Writing the same document twice dedups every string of the second copy:
+        enc.collectStats(true);
+        enc.beginArray();
+        enc.writeValue(root);
+        auto deduped = enc.stats().stringsDeduped;
+        enc.writeValue(root);
+        enc.endArray();
+        auto written = enc.stats().stringsWritten;
+        CHECK(enc.stats().stringsDeduped > deduped + written);
+        alloc_slice result = enc.extractOutput();
+        auto copies = Value::fromData(result)->asArray();
+        REQUIRE(copies);
+        CHECK(copies->get(0)->isEqual(root));
+        CHECK(copies->get(1)->isEqual(root));
+
+        // A source whose memory is reused for different data mustn't get the old strings:
+        enc.reset();
+        enc.beginArray();
+        alloc_slice src = JSONConverter::convertJSON(slice("{\"name\":\"alpha\"}"));
+        alloc_slice other = JSONConverter::convertJSON(slice("{\"name\":\"bravo\"}"));
+        REQUIRE(src.size == other.size);
+        enc.writeValue(Value::fromData(src));
+        memcpy((void*)src.buf, other.buf, other.size);
+        enc.writeValue(Value::fromData(src));
+        enc.endArray();
+        result = enc.extractOutput();
+        CHECK(Value::fromData(result)->toJSON() == alloc_slice("[{\"name\":\"alpha\"},{\"name\":\"bravo\"}]"));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "WriteEncoded") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        std::vector<alloc_slice> fragments;
+        {
+            Encoder e;
+            e.writeInt(17);                             fragments.push_back(e.extractOutput());
+            e.reset(); e.writeInt(-123456789);          fragments.push_back(e.extractOutput());
+            e.reset(); e.writeDouble(3.14);             fragments.push_back(e.extractOutput());
+            e.reset(); e.writeBool(true);               fragments.push_back(e.extractOutput());
+            e.reset(); e.writeString("hi");             fragments.push_back(e.extractOutput());
+            e.reset(); e.writeString("a string too long to be inline");
+            fragments.push_back(e.extractOutput());
+        }
+        const char* fragmentJSON[] = {"[]", "{}", "[1,[2,\"three\"],{\"four\":4}]"};
+        for (auto json : fragmentJSON)
+            fragments.push_back(JSONConverter::convertJSON(slice(json)));
+        fragments.push_back(JSONConverter::convertJSON(input));
+
+        enc.beginArray();
+        enc.writeString("first");
+        for (auto &fragment : fragments)
+            enc.writeEncoded(fragment);
+        enc.beginDictionary();
+        enc.writeKey("people");
+        enc.writeEncoded(fragments.back());
+        CHECK_THROWS(enc.writeEncoded(fragments[0]));       // (a key is needed first)
+        enc.endDictionary();
+        enc.endArray();
+        endEncoding();
+
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        auto items = root->asArray();
+        REQUIRE(items->count() == fragments.size() + 2);
+        CHECK(items->get(0)->asString() == slice("first"));
+        for (uint32_t i = 0; i < fragments.size(); ++i) {
+            auto original = Value::fromData(fragments[i]);
+            INFO("fragment " << i << ": " << original->toJSON().asString());
+            CHECK(items->get(i + 1)->isEqual(original));
+        }
+        auto people = items->get((uint32_t)fragments.size() + 1)->asDict()->get(slice("people"));
+        CHECK(people->isEqual(Value::fromData(fragments.back())));
+        CHECK(people->asArray()->get(123)->asDict()->get(slice("name"))->asString()
+                  == slice("Concepcion Burns"));
+
+        // Invalid data is refused:
+        enc.beginArray();
+        alloc_slice corrupt(fragments[8]);
+        ((uint8_t*)corrupt.buf)[corrupt.size - 2] = 0xFF;   // root pointer way out of bounds
+        CHECK_THROWS(enc.writeEncoded(corrupt));
+        CHECK_THROWS(enc.writeEncoded(slice("nope")));
+    }
+
+    // Counts the strings a StringCache converts and releases, for the test below.
+    struct StringCacheCounts {
+        std::atomic<int> converted {0}, released {0};
+    };
+
+    static StringCache::PlatformString convertToStdString(void *context, slice str) {
+        ++((StringCacheCounts*)context)->converted;
+        return new std::string(str);
+    }
+
+    static void releaseStdString(void *context, StringCache::PlatformString str) {
+        ++((StringCacheCounts*)context)->released;
+        delete (const std::string*)str;
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "StringCache") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice data = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(data)->asArray();
+        for (int threadSafe = 0; threadSafe <= 1; ++threadSafe) {
+            StringCacheCounts counts;
+            {
+                StringCache cache(convertToStdString, releaseStdString, &counts, threadSafe != 0);
+                std::atomic<int> mismatches {0};        // (Catch's macros aren't thread-safe)
+                auto checkColors = [&]() {
+                    for (Array::iterator i(people); i; ++i) {
+                        auto color = i.value()->asDict()->get(slice("eyeColor"));
+                        auto str = (const std::string*)cache.get(color);
+                        if (!str || slice(*str) != color->asString())
+                            ++mismatches;
+                    }
+                };
+                if (threadSafe) {
+                    std::vector<std::thread> threads;
+                    for (int t = 0; t < 4; ++t)
+                        threads.emplace_back(checkColors);
+                    for (auto &t : threads)
+                        t.join();
+                } else {
+                    checkColors();
+                    checkColors();
+                }
+                CHECK(mismatches == 0);
+                // Each of the three eye colors is converted once (plus any lost races):
+                CHECK(cache.count() == 3);
+                CHECK(counts.converted - counts.released == 3);
+                if (!threadSafe)
+                    CHECK(counts.converted == 3);
+
+                // Strings that aren't uniqued aren't cached:
+                auto person = people->get(0)->asDict();
+                CHECK(cache.get(person->get(slice("guid"))) == nullptr);   // (too long)
+                CHECK(cache.get(person->get(slice("age"))) == nullptr);
+                CHECK(cache.get(nullptr) == nullptr);
+                CHECK(cache.count() == 3);
+
+                cache.clear();
+                CHECK(cache.count() == 0);
+                CHECK(counts.released == counts.converted);
+                cache.get(people->get(0)->asDict()->get(slice("eyeColor")));
+            }
+            CHECK(counts.released == counts.converted);
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ParallelArrayEncoder") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice data = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(data)->asArray();
+        auto writePerson = [=](size_t i, Encoder &enc) {
+            enc.writeValue(people->get((uint32_t)i));
+        };
+
+        ParallelArrayEncoder parallel(4);
+        parallel.setChunkSize(37);              // (so the chunks are uneven)
+        enc.beginArray();
+        parallel.writeArray(enc, people->count(), writePerson);
+        parallel.writeArray(enc, 0, writePerson);
+        enc.endArray();
+        endEncoding();
+
+        auto root = Value::fromData(result);
+        REQUIRE(root);
+        auto arrays = root->asArray();
+        REQUIRE(arrays->count() == 2);
+        CHECK(arrays->get(0)->isEqual(people));
+        CHECK(arrays->get(1)->asArray()->count() == 0);
+        CHECK(result.size <= data.size);        // (no bigger than encoding it sequentially)
+        enc.reset();
+
+        // The workers use the destination's options:
+        auto writeItem = [](size_t i, Encoder &e) {
+            e.beginDictionary();
+            e.writeKey("b");
+            e.beginArray();
+            for (int j = 0; j < 20; ++j)
+                e.writeDouble(i + j + 0.1);
+            e.endArray();
+            e.writeKey("a");
+            e.writeInt(i);
+            e.endDictionary();
+        };
+        enc.sortKeys(false);
+        enc.hashIndexMinCount(2);
+        enc.packNumericArrays(true);
+        parallel.writeArray(enc, 100, writeItem);
+        endEncoding();
+        auto items = Value::fromData(result)->asArray();
+        REQUIRE(items->count() == 100);
+        int64_t n = 0;
+        for (Array::iterator i(items); i; ++i, ++n) {
+            auto item = i.value()->asDict();
+            CHECK(Dict::iterator(item).keyString() == slice("b"));      // (not sorted)
+            CHECK(item->get(slice("a"))->asInt() == n);                 // (via the hash index)
+            auto numbers = item->get(slice("b"))->asArray();
+            CHECK(numbers->packedDoubles() != nullptr);
+        }
+        enc.sortKeys(true);
+        enc.hashIndexMinCount(0);
+        enc.packNumericArrays(false);
+
+        // A failing ItemWriter's exception is rethrown:
+        parallel.setChunkSize(10);
+        enc.beginArray();
+        CHECK_THROWS_AS(parallel.writeArray(enc, 1000, [](size_t i, Encoder &e) {
+            if (i == 500)
+                throw std::runtime_error("oops");
+            e.writeInt(i);
+        }), const std::runtime_error&);
+        CHECK_THROWS_AS(parallel.writeArray(enc, 100, [](size_t i, Encoder &e) {
+            e.writeInt(i);
+            if (i == 42)
+                e.writeInt(i);
+        }), const FleeceException&);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "MutableArray and MutableDict") {
+        alloc_slice input = readFile(kTestFilesDir "1000people.json");
+        alloc_slice base = JSONConverter::convertJSON(input);
+        auto people = Value::fromData(base)->asArray();
+        auto original = people->get(123)->asDict();
+
+        MutableArray mutablePeople(people);
+        CHECK(mutablePeople.count() == 1000);
+        MutableDict *person = mutablePeople.getMutableDict(123);
+        REQUIRE(person);
+        CHECK(!mutablePeople.isChanged());
+        CHECK(person->count() == original->count());
+        CHECK(person->get(slice("name")) == original->get(slice("name")));
+        CHECK(mutablePeople.getMutableDict(1000) == nullptr);
+
+        // Change, add and remove keys, and edit a nested array:
+        person->set(slice("name")).setString(slice("Nobody In Particular"));
+        person->set(slice("nickname")).setString(slice("Nemo"));
+        person->remove(slice("guid"));
+        person->remove(slice("nonexistent"));
+        CHECK(mutablePeople.isChanged());
+        CHECK(person->count() == original->count());
+        CHECK(person->get(slice("name"))->asString() == slice("Nobody In Particular"));
+        CHECK(person->get(slice("guid")) == nullptr);
+        CHECK(person->getMutableArray(slice("name")) == nullptr);
+        CHECK(person->getMutableDict(slice("guid")) == nullptr);
+
+        MutableArray *tags = person->getMutableArray(slice("tags"));
+        REQUIRE(tags);
+        uint32_t nTags = tags->count();
+        REQUIRE(nTags > 2);
+        tags->append().setInt(17);
+        tags->remove(0);
+        tags->insert(0);
+        tags->set(0).setBool(true);
+        CHECK(tags->count() == nTags + 1);
+        CHECK_THROWS(tags->set(nTags + 1));
+        CHECK_THROWS(tags->remove(nTags, 2));
+
+        // Re-encode it as a delta appended to the original:
+        enc.setBase(base);
+        mutablePeople.writeTo(enc);
+        alloc_slice delta = enc.extractOutput();
+        CHECK(delta.size < base.size / 10);
+
+        std::string combined = (std::string)base + (std::string)delta;
+        auto updated = Value::fromData(slice(combined))->asArray();
+        REQUIRE(updated);
+        REQUIRE(updated->count() == 1000);
+        auto updatedPerson = updated->get(123)->asDict();
+        REQUIRE(updatedPerson);
+        CHECK(updatedPerson->count() == original->count());
+        CHECK(updatedPerson->get(slice("name"))->asString() == slice("Nobody In Particular"));
+        CHECK(updatedPerson->get(slice("nickname"))->asString() == slice("Nemo"));
+        CHECK(updatedPerson->get(slice("guid")) == nullptr);
+        CHECK(updatedPerson->get(slice("friends"))->isEqual(original->get(slice("friends"))));
+        auto updatedTags = updatedPerson->get(slice("tags"))->asArray();
+        REQUIRE(updatedTags);
+        CHECK(updatedTags->count() == nTags + 1);
+        CHECK(updatedTags->get(0)->asBool() == true);
+        CHECK(updatedTags->get(1)->isEqual(original->get(slice("tags"))->asArray()->get(1)));
+        CHECK(updatedTags->get(nTags)->asInt() == 17);
+
+        // Unchanged people weren't copied; they're still in the base:
+        auto offsetIn = [](const Value *v, const void *start) {return (size_t)((const char*)v - (const char*)start);};
+        CHECK(offsetIn(updated->get(122), combined.data()) == offsetIn(people->get(122), base.buf));
+        CHECK(updated->get(999)->isEqual(people->get(999)));
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "MutableDict SharedKeys") {
+        SharedKeys sk;
+        enc.setSharedKeys(&sk);
+        enc.beginDictionary();
+        enc.writeKey("a");
+        enc.writeInt(1);
+        enc.writeKey("b");
+        enc.writeInt(2);
+        enc.endDictionary();
+        alloc_slice doc = enc.extractOutput();
+        auto dict = Value::fromData(doc)->asDict();
+
+        MutableDict md(dict, &sk);
+        CHECK(md.get(slice("a"))->asInt() == 1);
+        md.set(slice("b")).setInt(3);
+        md.set(slice("c")).setString(slice("new"));
+        md.remove(slice("a"));
+        md.set(slice("a")).setDouble(0.5);
+        CHECK(md.count() == 3);
+
+        enc.reset();
+        md.writeTo(enc);
+        doc = enc.extractOutput();
+        dict = Value::fromData(doc)->asDict();
+        REQUIRE(dict);
+        CHECK(dict->count() == 3);
+        CHECK(dict->get(slice("a"), &sk)->asDouble() == 0.5);
+        CHECK(dict->get(slice("b"), &sk)->asInt() == 3);
+        CHECK(dict->get(slice("c"), &sk)->asString() == slice("new"));
+
+        // An empty one, and one that's never changed:
+        MutableDict empty;
+        MutableArray &items = empty.set(slice("items")).setArray();
+        items.append().setString(slice("x"));
+        items.append().setNull();
+        enc.reset();
+        enc.setSharedKeys(nullptr);
+        empty.writeTo(enc);
+        doc = enc.extractOutput();
+        CHECK(Value::fromData(doc)->toJSON() == alloc_slice("{\"items\":[\"x\",null]}"));
+        MutableDict unchanged(Value::fromData(doc)->asDict());
+        CHECK(!unchanged.isChanged());
+        enc.reset();
+        unchanged.writeTo(enc);
+        CHECK(enc.extractOutput() == doc);
+    }
+
     TEST_CASE_METHOD(EncoderTests, "KeyTree") {
         bool verbose = false;
+        KeyTree::Layout layout = KeyTree::kCompact;
+        SECTION("Compact") { }
+        SECTION("Eytzinger") {layout = KeyTree::kEytzinger;}
 
         char eeeeeeee[1024] = "";
         memset(&eeeeeeee[0], 'e', sizeof(eeeeeeee)-1);
@@ -770,7 +2996,7 @@ public:
             totalLen += strings[i].size;
         }
 
-        KeyTree keys = KeyTree::fromStrings(strings);
+        KeyTree keys = KeyTree::fromStrings(strings, layout);
         slice output = keys.encodedData();
         if (verbose) {
             std::cerr << "\n" << sliceToHexDump(output, 32);
@@ -797,6 +3023,8 @@ public:
         REQUIRE(keys[slice("whiske")] == 0);
         REQUIRE(keys[slice("whiskex")] == 0);
         REQUIRE(keys[slice("whiskez")] == 0);
+        REQUIRE(keys[slice("eeeeeeee")] == 0);
+        REQUIRE(keys[slice(eeeeeeee, 500)] == 0);
 
         REQUIRE(keys[0].buf == nullptr);
         REQUIRE(keys[(unsigned)n+1].buf == nullptr);
@@ -804,4 +3032,22 @@ public:
         REQUIRE(keys[(unsigned)n+28].buf == nullptr);
         REQUIRE(keys[(unsigned)9999].buf == nullptr);
     }
+
+    TEST_CASE_METHOD(EncoderTests, "KeyTree Eytzinger Prefixes") {
+        // Strings that differ only past the inline prefix, or only in length:
+        std::vector<slice> strings = {slice(""), slice("a"), slice("ab"), slice("ab\0", 3),
+                                      slice("abcdefgh"), slice("abcdefgh\0", 9),
+                                      slice("abcdefghi"), slice("abcdefghij"),
+                                      slice("abcdefghik"), slice("\xff\xff")};
+        KeyTree keys = KeyTree::fromStrings(strings, KeyTree::kEytzinger);
+        for (slice str : strings) {
+            unsigned id = keys[str];
+            REQUIRE(id > 0);
+            REQUIRE(id <= strings.size());
+            REQUIRE(keys[id] == str);
+        }
+        REQUIRE(keys[slice("ab\0\0", 4)] == 0);
+        REQUIRE(keys[slice("abcdefghii")] == 0);
+        REQUIRE(keys[slice("abcdefg")] == 0);
+    }
 };
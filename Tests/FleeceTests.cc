@@ -15,7 +15,6 @@
 #include "slice.hh"
 #include <assert.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -74,28 +73,6 @@ std::string sliceToHexDump(slice result, size_t width) {
 }
 
 
-mmap_slice::mmap_slice(const char *path)
-:_fd(-1),
-_mapped(MAP_FAILED)
-{
-    _fd = ::open(path, O_RDONLY);
-    assert(_fd != -1);
-    struct stat stat;
-    ::fstat(_fd, &stat);
-    size = stat.st_size;
-    _mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, _fd, 0);
-    assert(_mapped != MAP_FAILED);
-    buf = _mapped;
-}
-
-mmap_slice::~mmap_slice() {
-    if (_mapped != MAP_FAILED)
-        munmap((void*)buf, size);
-    if (_fd != -1)
-        close(_fd);
-}
-
-
 alloc_slice readFile(const char *path) {
     int fd = ::open(path, O_RDONLY);
     assert(fd != -1);
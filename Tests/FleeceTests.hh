@@ -36,15 +36,8 @@ alloc_slice readFile(const char *path);
 void writeToFile(slice s, const char *path);
 
 
-struct mmap_slice : public slice {
-    mmap_slice(const char *path);
-    ~mmap_slice();
-
-private:
-    int _fd;
-    void* _mapped;
-    mmap_slice(const mmap_slice&);
-};
+// Memory-mapped file contents (see MappedFile.hh)
+typedef fleece::mapped_slice mmap_slice;
 
 
 // Converts JSON5 to JSON; helps make JSON test input more readable!
@@ -7,6 +7,8 @@
 //
 
 #include "JSON5.hh"
+#include "Encoder.hh"
+#include "FleeceException.hh"
 #include "catch.hpp"
 
 using namespace fleece;
@@ -66,3 +68,46 @@ TEST_CASE("JSON5 Objects") {
     CHECK(ConvertJSON5("{key:false,$other:'hey',}") == "{\"key\":false,\"$other\":\"hey\"}");
     CHECK(ConvertJSON5("{_key : false, _Oth3r:null,}") == "{\"_key\":false,\"_Oth3r\":null}");
 }
+
+
+// Converts JSON5 to Fleece, then returns the Fleece data as JSON.
+static std::string json5ToFleeceToJSON(const char *json5) {
+    Encoder enc;
+    ConvertJSON5(slice(json5), enc);
+    alloc_slice data = enc.extractOutput();
+    return (std::string)Value::fromData(data)->toJSON();
+}
+
+TEST_CASE("JSON5 To Fleece") {
+    CHECK(json5ToFleeceToJSON("null") == "null");
+    CHECK(json5ToFleeceToJSON(" true // comment") == "true");
+    CHECK(json5ToFleeceToJSON("/* comment */false") == "false");
+    CHECK(json5ToFleeceToJSON("+12340") == "12340");
+    CHECK(json5ToFleeceToJSON("-12340") == "-12340");
+    CHECK(json5ToFleeceToJSON("18446744073709551615") == "18446744073709551615");
+    CHECK(json5ToFleeceToJSON("-9223372036854775808") == "-9223372036854775808");
+    CHECK(json5ToFleeceToJSON("0x1F") == "31");
+    CHECK(json5ToFleeceToJSON("-0xff") == "-255");
+    CHECK(json5ToFleeceToJSON(".5") == "0.5");
+    CHECK(json5ToFleeceToJSON("5.") == "5");
+    CHECK(json5ToFleeceToJSON("-1.25e3") == "-1250");
+    CHECK(json5ToFleeceToJSON("'hi'") == "\"hi\"");
+    CHECK(json5ToFleeceToJSON("'\"hi\" \\'there\\''") == "\"\\\"hi\\\" 'there'\"");
+    CHECK(json5ToFleeceToJSON("'a\\tb\\x41\\u00e9\\ud83d\\ude00\\\nc'") == "\"a\\tbA\xC3\xA9\xF0\x9F\x98\x80" "c\"");
+    CHECK(json5ToFleeceToJSON("[1, 'two', [], [3,],]") == "[1,\"two\",[],[3]]");
+    CHECK(json5ToFleeceToJSON("{zed: 1, $a: 'x', 'b\\n': null, _c:[true],}")
+          == "{\"$a\":\"x\",\"_c\":[true],\"b\\n\":null,\"zed\":1}");
+
+    const char* invalid[] = {"", "nul", "[1 2]", "{a 1}", "{1:2}", "'unterminated", "0xZZ",
+                             "1.2.3", "-inf", "nan", "--1", "'\\ud800'", "[", "true false"};
+    for (auto json5 : invalid) {
+        INFO("Input: " << json5);
+        Encoder enc;
+        try {
+            ConvertJSON5(slice(json5), enc);
+            FAIL("No exception thrown");
+        } catch (const FleeceException &x) {
+            CHECK(x.code == JSONError);
+        }
+    }
+}
@@ -63,6 +63,30 @@ TEST_CASE("Obj-C Strings") {
     checkIt(@"line1\01\02line2",    "\"line1\\u0001\\u0002line2\"");
 }
 
+TEST_CASE("Obj-C Mutable Strings") {
+    // The encoder caches strings' UTF-8, but mustn't cache a mutable string's:
+    NSMutableString *str = [NSMutableString stringWithString: @"before"];
+    Encoder enc;
+    enc.beginArray();
+    enc.write(str);
+    [str setString: @"after"];
+    enc.write(str);
+    enc.beginDictionary();
+    [str setString: @"key1"];
+    enc.writeKey(str);
+    enc.writeInt(1);
+    [str setString: @"key2"];
+    enc.writeKey(str);
+    enc.writeInt(2);
+    enc.endDictionary();
+    enc.endArray();
+    enc.end();
+    auto result = enc.extractOutput();
+    auto v = Value::fromData(result);
+    REQUIRE(v != nullptr);
+    CHECK(v->toJSON() == alloc_slice("[\"before\",\"after\",{\"key1\":1,\"key2\":2}]"));
+}
+
 TEST_CASE("Obj-C Arrays") {
     checkIt(@[], "[]");
     checkIt(@[@123], "[123]");
@@ -82,6 +106,29 @@ TEST_CASE("Obj-C Dictionaries") {
             "{\"a\":\"flumpety\",\"b\":\"flumpety\",\"c\":\"flumpety\"}");
 }
 
+TEST_CASE("Obj-C Concurrent Conversion") {
+    NSMutableArray *items = [NSMutableArray array];
+    for (int i = 0; i < 5000; ++i)
+        [items addObject: @{@"i": @(i), @"name": [NSString stringWithFormat: @"item %d", i % 100]}];
+    NSDictionary *obj = @{@"items": items, @"count": @(items.count)};
+    Encoder enc;
+    enc.write(obj);
+    enc.end();
+    auto result = enc.extractOutput();
+    auto v = Value::fromData(result);
+    REQUIRE(v != nullptr);
+
+    NSMapTable *strings = Value::createSharedStringsTable();
+    REQUIRE([v->toNSObjectConcurrently(strings) isEqual: obj]);
+    REQUIRE(strings.count > 0);
+
+    NSArray *lazy = v->asDict()->get(slice("items"))->toLazyNSArray();
+    REQUIRE(lazy.count == items.count);
+    REQUIRE([lazy[4321] isEqual: items[4321]]);
+    REQUIRE([lazy isEqual: items]);
+    REQUIRE(v->toLazyNSArray() == nil);
+}
+
 TEST_CASE("Obj-C PerfParse1000PeopleNS", "[.Perf]") {
     @autoreleasepool {
         const int kSamples = 50;
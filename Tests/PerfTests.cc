@@ -7,9 +7,18 @@
 //
 
 #include "FleeceTests.hh"
+#include "Compression.hh"
 #include "JSONConverter.hh"
+#include "KeyTree.hh"
+#include "ParallelArrayEncoder.hh"
+#include "StringTable.hh"
+#include "varint.hh"
 #include <assert.h>
 #include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <thread>
 
 // Catch's REQUIRE is too slow for perf testing
 #undef REQUIRE
@@ -22,7 +31,7 @@ using namespace fleece;
 
 static const bool kSortKeys = true;
 
-TEST_CASE("Perf Convert1000People", "[.Perf]") {
+static void testConvert1000People(JSONConverter::Engine engine) {
     static const int kSamples = 500;
 
     std::vector<double> elapsedTimes;
@@ -39,6 +48,7 @@ TEST_CASE("Perf Convert1000People", "[.Perf]") {
             e.uniqueStrings(true);
             e.sortKeys(kSortKeys);
             JSONConverter jr(e);
+            jr.setEngine(engine);
 
             jr.encodeJSON(input);
             e.end();
@@ -57,6 +67,9 @@ TEST_CASE("Perf Convert1000People", "[.Perf]") {
     writeToFile(lastResult, kTestFilesDir "1000people.fleece");
 }
 
+TEST_CASE("Perf Convert1000People", "[.Perf]")         {testConvert1000People(JSONConverter::kJsonslEngine);}
+TEST_CASE("Perf Convert1000PeopleIndexed", "[.Perf]")  {testConvert1000People(JSONConverter::kIndexEngine);}
+
 TEST_CASE("Perf LoadFleece", "[.Perf]") {
     static const int kIterations = 1000;
     alloc_slice doc = readFile(kTestFilesDir "1000people.fleece");
@@ -73,6 +86,31 @@ TEST_CASE("Perf LoadFleece", "[.Perf]") {
         bench.printReport(1e3, "ms");
     }
 
+    {
+        fprintf(stderr, "Scanning untrusted Fleece in parallel... ");
+        Benchmark bench;
+        for (int i = 0; i < kIterations; i++) {
+            bench.start();
+            __unused auto root = Value::fromDataInParallel(doc)->asArray();
+            REQUIRE(root != nullptr);
+            bench.stop();
+        }
+        bench.printReport(1e3, "ms");
+    }
+
+    {
+        fprintf(stderr, "Reading one value from lazily-validated Fleece... ");
+        Benchmark bench;
+        for (int i = 0; i < kIterations; i++) {
+            bench.start();
+            LazyValidator lazy(doc);
+            auto person = lazy.root()->asArray()->get(123)->asDict();
+            REQUIRE(person->get(slice("name")) != nullptr);
+            bench.stop();
+        }
+        bench.printReport(1e6, "µs");
+    }
+
     {
         fprintf(stderr, "Scanning trusted Fleece... ");
         static const int kIterationsPerSample = 1000;
@@ -127,7 +165,7 @@ TEST_CASE("Perf FindPersonByIndexUnsorted", "[.Perf]")    {testFindPersonByIndex
 TEST_CASE("Perf FindPersonByIndexSorted", "[.Perf]")      {if (kSortKeys) testFindPersonByIndex(1);}
 TEST_CASE("Perf FindPersonByIndexKeyed", "[.Perf]")       {testFindPersonByIndex(2);}
 
-static void testLoadPeople(bool multiKeyGet) {
+static void testLoadPeople(bool multiKeyGet, unsigned prefetch =0) {
     int kSamples = 50;
     int kIterations = 1000;
     Benchmark bench;
@@ -148,13 +186,14 @@ static void testLoadPeople(bool multiKeyGet) {
     };
     Dict::sortKeys(keys, 10);
 
-    fprintf(stderr, "Looking up 1000 people, multi-key get=%d...\n", multiKeyGet);
+    fprintf(stderr, "Looking up 1000 people, multi-key get=%d, prefetch=%u...\n",
+            multiKeyGet, prefetch);
     for (int i = 0; i < kSamples; i++) {
         bench.start();
 
         for (int j = 0; j < kIterations; j++) {
             auto root = Value::fromTrustedData(doc)->asArray();
-            for (Array::iterator iter(root); iter; ++iter) {
+            for (Array::iterator iter(root, prefetch); iter; ++iter) {
                 const Dict *person = iter->asDict();
                 size_t n = 0;
                 if (multiKeyGet) {
@@ -176,3 +215,578 @@ static void testLoadPeople(bool multiKeyGet) {
 
 TEST_CASE("Perf LoadPeople", "[.Perf]") {testLoadPeople(false);}
 TEST_CASE("Perf LoadPeopleFast", "[.Perf]") {testLoadPeople(true);}
+TEST_CASE("Perf LoadPeoplePrefetch", "[.Perf]") {testLoadPeople(false, 4);}
+
+TEST_CASE("Perf ExtractColumn", "[.Perf]") {
+    static const int kSamples = 50, kIterations = 1000;
+    mmap_slice doc(kTestFilesDir "1000people.fleece");
+    auto root = Value::fromTrustedData(doc)->asArray();
+    std::vector<double> latitudes(root->count());
+
+    for (int column = 0; column <= 1; column++) {
+        fprintf(stderr, "Getting 1000 latitudes, %s... ",
+                (column ? "extractColumn" : "iterator and Dict::get"));
+        Dict::key key(slice("latitude"));
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            for (int j = 0; j < kIterations; j++) {
+                if (column) {
+                    root->extractColumn(key, latitudes.data());
+                } else {
+                    double *out = latitudes.data();
+                    for (Array::iterator iter(root); iter; ++iter)
+                        *out++ = iter->asDict()->get(key)->asDouble();
+                }
+            }
+            bench.stop();
+        }
+        bench.printReport(1e9 / 1000 / kIterations, "ns per person");
+    }
+}
+
+TEST_CASE("Perf JSONEscaping", "[.Perf]") {
+    static const int kSamples = 500;
+    // String-heavy input: long runs of plain text with an occasional character to escape.
+    std::string str;
+    for (int i = 0; i < 1000; i++)
+        str += "The quick brown fox jumps over the lazy dog, said \"Fleece\".\n";
+    auto begin = (const uint8_t*)str.data(), end = begin + str.size();
+
+    for (int simd = 0; simd <= 1; simd++) {
+        fprintf(stderr, "Scanning JSON string for escapes, %s... ", (simd ? "SIMD" : "scalar"));
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            size_t total = 0;
+            for (auto p = begin; p < end; ++p) {
+                p += simd ? internal::countUnescapedJSONBytes(p, end)
+                          : internal::countUnescapedJSONBytesScalar(p, end);
+                ++total;
+            }
+            REQUIRE(total > 0);
+            bench.stop();
+        }
+        bench.printReport(1e6, "µs");
+    }
+
+    Encoder enc;
+    enc.beginArray();
+    for (int i = 0; i < 100; i++)
+        enc.writeString(str);
+    enc.endArray();
+    alloc_slice doc = enc.extractOutput();
+    fprintf(stderr, "Converting string-heavy Fleece to JSON... ");
+    Benchmark bench;
+    for (int i = 0; i < 50; i++) {
+        bench.start();
+        alloc_slice json = Value::fromTrustedData(doc)->toJSON();
+        REQUIRE(json.size > 0);
+        bench.stop();
+    }
+    bench.printReport(1e3, "ms");
+}
+
+TEST_CASE("Perf Base64", "[.Perf]") {
+    static const int kSamples = 200;
+    std::string data(1000000, '\0');
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (char)(i * 7919 >> 3);
+    std::string base64 = slice(data).base64String();
+
+    fprintf(stderr, "Encoding 1MB as base64... ");
+    Benchmark encBench;
+    for (int i = 0; i < kSamples; i++) {
+        encBench.start();
+        Writer w(base64.size() + 100);
+        w.writeBase64(slice(data));
+        REQUIRE(w.length() == base64.size());
+        encBench.stop();
+    }
+    encBench.printReport(1e3, "ms");
+
+    fprintf(stderr, "Decoding 1MB of base64... ");
+    Benchmark decBench;
+    for (int i = 0; i < kSamples; i++) {
+        decBench.start();
+        Writer w(data.size() + 100);
+        w.writeDecodedBase64(slice(base64));
+        REQUIRE(w.length() == data.size());
+        decBench.stop();
+    }
+    decBench.printReport(1e3, "ms");
+}
+
+TEST_CASE("Perf StringTable", "[.Perf]") {
+    static const int kSamples = 50;
+    static const size_t kNumStrings = 10000;
+    // (Encoder only uniques strings of up to 15 bytes, but longer ones show how the hash scales.)
+    static const struct {const char *name; size_t minLen, maxLen;} kDistributions[] = {
+        {"short (2-15 bytes)",      2,   15},
+        {"medium (16-64 bytes)",   16,   64},
+        {"long (64-1024 bytes)",   64, 1024},
+    };
+    srandom(42);
+    for (auto &dist : kDistributions) {
+        std::set<std::string> unique;
+        while (unique.size() < kNumStrings) {
+            size_t len = dist.minLen + random() % (dist.maxLen - dist.minLen + 1);
+            std::string str(len, ' ');
+            for (auto &c : str)
+                c = 'a' + random() % 26;
+            unique.insert(str);
+        }
+        std::vector<std::string> strings(unique.begin(), unique.end());
+        std::shuffle(strings.begin(), strings.end(), std::mt19937(42));
+
+        fprintf(stderr, "Adding %zu %s strings to StringTable... ", kNumStrings, dist.name);
+        Benchmark addBench;
+        Benchmark findBench;
+        for (int i = 0; i < kSamples; i++) {
+            StringTable table;
+            addBench.start();
+            for (size_t j = 0; j < kNumStrings; j++) {
+                StringTable::info info = {false, (uint32_t)j};
+                table.add(slice(strings[j]), info);
+            }
+            addBench.stop();
+
+            findBench.start();
+            for (size_t j = 0; j < kNumStrings; j++)
+                REQUIRE(table.find(slice(strings[j])).second.offset == j);
+            findBench.stop();
+        }
+        addBench.printReport(1e9 / kNumStrings, "ns/string");
+        fprintf(stderr, "    ...finding them: ");
+        findBench.printReport(1e9 / kNumStrings, "ns/string");
+    }
+}
+
+TEST_CASE("Perf KeyTree", "[.Perf]") {
+    static const int kSamples = 50;
+    static const size_t kNumStrings = 100000;
+    srandom(42);
+    std::set<std::string> unique;
+    while (unique.size() < kNumStrings) {
+        std::string str(4 + random() % 20, ' ');
+        for (auto &c : str)
+            c = 'a' + random() % 26;
+        unique.insert(str);
+    }
+    std::vector<std::string> strings(unique.begin(), unique.end());
+    std::vector<slice> sorted(unique.begin(), unique.end());
+    std::shuffle(strings.begin(), strings.end(), std::mt19937(42));
+
+    for (int eytzinger = 0; eytzinger <= 1; eytzinger++) {
+        auto layout = eytzinger ? KeyTree::kEytzinger : KeyTree::kCompact;
+        KeyTree tree = KeyTree::fromSortedStrings(sorted, layout);
+        fprintf(stderr, "Looking up %zu strings in %s KeyTree (%zu bytes)... ",
+                kNumStrings, (eytzinger ? "Eytzinger" : "compact"), tree.encodedData().size);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            for (size_t j = 0; j < kNumStrings; j++)
+                REQUIRE(tree[slice(strings[j])] != 0);
+            bench.stop();
+        }
+        bench.printReport(1e9 / kNumStrings, "ns/string");
+    }
+}
+
+TEST_CASE("Perf PackedArray", "[.Perf]") {
+    static const int kSamples = 50;
+    static const unsigned kCount = 1000000;
+    for (int packed = 0; packed <= 1; packed++) {
+        Encoder enc;
+        enc.packNumericArrays(packed);
+        enc.beginArray(kCount);
+        double expectedSum = 0.0;
+        for (unsigned i = 0; i < kCount; i++) {
+            enc.writeDouble(i * 0.001 + 0.0001);
+            expectedSum += i * 0.001 + 0.0001;
+        }
+        enc.endArray();
+        alloc_slice data = enc.extractOutput();
+        auto array = Value::fromData(data)->asArray();
+        fprintf(stderr, "Summing %u doubles in %s array (%zu bytes)... ",
+                kCount, (packed ? "packed" : "unpacked"), data.size);
+        Benchmark bench;
+        for (int s = 0; s < kSamples; s++) {
+            bench.start();
+            double sum = 0.0;
+            for (Array::iterator i(array); i; ++i)
+                sum += i->asDouble();
+            bench.stop();
+            REQUIRE(sum == expectedSum);
+        }
+        bench.printReport(1e9 / kCount, "ns/item");
+
+        if (packed) {
+            fprintf(stderr, "    ...using packedDoubles: ");
+            Benchmark spanBench;
+            for (int s = 0; s < kSamples; s++) {
+                spanBench.start();
+                const double *d = array->packedDoubles();
+                REQUIRE(d);
+                double sum = 0.0;
+                for (unsigned i = 0; i < kCount; i++)
+                    sum += d[i];
+                spanBench.stop();
+                REQUIRE(sum == expectedSum);
+            }
+            spanBench.printReport(1e9 / kCount, "ns/item");
+        }
+    }
+}
+
+TEST_CASE("Perf Compression", "[.Perf]") {
+    static const int kSamples = 20;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice fleece = JSONConverter::convertJSON(input);
+    std::vector<alloc_slice> docs;
+    for (Array::iterator i(Value::fromData(fleece)->asArray()); i; ++i) {
+        Encoder enc;
+        enc.writeValue(i.value());
+        docs.push_back(enc.extractOutput());
+    }
+    std::vector<slice> samples(docs.begin(), docs.begin() + 100);
+    auto dict = CompressionDictionary::fromSamples(samples);
+
+    for (int useDict = 0; useDict <= 1; useDict++) {
+        auto d = useDict ? &dict : nullptr;
+        size_t size = 0, compressedSize = 0;
+        std::vector<alloc_slice> compressed;
+        Benchmark compBench, decompBench;
+        for (int s = 0; s < kSamples; s++) {
+            compressed.clear();
+            compBench.start();
+            for (auto &doc : docs)
+                compressed.push_back(CompressFleece(doc, d));
+            compBench.stop();
+            decompBench.start();
+            for (auto &c : compressed)
+                DecompressFleece(c, d);
+            decompBench.stop();
+        }
+        for (size_t i = 0; i < docs.size(); i++) {
+            size += docs[i].size;
+            compressedSize += compressed[i].size;
+        }
+        fprintf(stderr, "Compressing %zu docs %s: %zu -> %zu bytes (%.0f%%). Compress: ",
+                docs.size(), (useDict ? "with dictionary" : "without dictionary"),
+                size, compressedSize, compressedSize * 100.0 / size);
+        compBench.printReport(1e6 / docs.size(), "us/doc");
+        fprintf(stderr, "    ...decompress: ");
+        decompBench.printReport(1e6 / docs.size(), "us/doc");
+    }
+}
+
+TEST_CASE("Perf Hash", "[.Perf]") {
+    static const int kSamples = 50;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice fleece = JSONConverter::convertJSON(input);
+    alloc_slice copy = JSONConverter::convertJSON(input);
+    auto root = Value::fromData(fleece), copyRoot = Value::fromData(copy);
+
+    fprintf(stderr, "Hashing 1000 people: ");
+    Benchmark hashBench;
+    for (int i = 0; i < kSamples; i++) {
+        hashBench.start();
+        REQUIRE(root->hash() == copyRoot->hash());
+        hashBench.stop();
+    }
+    hashBench.printReport(1e6 / 2, "us");
+
+    fprintf(stderr, "Comparing 1000 people: ");
+    Benchmark equalBench;
+    for (int i = 0; i < kSamples; i++) {
+        equalBench.start();
+        REQUIRE(root->isEqual(copyRoot));
+        equalBench.stop();
+    }
+    equalBench.printReport(1e6, "us");
+
+    fprintf(stderr, "...vs. converting them to JSON: ");
+    Benchmark jsonBench;
+    for (int i = 0; i < kSamples; i++) {
+        jsonBench.start();
+        REQUIRE(root->toJSON().size > 0);
+        jsonBench.stop();
+    }
+    jsonBench.printReport(1e6, "us");
+}
+
+TEST_CASE("Perf alloc_slice", "[.Perf]") {
+    static const int kSamples = 20;
+    static const size_t kOps = 1000000;
+    static const unsigned kThreads = 4;
+
+    fprintf(stderr, "Copying & destroying alloc_slice: ");
+    alloc_slice original(100);
+    Benchmark copyBench;
+    for (int i = 0; i < kSamples; i++) {
+        copyBench.start();
+        for (size_t j = 0; j < kOps; j++) {
+            alloc_slice copy(original);
+            REQUIRE(copy.buf == original.buf);
+        }
+        copyBench.stop();
+    }
+    copyBench.printReport(1e9 / kOps, "ns/copy");
+
+    fprintf(stderr, "Moving alloc_slice: ");
+    Benchmark moveBench;
+    for (int i = 0; i < kSamples; i++) {
+        alloc_slice a(original), b;
+        moveBench.start();
+        for (size_t j = 0; j < kOps; j++) {
+            b = std::move(a);
+            a = std::move(b);
+        }
+        moveBench.stop();
+        REQUIRE(a.buf == original.buf);
+    }
+    moveBench.printReport(1e9 / (2 * kOps), "ns/move");
+
+    fprintf(stderr, "Allocating & freeing alloc_slice: ");
+    Benchmark allocBench;
+    for (int i = 0; i < kSamples; i++) {
+        allocBench.start();
+        for (size_t j = 0; j < kOps; j++) {
+            alloc_slice temp(100);
+            REQUIRE(temp.buf);
+        }
+        allocBench.stop();
+    }
+    allocBench.printReport(1e9 / kOps, "ns/alloc");
+
+    // Each thread copies either the same (shared) buffer or one of its own:
+    for (int contended = 0; contended <= 1; ++contended) {
+        fprintf(stderr, "Copying alloc_slice on %u threads, %s: ", kThreads,
+                (contended ? "same buffer" : "separate buffers"));
+        Benchmark threadBench;
+        for (int i = 0; i < kSamples; i++) {
+            std::vector<alloc_slice> buffers(kThreads);
+            for (auto &b : buffers)
+                b = contended ? original : alloc_slice(100);
+            threadBench.start();
+            std::vector<std::thread> threads;
+            for (unsigned t = 0; t < kThreads; t++) {
+                threads.emplace_back([&buffers, t]() {
+                    const alloc_slice &mine = buffers[t];
+                    for (size_t j = 0; j < kOps; j++) {
+                        alloc_slice copy(mine);
+                        REQUIRE(copy.buf == mine.buf);
+                    }
+                });
+            }
+            for (auto &t : threads)
+                t.join();
+            threadBench.stop();
+        }
+        threadBench.printReport(1e9 / (kOps * kThreads), "ns/copy");
+    }
+}
+
+// The original byte-at-a-time varint decoder, for comparison:
+static size_t referenceGetUVarInt(slice buf, uint64_t *n) {
+    uint64_t result = 0;
+    int shift = 0;
+    for (size_t i = 0; i < buf.size; i++) {
+        uint8_t byte = ((const uint8_t*)buf.buf)[i];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte >= 0x80) {
+            shift += 7;
+        } else {
+            if (i > 9 || (i == 9 && byte > 1))
+                return 0;
+            *n = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+TEST_CASE("Perf varint", "[.Perf]") {
+    static const int kSamples = 50;
+    static const size_t kCount = 100000;
+    static const struct {const char *name; unsigned pct1, pct2; int maxBits;} kDistributions[] = {
+        {"1-byte",                 100,   0, 7},
+        {"2-byte",                   0, 100, 14},
+        {"mixed (90% 1, 8% 2 byte)", 90, 98, 32},
+        {"large (up to 8 bytes)",    0,   0, 56},
+    };
+    srandom(42);
+    for (auto &dist : kDistributions) {
+        std::vector<uint8_t> buf(kCount * kMaxVarintLen64);
+        size_t bufLen = 0;
+        for (size_t i = 0; i < kCount; i++) {
+            unsigned pct = random() % 100;
+            int bits = (pct < dist.pct1) ? 7 : (pct < dist.pct2) ? 14 : dist.maxBits;
+            uint64_t n = (((uint64_t)random() << 31) ^ random()) & ((1ull << bits) - 1);
+            bufLen += PutUVarInt(&buf[bufLen], n);
+        }
+        slice data(buf.data(), bufLen);
+        std::vector<uint64_t> out(kCount);
+
+        Benchmark refBench, singleBench, batchBench;
+        uint64_t refSum = 0, singleSum = 0;
+        for (int i = 0; i < kSamples; i++) {
+            refBench.start();
+            slice in = data;
+            for (size_t j = 0; j < kCount; j++) {
+                uint64_t n = 0;
+                in.moveStart(referenceGetUVarInt(in, &n));
+                refSum += n;
+            }
+            refBench.stop();
+
+            singleBench.start();
+            in = data;
+            for (size_t j = 0; j < kCount; j++) {
+                uint64_t n = 0;
+                ReadUVarInt(&in, &n);
+                singleSum += n;
+            }
+            singleBench.stop();
+
+            batchBench.start();
+            REQUIRE(GetUVarInts(data, out.data(), kCount) == bufLen);
+            batchBench.stop();
+        }
+        REQUIRE(refSum == singleSum);
+        fprintf(stderr, "Decoding %zu %s varints, byte loop: ", kCount, dist.name);
+        refBench.printReport(1e9 / kCount, "ns/varint");
+        fprintf(stderr, "    ...GetUVarInt: ");
+        singleBench.printReport(1e9 / kCount, "ns/varint");
+        fprintf(stderr, "    ...GetUVarInts: ");
+        batchBench.printReport(1e9 / kCount, "ns/varint");
+    }
+}
+
+TEST_CASE("Perf DictLookup", "[.Perf]") {
+    static const int kSamples = 50;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice doc = JSONConverter::convertJSON(input);
+    auto people = Value::fromData(doc)->asArray();
+    std::vector<std::string> keys;
+    for (Dict::iterator i(people->get(0)->asDict()); i; ++i)
+        keys.push_back((std::string)i.keyString());
+
+    // A big dict whose keys share long prefixes, as in many machine-generated documents:
+    Encoder enc;
+    enc.beginDictionary();
+    std::vector<std::string> bigKeys;
+    for (int i = 0; i < 1000; i++) {
+        char key[40];
+        snprintf(key, sizeof(key), "attribute.value.%04d", i);
+        bigKeys.push_back(key);
+        enc.writeKey(slice(key));
+        enc.writeInt(i);
+    }
+    enc.endDictionary();
+    alloc_slice bigDoc = enc.extractOutput();
+    auto bigDict = Value::fromData(bigDoc)->asDict();
+
+    for (int sorted = 0; sorted <= 1; ++sorted) {
+        fprintf(stderr, "Looking up every key of 1000 people, %s: ",
+                (sorted ? "get" : "get_unsorted"));
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            for (Array::iterator p(people); p; ++p) {
+                auto person = p.value()->asDict();
+                for (auto &key : keys)
+                    REQUIRE((sorted ? person->get(slice(key)) : person->get_unsorted(slice(key))));
+            }
+            bench.stop();
+        }
+        bench.printReport(1e9 / (1000 * keys.size()), "ns/lookup");
+
+        fprintf(stderr, "Looking up every key of a 1000-key dict, %s: ",
+                (sorted ? "get" : "get_unsorted"));
+        Benchmark bigBench;
+        for (int i = 0; i < (sorted ? kSamples : kSamples / 10); i++) {
+            bigBench.start();
+            for (auto &key : bigKeys)
+                REQUIRE((sorted ? bigDict->get(slice(key)) : bigDict->get_unsorted(slice(key))));
+            bigBench.stop();
+        }
+        bigBench.printReport(1e9 / bigKeys.size(), "ns/lookup");
+    }
+
+    // Dicts with integer (SharedKeys) keys, with every key in a range or with a few missing:
+    for (int gaps = 0; gaps <= 1; ++gaps) {
+        static const int kNumKeys = 40;
+        Encoder intEnc;
+        intEnc.beginDictionary();
+        for (int k = 0; k < kNumKeys; k++) {
+            if (!gaps || k % 7 != 3) {
+                intEnc.writeKey(k);
+                intEnc.writeInt(k);
+            }
+        }
+        intEnc.endDictionary();
+        alloc_slice intDoc = intEnc.extractOutput();
+        auto intDict = Value::fromData(intDoc)->asDict();
+        fprintf(stderr, "Looking up integer keys 0-%d%s: ", kNumKeys - 1,
+                (gaps ? " (some missing)" : ""));
+        Benchmark intBench;
+        static const int kRounds = 10000;
+        for (int i = 0; i < kSamples; i++) {
+            intBench.start();
+            for (int r = 0; r < kRounds; r++) {
+                for (int k = 0; k < kNumKeys; k++)
+                    REQUIRE((intDict->get(k) != nullptr) == (!gaps || k % 7 != 3));
+            }
+            intBench.stop();
+        }
+        intBench.printReport(1e9 / (kRounds * kNumKeys), "ns/lookup");
+    }
+}
+
+TEST_CASE("Perf ReEncode", "[.Perf]") {
+    static const int kSamples = 200;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice doc = JSONConverter::convertJSON(input);
+    auto root = Value::fromData(doc);
+
+    fprintf(stderr, "Re-encoding 1000 people with writeValue: ");
+    Benchmark bench;
+    size_t size = 0;
+    for (int i = 0; i < kSamples; i++) {
+        bench.start();
+        Encoder enc(doc.size);
+        enc.writeValue(root);
+        size = enc.extractOutput().size;
+        bench.stop();
+    }
+    bench.printReport(1000, "ms");
+    fprintf(stderr, "Output is %zu bytes (input %zu)\n", size, doc.size);
+}
+
+TEST_CASE("Perf ParallelArrayEncoder", "[.Perf]") {
+    static const int kSamples = 20;
+    static const size_t kCount = 20000;
+    alloc_slice input = readFile(kTestFilesDir "1000people.json");
+    alloc_slice doc = JSONConverter::convertJSON(input);
+    auto people = Value::fromData(doc)->asArray();
+
+    for (unsigned nThreads = 1; nThreads <= std::thread::hardware_concurrency(); nThreads *= 2) {
+        fprintf(stderr, "Encoding %zu people on %u thread(s): ", kCount, nThreads);
+        ParallelArrayEncoder parallel(nThreads);
+        Benchmark bench;
+        size_t size = 0;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            Encoder enc;
+            parallel.writeArray(enc, kCount, [=](size_t i, Encoder &e) {
+                e.writeValue(people->get(i % 1000));
+            });
+            size = enc.extractOutput().size;
+            bench.stop();
+        }
+        bench.printReport(1000, "ms");
+        fprintf(stderr, "Output is %zu bytes\n", size);
+    }
+}
@@ -10,7 +10,9 @@
 
 #include "FleeceTests.hh"
 #include "Path.hh"
+#include <atomic>
 #include <iostream>
+#include <thread>
 
 using namespace std;
 
@@ -146,6 +148,141 @@ TEST_CASE("many keys") {
 }
 
 
+
+TEST_CASE("concurrent reads") {
+    static const int kNumKeys = 2000, kNumReaders = 4;
+    SharedKeys sk;
+    sk.setMaxCount(kNumKeys);
+    std::atomic<bool> done {false};
+    std::atomic<int> errors {0};
+
+    // Readers look up keys while the writer is adding them. (Catch's assertions aren't
+    // thread-safe, so they just count errors.)
+    std::vector<std::thread> readers;
+    for (int r = 0; r < kNumReaders; r++) {
+        readers.emplace_back([&, r] {
+            int n = r;
+            while (!done) {
+                char str[10];
+                sprintf(str, "K%d", n);
+                int key;
+                if (sk.encode(slice(str), key) && (key != n || sk.decode(key) != slice(str)))
+                    ++errors;
+                size_t count = sk.count();
+                if (count > 0 && !sk.decode((int)count - 1))
+                    ++errors;
+                n = (n + 7) % kNumKeys;
+            }
+        });
+    }
+    for (int i = 0; i < kNumKeys; i++) {
+        char str[10];
+        sprintf(str, "K%d", i);
+        int key;
+        REQUIRE(sk.encodeAndAdd(slice(str), key));
+        REQUIRE(key == i);
+    }
+    done = true;
+    for (auto &reader : readers)
+        reader.join();
+    CHECK(errors == 0);
+    CHECK(sk.count() == (size_t)kNumKeys);
+}
+
+
+TEST_CASE("concurrent reads between reverts") {
+    static const int kNumKeys = 100, kNumReaders = 4, kNumReverts = 200;
+    SharedKeys sk;
+    std::atomic<int> errors {0};
+    int key;
+    REQUIRE(sk.encodeAndAdd("permanent"_sl, key));
+
+    // Keys are added (growing the State) while readers look them up; then, with the readers
+    // stopped, they're reverted, which frees the old States and strings:
+    for (int i = 0; i < kNumReverts; i++) {
+        std::atomic<bool> done {false};
+        std::vector<std::thread> readers;
+        for (int r = 0; r < kNumReaders; r++) {
+            readers.emplace_back([&, r] {
+                int n = r;
+                while (!done) {
+                    char str[10];
+                    snprintf(str, sizeof(str), "K%d", n);
+                    int key;
+                    if (!sk.encode("permanent"_sl, key) || key != 0
+                                                        || sk.decode(0) != "permanent"_sl)
+                        ++errors;
+                    if (sk.encode(slice(str), key) && (key != n + 1 || sk.decode(key) != slice(str)))
+                        ++errors;
+                    n = (n + 3) % kNumKeys;
+                }
+            });
+        }
+        for (int k = 0; k < 1 + i % kNumKeys; k++) {
+            char str[10];
+            snprintf(str, sizeof(str), "K%d", k);
+            REQUIRE(sk.encodeAndAdd(slice(str), key));
+            REQUIRE(key == k + 1);
+        }
+        done = true;
+        for (auto &reader : readers)
+            reader.join();
+        sk.revertToCount(1);
+        CHECK(sk.count() == 1);
+        CHECK(!sk.encode("K0"_sl, key));
+    }
+    CHECK(errors == 0);
+}
+
+TEST_CASE("training") {
+    SharedKeys sk;
+    int key;
+    REQUIRE(sk.encodeAndAdd("known"_sl, key));
+
+    sk.beginTraining();
+    CHECK(sk.isTraining());
+    // A rare key seen first, then hot ones, including one longer than the max key length:
+    CHECK(!sk.encodeAndAdd("rare"_sl, key));
+    for (int i = 0; i < 10; ++i) {
+        CHECK(!sk.encodeAndAdd("warm"_sl, key));
+        for (int j = 0; j < 3; ++j)
+            CHECK(!sk.encodeAndAdd("a_rather_long_but_very_common_key"_sl, key));
+    }
+    CHECK(!sk.encodeAndAdd("@"_sl, key));
+    CHECK(!sk.encodeAndAdd("@"_sl, key));
+    CHECK(sk.encodeAndAdd("known"_sl, key));
+    CHECK(key == 0);
+
+    // Keys can also be counted from existing documents:
+    Encoder enc;
+    enc.beginArray();
+    for (int i = 0; i < 5; ++i) {
+        enc.beginDictionary();
+        enc.writeKey("tepid");
+        enc.writeInt(i);
+        enc.writeKey("known");
+        enc.writeInt(i);
+        enc.endDictionary();
+    }
+    enc.endArray();
+    alloc_slice doc = enc.extractOutput();
+    sk.train(Value::fromData(doc));
+    CHECK(sk.count() == 1);
+
+    CHECK(sk.endTraining(2) == 3);
+    CHECK(!sk.isTraining());
+    CHECK(sk.count() == 4);
+    CHECK(sk.decode(1) == "a_rather_long_but_very_common_key"_sl);
+    CHECK(sk.decode(2) == "warm"_sl);
+    CHECK(sk.decode(3) == "tepid"_sl);
+    CHECK(!sk.encode("rare"_sl, key));
+
+    // Back to the usual first-seen assignment:
+    CHECK(sk.encodeAndAdd("rare"_sl, key));
+    CHECK(key == 4);
+}
+
+
 #pragma mark - PERSISTENCE:
 
 
@@ -159,6 +296,7 @@ public:
         sNumberOfWrites = 0;
     }
     static unsigned numberOfWrites() {return sNumberOfWrites;}
+    static slice committedStorage() {return sCommittedStorage;}
 
     slice read()  {
         return _written ? _pendingStorage : sCommittedStorage;
@@ -170,6 +308,18 @@ public:
         _pendingStorage = data;
     }
 
+    void append(slice data) {
+        REQUIRE(sTransactionOwner == this);
+        alloc_slice storage(read().size + data.size);
+        memcpy((void*)storage.buf, read().buf, read().size);
+        memcpy((void*)&storage[read().size], data.buf, data.size);
+        _written = true;
+        _pendingStorage = storage;
+        _appendedBytes += data.size;
+    }
+
+    size_t appendedBytes() const {return _appendedBytes;}
+
     void begin() {
         REQUIRE(sTransactionOwner == nullptr);
         sTransactionOwner = this;
@@ -189,6 +339,7 @@ public:
 private:
     bool _written {false};
     alloc_slice _pendingStorage;
+    size_t _appendedBytes {0};
 
     static Client* sTransactionOwner;
     static alloc_slice sCommittedStorage;
@@ -203,8 +354,9 @@ unsigned Client::sNumberOfWrites = 0;
 // PersistentSharedKeys implementation that stores data in a Client
 class MockPersistentSharedKeys : public PersistentSharedKeys {
 public:
-    MockPersistentSharedKeys(Client &client)
+    MockPersistentSharedKeys(Client &client, bool canAppend =false)
     :_client(client)
+    ,_canAppend(canAppend)
     { }
 
 protected:
@@ -218,8 +370,16 @@ protected:
         _client.write(encodedData);
     }
 
+    virtual bool append(slice encodedData) override {
+        if (!_canAppend)
+            return false;
+        _client.append(encodedData);
+        return true;
+    }
+
 private:
     Client &_client;
+    bool _canAppend;
 };
 
 
@@ -326,6 +486,71 @@ TEST_CASE("basic persistence") {
 }
 
 
+TEST_CASE("incremental persistence") {
+    Client::reset();
+    Client client1;
+    MockPersistentSharedKeys sk1(client1, true);
+    int key;
+    char name[20];
+
+    // Each transaction adds two keys; after the first, saves only append the new ones:
+    size_t lastAppended = 0;
+    for (int t = 0; t < 40; ++t) {
+        client1.begin();
+        sk1.transactionBegan();
+        for (int i = 0; i < 2; ++i) {
+            sprintf(name, "key%d", 2*t + i);
+            REQUIRE(sk1.encodeAndAdd(slice(name), key));
+            CHECK(key == 2*t + i);
+        }
+        sk1.save();
+        client1.end(true);
+        sk1.transactionEnded();
+        size_t appended = client1.appendedBytes() - lastAppended;
+        lastAppended = client1.appendedBytes();
+        if (t > 0 && t % (PersistentSharedKeys::kMaxLogSegments + 1) != 0) {
+            CHECK(appended > 0);
+            CHECK(appended < 32);
+        } else {
+            CHECK(appended == 0);       // first save (or compaction) writes everything
+        }
+    }
+    CHECK(Client::numberOfWrites() == 40);
+
+    // Another client reads the whole log:
+    Client client2;
+    MockPersistentSharedKeys sk2(client2);
+    for (int k = 0; k < 80; ++k) {
+        sprintf(name, "key%d", k);
+        CHECK(sk2.decode(k) == slice(name));
+    }
+    CHECK(sk2.decode(80) == nullslice);
+
+    // ...and can add to it, rewriting all of it since it doesn't implement append():
+    client2.begin();
+    sk2.transactionBegan();
+    REQUIRE(sk2.encodeAndAdd("extra"_sl, key));
+    CHECK(key == 80);
+    sk2.save();
+    client2.end(true);
+    sk2.transactionEnded();
+    CHECK(Value::fromData(Client::committedStorage())->asArray()->count() == 81);
+
+    // The first client catches up, then appends to what the second one wrote:
+    client1.begin();
+    sk1.transactionBegan();
+    CHECK(sk1.decode(80) == "extra"_sl);
+    REQUIRE(sk1.encodeAndAdd("more"_sl, key));
+    CHECK(key == 81);
+    sk1.save();
+    client1.end(true);
+    sk1.transactionEnded();
+    CHECK(client1.appendedBytes() > lastAppended);
+    CHECK(sk2.decode(81) == "more"_sl);
+    CHECK(sk2.decode(80) == "extra"_sl);
+}
+
+
 #pragma mark - TESTING WITH ENCODERS:
 
 
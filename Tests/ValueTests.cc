@@ -8,6 +8,10 @@
 
 #include "FleeceTests.hh"
 #include "Value.hh"
+#include "NumConversion.hh"
+#include "JSONConverter.hh"
+#include "Delta.hh"
+#include "varint.hh"
 
 namespace fleece {
     using namespace internal;
@@ -32,6 +36,91 @@ namespace fleece {
 
     };
 
+    TEST_CASE("Varints") {
+        // Values of every encoded length, followed by padding so some are read a word at a time:
+        std::vector<uint64_t> values;
+        for (int bits = 0; bits <= 64; ++bits) {
+            uint64_t n = (bits == 64) ? UINT64_MAX : (1ull << bits) - 1;
+            values.push_back(n);
+            values.push_back(n / 3);
+        }
+        uint8_t buf[kMaxVarintLen64 * 200 + 16] = {};
+        size_t bufLen = 0;
+        for (uint64_t n : values) {
+            size_t size = PutUVarInt(&buf[bufLen], n);
+            REQUIRE(size == SizeOfVarInt(n));
+            uint64_t decoded;
+            // Decode with and without trailing bytes in the buffer:
+            REQUIRE(GetUVarInt(slice(&buf[bufLen], size), &decoded) == size);
+            REQUIRE(decoded == n);
+            REQUIRE(GetUVarInt(slice(&buf[bufLen], 16), &decoded) == size);
+            REQUIRE(decoded == n);
+            REQUIRE(GetUVarInt(slice(&buf[bufLen], size - 1), &decoded) == 0);
+            uint32_t decoded32;
+            REQUIRE(GetUVarInt32(slice(&buf[bufLen], 16), &decoded32) == (n <= UINT32_MAX ? size : 0));
+            if (n <= UINT32_MAX)
+                REQUIRE(decoded32 == n);
+            bufLen += size;
+        }
+
+        // Batch decoding, including runs of 1-byte varints:
+        for (int i = 0; i < 20; ++i)
+            bufLen += PutUVarInt(&buf[bufLen], i * 5);
+        for (int i = 0; i < 20; ++i)
+            values.push_back(i * 5);
+        std::vector<uint64_t> decoded(values.size());
+        REQUIRE(GetUVarInts(slice(buf, bufLen), decoded.data(), values.size()) == bufLen);
+        REQUIRE(decoded == values);
+        REQUIRE(GetUVarInts(slice(buf, bufLen - 1), decoded.data(), values.size()) == 0);
+
+        std::vector<uint32_t> small(20);
+        size_t smallStart = bufLen - 20;
+        REQUIRE(GetUVarInts32(slice(&buf[smallStart], 20), small.data(), 20) == 20);
+        for (int i = 0; i < 20; ++i)
+            REQUIRE(small[i] == (uint32_t)i * 5);
+        std::vector<uint32_t> all(values.size());
+        REQUIRE(GetUVarInts32(slice(buf, bufLen), all.data(), all.size()) == 0); // 64-bit values
+
+        // Invalid: 11 bytes long, or a 10th byte over 1
+        uint8_t tooLong[16];
+        memset(tooLong, 0xFF, sizeof(tooLong));
+        tooLong[10] = 0x01;
+        uint64_t n;
+        CHECK(GetUVarInt(slice(tooLong, sizeof(tooLong)), &n) == 0);
+        tooLong[9] = 0x02;
+        CHECK(GetUVarInt(slice(tooLong, sizeof(tooLong)), &n) == 0);
+        tooLong[9] = 0x01;
+        CHECK(GetUVarInt(slice(tooLong, sizeof(tooLong)), &n) == 10);
+        CHECK(n == UINT64_MAX);
+    }
+
+    TEST_CASE("IntOfLength") {
+        // The limits of every length, and one past them. A signed number's last byte must
+        // have the right sign bit, so -34567 (0x...FF78F9) needs 3 bytes, not 2:
+        uint8_t buf[8];
+        for (unsigned length = 1; length <= 8; ++length) {
+            int64_t max = (length == 8) ? INT64_MAX : (1ll << (8*length - 1)) - 1;
+            int64_t min = -max - 1;
+            for (int64_t n : {max, min, max / 3, min / 3}) {
+                INFO("n = " << n);
+                CHECK(PutIntOfLength(buf, n) == length);
+                CHECK(GetIntOfLength(buf, length) == n);
+            }
+            if (length < 8) {
+                for (int64_t n : {max + 1, min - 1}) {
+                    INFO("n = " << n);
+                    CHECK(PutIntOfLength(buf, n) == length + 1);
+                    CHECK(GetIntOfLength(buf, length + 1) == n);
+                }
+            }
+            // Unsigned numbers don't need a sign bit:
+            uint64_t umax = (length == 8) ? UINT64_MAX : (1ull << (8*length)) - 1;
+            CHECK(PutUIntOfLength(buf, umax) == length);
+        }
+        CHECK(PutIntOfLength(buf, -34567) == 3);
+        CHECK(GetIntOfLength(buf, 3) == -34567);
+    }
+
     TEST_CASE("Pointers") {
         ValueTests::testPointers();
     }
@@ -40,4 +129,239 @@ namespace fleece {
         ValueTests::testDeref();
     }
 
+    static std::string formatted(double n) {
+        char buf[kMinNumberBufferSize];
+        return std::string(buf, WriteFloat(n, buf));
+    }
+
+    static std::string formatted(float n) {
+        char buf[kMinNumberBufferSize];
+        return std::string(buf, WriteFloat(n, buf));
+    }
+
+    TEST_CASE("NumberFormatting") {
+        char buf[kMinNumberBufferSize];
+        REQUIRE(std::string(buf, WriteInteger(0, buf)) == "0");
+        REQUIRE(std::string(buf, WriteInteger(-12345, buf)) == "-12345");
+        REQUIRE(std::string(buf, WriteInteger(INT64_MIN, buf)) == "-9223372036854775808");
+        REQUIRE(std::string(buf, WriteUInteger(UINT64_MAX, buf)) == "18446744073709551615");
+
+        REQUIRE(formatted(0.0) == "0");
+        REQUIRE(formatted(0.1) == "0.1");
+        REQUIRE(formatted(-2.5) == "-2.5");
+        REQUIRE(formatted(123.456) == "123.456");
+        REQUIRE(formatted(6.02e23) == "6.02e+23");
+        REQUIRE(formatted(1e15) == "1000000000000000");
+        REQUIRE(formatted(1e16) == "1e+16");
+        REQUIRE(formatted(0.0001) == "0.0001");
+        REQUIRE(formatted(0.00001) == "1e-05");
+        REQUIRE(formatted(5e-324) == "5e-324");
+        REQUIRE(formatted(1.7976931348623157e308) == "1.7976931348623157e+308");
+        REQUIRE(formatted(0.1f) == "0.1");
+        REQUIRE(formatted(3.14159f) == "3.14159");
+        REQUIRE(formatted(1234567.0f) == "1.234567e+06");
+
+        // Every output should parse back to the identical value:
+        srandom(42);
+        for (int i = 0; i < 100000; i++) {
+            uint64_t bits = ((uint64_t)random() << 62) ^ ((uint64_t)random() << 31) ^ random();
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            if (std::isnan(d) || std::isinf(d))
+                continue;
+            REQUIRE(strtod(formatted(d).c_str(), nullptr) == d);
+        }
+    }
+
+    TEST_CASE("NumberParsing") {
+        int64_t i;
+        uint64_t u;
+        CHECK((ParseInteger("0"_sl, i) && i == 0));
+        CHECK((ParseInteger("-12345"_sl, i) && i == -12345));
+        CHECK((ParseInteger("-9223372036854775808"_sl, i) && i == INT64_MIN));
+        CHECK(!ParseInteger("9223372036854775808"_sl, i));
+        CHECK((ParseUInteger("18446744073709551615"_sl, u) && u == UINT64_MAX));
+        CHECK(!ParseUInteger("18446744073709551616"_sl, u));
+        CHECK(!ParseUInteger("-1"_sl, u));
+        CHECK(!ParseInteger("12x"_sl, i));
+        CHECK(!ParseInteger(""_sl, i));
+
+        const char* valid[] = {"0", "-0", "0.1", "-2.5", "6.02e23", "1E-2", "1e+22", "1e23",
+            ".5", "5.", "+3", "9007199254740993", "123456789012345678901234567890",
+            "0.000000000000000000000000000001234567890123456789012", "1.7976931348623157e308",
+            "1.7976931348623159e308", "1e400", "4.9e-324", "2.4703282292062328e-324", "1e-400",
+            "2.2250738585072011e-308", "1.00000000000000011102230246251565404236316680908203125",
+            "1.00000000000000011102230246251565404236316680908203126"};
+        for (auto str : valid) {
+            INFO("Input: " << str);
+            double d;
+            CHECK(ParseDouble(slice(str), d));
+            CHECK(d == strtod(str, nullptr));
+        }
+        const char* invalid[] = {"", "-", ".", "e5", "1e", "1e+", "1.2.3", "0x10", "inf", "nan",
+                                 "1,5", " 1"};
+        for (auto str : invalid) {
+            INFO("Input: " << str);
+            double d;
+            CHECK(!ParseDouble(slice(str), d));
+        }
+
+        // Every formatted double should parse back to the identical value:
+        srandom(42);
+        for (int n = 0; n < 100000; n++) {
+            uint64_t bits = ((uint64_t)random() << 62) ^ ((uint64_t)random() << 31) ^ random();
+            double d, parsed;
+            memcpy(&d, &bits, sizeof(d));
+            if (std::isnan(d) || std::isinf(d))
+                continue;
+            std::string str = formatted(d);
+            REQUIRE(ParseDouble(slice(str), parsed));
+            REQUIRE(parsed == d);
+        }
+    }
+
+    static alloc_slice encodeJSON(const std::string &json5, bool sortKeys =true, bool packArrays =false) {
+        Encoder enc;
+        enc.sortKeys(sortKeys);
+        enc.packNumericArrays(packArrays);
+        JSONConverter jr(enc);
+        REQUIRE(jr.encodeJSON(slice(ConvertJSON5(json5))));
+        return enc.extractOutput();
+    }
+
+    TEST_CASE("Equality") {
+        static const std::string kWeights = "[1.5,2,3.25,4.5,5.5,6.5,7.75,8.5,9.5,10.5,11.5,12.5,"
+                                            "13.5,14.5,15.5,16.5]";
+        static const std::string kDoc = "{name:'Rosie', age:2, weight:" + kWeights + ", "
+                                        "toys:{ball:true, bone:null}, d:7.0}";
+        alloc_slice doc = encodeJSON(kDoc);
+        alloc_slice unsorted = encodeJSON(kDoc, false);
+        alloc_slice packed = encodeJSON(kDoc, true, true);
+        auto root = Value::fromData(doc);
+        auto unsortedRoot = Value::fromData(unsorted);
+        auto packedRoot = Value::fromData(packed);
+        REQUIRE(packedRoot->asDict()->get(slice("weight"))->asArray()->packedType()
+                    == Array::kPackedFloat);
+
+        CHECK(root->isEqual(root));
+        CHECK(root->isEqual(unsortedRoot));
+        CHECK(unsortedRoot->isEqual(root));
+        CHECK(root->isEqual(packedRoot));
+        CHECK(!root->isEqual(nullptr));
+        CHECK(root->hash() == unsortedRoot->hash());
+        CHECK(root->hash() == packedRoot->hash());
+
+        std::string different[] = {
+            "{name:'Rosie', age:2, weight:[], toys:{ball:true, bone:null}, d:7.0}",
+            "{name:'Rosie', age:3, weight:" + kWeights + ", toys:{ball:true, bone:null}, d:7.0}",
+            "{name:'Rosie', age:2, weight:" + kWeights + ", toys:{ball:true, bone:false}, d:7.0}",
+            "{name:'Rosie', age:2, weight:" + kWeights + ", toys:{ball:true, bonE:null}, d:7.0}",
+            "{name:'Rosie', age:2, weight:" + kWeights + ", toys:{ball:true, bone:null}, d:7.5}",
+            "{name:'Rosie', age:2, weight:" + kWeights + ", toys:{ball:true, bone:null}}",
+            "{name:'Rosie', age:2, weight:[2,1.5,3.25,4.5,5.5,6.5,7.75,8.5,9.5,10.5,11.5,12.5,"
+                "13.5,14.5,15.5,16.5], toys:{ball:true, bone:null}, d:7.0}",
+        };
+        for (auto json : different) {
+            INFO("JSON: " << json);
+            alloc_slice other = encodeJSON(json);
+            auto otherRoot = Value::fromData(other);
+            CHECK(!root->isEqual(otherRoot));
+            CHECK(!otherRoot->isEqual(root));
+            CHECK(root->hash() != otherRoot->hash());
+        }
+
+        // Numbers compare by value:
+        Encoder enc;
+        enc.beginArray();
+        enc.writeInt(-1);
+        enc.writeUInt(UINT64_MAX);
+        enc.writeInt(7);
+        enc.writeFloat(0.5f);
+        enc.writeDouble(0.5);
+        enc.writeString("7");
+        enc.writeData(slice("7"));
+        enc.endArray();
+        alloc_slice numbers = enc.extractOutput();
+        auto n = Value::fromData(numbers)->asArray();
+        CHECK(!n->get(0)->isEqual(n->get(1)));
+        CHECK(n->get(2)->isEqual(root->asDict()->get(slice("d"))));
+        CHECK(n->get(2)->hash() == root->asDict()->get(slice("d"))->hash());
+        CHECK(n->get(3)->isEqual(n->get(4)));
+        CHECK(n->get(3)->hash() == n->get(4)->hash());
+        CHECK(!n->get(2)->isEqual(n->get(5)));
+        CHECK(!n->get(5)->isEqual(n->get(6)));
+        CHECK(n->get(5)->hash() != n->get(6)->hash());
+
+        // The hash is stable: it mustn't change between releases.
+        CHECK(root->hash() == 0xc64daf5ab3328366ull);
+        CHECK(n->hash() == 0xea9e70d3ef52daccull);
+    }
+
+
+    TEST_CASE("Delta") {
+        static const char* const kOld = "{name: 'Alice', age: 35, tags: ['a', 'b', 'c'],"
+                                        " address: {city: 'Paris', zip: 75001},"
+                                        " friends: [{name: 'Bob'}, {name: 'Carol'}]}";
+        alloc_slice oldDoc = encodeJSON(kOld);
+        const Value *oldRoot = Value::fromData(oldDoc);
+
+        // Equal values have no delta:
+        alloc_slice same = encodeJSON(kOld);
+        CHECK(!CreateDelta(oldRoot, Value::fromData(same)));
+        CHECK(!CreateDelta(oldRoot, oldRoot));
+
+        static const char* const kNew[] = {
+            "{name: 'Alice', age: 36, tags: ['a', 'b', 'c'],"
+                " address: {city: 'Paris', zip: 75001}, friends: [{name: 'Bob'}, {name: 'Carol'}]}",
+            "{name: 'Alice', tags: ['a', 'b'], address: {city: 'Lyon', zip: 75001},"
+                " friends: [{name: 'Bob'}, {name: 'Carol', age: 2}], pet: 'cat'}",
+            "{name: 'Alice', age: 35, tags: ['a', 'b', 'c', 'd', 'e'],"
+                " address: 'Paris', friends: []}",
+            "['Alice', 35]",
+        };
+        static const char* const kDelta[] = {
+            "{\"age\":[36]}",
+            "{\"address\":{\"city\":[\"Lyon\"]},\"age\":[],"
+                "\"friends\":{1:{\"age\":[2]}},\"pet\":[\"cat\"],\"tags\":{2:[]}}",
+            "{\"address\":[\"Paris\"],\"friends\":{0:[]},"
+                "\"tags\":{3:[\"d\"],4:[\"e\"]}}",
+            "[[\"Alice\",35]]",
+        };
+        for (int i = 0; i < 4; i++) {
+            alloc_slice newDoc = encodeJSON(kNew[i]);
+            const Value *newRoot = Value::fromData(newDoc);
+            alloc_slice delta = CreateDelta(oldRoot, newRoot);
+            REQUIRE(delta);
+            CHECK(Value::fromData(delta)->toJSON() == alloc_slice(kDelta[i]));
+
+            alloc_slice result = ApplyDelta(oldRoot, delta);
+            CHECK(Value::fromData(result)->isEqual(newRoot));
+
+            // Applying it with the old document as the encoder's base only writes the changes:
+            Encoder enc;
+            enc.setBase(oldDoc);
+            ApplyDelta(oldRoot, delta, enc);
+            alloc_slice changes = enc.extractOutput();
+            alloc_slice complete(oldDoc.size + changes.size);
+            memcpy((void*)complete.buf, oldDoc.buf, oldDoc.size);
+            memcpy((void*)&complete[oldDoc.size], changes.buf, changes.size);
+            CHECK(Value::fromData(complete)->isEqual(newRoot));
+            if (i == 0)
+                CHECK(changes.size < 32);
+
+            // Unsorted dicts are diffed too:
+            alloc_slice unsorted = encodeJSON(kNew[i], false);
+            alloc_slice delta2 = CreateDelta(oldRoot, Value::fromData(unsorted));
+            result = ApplyDelta(oldRoot, delta2);
+            CHECK(Value::fromData(result)->isEqual(newRoot));
+        }
+
+        // Deltas that don't fit:
+        alloc_slice array = encodeJSON("[17]");
+        alloc_slice delta = CreateDelta(oldRoot, Value::fromData(encodeJSON(kNew[0])));
+        CHECK_THROWS(ApplyDelta(Value::fromData(array), delta));
+        CHECK_THROWS(ApplyDelta(oldRoot, encodeJSON("[]")));
+        CHECK_THROWS(ApplyDelta(oldRoot, encodeJSON("{tags: {x: [1]}}")));
+    }
+
 }
@@ -0,0 +1,586 @@
+//
+//  fleece_bench.cc
+//  Fleece
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+// Runs a suite of benchmarks of the core Fleece operations over several generated corpora,
+// and writes the results as JSON, so they can be compared between builds to catch regressions.
+
+#include "Fleece.hh"
+#include "MappedFile.hh"
+#include "Benchmark.hh"
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace fleece;
+using namespace std;
+
+
+#pragma mark - CORPORA:
+
+
+// A document to benchmark with, in JSON and Fleece form.
+struct Corpus {
+    string name;
+    alloc_slice json;
+    alloc_slice fleece;
+    const Value *root {nullptr};
+    vector<alloc_slice> keys;       // Keys to look up, if the root is a dict or array of dicts
+
+    Corpus(string n, alloc_slice j)
+    :name(n), json(j)
+    {
+        fleece = JSONConverter::convertJSON(json);
+        root = Value::fromData(fleece);
+        if (!root)
+            throw runtime_error("couldn't convert corpus " + name);
+        const Dict *dict = root->asDict();
+        if (!dict && root->asArray() && root->asArray()->count() > 0)
+            dict = root->asArray()->get(0)->asDict();
+        if (dict) {
+            // Look up every 4th key, so some lookups go through the middle of the dict:
+            unsigned i = 0;
+            for (Dict::iterator d(dict); d; ++d, ++i)
+                if (i % 4 == 0 && d.key()->asString())
+                    keys.push_back(alloc_slice(d.key()->asString()));
+        }
+    }
+};
+
+
+// Deterministic pseudo-random numbers (xorshift), so every run uses the same data.
+class Random {
+public:
+    uint64_t next()                 {_x ^= _x << 13; _x ^= _x >> 7; _x ^= _x << 17; return _x;}
+    unsigned below(unsigned n)      {return (unsigned)(next() % n);}
+    double fraction()               {return (next() >> 11) * (1.0 / 9007199254740992.0);}
+private:
+    uint64_t _x {0x9E3779B97F4A7C15ull};
+};
+
+
+static const char* const kWords[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do",
+    "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua", "enim",
+};
+static const unsigned kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+
+static string words(Random &rnd, unsigned count) {
+    string s;
+    for (unsigned i = 0; i < count; ++i) {
+        if (i > 0)
+            s += ' ';
+        s += kWords[rnd.below(kNumWords)];
+    }
+    return s;
+}
+
+// An array of dicts shaped like typical application records.
+static string generatePeople(unsigned count) {
+    Random rnd;
+    char buf[100];
+    string json = "[";
+    for (unsigned i = 0; i < count; ++i) {
+        if (i > 0)
+            json += ",";
+        snprintf(buf, sizeof(buf),
+                 "{\"index\":%u,\"guid\":\"%08x-%04x\",\"isActive\":%s,\"age\":%u,", i,
+                 (unsigned)rnd.next(), rnd.below(0x10000), (rnd.below(2) ? "true" : "false"),
+                 20 + rnd.below(50));
+        json += buf;
+        snprintf(buf, sizeof(buf), "\"latitude\":%.6f,\"longitude\":%.6f,",
+                 rnd.fraction() * 180 - 90, rnd.fraction() * 360 - 180);
+        json += buf;
+        json += "\"name\":\"" + words(rnd, 2) + "\",\"eyeColor\":\""
+              + kWords[rnd.below(3)] + "\",\"about\":\"" + words(rnd, 30) + "\",\"tags\":[";
+        for (unsigned t = 0, n = rnd.below(8); t < n; ++t)
+            json += string(t ? "," : "") + "\"" + kWords[rnd.below(kNumWords)] + "\"";
+        json += "],\"friends\":[";
+        for (unsigned f = 0; f < 3; ++f) {
+            snprintf(buf, sizeof(buf), "%s{\"id\":%u,\"name\":\"", (f ? "," : ""), f);
+            json += string(buf) + words(rnd, 2) + "\"}";
+        }
+        json += "]}";
+    }
+    return json + "]";
+}
+
+// One big dict with many scalar values.
+static string generateFlatDict(unsigned count) {
+    Random rnd;
+    char buf[100];
+    string json = "{";
+    for (unsigned i = 0; i < count; ++i) {
+        snprintf(buf, sizeof(buf), "%s\"key-%05u\":", (i ? "," : ""),
+                 (unsigned)(rnd.next() % 100000));
+        json += buf;
+        if (i % 3 == 0)
+            snprintf(buf, sizeof(buf), "%u", rnd.below(100000));
+        else if (i % 3 == 1)
+            snprintf(buf, sizeof(buf), "%.4f", rnd.fraction() * 1000);
+        else
+            snprintf(buf, sizeof(buf), "\"%s\"", kWords[rnd.below(kNumWords)]);
+        json += buf;
+    }
+    return json + "}";
+}
+
+// A balanced binary tree of dicts, for deep nesting.
+static void generateTree(Random &rnd, unsigned depth, string &json) {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "{\"v\":%u", rnd.below(1000));
+    json += buf;
+    if (depth > 0) {
+        json += ",\"l\":";
+        generateTree(rnd, depth - 1, json);
+        json += ",\"r\":";
+        generateTree(rnd, depth - 1, json);
+    }
+    json += "}";
+}
+
+static string generateTree(unsigned depth) {
+    Random rnd;
+    string json;
+    generateTree(rnd, depth, json);
+    return json;
+}
+
+// A big array of numbers, both integers and floats.
+static string generateNumbers(unsigned count) {
+    Random rnd;
+    char buf[40];
+    string json = "[";
+    for (unsigned i = 0; i < count; ++i) {
+        if (i % 2)
+            snprintf(buf, sizeof(buf), "%s%d", (i ? "," : ""),
+                     (int)(rnd.next() % 2000000) - 1000000);
+        else
+            snprintf(buf, sizeof(buf), "%s%.6g", (i ? "," : ""), rnd.fraction() * 1e6);
+        json += buf;
+    }
+    return json + "]";
+}
+
+// A big array of strings, some repeated, of widely varying lengths.
+static string generateStrings(unsigned count) {
+    Random rnd;
+    string json = "[";
+    for (unsigned i = 0; i < count; ++i) {
+        json += (i ? ",\"" : "\"");
+        if (rnd.below(3) == 0)
+            json += kWords[rnd.below(kNumWords)];
+        else
+            json += words(rnd, 1 + rnd.below(30));
+        json += "\"";
+    }
+    return json + "]";
+}
+
+static vector<unique_ptr<Corpus>> makeCorpora(const vector<const char*> &files) {
+    vector<unique_ptr<Corpus>> corpora;
+    auto add = [&](const char *name, const string &json) {
+        corpora.emplace_back(new Corpus(name, alloc_slice(json)));
+    };
+    add("tiny",      "{\"id\":17,\"name\":\"x\",\"ok\":true}");
+    add("people",    generatePeople(1000));
+    add("flat-dict", generateFlatDict(5000));
+    add("tree",      generateTree(14));
+    add("numbers",   generateNumbers(100000));
+    add("strings",   generateStrings(20000));
+    for (auto path : files) {
+        const char *name = strrchr(path, '/');
+        mapped_slice file(path);
+        corpora.emplace_back(new Corpus(name ? name + 1 : path, alloc_slice(file)));
+    }
+    return corpora;
+}
+
+
+#pragma mark - OPERATIONS:
+
+
+static size_t countValues(const Value *v) {
+    size_t n = 1;
+    switch (v->type()) {
+        case kArray:
+            for (Array::iterator i(v->asArray()); i; ++i)
+                n += countValues(i.value());
+            break;
+        case kDict:
+            for (Dict::iterator i(v->asDict()); i; ++i)
+                n += countValues(i.value());
+            break;
+        default:
+            break;
+    }
+    return n;
+}
+
+
+// An operation to benchmark. It's given a corpus and returns a number derived from its work,
+// so the compiler can't optimize the work away; it returns false if it doesn't apply.
+struct Operation {
+    const char *name;
+    function<bool(Corpus&, size_t &result)> run;
+};
+
+static vector<Operation> makeOperations() {
+    auto encoder = make_shared<Encoder>();
+    auto sharedKeys = make_shared<SharedKeys>();
+    return {
+        {"convert", [=](Corpus &c, size_t &result) {
+            encoder->reset();
+            JSONConverter jc(*encoder);
+            if (!jc.encodeJSON(c.json))
+                throw runtime_error("JSON conversion failed");
+            result = encoder->extractOutput().size;
+            return true;
+        }},
+        {"encode", [=](Corpus &c, size_t &result) {
+            encoder->reset();
+            encoder->writeValue(c.root);
+            result = encoder->extractOutput().size;
+            return true;
+        }},
+        {"validate", [](Corpus &c, size_t &result) {
+            result = (Value::fromData(c.fleece) != nullptr);
+            return true;
+        }},
+        {"lookup", [](Corpus &c, size_t &result) {
+            if (c.keys.empty())
+                return false;
+            const Dict *dict = c.root->asDict();
+            if (dict) {
+                for (auto &key : c.keys)
+                    result += (dict->get(key) != nullptr);
+            } else {
+                for (Array::iterator i(c.root->asArray()); i; ++i) {
+                    dict = i.value()->asDict();
+                    if (dict)
+                        for (auto &key : c.keys)
+                            result += (dict->get(key) != nullptr);
+                }
+            }
+            return true;
+        }},
+        {"iterate", [](Corpus &c, size_t &result) {
+            result = countValues(c.root);
+            return true;
+        }},
+        {"toJSON", [](Corpus &c, size_t &result) {
+            result = c.root->toJSON().size;
+            return true;
+        }},
+        {"sharedKeys", [=](Corpus &c, size_t &result) {
+            // Steady state: the keys are already known after the first iteration
+            encoder->reset();
+            encoder->setSharedKeys(sharedKeys.get());
+            JSONConverter jc(*encoder);
+            bool ok = jc.encodeJSON(c.json);
+            encoder->setSharedKeys(nullptr);
+            if (!ok)
+                throw runtime_error("JSON conversion failed");
+            result = encoder->extractOutput().size;
+            return true;
+        }},
+    };
+}
+
+
+#pragma mark - HARDWARE COUNTERS:
+
+
+// Reads CPU performance counters (on Linux, if the kernel allows it.)
+class PerfCounters {
+public:
+    enum {kCycles, kInstructions, kCacheMisses, kBranchMisses, kNumCounters};
+    static constexpr const char* kNames[kNumCounters] =
+        {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+    PerfCounters() {
+        for (int i = 0; i < kNumCounters; ++i)
+            _fd[i] = -1;
+#ifdef __linux__
+        static const uint64_t kConfigs[kNumCounters] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int i = 0; i < kNumCounters; ++i) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = kConfigs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            _fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int i = 0; i < kNumCounters; ++i)
+            if (_fd[i] >= 0)
+                close(_fd[i]);
+#endif
+    }
+
+    bool available(int i) const         {return _fd[i] >= 0;}
+
+    bool anyAvailable() const {
+        for (int i = 0; i < kNumCounters; ++i)
+            if (available(i))
+                return true;
+        return false;
+    }
+
+    void start() {
+#ifdef __linux__
+        for (int i = 0; i < kNumCounters; ++i) {
+            if (available(i)) {
+                ioctl(_fd[i], PERF_EVENT_IOC_RESET, 0);
+                ioctl(_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // Stops counting and adds the counts to `totals`.
+    void stop(uint64_t totals[kNumCounters]) {
+#ifdef __linux__
+        for (int i = 0; i < kNumCounters; ++i) {
+            if (available(i)) {
+                ioctl(_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+                uint64_t count;
+                if (read(_fd[i], &count, sizeof(count)) == sizeof(count))
+                    totals[i] += count;
+            }
+        }
+#endif
+    }
+
+private:
+    int _fd[kNumCounters];
+};
+
+constexpr const char* PerfCounters::kNames[];
+
+
+#pragma mark - RUNNER:
+
+
+struct Options {
+    vector<const char*> filters;
+    vector<const char*> files;
+    const char *jsonPath {nullptr};
+    unsigned samples {15};
+    double sampleTime {0.02};
+    double warmupTime {0.1};
+    bool counters {false};
+    bool list {false};
+};
+
+
+// Runs one benchmark and writes its results to the encoder as a dict.
+static void runBenchmark(const Operation &op, Corpus &corpus, const Options &options,
+                         PerfCounters *counters, Encoder &out)
+{
+    size_t result = 0;
+    if (!op.run(corpus, result))
+        return;                                 // doesn't apply to this corpus
+    string name = string(op.name) + "/" + corpus.name;
+
+    // Warm up, and calibrate how many iterations make up a sample:
+    unsigned iterations = 1;
+    Stopwatch st;
+    double elapsed;
+    while ((elapsed = st.elapsed()) < options.warmupTime) {
+        Stopwatch it;
+        for (unsigned i = 0; i < iterations; ++i)
+            op.run(corpus, result);
+        if (it.elapsed() < options.sampleTime / 2)
+            iterations *= 2;
+    }
+
+    Benchmark bench;
+    uint64_t counts[PerfCounters::kNumCounters] = {};
+    for (unsigned s = 0; s < options.samples; ++s) {
+        if (counters)
+            counters->start();
+        bench.start();
+        for (unsigned i = 0; i < iterations; ++i)
+            op.run(corpus, result);
+        bench.stop();
+        if (counters)
+            counters->stop(counts);
+    }
+
+    double scale = 1e9 / iterations;            // seconds per sample --> ns per iteration
+    double median = bench.median() * scale;
+    double mbPerSec = corpus.json.size / (median / 1e9) / 1e6;
+    fprintf(stderr, "%-24s %12.1f ns  (±%.1f%%)  %9.1f MB/s of JSON\n",
+            name.c_str(), median, bench.stddev() / bench.average() * 100, mbPerSec);
+
+    out.beginDictionary();
+    out.writeKey("name");               out.writeString(name);
+    out.writeKey("operation");          out.writeString(op.name);
+    out.writeKey("corpus");             out.writeString(corpus.name);
+    out.writeKey("json_bytes");         out.writeUInt(corpus.json.size);
+    out.writeKey("fleece_bytes");       out.writeUInt(corpus.fleece.size);
+    out.writeKey("samples");            out.writeUInt(options.samples);
+    out.writeKey("iterations");         out.writeUInt(iterations);
+    out.writeKey("ns_median");          out.writeDouble(median);
+    out.writeKey("ns_mean");            out.writeDouble(bench.average() * scale);
+    out.writeKey("ns_min");             out.writeDouble(bench.range().first * scale);
+    out.writeKey("ns_max");             out.writeDouble(bench.range().second * scale);
+    out.writeKey("ns_stddev");          out.writeDouble(bench.stddev() * scale);
+    out.writeKey("mb_per_sec");         out.writeDouble(mbPerSec);
+    if (counters) {
+        out.writeKey("counters");
+        out.beginDictionary();
+        for (int i = 0; i < PerfCounters::kNumCounters; ++i) {
+            if (counters->available(i)) {
+                out.writeKey(PerfCounters::kNames[i]);
+                out.writeDouble(counts[i] / (double)options.samples / iterations);
+            }
+        }
+        out.endDictionary();
+    }
+    out.writeKey("result");             out.writeUInt(result);
+    out.endDictionary();
+}
+
+static bool matchesFilters(const string &name, const Options &options) {
+    if (options.filters.empty())
+        return true;
+    for (auto filter : options.filters)
+        if (name.find(filter) != string::npos)
+            return true;
+    return false;
+}
+
+
+#pragma mark - MAIN:
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: fleece_bench [options] [filter...]\n");
+    fprintf(stderr, "  Runs the benchmarks whose names (operation/corpus) contain any filter.\n");
+    fprintf(stderr, "  --json PATH       Write the results to PATH as JSON (default: stdout)\n");
+    fprintf(stderr, "  --file PATH       Also benchmark a JSON file (may be repeated)\n");
+    fprintf(stderr, "  --samples N       Number of timed samples (default 15)\n");
+    fprintf(stderr, "  --sample-ms N     Approximate duration of each sample (default 20)\n");
+    fprintf(stderr, "  --warmup-ms N     Warmup time before sampling (default 100)\n");
+    fprintf(stderr, "  --counters        Collect CPU performance counters (Linux only)\n");
+    fprintf(stderr, "  --list            List the benchmarks instead of running them\n");
+}
+
+int main(int argc, const char * argv[]) {
+    try {
+        Options options;
+        for (int i = 1; i < argc; ++i) {
+            const char *arg = argv[i];
+            bool hasValue = (i + 1 < argc);
+            if (strcmp(arg, "--json") == 0 && hasValue) {
+                options.jsonPath = argv[++i];
+            } else if (strcmp(arg, "--file") == 0 && hasValue) {
+                options.files.push_back(argv[++i]);
+            } else if (strcmp(arg, "--samples") == 0 && hasValue) {
+                options.samples = std::max(atoi(argv[++i]), 1);
+            } else if (strcmp(arg, "--sample-ms") == 0 && hasValue) {
+                options.sampleTime = atof(argv[++i]) / 1000.0;
+            } else if (strcmp(arg, "--warmup-ms") == 0 && hasValue) {
+                options.warmupTime = atof(argv[++i]) / 1000.0;
+            } else if (strcmp(arg, "--counters") == 0) {
+                options.counters = true;
+            } else if (strcmp(arg, "--list") == 0) {
+                options.list = true;
+            } else if (strcmp(arg, "--help") == 0) {
+                usage();
+                return 0;
+            } else if (arg[0] == '-') {
+                fprintf(stderr, "Unknown option '%s'\n", arg);
+                usage();
+                return 1;
+            } else {
+                options.filters.push_back(arg);
+            }
+        }
+
+        auto corpora = makeCorpora(options.files);
+        auto operations = makeOperations();
+
+        unique_ptr<PerfCounters> counters;
+        if (options.counters) {
+            counters.reset(new PerfCounters);
+            if (!counters->anyAvailable()) {
+                fprintf(stderr, "Warning: CPU performance counters aren't available\n");
+                counters.reset();
+            }
+        }
+
+        Encoder out;
+        out.beginDictionary();
+        out.writeKey("benchmarks");
+        out.beginArray();
+        for (auto &op : operations) {
+            for (auto &corpus : corpora) {
+                string name = string(op.name) + "/" + corpus->name;
+                if (!matchesFilters(name, options))
+                    continue;
+                if (options.list)
+                    fprintf(stdout, "%s\n", name.c_str());
+                else
+                    runBenchmark(op, *corpus, options, counters.get(), out);
+            }
+        }
+        out.endArray();
+        out.writeKey("counters");
+        out.writeBool(counters != nullptr);
+#ifdef NDEBUG
+        out.writeKey("optimized");
+        out.writeBool(true);
+#else
+        out.writeKey("optimized");
+        out.writeBool(false);
+        fprintf(stderr, "Warning: this is an unoptimized build; the times are meaningless\n");
+#endif
+        out.endDictionary();
+        if (options.list)
+            return 0;
+
+        alloc_slice json = Value::fromData(out.extractOutput())->toJSON();
+        FILE *f = options.jsonPath ? fopen(options.jsonPath, "w") : stdout;
+        if (!f) {
+            fprintf(stderr, "Couldn't open %s\n", options.jsonPath);
+            return 1;
+        }
+        fwrite(json.buf, 1, json.size, f);
+        fputc('\n', f);
+        if (f != stdout)
+            fclose(f);
+        return 0;
+    } catch (const std::exception &x) {
+        fprintf(stderr, "Error: %s\n", x.what());
+        return 1;
+    }
+}
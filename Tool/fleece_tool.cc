@@ -7,19 +7,42 @@
 //
 
 #include "JSONConverter.hh"
+#include "MappedFile.hh"
+#include "FleeceException.hh"
+#include "Benchmark.hh"
+#include "varint.hh"
 #include <stdio.h>
 #include <unistd.h>
-#include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 using namespace fleece;
 using namespace std;
 
 static void usage(void) {
-    fprintf(stderr, "usage: fleece --encode [JSON file]\n");
+    fprintf(stderr, "usage: fleece --encode [JSON file...]\n");
+    fprintf(stderr, "       fleece --ndjson [NDJSON file]\n");
     fprintf(stderr, "       fleece --decode [Fleece file]\n");
     fprintf(stderr, "       fleece --dump [Fleece file]\n");
+    fprintf(stderr, "       fleece --profile [Fleece file]\n");
     fprintf(stderr, "  Reads stdin unless a file is given; always writes to stdout.\n");
+    fprintf(stderr, "  --ndjson converts each line of the input (newline-delimited JSON) to a\n");
+    fprintf(stderr, "  record; --encode with multiple files converts each file to a record.\n");
+    fprintf(stderr, "  The records are written in order, each prefixed with its length as a\n");
+    fprintf(stderr, "  varint, and converted in parallel:\n");
+    fprintf(stderr, "  --jobs N    Number of worker threads (default: one per CPU core)\n");
+    fprintf(stderr, "  --encode and --ndjson can keep only parts of each document:\n");
+    fprintf(stderr, "  --project PATH   Keep only the values at PATH, such as 'name' or\n");
+    fprintf(stderr, "                   'friends[*].id'; may be given more than once\n");
+    fprintf(stderr, "  --dump scans the file front to back, writing as it goes; to dump only the\n");
+    fprintf(stderr, "  values starting in part of it, add:\n");
+    fprintf(stderr, "  --range START:END   Byte offsets (decimal, or hex with '0x'); either may\n");
+    fprintf(stderr, "                      be omitted\n");
+    fprintf(stderr, "  --profile reports the bytes taken by each path in the document, uniquing,\n");
+    fprintf(stderr, "  narrow and wide collections, and the most-used dict keys.\n");
 }
 
 static alloc_slice readInput(FILE *in) {
@@ -33,12 +56,169 @@ static alloc_slice readInput(FILE *in) {
     }
     if (ferror(in))
         throw "Error reading input";
-    return out.str();
+    return alloc_slice(out.str());
 }
 
+
+#pragma mark - BATCH CONVERSION:
+
+
+// Converts many JSON documents ("records") to Fleece on a pool of worker threads, each with its
+// own Encoder and JSONConverter, and writes them in their original order to stdout, each
+// prefixed with its length as a varint.
+class BatchConverter {
+public:
+    // Records are converted in batches this big, so the output of one batch is all that's
+    // kept in memory at once.
+    static const size_t kBatchSize = 4096;
+
+    explicit BatchConverter(unsigned nThreads, const vector<string> &projection)
+    :_nThreads(nThreads ? nThreads : std::max(thread::hardware_concurrency(), 1u)),
+     _projection(projection)
+    { }
+
+    // Converts each non-blank line of NDJSON data as a record.
+    void convertLines(slice input) {
+        vector<Record> batch;
+        auto end = (const char*)input.end();
+        size_t lineNo = 0;
+        for (auto line = (const char*)input.buf; line < end; ) {
+            auto eol = (const char*)memchr(line, '\n', end - line);
+            if (!eol)
+                eol = end;
+            ++lineNo;
+            slice json(line, eol);
+            while (json.size > 0 && isspace(json[json.size - 1]))
+                --json.size;
+            if (json.size > 0) {
+                batch.push_back({json, lineNo, nullptr});
+                if (batch.size() == kBatchSize) {
+                    convertBatch(batch);
+                    batch.clear();
+                }
+            }
+            line = eol + 1;
+        }
+        convertBatch(batch);
+    }
+
+    // Converts each file as a record.
+    void convertFiles(const vector<const char*> &paths) {
+        vector<Record> batch;
+        for (auto path : paths) {
+            batch.push_back({nullslice, 0, path});
+            if (batch.size() == kBatchSize) {
+                convertBatch(batch);
+                batch.clear();
+            }
+        }
+        convertBatch(batch);
+    }
+
+    // Writes a summary to stderr; returns the number of records that failed to convert.
+    size_t finish() {
+        double elapsed = _stopwatch.elapsed();
+        fprintf(stderr, "Converted %zu records (%.1f MB of JSON to %.1f MB of Fleece) "
+                        "in %.3f sec on %u thread%s: %.0f records/sec, %.1f MB/sec\n",
+                _converted, _jsonBytes / 1e6, _fleeceBytes / 1e6, elapsed,
+                _nThreads, (_nThreads == 1 ? "" : "s"),
+                _converted / elapsed, _jsonBytes / 1e6 / elapsed);
+        if (_failed > 0)
+            fprintf(stderr, "%zu records failed to convert\n", _failed);
+        return _failed;
+    }
+
+private:
+    struct Record {
+        slice json;             // The JSON, if it's in memory
+        size_t line;            // Line number in NDJSON input
+        const char *path;       // Else the path of the file containing the JSON
+    };
+
+    struct Result {
+        alloc_slice fleece;
+        size_t jsonSize {0};
+        string error;
+    };
+
+    // Converts a batch of records in parallel and writes them.
+    void convertBatch(const vector<Record> &batch) {
+        if (batch.empty())
+            return;
+        vector<Result> results(batch.size());
+        atomic<size_t> next {0};
+        auto work = [&]() {
+            Encoder enc;
+            JSONConverter jc(enc);
+            jc.setProjection(_projection);
+            for (size_t i; (i = next++) < batch.size(); ) {
+                Result &result = results[i];
+                try {
+                    mapped_slice file;
+                    slice json = batch[i].json;
+                    if (batch[i].path) {
+                        file = mapped_slice(batch[i].path);
+                        json = file;
+                    }
+                    result.jsonSize = json.size;
+                    enc.reset();
+                    jc.reset();
+                    if (jc.encodeJSON(json))
+                        result.fleece = enc.extractOutput();
+                    else
+                        result.error = jc.errorMessage();
+                } catch (const std::exception &x) {
+                    result.error = x.what();
+                }
+            }
+        };
+        vector<thread> threads;
+        unsigned nThreads = (unsigned)min((size_t)_nThreads, batch.size());
+        for (unsigned t = 1; t < nThreads; ++t)
+            threads.emplace_back(work);
+        work();                                 // The calling thread does its share too
+        for (auto &t : threads)
+            t.join();
+
+        for (size_t i = 0; i < results.size(); ++i) {
+            auto &result = results[i];
+            if (!result.fleece) {
+                if (batch[i].path)
+                    fprintf(stderr, "%s: %s\n", batch[i].path, result.error.c_str());
+                else
+                    fprintf(stderr, "Line %zu: %s\n", batch[i].line, result.error.c_str());
+                ++_failed;
+                continue;
+            }
+            uint8_t prefix[kMaxVarintLen64];
+            size_t prefixSize = PutUVarInt(prefix, result.fleece.size);
+            fwrite(prefix, 1, prefixSize, stdout);
+            fwrite(result.fleece.buf, 1, result.fleece.size, stdout);
+            ++_converted;
+            _jsonBytes += result.jsonSize;
+            _fleeceBytes += result.fleece.size;
+        }
+        if (ferror(stdout))
+            throw "Error writing output";
+    }
+
+    unsigned const _nThreads;
+    vector<string> const _projection;
+    Stopwatch _stopwatch;
+    size_t _converted {0}, _failed {0};
+    size_t _jsonBytes {0}, _fleeceBytes {0};
+};
+
+
+#pragma mark - MAIN:
+
+
 int main(int argc, const char * argv[]) {
     try {
-        bool encode = false, decode = false, dump = false;
+        bool encode = false, ndjson = false, decode = false, dump = false, profile = false;
+        unsigned nThreads = 0;
+        vector<string> projection;
+        size_t rangeStart = 0, rangeEnd = SIZE_MAX;
 
         int i;
         for (i = 1; i < argc; ++i) {
@@ -50,10 +230,26 @@ int main(int argc, const char * argv[]) {
                 break;
             } else if (strcmp(arg, "--encode") == 0) {
                 encode = true;
+            } else if (strcmp(arg, "--ndjson") == 0) {
+                ndjson = true;
+            } else if (strcmp(arg, "--jobs") == 0 && i + 1 < argc) {
+                nThreads = (unsigned)max(atoi(argv[++i]), 1);
+            } else if (strcmp(arg, "--project") == 0 && i + 1 < argc) {
+                projection.push_back(argv[++i]);
+            } else if (strcmp(arg, "--range") == 0 && i + 1 < argc) {
+                char *colon;
+                const char *range = argv[++i];
+                rangeStart = strtoull(range, &colon, 0);
+                if (*colon != ':')
+                    throw "--range must be START:END";
+                if (colon[1])
+                    rangeEnd = strtoull(colon + 1, nullptr, 0);
             } else if (strcmp(arg, "--decode") == 0) {
                 decode = true;
             } else if (strcmp(arg, "--dump") == 0) {
                 dump = true;
+            } else if (strcmp(arg, "--profile") == 0) {
+                profile = true;
             } else if (strcmp(arg, "--help") == 0) {
                 usage();
                 return 0;
@@ -64,35 +260,61 @@ int main(int argc, const char * argv[]) {
             }
         }
 
-        if (encode + decode + dump != 1) {
-            fprintf(stderr, "Choose one of --encode, --decode, or --dump\n");
+        if (encode + ndjson + decode + dump + profile != 1) {
+            fprintf(stderr, "Choose one of --encode, --ndjson, --decode, --dump, or --profile\n");
             usage();
             return 1;
         }
 
-        FILE *in = stdin;
-        if (i < argc) {
-            in = fopen(argv[i], "r");
-            if (!in) {
-                fprintf(stderr, "Couldn't open file %s\n", argv[i]);
-                return 1;
-            }
-            ++i;
-        }
+        // A file is memory-mapped instead of being read, so Fleece data can be used in place:
+        const char *inputPath = nullptr;
+        if (i < argc)
+            inputPath = argv[i++];
 
-        if (i < argc) {
+        if (i < argc && !encode) {
             fprintf(stderr, "Unknown argument '%s'\n", argv[i]);
             usage();
             return 1;
         }
 
-        if (encode && isatty(STDOUT_FILENO))
+        if ((encode || ndjson) && isatty(STDOUT_FILENO))
             throw "Let's not spew binary Fleece data to a terminal! Please redirect stdout.";
 
-        auto input = readInput(in);
+        if (encode && i < argc) {
+            // Multiple files:
+            vector<const char*> paths(&argv[i - 1], &argv[argc]);
+            BatchConverter batch(nThreads, projection);
+            batch.convertFiles(paths);
+            return batch.finish() ? 1 : 0;
+        }
+
+        alloc_slice inputData;
+        mapped_slice inputFile;
+        slice input;
+        if (inputPath) {
+            try {
+                inputFile = mapped_slice(inputPath);
+            } catch (const FleeceException &) {
+                fprintf(stderr, "Couldn't open file %s\n", inputPath);
+                return 1;
+            }
+            input = inputFile;
+        } else {
+            inputData = readInput(stdin);
+            input = inputData;
+        }
 
-        if (encode) {
-            auto output = JSONConverter::convertJSON(input);
+        if (ndjson) {
+            BatchConverter batch(nThreads, projection);
+            batch.convertLines(input);
+            return batch.finish() ? 1 : 0;
+        } else if (encode) {
+            Encoder enc;
+            JSONConverter jc(enc);
+            jc.setProjection(projection);
+            if (!jc.encodeJSON(input))
+                throw jc.errorMessage();
+            auto output = enc.extractOutput();
             fwrite(output.buf, 1, output.size, stdout);
         } else if (decode) {
             auto root = Value::fromData(input);
@@ -102,7 +324,12 @@ int main(int argc, const char * argv[]) {
             fwrite(json.buf, json.size, 1, stderr);
             fprintf(stderr, "\n");
         } else if (dump) {
-            if (!Value::dump(input, cout))
+            Writer out(Writer::outputToFile(stdout));
+            if (!Value::dumpLinear(input, out, rangeStart, rangeEnd))
+                throw "Invalid Fleece data";
+        } else if (profile) {
+            Writer out(Writer::outputToFile(stdout));
+            if (!Value::writeSizeProfile(input, out))
                 throw "Couldn't parse input as Fleece";
         }
 